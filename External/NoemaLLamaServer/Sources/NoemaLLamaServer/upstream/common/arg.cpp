@@ -1303,6 +1303,27 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cache_ram_mib = value;
         }
     ).set_env("LLAMA_ARG_CACHE_RAM").set_examples({LLAMA_EXAMPLE_SERVER, LLAMA_EXAMPLE_CLI}));
+    add_opt(common_arg(
+        {"-cdisk", "--cache-disk"}, "PATH",
+        "directory for prompt cache states evicted from RAM; they are promoted back on a hit and survive a restart (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.cache_disk_path = value;
+        }
+    ).set_env("LLAMA_ARG_CACHE_DISK").set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--cache-disk-size"}, "N",
+        string_format("set the maximum size of the prompt cache directory in MiB (default: %d, -1 - no limit)", params.cache_disk_mib),
+        [](common_params & params, int value) {
+            params.cache_disk_mib = value;
+        }
+    ).set_env("LLAMA_ARG_CACHE_DISK_SIZE").set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--stream-coalesce"}, "N",
+        string_format("max number of tokens merged into one streamed chunk while a client reads slower than tokens are generated (default: %d, 1 = disabled)", params.n_stream_coalesce),
+        [](common_params & params, int value) {
+            params.n_stream_coalesce = value;
+        }
+    ).set_env("LLAMA_ARG_STREAM_COALESCE").set_examples({LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-kvu", "--kv-unified"},
         {"-no-kvu", "--no-kv-unified"},
@@ -1995,6 +2016,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.no_extra_bufts = !value;
         }
     ).set_env("LLAMA_ARG_REPACK"));
+    add_opt(common_arg(
+        {"--repack-cache"}, "PATH",
+        "directory of the persisted cache of repacked weights, mapped read-only by later loads of the same model on the same CPU, the cache of a model file that was replaced is removed on load (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.repack_cache_dir = value;
+        }
+    ).set_env("LLAMA_ARG_REPACK_CACHE"));
     add_opt(common_arg(
         {"--no-host"},
         "bypass host buffer allowing extra buffers to be used",
@@ -2245,6 +2273,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             else { throw std::invalid_argument("invalid value"); }
         }
     ).set_env("LLAMA_ARG_NUMA"));
+    add_opt(common_arg(
+        {"--hugepages"}, "TYPE",
+        "pages of the CPU buffers of the weights loaded without mmap, the KV cache and the compute buffers\n"
+        "- none: regular pages (default)\n"
+        "- thp: transparent huge pages\n"
+        "- explicit: hugetlbfs pages reserved in /proc/sys/vm/nr_hugepages, transparent huge pages if there are not enough\n"
+        "with --numa distribute, the CPU buffers are also interleaved over the nodes",
+        [](common_params & params, const std::string & value) {
+            /**/ if (value == "none")     { params.hugepages = GGML_BACKEND_CPU_HUGEPAGES_NONE; }
+            else if (value == "thp")      { params.hugepages = GGML_BACKEND_CPU_HUGEPAGES_THP; }
+            else if (value == "explicit") { params.hugepages = GGML_BACKEND_CPU_HUGEPAGES_EXPLICIT; }
+            else { throw std::invalid_argument("invalid value"); }
+        }
+    ).set_env("LLAMA_ARG_HUGEPAGES"));
     add_opt(common_arg(
         {"-dev", "--device"}, "<dev1,dev2,..>",
         "comma-separated list of devices to use for offloading (none = don't offload)\n"
@@ -3017,6 +3059,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--slot-save-compress"},
+        string_format("compress the saved slot files with LZ4; a request can override it with \"compress\" (default: %s)", params.slot_save_compress ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.slot_save_compress = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_SAVE_COMPRESS"));
     add_opt(common_arg(
         {"--media-path"}, "PATH",
         "directory for loading local media files; files can be accessed via file:// URLs using relative paths (default: disabled)",
@@ -3165,6 +3214,54 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.slot_prompt_similarity = std::stof(value);
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--slot-schedule"}, "POLICIES",
+        string_format(
+            "comma-separated list of policies choosing which waiting request gets the next free slot, in order of precedence (default: %s)\n"
+            "fifo: order of arrival, cache: longest cached prefix reused, shortest: fewest prompt tokens to process,\n"
+            "fair: least recent usage per API key, then per user, priority: highest \"priority\" field first",
+            params.slot_schedule.c_str()),
+        [](common_params & params, const std::string & value) {
+            params.slot_schedule = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_SCHEDULE"));
+    add_opt(common_arg(
+        {"--slot-schedule-max-wait"}, "N",
+        string_format("max time in ms a waiting request can be passed over by the slot schedule before it runs in order of arrival (default: %d, -1 = no limit)", params.slot_schedule_max_wait),
+        [](common_params & params, int value) {
+            params.slot_schedule_max_wait = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_SCHEDULE_MAX_WAIT"));
+    add_opt(common_arg(
+        {"--prefill-budget"}, "N",
+        string_format("max number of prompt tokens processed in a step together with the generating slots (default: %d, 0 = batch size)", params.n_prefill_budget),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.n_prefill_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_BUDGET"));
+    add_opt(common_arg(
+        {"--prefill-target-itl"}, "MS",
+        string_format("target inter-token latency in ms of the generating slots; adapts the prefill budget to the measured step time (default: %.0f, 0 = disabled)", (double) params.prefill_target_itl),
+        [](common_params & params, const std::string & value) {
+            params.prefill_target_itl = std::stof(value);
+            if (params.prefill_target_itl < 0.0f) {
+                throw std::invalid_argument("invalid value");
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_TARGET_ITL"));
+    add_opt(common_arg(
+        {"--embd-batch-window"}, "MS",
+        string_format("time in ms to collect the embedding and rerank inputs of concurrent requests into one batch, for models without a KV cache (default: %d, 0 = only the inputs already queued, -1 = disabled)", params.embd_batch_window),
+        [](common_params & params, int value) {
+            if (value < -1) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.embd_batch_window = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_EMBD_BATCH_WINDOW"));
     add_opt(common_arg(
         {"--lora-init-without-apply"},
         string_format("load LoRA adapters without applying them (apply later via POST /lora-adapters) (default: %s)", params.lora_init_without_apply ? "enabled" : "disabled"),
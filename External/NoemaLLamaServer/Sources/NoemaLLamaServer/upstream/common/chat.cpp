@@ -20,7 +20,10 @@
 #include <ctime>
 #include <exception>
 #include <functional>
-
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <sstream>
 #include <stdexcept>
@@ -220,12 +223,37 @@ std::vector<common_chat_msg_diff> common_chat_msg_diff::compute_diffs(const comm
 
 using chat_template_caps = jinja::caps;
 
+// the differential analysis of a template renders it many times, and the parser and grammar built from it depend only
+// on the tools and the output format of a request. agents send the same tools with every request, so both are kept
+// and only the prompt is rendered per request
+struct common_chat_templates_cache {
+    static constexpr size_t N_PARSERS_MAX = 32;
+
+    struct parser_entry {
+        const common_chat_template * tmpl;
+
+        std::string key; // see common_chat_parser_cache_key()
+
+        common_chat_params params; // without the prompt
+    };
+
+    std::mutex mutex;
+
+    std::map<const common_chat_template *, std::shared_ptr<const autoparser::autoparser>> analyses;
+
+    std::list<parser_entry> parsers; // most recently used first
+
+    common_chat_templates_cache_stats stats;
+};
+
 struct common_chat_templates {
     bool add_bos;
     bool add_eos;
     bool has_explicit_template;  // Model had builtin template or template overridden was specified.
     std::unique_ptr<common_chat_template> template_default;  // always set (defaults to chatml)
     std::unique_ptr<common_chat_template> template_tool_use;
+
+    mutable common_chat_templates_cache cache;
 };
 
 common_chat_tool_choice common_chat_tool_choice_parse_oaicompat(const std::string & tool_choice) {
@@ -1921,6 +1949,97 @@ std::optional<common_chat_params> common_chat_try_specialized_template(
     return std::nullopt;
 }
 
+// everything the parser and the grammar depend on, besides the template
+static std::string common_chat_parser_cache_key(const autoparser::generation_params & params) {
+    const json key = {
+        { "tools",               params.tools               },
+        { "tool_choice",         params.tool_choice         },
+        { "parallel_tool_calls", params.parallel_tool_calls },
+        { "json_schema",         params.json_schema         },
+        { "reasoning_format",    params.reasoning_format    },
+        { "generation_prompt",   params.generation_prompt   },
+    };
+    return key.dump();
+}
+
+static common_chat_params common_chat_templates_apply_autoparser(const struct common_chat_templates *  tmpls,
+                                                                 const common_chat_template &          tmpl,
+                                                                 const autoparser::generation_params & params) {
+    auto & cache = tmpls->cache;
+
+    const std::string key = common_chat_parser_cache_key(params);
+
+    std::shared_ptr<const autoparser::autoparser> analysis;
+
+    // the prompt is rendered after the lock is released, so that requests do not serialize on the template
+    std::optional<common_chat_params> hit;
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        for (auto it = cache.parsers.begin(); it != cache.parsers.end(); ++it) {
+            if (it->tmpl != &tmpl || it->key != key) {
+                continue;
+            }
+
+            cache.parsers.splice(cache.parsers.begin(), cache.parsers, it);
+            cache.stats.n_hit++;
+
+            hit = cache.parsers.front().params;
+            break;
+        }
+
+        if (!hit) {
+            cache.stats.n_miss++;
+
+            const auto it = cache.analyses.find(&tmpl);
+            if (it != cache.analyses.end()) {
+                analysis = it->second;
+            }
+        }
+    }
+
+    if (hit) {
+        hit->prompt = common_chat_template_direct_apply(tmpl, params);
+
+        return std::move(*hit);
+    }
+
+    if (!analysis) {
+        LOG_DBG("%s: using differential autoparser\n", __func__);
+        auto res = std::make_shared<autoparser::autoparser>();
+        res->analyze_template(tmpl);
+        analysis = res;
+    }
+
+    auto auto_params = autoparser::peg_generator::generate_parser(tmpl, params, *analysis);
+    auto_params.supports_thinking = analysis->reasoning.mode != autoparser::reasoning_mode::NONE;
+    if (auto_params.supports_thinking) {
+        auto_params.thinking_start_tag = analysis->reasoning.start;
+        auto_params.thinking_end_tag   = analysis->reasoning.end;
+    }
+    auto_params.generation_prompt = params.generation_prompt;
+    common_peg_arena arena;
+    arena.load(auto_params.parser);
+    LOG_DBG("%s: generated parser:\n%s\n\nparser generation prompt: %s\n", __func__, arena.dump(arena.root()).c_str(), auto_params.generation_prompt.c_str());
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        cache.analyses.emplace(&tmpl, analysis);
+
+        common_chat_templates_cache::parser_entry entry = { &tmpl, key, auto_params };
+        entry.params.prompt.clear();
+
+        cache.parsers.push_front(std::move(entry));
+        if (cache.parsers.size() > common_chat_templates_cache::N_PARSERS_MAX) {
+            cache.parsers.pop_back();
+        }
+    }
+
+    return auto_params;
+}
+
 static common_chat_params common_chat_templates_apply_jinja(const struct common_chat_templates *        tmpls,
                                                             const struct common_chat_templates_inputs & inputs) {
     autoparser::generation_params params;
@@ -2011,20 +2130,7 @@ static common_chat_params common_chat_templates_apply_jinja(const struct common_
     }
 
     try {
-        LOG_DBG("%s: using differential autoparser\n", __func__);
-        struct autoparser::autoparser autoparser;
-        autoparser.analyze_template(tmpl);
-        auto auto_params = autoparser::peg_generator::generate_parser(tmpl, params, autoparser);
-        auto_params.supports_thinking = autoparser.reasoning.mode != autoparser::reasoning_mode::NONE;
-        if (auto_params.supports_thinking) {
-            auto_params.thinking_start_tag = autoparser.reasoning.start;
-            auto_params.thinking_end_tag   = autoparser.reasoning.end;
-        }
-        auto_params.generation_prompt = params.generation_prompt;
-        common_peg_arena arena;
-        arena.load(auto_params.parser);
-        LOG_DBG("%s: generated parser:\n%s\n\nparser generation prompt: %s\n", __func__, arena.dump(arena.root()).c_str(), auto_params.generation_prompt.c_str());
-        return auto_params;
+        return common_chat_templates_apply_autoparser(tmpls, tmpl, params);
     } catch (const std::exception & e) {
         throw std::invalid_argument(std::string("Unable to generate parser for this template. Automatic parser generation failed: ") + e.what());
     }
@@ -2182,6 +2288,11 @@ common_chat_msg common_chat_peg_parse(const common_peg_arena &          src_pars
     return msg;
 }
 
+common_chat_templates_cache_stats common_chat_templates_get_cache_stats(const common_chat_templates * chat_templates) {
+    std::lock_guard<std::mutex> lock(chat_templates->cache.mutex);
+    return chat_templates->cache.stats;
+}
+
 std::map<std::string, bool> common_chat_templates_get_caps(const common_chat_templates * chat_templates) {
     GGML_ASSERT(chat_templates != nullptr);
     GGML_ASSERT(chat_templates->template_default != nullptr);
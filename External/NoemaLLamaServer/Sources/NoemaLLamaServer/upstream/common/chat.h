@@ -267,6 +267,14 @@ nlohmann::ordered_json common_chat_msg_diff_to_json_oaicompat(const common_chat_
 // get template caps, useful for reporting to server /props endpoint
 std::map<std::string, bool> common_chat_templates_get_caps(const common_chat_templates * chat_templates);
 
+// the template analysis and the parsers built from it are cached, as they do not depend on the messages
+struct common_chat_templates_cache_stats {
+    uint64_t n_hit  = 0; // requests that reused the parser and grammar of an earlier request
+    uint64_t n_miss = 0;
+};
+
+common_chat_templates_cache_stats common_chat_templates_get_cache_stats(const common_chat_templates * chat_templates);
+
 std::string common_chat_template_direct_apply(
     const common_chat_template & tmpl,
     const autoparser::generation_params & inputs);
@@ -1154,6 +1154,10 @@ common_init_result::common_init_result(common_params & params) :
             params.verbosity >= 4 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_ERROR);
     }
 
+    // the CPU buffers are interleaved over the nodes when the threads are spread over them
+    ggml_backend_cpu_set_alloc_policy(params.hugepages,
+            params.numa == GGML_NUMA_STRATEGY_DISTRIBUTE ? GGML_BACKEND_CPU_NUMA_ALLOC_INTERLEAVE : GGML_BACKEND_CPU_NUMA_ALLOC_DEFAULT);
+
     llama_model * model = llama_model_load_from_file(params.model.path.c_str(), mparams);
     if (model == NULL) {
         return;
@@ -1426,6 +1430,10 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.use_extra_bufts = !params.no_extra_bufts;
     mparams.no_host         = params.no_host;
 
+    if (!params.repack_cache_dir.empty()) {
+        mparams.repack_cache_dir = params.repack_cache_dir.c_str();
+    }
+
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -452,6 +452,8 @@ struct common_params {
 
     ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
 
+    ggml_backend_cpu_hugepages hugepages = GGML_BACKEND_CPU_HUGEPAGES_NONE; // pages of the CPU buffers (weights without mmap, KV cache, compute)
+
     enum llama_rope_scaling_type rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
     enum llama_pooling_type      pooling_type      = LLAMA_POOLING_TYPE_UNSPECIFIED; // pooling type for embeddings
     enum llama_attention_type    attention_type    = LLAMA_ATTENTION_TYPE_UNSPECIFIED; // attention type for embeddings
@@ -474,6 +476,7 @@ struct common_params {
     std::string input_prefix         = ""; // string to prefix user inputs with                             // NOLINT
     std::string input_suffix         = ""; // string to suffix user inputs with                             // NOLINT
     std::string logits_file          = ""; // file for saving *all* logits                                  // NOLINT
+    std::string repack_cache_dir     = ""; // directory of the persisted cache of repacked weights         // NOLINT
 
     // llama-debug specific options
     std::string logits_output_dir = "data"; // directory for saving logits output files                     // NOLINT
@@ -583,6 +586,8 @@ struct common_params {
     int32_t n_ctx_checkpoints   = 32;    // max number of context checkpoints per slot
     int32_t checkpoint_every_nt = 8192;  // make a checkpoint every n tokens during prefill
     int32_t cache_ram_mib       = 8192;  // -1 = no limit, 0 - disable, 1 = 1 MiB, etc.
+    int32_t cache_disk_mib      = 32768; // -1 = no limit, size of the disk tier of the prompt cache
+    int32_t n_stream_coalesce   = 1;     // max tokens merged into one streamed chunk while a client is behind
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -627,10 +632,20 @@ struct common_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    bool        slot_save_compress = false; // compress the slot files with LZ4
+    std::string cache_disk_path; // directory for prompt cache states evicted from RAM (default: disabled)
     std::string media_path; // path to directory for loading media files
 
     float slot_prompt_similarity = 0.1f;
 
+    std::string slot_schedule          = "cache"; // policies ordering the deferred tasks, in order of precedence
+    int32_t     slot_schedule_max_wait = 30000;   // ms a deferred task can wait before it runs in order of arrival (-1 = no limit)
+
+    int32_t n_prefill_budget   = 0;    // max prompt tokens per step next to generating slots (0 = n_batch)
+    float   prefill_target_itl = 0.0f; // target inter-token latency in ms that adapts the prefill budget (0 = disabled)
+
+    int32_t embd_batch_window = -1; // ms to collect embedding and rerank inputs of several requests into one batch (-1 = disabled)
+
     // batched-bench params
     bool is_pp_shared   = false;
     bool is_tg_separate = false;
@@ -144,28 +144,148 @@ struct common_speculative_state {
     virtual void accept(uint16_t n_accepted) = 0;
 };
 
-struct common_speculative_state_draft : public common_speculative_state {
+// the draft model context
+//
+// a single llama_context can be shared by the draft implementations of several speculative decoders (e.g. one per
+// server slot). each decoder drafts in its own sequence, so the drafts of all decoders are evaluated together: one
+// batch with the new prompt tokens and the last accepted tokens, followed by one batch per draft step
+struct common_speculative_shared {
     llama_context * ctx_tgt; // only used for retokenizing from ctx_dft
     llama_context * ctx_dft;
 
-    common_sampler * smpl;
+    llama_batch batch;
 
-    llama_batch  batch;
-    llama_tokens prompt_dft;
+    int32_t n_seq;
 
     bool vocab_cmpt = true; // whether retokenization is needed
     std::unordered_map<std::string, std::string> vocab_map;
 
-    common_speculative_state_draft(
-            enum common_speculative_type type,
+    bool failed = false; // an evaluation failed since the current drafts started
+
+    common_speculative_shared(
             llama_context * ctx_tgt,
             llama_context * ctx_dft,
+            int32_t n_seq,
             const std::vector<std::pair<std::string, std::string>> & replacements)
-        : common_speculative_state(type)
-        , ctx_tgt(ctx_tgt)
+        : ctx_tgt(ctx_tgt)
         , ctx_dft(ctx_dft)
+        , n_seq(n_seq)
     {
         batch = llama_batch_init(llama_n_batch(ctx_dft), 0, 1);
+
+        vocab_cmpt = common_speculative_are_compatible(llama_get_model(ctx_tgt), llama_get_model(ctx_dft));
+        LOG_DBG("vocab_cmpt = %d\n", vocab_cmpt);
+
+        if (!vocab_cmpt) {
+            LOG_WRN("the target and draft vocabs are not compatible - tokens will be translated between the two\n");
+
+            for (const auto & pair : replacements) {
+                vocab_map[pair.first] = pair.second;
+            }
+        }
+    }
+
+    ~common_speculative_shared() {
+        llama_perf_context_print(ctx_dft);
+
+        llama_free(ctx_dft);
+
+        llama_batch_free(batch);
+    }
+
+    // add a token to the batch, evaluating the pending tokens first if the batch is full
+    // only for tokens without logits, as their outputs would be overwritten by the next evaluation
+    void add(llama_token id, llama_pos pos, llama_seq_id seq_id) {
+        if (batch.n_tokens >= (int32_t) llama_n_batch(ctx_dft)) {
+            decode();
+        }
+
+        common_batch_add(batch, id, pos, { seq_id }, false);
+    }
+
+    // the batch is dropped even if the evaluation fails, in which case `failed` is set
+    void decode() {
+        if (batch.n_tokens > 0) {
+            const int ret = llama_decode(ctx_dft, batch);
+            if (ret != 0) {
+                LOG_WRN("%s: failed to evaluate %d draft tokens, ret = %d\n", __func__, batch.n_tokens, ret);
+                failed = true;
+            }
+
+            common_batch_clear(batch);
+        }
+    }
+
+    std::string replace_to_dft(const std::string & input) const {
+        std::string result = input;
+
+        for (const auto & pair : this->vocab_map) {
+            size_t pos = result.find(pair.first);
+            while (pos != std::string::npos) {
+                result.replace(pos, pair.first.length(), pair.second);
+                pos = result.find(pair.first, pos + pair.second.length());
+            }
+        }
+
+        return result;
+    }
+
+    std::string replace_to_tgt(const std::string & input) const {
+        std::string result = input;
+
+        for (const auto & pair : this->vocab_map) {
+            size_t pos = result.find(pair.second);
+            while (pos != std::string::npos) {
+                result.replace(pos, pair.second.length(), pair.first);
+                pos = result.find(pair.second, pos + pair.first.length());
+            }
+        }
+
+        return result;
+    }
+};
+
+struct common_speculative_state_draft;
+
+// one sequence to draft in a shared draft context
+struct common_speculative_draft_job {
+    common_speculative_state_draft * impl;
+
+    const common_params_speculative * params;
+    const llama_tokens              * prompt_tgt;
+
+    llama_token    id_last;
+    llama_tokens * result;
+
+    llama_pos n_past  = 0;
+    int32_t   i_batch = -1;
+    bool      active  = false;
+};
+
+static void common_speculative_draft_jobs(common_speculative_shared & shared, std::vector<common_speculative_draft_job> & jobs);
+
+struct common_speculative_state_draft : public common_speculative_state {
+    common_speculative_shared * shared;
+
+    // the shared context was created for this decoder alone (common_speculative_init without a shared context)
+    const bool shared_owned;
+
+    const llama_seq_id seq_id;
+
+    common_sampler * smpl;
+
+    llama_tokens prompt_dft;
+
+    common_speculative_state_draft(
+            enum common_speculative_type type,
+            common_speculative_shared * shared,
+            bool shared_owned,
+            llama_seq_id seq_id)
+        : common_speculative_state(type)
+        , shared(shared)
+        , shared_owned(shared_owned)
+        , seq_id(seq_id)
+    {
         smpl = nullptr;
 
         // TODO: optimize or pass from outside?
@@ -192,29 +312,19 @@ struct common_speculative_state_draft : public common_speculative_state {
                 COMMON_SAMPLER_TYPE_TOP_K,
             };
 
-            smpl = common_sampler_init(llama_get_model(ctx_dft), params);
+            smpl = common_sampler_init(llama_get_model(shared->ctx_dft), params);
         }
 
-        vocab_cmpt = common_speculative_are_compatible(llama_get_model(ctx_tgt), llama_get_model(ctx_dft));
-        LOG_DBG("vocab_cmpt = %d\n", vocab_cmpt);
-
-        if (!vocab_cmpt) {
-            LOG_WRN("the target and draft vocabs are not compatible - tokens will be translated between the two\n");
-
-            for (const auto & pair : replacements) {
-                vocab_map[pair.first] = pair.second;
-            }
-        }
+        // start from an empty sequence, a previous decoder may have used it
+        llama_memory_seq_rm(llama_get_memory(shared->ctx_dft), seq_id, -1, -1);
     }
 
     ~common_speculative_state_draft() override {
-        llama_perf_context_print(ctx_dft);
-
-        llama_free(ctx_dft);
-
         common_sampler_free(smpl);
 
-        llama_batch_free(batch);
+        if (shared_owned) {
+            delete shared;
+        }
     }
 
     void begin(const llama_tokens & prompt) override {
@@ -226,27 +336,41 @@ struct common_speculative_state_draft : public common_speculative_state {
             const llama_tokens & prompt_tgt,
             llama_token id_last,
             llama_tokens & result) override {
-        auto * spec = this;
+        std::vector<common_speculative_draft_job> jobs(1);
 
-        auto & batch      = spec->batch;
-        auto & ctx_tgt    = spec->ctx_tgt;
-        auto & ctx_dft    = spec->ctx_dft;
-        auto & smpl       = spec->smpl;
-        auto & prompt_dft = spec->prompt_dft;
+        jobs[0].impl       = this;
+        jobs[0].params     = &params;
+        jobs[0].prompt_tgt = &prompt_tgt;
+        jobs[0].id_last    = id_last;
+        jobs[0].result     = &result;
+
+        common_speculative_draft_jobs(*shared, jobs);
+    }
+
+    // reuse as much as possible of the sequence and queue the new prompt tokens in the shared batch
+    // returns false if the draft model does not have to be evaluated for this sequence
+    bool prepare(common_speculative_draft_job & job) {
+        const auto & params     = *job.params;
+        const auto & prompt_tgt = *job.prompt_tgt;
+
+        auto & ctx_tgt = shared->ctx_tgt;
+        auto & ctx_dft = shared->ctx_dft;
+        auto & result  = *job.result;
+        auto & id_last = job.id_last;
 
         auto * mem_dft = llama_get_memory(ctx_dft);
 
         int reuse_i = 0;
         int reuse_n = 0;
 
-        const int n_ctx = llama_n_ctx(ctx_dft) - params.n_max;
+        const int n_ctx = llama_n_ctx_seq(ctx_dft) - params.n_max;
 
         llama_tokens prompt_cnv;
-        if (!spec->vocab_cmpt) {
+        if (!shared->vocab_cmpt) {
             std::string text;
 
             text = common_detokenize(ctx_tgt, prompt_tgt, true);
-            text = replace_to_dft(text);
+            text = shared->replace_to_dft(text);
 
             LOG_DBG("%s: main->draft detokenized string: '%s'\n", __func__, text.c_str());
 
@@ -261,13 +385,13 @@ struct common_speculative_state_draft : public common_speculative_state {
 
             text.resize(-n_chars);
             llama_detokenize(vocab_tgt, &id_last, 1, text.data(), text.size(), false, false);
-            text = replace_to_dft(text);
+            text = shared->replace_to_dft(text);
 
             LOG_DBG("main->draft detokenized id_last(%d): '%s'\n", id_last, text.c_str());
             id_last = common_tokenize(ctx_dft, text, false, true)[0];
         }
 
-        const llama_tokens & prompt_cur = spec->vocab_cmpt ? prompt_tgt : prompt_cnv;
+        const llama_tokens & prompt_cur = shared->vocab_cmpt ? prompt_tgt : prompt_cnv;
 
         const int i_start = std::max<int>(0, (int) prompt_cur.size() - n_ctx);
 
@@ -287,13 +411,13 @@ struct common_speculative_state_draft : public common_speculative_state {
             }
         }
 
-        LOG_DBG("%s: reuse_i = %d, reuse_n = %d, prompt = %d\n", __func__, reuse_i, reuse_n, (int) prompt_dft.size());
+        LOG_DBG("%s: seq_id = %d, reuse_i = %d, reuse_n = %d, prompt = %d\n", __func__, seq_id, reuse_i, reuse_n, (int) prompt_dft.size());
 
         result.clear();
         result.reserve(params.n_max);
 
         if (reuse_n == 0) {
-            llama_memory_clear(mem_dft, false);
+            llama_memory_seq_rm(mem_dft, seq_id, -1, -1);
             prompt_dft.clear();
         } else {
             // this happens when a previous draft has been discarded (for example, due to being too small), but the
@@ -307,135 +431,175 @@ struct common_speculative_state_draft : public common_speculative_state {
                     }
                 }
 
-                return;
+                return false;
             }
 
             if (reuse_i > 0) {
-                llama_memory_seq_rm (mem_dft, 0, 0, reuse_i);
-                llama_memory_seq_add(mem_dft, 0, reuse_i, -1, -reuse_i);
+                llama_memory_seq_rm (mem_dft, seq_id, 0, reuse_i);
+                llama_memory_seq_add(mem_dft, seq_id, reuse_i, -1, -reuse_i);
 
                 prompt_dft.erase(prompt_dft.begin(), prompt_dft.begin() + reuse_i);
             }
 
             if (reuse_n < (int) prompt_dft.size()) {
-                llama_memory_seq_rm (mem_dft, 0, reuse_n, -1);
+                llama_memory_seq_rm (mem_dft, seq_id, reuse_n, -1);
                 prompt_dft.erase(prompt_dft.begin() + reuse_n, prompt_dft.end());
             }
         }
 
-        // prepare a batch to evaluate any new tokens in the prompt
-        common_batch_clear(batch);
-
+        // we should rarely have new prompt tokens during normal decoding
         for (size_t i = i_start + reuse_n; i < prompt_cur.size(); ++i) {
-            //LOG_DBG("i = %d, i_start = %d, reuse_n = %d, i - i_start = %d, id = %6d\n", i, i_start, reuse_n, i - i_start, prompt_cur[i]);
-            common_batch_add(batch, prompt_cur[i], i - i_start, { 0 }, false);
+            shared->add(prompt_cur[i], i - i_start, seq_id);
 
             prompt_dft.push_back(prompt_cur[i]);
         }
 
-        // we should rarely end-up here during normal decoding
-        if (batch.n_tokens > 0) {
-            //LOG_DBG("%s: draft prompt batch: %s\n", __func__, string_from(ctx, batch).c_str());
+        job.n_past = prompt_dft.size();
 
-            llama_decode(ctx_dft, batch);
-        }
+        LOG_DBG("%s: seq_id = %d, n_past = %d\n", __func__, seq_id, job.n_past);
 
-        const llama_pos n_past = prompt_dft.size();
+        return true;
+    }
 
-        LOG_DBG("%s: n_past = %d\n", __func__, n_past);
+    // convert the draft back to the target vocab
+    void finish(common_speculative_draft_job & job) {
+        if (shared->vocab_cmpt) {
+            return;
+        }
 
-        common_batch_clear(batch);
-        common_batch_add  (batch, id_last, n_past, { 0 }, true);
+        auto & result = *job.result;
 
-        prompt_dft.push_back(id_last);
+        std::string detokenized = common_detokenize(shared->ctx_dft, result, true);
+        detokenized = shared->replace_to_tgt(detokenized);
+        LOG_DBG("draft->main detokenized string: '%s'\n", detokenized.c_str());
+        result = common_tokenize(shared->ctx_tgt, detokenized, false, true);
+        if (result.size() > (size_t) job.params->n_max) {
+            result.resize(job.params->n_max);
+        }
+    }
 
-        LOG_DBG("%s: draft prompt: %s\n", __func__, string_from(ctx_dft, prompt_dft).c_str());
+    void accept(uint16_t n_accepted) override {
+        // noop
+        GGML_UNUSED(n_accepted);
+    }
+};
 
-        llama_decode(ctx_dft, batch);
+// sample the drafts of all jobs, evaluating the sequences together
+static void common_speculative_draft_jobs(common_speculative_shared & shared, std::vector<common_speculative_draft_job> & jobs) {
+    auto & batch   = shared.batch;
+    auto & ctx_dft = shared.ctx_dft;
 
-        common_sampler_reset(smpl);
+    common_batch_clear(batch);
 
-        // sample n_draft tokens from the draft model
-        for (int i = 0; i < params.n_max; ++i) {
-            common_batch_clear(batch);
-
-            common_sampler_sample(smpl, ctx_dft, 0, true);
+    shared.failed = false;
 
-            const auto * cur_p = common_sampler_get_candidates(smpl, true);
+    int32_t n_active = 0;
+    std::vector<bool> evaluated(jobs.size());
+    for (size_t k = 0; k < jobs.size(); ++k) {
+        jobs[k].active = jobs[k].impl->prepare(jobs[k]);
+        evaluated[k] = jobs[k].active;
+        n_active += jobs[k].active;
+    }
 
-            for (int k = 0; k < std::min(3, (int) cur_p->size); ++k) {
-                LOG_DBG(" - draft candidate %3d, pos %3d: %6d (%8.3f) '%s'\n",
-                        k, i, cur_p->data[k].id, cur_p->data[k].p, common_token_to_piece(ctx_dft, cur_p->data[k].id).c_str());
+    // a failed evaluation (e.g. the draft KV cache is full) leaves the logits stale and the sequences out of sync
+    // with their tokens - stop drafting, keep the tokens sampled so far and start the sequences over next time
+    const auto abort = [&]() {
+        for (size_t k = 0; k < jobs.size(); ++k) {
+            if (!evaluated[k]) {
+                continue;
             }
 
-            // add drafted token for each sequence
-            const llama_token id = cur_p->data[0].id;
+            auto * impl = jobs[k].impl;
 
-            common_sampler_accept(smpl, id, true);
+            jobs[k].active = false;
 
-            result.push_back(id);
+            llama_memory_seq_rm(llama_get_memory(ctx_dft), impl->seq_id, -1, -1);
+            impl->prompt_dft.clear();
+        }
+        n_active = 0;
+    };
 
-            if (params.n_max <= (int) result.size()) {
-                break;
-            }
+    GGML_ASSERT(n_active <= (int32_t) llama_n_batch(ctx_dft));
 
-            // only collect very high-confidence draft tokens
-            if (cur_p->data[0].p < params.p_min) {
-                break;
-            }
+    // the last accepted token of each sequence goes in the same batch as the new prompt tokens if there is room
+    if (batch.n_tokens + n_active > (int32_t) llama_n_batch(ctx_dft)) {
+        shared.decode();
+    }
 
-            common_batch_add(batch, id, n_past + i + 1, { 0 }, true);
+    for (auto & job : jobs) {
+        if (!job.active) {
+            continue;
+        }
 
-            // evaluate the drafted tokens on the draft model
-            llama_decode(ctx_dft, batch);
+        auto * impl = job.impl;
 
-            prompt_dft.push_back(id);
-        }
+        job.i_batch = batch.n_tokens;
+        common_batch_add(batch, job.id_last, job.n_past, { impl->seq_id }, true);
 
-        if (!spec->vocab_cmpt) {
-            std::string detokenized = common_detokenize(ctx_dft, result, true);
-            detokenized = replace_to_tgt(detokenized);
-            LOG_DBG("draft->main detokenized string: '%s'\n", detokenized.c_str());
-            result = common_tokenize(ctx_tgt, detokenized, false, true);
-            if (result.size() > (size_t)params.n_max) {
-                result.resize(params.n_max);
-            }
-        }
+        impl->prompt_dft.push_back(job.id_last);
+
+        LOG_DBG("%s: seq_id = %d, draft prompt: %s\n", __func__, impl->seq_id, string_from(ctx_dft, impl->prompt_dft).c_str());
+
+        common_sampler_reset(impl->smpl);
     }
 
-    void accept(uint16_t n_accepted) override {
-        // noop
-        GGML_UNUSED(n_accepted);
+    shared.decode();
+
+    if (shared.failed) {
+        abort();
     }
 
-    std::string replace_to_dft(const std::string & input) const {
-        std::string result = input;
+    // sample n_draft tokens from the draft model, one evaluation per step for all sequences
+    for (int i = 0; n_active > 0; ++i) {
+        for (auto & job : jobs) {
+            if (!job.active) {
+                continue;
+            }
 
-        for (const auto & pair : this->vocab_map) {
-            size_t pos = result.find(pair.first);
-            while (pos != std::string::npos) {
-                result.replace(pos, pair.first.length(), pair.second);
-                pos = result.find(pair.first, pos + pair.second.length());
+            auto * impl   = job.impl;
+            auto & result = *job.result;
+
+            common_sampler_sample(impl->smpl, ctx_dft, job.i_batch, true);
+
+            const auto * cur_p = common_sampler_get_candidates(impl->smpl, true);
+
+            for (int k = 0; k < std::min(3, (int) cur_p->size); ++k) {
+                LOG_DBG(" - seq %d, draft candidate %3d, pos %3d: %6d (%8.3f) '%s'\n",
+                        impl->seq_id, k, i, cur_p->data[k].id, cur_p->data[k].p, common_token_to_piece(ctx_dft, cur_p->data[k].id).c_str());
             }
-        }
 
-        return result;
-    }
+            // add drafted token for each sequence
+            const llama_token id = cur_p->data[0].id;
 
-    std::string replace_to_tgt(const std::string & input) const {
-        std::string result = input;
+            common_sampler_accept(impl->smpl, id, true);
 
-        for (const auto & pair : this->vocab_map) {
-            size_t pos = result.find(pair.second);
-            while (pos != std::string::npos) {
-                result.replace(pos, pair.second.length(), pair.first);
-                pos = result.find(pair.second, pos + pair.first.length());
+            result.push_back(id);
+
+            // only collect very high-confidence draft tokens
+            if (job.params->n_max <= (int) result.size() || cur_p->data[0].p < job.params->p_min) {
+                job.active = false;
+                n_active--;
+                continue;
             }
+
+            job.i_batch = batch.n_tokens;
+            common_batch_add(batch, id, job.n_past + i + 1, { impl->seq_id }, true);
+
+            impl->prompt_dft.push_back(id);
         }
 
-        return result;
+        // evaluate the drafted tokens on the draft model
+        shared.decode();
+
+        if (shared.failed) {
+            abort();
+        }
     }
-};
+
+    for (auto & job : jobs) {
+        job.impl->finish(job);
+    }
+}
 
 struct common_speculative_state_eagle3 : public common_speculative_state {
     common_speculative_state_eagle3(enum common_speculative_type type) : common_speculative_state(type) {}
@@ -834,20 +998,50 @@ done:
     return res;
 }
 
+common_speculative_shared * common_speculative_shared_init(
+        common_params_speculative & params,
+        llama_context             * ctx_tgt,
+        int32_t                     n_seq) {
+    GGML_ASSERT(params.model_dft);
+
+    llama_context * ctx_dft = llama_init_from_model(params.model_dft, params.cparams_dft);
+    if (ctx_dft == nullptr) {
+        LOG_ERR("%s", "failed to create draft context\n");
+        return nullptr;
+    }
+
+    if ((int32_t) llama_n_seq_max(ctx_dft) < n_seq) {
+        LOG_ERR("%s: the draft context supports %u sequences, %d are needed\n", __func__, llama_n_seq_max(ctx_dft), n_seq);
+        llama_free(ctx_dft);
+        return nullptr;
+    }
+
+    return new common_speculative_shared(ctx_tgt, ctx_dft, n_seq, params.replacements);
+}
+
+void common_speculative_shared_free(common_speculative_shared * shared) {
+    delete shared;
+}
+
 // initialization of the speculative decoding system
 //
 common_speculative * common_speculative_init(
         common_params_speculative & params,
-        llama_context             * ctx_tgt) {
-    llama_context * ctx_dft = nullptr;
-    if (params.model_dft) {
-        ctx_dft = llama_init_from_model(params.model_dft, params.cparams_dft);
-        if (ctx_dft == nullptr) {
-            LOG_ERR("%s", "failed to create draft context\n");
+        llama_context             * ctx_tgt,
+        common_speculative_shared * shared,
+        llama_seq_id                seq_id) {
+    // without a shared draft context, the draft model gets a context of its own
+    bool shared_owned = false;
+    if (shared == nullptr && params.model_dft) {
+        shared = common_speculative_shared_init(params, ctx_tgt, 1);
+        if (shared == nullptr) {
             return nullptr;
         }
+        shared_owned = true;
     }
 
+    GGML_ASSERT(shared == nullptr || (seq_id >= 0 && seq_id < shared->n_seq));
+
     // Compute the implementations to use based on the config and their order of preference
     std::vector<common_speculative_config> configs = {}; // list of speculative configs to try
     {
@@ -908,11 +1102,16 @@ common_speculative * common_speculative_init(
             case COMMON_SPECULATIVE_TYPE_NONE:
                 break;
             case COMMON_SPECULATIVE_TYPE_DRAFT: {
+                if (shared == nullptr) {
+                    LOG_WRN("%s", "no draft model loaded - skipping the draft implementation\n");
+                    break;
+                }
                 impls.push_back(std::make_unique<common_speculative_state_draft>(config.type,
-                    /* .ctx_tgt      = */ ctx_tgt,
-                    /* .ctx_dft      = */ ctx_dft,
-                    /* .replacements = */ params.replacements
+                    /* .shared       = */ shared,
+                    /* .shared_owned = */ shared_owned,
+                    /* .seq_id       = */ seq_id
                 ));
+                shared_owned = false;
                 break;
             }
             case COMMON_SPECULATIVE_TYPE_EAGLE3: {
@@ -960,6 +1159,10 @@ common_speculative * common_speculative_init(
         }
     }
 
+    if (shared_owned) {
+        delete shared;
+    }
+
     if (impls.empty()) {
         LOG_WRN("%s", "no implementations specified for speculative decoding\n");
         return nullptr;
@@ -992,36 +1195,125 @@ void common_speculative_begin(common_speculative * spec, const llama_tokens & pr
     }
 }
 
-llama_tokens common_speculative_draft(
+// called once an implementation produced a draft for the decoder
+static void common_speculative_on_draft(
         common_speculative * spec,
-        const common_params_speculative & params,
-        const llama_tokens & prompt_tgt, // specified in target model vocab
-        llama_token id_last) {
-    llama_tokens result;
+        common_speculative_state * impl,
+        const llama_tokens & prompt_tgt,
+        const llama_tokens & result) {
+    LOG_DBG("%s: called impl %s, hist size = %zu, call_count = %zu, gen = %zu\n", __func__,
+            common_speculative_type_to_str(impl->type).c_str(), prompt_tgt.size(),
+            impl->n_call_draft, result.size());
+
+    spec->curr_impl = impl; // set current implementation for stats
+    impl->n_gen_drafts++;
+    impl->n_gen_tokens += result.size();
+}
 
-    spec->curr_impl = nullptr; // reset current implementation
+void common_speculative_draft_batch(std::vector<common_speculative_request> & reqs) {
+    // index of the implementation each request has reached
+    std::vector<size_t> i_impl(reqs.size(), 0);
 
-    for (auto & impl : spec->impls) {
-        {
-            common_time_meas tm(impl->t_draft_us, !impl->gen_perf);
-            impl->draft(params, prompt_tgt, id_last, result);
-            impl->n_call_draft++;
+    // the draft model implementations, grouped by draft context
+    std::map<common_speculative_shared *, std::vector<size_t>> pending;
+
+    // run the implementations in order of preference for each request, until one produces a draft
+    // requests that reach the draft model are evaluated together below, instead of one after the other
+    const auto run = [&](size_t i) {
+        auto & req  = reqs[i];
+        auto * spec = req.spec;
+
+        for (; i_impl[i] < spec->impls.size(); ++i_impl[i]) {
+            auto & impl = spec->impls[i_impl[i]];
+
+            if (impl->type == COMMON_SPECULATIVE_TYPE_DRAFT) {
+                pending[static_cast<common_speculative_state_draft *>(impl.get())->shared].push_back(i);
+                return;
+            }
+
+            {
+                common_time_meas tm(impl->t_draft_us, !impl->gen_perf);
+                impl->draft(*req.params, *req.prompt, req.id_last, req.result);
+                impl->n_call_draft++;
+            }
+
+            if (!req.result.empty()) {
+                common_speculative_on_draft(spec, impl.get(), *req.prompt, req.result);
+                return;
+            }
         }
+    };
+
+    for (size_t i = 0; i < reqs.size(); ++i) {
+        reqs[i].spec->curr_impl = nullptr; // reset current implementation
+        reqs[i].result.clear();
+
+        run(i);
+    }
+
+    while (!pending.empty()) {
+        auto cur = std::move(pending);
+        pending.clear();
+
+        for (auto & [shared, ids] : cur) {
+            std::vector<common_speculative_draft_job> jobs(ids.size());
+
+            for (size_t k = 0; k < ids.size(); ++k) {
+                auto & req = reqs[ids[k]];
+
+                jobs[k].impl       = static_cast<common_speculative_state_draft *>(req.spec->impls[i_impl[ids[k]]].get());
+                jobs[k].params     = req.params;
+                jobs[k].prompt_tgt = req.prompt;
+                jobs[k].id_last    = req.id_last;
+                jobs[k].result     = &req.result;
+            }
+
+            const int64_t t_start_us = ggml_time_us();
+
+            common_speculative_draft_jobs(*shared, jobs);
+
+            // the evaluation time is split evenly between the sequences
+            const int64_t t_draft_us = (ggml_time_us() - t_start_us) / (int64_t) ids.size();
 
-        if (!result.empty()) {
-            LOG_DBG("%s: called impl %s, hist size = %zu, call_count = %zu, gen = %zu\n", __func__,
-                    common_speculative_type_to_str(impl.get()->type).c_str(), prompt_tgt.size(),
-                    impl.get()->n_call_draft, result.size());
+            for (size_t k = 0; k < ids.size(); ++k) {
+                const size_t i = ids[k];
 
-            spec->curr_impl = impl.get(); // set current implementation for stats
-            impl->n_gen_drafts++;
-            impl->n_gen_tokens += result.size();
+                auto & req  = reqs[i];
+                auto * impl = jobs[k].impl;
 
-            break; // We have a draft, so break out of the loop and return it.
+                if (impl->gen_perf) {
+                    impl->t_draft_us += t_draft_us;
+                }
+                impl->n_call_draft++;
+
+                if (!req.result.empty()) {
+                    common_speculative_on_draft(req.spec, impl, *req.prompt, req.result);
+                    continue;
+                }
+
+                // no draft, fall back to the remaining implementations
+                i_impl[i]++;
+                run(i);
+            }
         }
     }
+}
 
-    return result;
+llama_tokens common_speculative_draft(
+        common_speculative * spec,
+        const common_params_speculative & params,
+        const llama_tokens & prompt_tgt, // specified in target model vocab
+        llama_token id_last) {
+    std::vector<common_speculative_request> reqs(1);
+
+    reqs[0].spec    = spec;
+    reqs[0].params  = &params;
+    reqs[0].prompt  = &prompt_tgt;
+    reqs[0].id_last = id_last;
+
+    common_speculative_draft_batch(reqs);
+
+    return std::move(reqs[0].result);
 }
 
 void common_speculative_accept(common_speculative * spec, uint16_t n_accepted) {
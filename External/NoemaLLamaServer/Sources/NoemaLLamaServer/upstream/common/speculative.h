@@ -18,9 +18,25 @@ std::string common_speculative_type_to_str(enum common_speculative_type type);
 // note: clears the memory of the context
 bool common_speculative_is_compat(llama_context * ctx_tgt);
 
+// a draft model context shared by several speculative decoders, each of them drafting in its own sequence
+// the drafts of all decoders that share the context are evaluated together in common_speculative_draft_batch
+struct common_speculative_shared;
+
+// create the draft context from params.model_dft and params.cparams_dft (n_seq_max must be at least n_seq)
+common_speculative_shared * common_speculative_shared_init(
+        common_params_speculative & params,
+        llama_context             * ctx_tgt,
+        int32_t                     n_seq);
+
+// free after all the speculative decoders that use it
+void common_speculative_shared_free(common_speculative_shared * shared);
+
+// if shared is nullptr and a draft model is loaded, the draft model gets a context of its own
 common_speculative * common_speculative_init(
         common_params_speculative & params,
-        llama_context             * ctx_tgt);
+        llama_context             * ctx_tgt,
+        common_speculative_shared * shared = nullptr,
+        llama_seq_id                seq_id = 0);
 
 void common_speculative_free(common_speculative * spec);
 
@@ -34,6 +50,20 @@ llama_tokens common_speculative_draft(
                      const llama_tokens & prompt,
                             llama_token   id_last);
 
+struct common_speculative_request {
+    common_speculative              * spec;
+    const common_params_speculative * params;
+    const llama_tokens              * prompt; // specified in target model vocab
+
+    llama_token id_last;
+
+    llama_tokens result;
+};
+
+// same as common_speculative_draft for several speculative decoders at once
+// decoders with a shared draft context evaluate the draft model in a single batch per draft step
+void common_speculative_draft_batch(std::vector<common_speculative_request> & reqs);
+
 // informs the speculative decoder that n_accepted tokens were accepted by the target model
 void common_speculative_accept(common_speculative * spec, uint16_t n_accepted);
 
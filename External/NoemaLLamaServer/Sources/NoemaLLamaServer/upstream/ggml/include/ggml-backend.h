@@ -368,6 +368,36 @@ extern "C" {
     GGML_API ggml_backend_buffer_t      ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size);
     GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_buffer_type(void);
 
+    // allocation policy of the memory of the CPU buffers (the weights loaded without mmap, the KV cache, the compute
+    // buffers), applies to the buffers allocated after the call. Linux only, the default allocator is used elsewhere
+    enum ggml_backend_cpu_hugepages {
+        GGML_BACKEND_CPU_HUGEPAGES_NONE,     // regular pages
+        GGML_BACKEND_CPU_HUGEPAGES_THP,      // transparent huge pages
+        GGML_BACKEND_CPU_HUGEPAGES_EXPLICIT, // pages of the hugetlbfs pool, transparent huge pages when it is too small
+    };
+
+    enum ggml_backend_cpu_numa_alloc {
+        GGML_BACKEND_CPU_NUMA_ALLOC_DEFAULT,    // on the node of the thread that touches the page first
+        GGML_BACKEND_CPU_NUMA_ALLOC_INTERLEAVE, // interleaved over the nodes of the CPUs the process may run on
+    };
+
+    GGML_API void ggml_backend_cpu_set_alloc_policy(enum ggml_backend_cpu_hugepages hugepages, enum ggml_backend_cpu_numa_alloc numa);
+    GGML_API void ggml_backend_cpu_get_alloc_policy(enum ggml_backend_cpu_hugepages * hugepages, enum ggml_backend_cpu_numa_alloc * numa);
+
+    #define GGML_BACKEND_CPU_MAX_NODES 16
+
+    // page size and NUMA placement of host memory, e.g. the memory of a CPU buffer or a mapped model file
+    struct ggml_backend_cpu_placement {
+        size_t page_size; // the largest page size of the memory
+        size_t resident;  // bytes in memory
+        size_t huge;      // bytes in transparent or hugetlbfs huge pages
+        int    n_sampled; // resident pages sampled for their node
+        int    n_node_pages[GGML_BACKEND_CPU_MAX_NODES]; // sampled pages on each node
+    };
+
+    // returns false if the placement is not known on this system
+    GGML_API bool ggml_backend_cpu_get_placement(const void * ptr, size_t size, struct ggml_backend_cpu_placement * placement);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -137,6 +137,13 @@ extern "C" {
 
     GGML_BACKEND_API void ggml_backend_cpu_set_use_ref(ggml_backend_t backend_cpu, bool use_ref);
 
+    // persisted cache of the repacked weights of a CPU_REPACK buffer, to be set before the tensors are set
+    // the tensors found in the file <path>-<cpu fingerprint>.repack are mapped read-only instead of being repacked
+    // returns false if the buffer is not a CPU_REPACK buffer
+    GGML_BACKEND_API bool ggml_backend_cpu_repack_buffer_set_cache (ggml_backend_buffer_t buffer, const char * path);
+    // write the cache once all tensors are set, if some of them were not in it
+    GGML_BACKEND_API bool ggml_backend_cpu_repack_buffer_save_cache(ggml_backend_buffer_t buffer);
+
     GGML_BACKEND_API ggml_backend_reg_t ggml_backend_cpu_reg(void);
 
     GGML_BACKEND_API void ggml_cpu_fp32_to_fp32(const float *,       float *, int64_t);
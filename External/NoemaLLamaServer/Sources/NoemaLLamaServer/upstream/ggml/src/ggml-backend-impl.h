@@ -74,6 +74,10 @@ extern "C" {
     // do not use directly, use ggml_backend_tensor_copy instead
     GGML_API bool ggml_backend_buffer_copy_tensor(const struct ggml_tensor * src, struct ggml_tensor * dst);
 
+    // memory of the host buffers, with the policy of ggml_backend_cpu_set_alloc_policy()
+    GGML_API void * ggml_backend_cpu_pages_alloc(size_t size);
+    GGML_API void   ggml_backend_cpu_pages_free(void * ptr, size_t size);
+
     // multi-buffer
     // buffer that contains a collection of buffers
     GGML_API ggml_backend_buffer_t ggml_backend_multi_buffer_alloc_buffer(ggml_backend_buffer_t * buffers, size_t n_buffers);
@@ -0,0 +1,341 @@
+// allocation policy of the memory of the CPU buffers
+//
+// the weights loaded without mmap, the KV cache and the compute buffers are read at memory bandwidth on every token.
+// with regular pages their TLB misses add up, and on a NUMA system all their pages end up on the node of the thread
+// that touches them first, usually the loading thread. with a policy, the buffers of GGML_PAGES_MIN_SIZE and more are
+// mapped directly: in transparent or hugetlbfs huge pages, and interleaved over the nodes of the CPUs of the process
+
+#include "ggml-backend.h"
+#include "ggml-backend-impl.h"
+#include "ggml-impl.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define GGML_PAGES_MIN_SIZE  (1ull << 20) // smaller buffers use the default allocator
+#define GGML_PAGES_HUGE_SIZE (2ull << 20) // alignment of the mappings, for the transparent huge pages of x86-64 and arm64
+#define GGML_PAGES_N_SAMPLES 1024         // pages sampled for their node by ggml_backend_cpu_get_placement()
+
+static std::atomic<int> g_pages_hugepages { GGML_BACKEND_CPU_HUGEPAGES_NONE };
+static std::atomic<int> g_pages_numa      { GGML_BACKEND_CPU_NUMA_ALLOC_DEFAULT };
+
+void ggml_backend_cpu_set_alloc_policy(enum ggml_backend_cpu_hugepages hugepages, enum ggml_backend_cpu_numa_alloc numa) {
+    g_pages_hugepages = hugepages;
+    g_pages_numa      = numa;
+}
+
+void ggml_backend_cpu_get_alloc_policy(enum ggml_backend_cpu_hugepages * hugepages, enum ggml_backend_cpu_numa_alloc * numa) {
+    *hugepages = (enum ggml_backend_cpu_hugepages)  g_pages_hugepages.load();
+    *numa      = (enum ggml_backend_cpu_numa_alloc) g_pages_numa.load();
+}
+
+#if defined(__linux__)
+
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+// the mappings made by ggml_backend_cpu_pages_alloc() and their size
+// never destroyed, buffers may be freed by static destructors
+static std::mutex & ggml_pages_mutex() {
+    static auto * mutex = new std::mutex();
+    return *mutex;
+}
+
+static std::unordered_map<void *, size_t> & ggml_pages_mappings() {
+    static auto * mappings = new std::unordered_map<void *, size_t>();
+    return *mappings;
+}
+
+static std::string ggml_pages_read_file(const char * path) {
+    std::string res;
+    FILE * f = fopen(path, "r");
+    if (f) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            res.append(buf, n);
+        }
+        fclose(f);
+    }
+    return res;
+}
+
+// parses a list such as "0-3,8,10-11"
+static std::vector<int> ggml_pages_parse_list(const std::string & s) {
+    std::vector<int> res;
+    const char * p = s.c_str();
+    while (*p) {
+        char * end;
+        const long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long i = first; i <= last; i++) {
+            res.push_back((int) i);
+        }
+        while (*p == ',' || *p == '\n' || *p == ' ') {
+            p++;
+        }
+    }
+    return res;
+}
+
+// the size of the pages of the hugetlbfs pool, 0 if there is none
+static size_t ggml_pages_hugetlb_size() {
+    const std::string meminfo = ggml_pages_read_file("/proc/meminfo");
+    const size_t pos = meminfo.find("Hugepagesize:");
+    if (pos == std::string::npos) {
+        return 0;
+    }
+    return (size_t) strtoull(meminfo.c_str() + pos + strlen("Hugepagesize:"), nullptr, 10) * 1024;
+}
+
+// the nodes with CPUs that the process may run on
+static std::vector<int> ggml_pages_nodes() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return {};
+    }
+
+    std::vector<int> res;
+    for (const int node : ggml_pages_parse_list(ggml_pages_read_file("/sys/devices/system/node/online"))) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        for (const int cpu : ggml_pages_parse_list(ggml_pages_read_file(path))) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                res.push_back(node);
+                break;
+            }
+        }
+    }
+    return res;
+}
+
+static void ggml_pages_interleave(void * addr, size_t size) {
+    static const std::vector<int> nodes = ggml_pages_nodes();
+    if (nodes.size() < 2) {
+        return;
+    }
+
+    unsigned long mask[16] = { 0 }; // 1024 nodes
+    const unsigned long n_bits = sizeof(mask)*8;
+    for (const int node : nodes) {
+        if ((unsigned long) node < n_bits) {
+            mask[node / (sizeof(mask[0])*8)] |= 1ul << (node % (sizeof(mask[0])*8));
+        }
+    }
+
+    if (syscall(SYS_mbind, addr, size, MPOL_INTERLEAVE, mask, n_bits + 1, 0) != 0) {
+        static std::atomic<bool> warned { false };
+        if (!warned.exchange(true)) {
+            GGML_LOG_WARN("%s: failed to interleave the pages over %zu nodes: %s\n", __func__, nodes.size(), strerror(errno));
+        }
+    }
+}
+
+// maps size bytes aligned to a huge page, with regular or transparent huge pages
+static void * ggml_pages_map(size_t size, bool thp) {
+    const size_t align = GGML_PAGES_HUGE_SIZE;
+
+    void * raw = mmap(nullptr, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // trim the mapping to the aligned range
+    const uintptr_t start = GGML_PAD((uintptr_t) raw, align);
+    const size_t    head  = start - (uintptr_t) raw;
+    if (head > 0) {
+        munmap(raw, head);
+    }
+    if (align - head > 0) {
+        munmap((void *) (start + size), align - head);
+    }
+
+    if (thp && madvise((void *) start, size, MADV_HUGEPAGE) != 0) {
+        static std::atomic<bool> warned { false };
+        if (!warned.exchange(true)) {
+            GGML_LOG_WARN("%s: transparent huge pages are not available: %s\n", __func__, strerror(errno));
+        }
+    }
+
+    return (void *) start;
+}
+
+void * ggml_backend_cpu_pages_alloc(size_t size) {
+    const int hugepages = g_pages_hugepages;
+    const int numa      = g_pages_numa;
+
+    if ((hugepages == GGML_BACKEND_CPU_HUGEPAGES_NONE && numa == GGML_BACKEND_CPU_NUMA_ALLOC_DEFAULT) || size < GGML_PAGES_MIN_SIZE) {
+        return ggml_aligned_malloc(size);
+    }
+
+    void * addr   = nullptr;
+    size_t mapped = 0;
+
+    if (hugepages == GGML_BACKEND_CPU_HUGEPAGES_EXPLICIT) {
+        static const size_t hugetlb_size = ggml_pages_hugetlb_size();
+        if (hugetlb_size > 0) {
+            mapped = GGML_PAD(size, hugetlb_size);
+            addr   = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (addr == MAP_FAILED) {
+                GGML_LOG_WARN("%s: not enough hugetlbfs pages for %.2f MiB (see /proc/sys/vm/nr_hugepages), using transparent huge pages\n",
+                        __func__, mapped/1024.0/1024.0);
+                addr = nullptr;
+            }
+        }
+    }
+
+    if (addr == nullptr) {
+        mapped = GGML_PAD(size, GGML_PAGES_HUGE_SIZE);
+        addr   = ggml_pages_map(mapped, hugepages != GGML_BACKEND_CPU_HUGEPAGES_NONE);
+        if (addr == nullptr) {
+            GGML_LOG_ERROR("%s: failed to map %.2f MiB: %s\n", __func__, mapped/1024.0/1024.0, strerror(errno));
+            return nullptr;
+        }
+    }
+
+    // before the pages are touched
+    if (numa == GGML_BACKEND_CPU_NUMA_ALLOC_INTERLEAVE) {
+        ggml_pages_interleave(addr, mapped);
+    }
+
+    std::lock_guard<std::mutex> lock(ggml_pages_mutex());
+    ggml_pages_mappings()[addr] = mapped;
+
+    return addr;
+}
+
+void ggml_backend_cpu_pages_free(void * ptr, size_t size) {
+    if (ptr != nullptr) {
+        std::lock_guard<std::mutex> lock(ggml_pages_mutex());
+        auto & mappings = ggml_pages_mappings();
+        auto it = mappings.find(ptr);
+        if (it != mappings.end()) {
+            munmap(ptr, it->second);
+            mappings.erase(it);
+            return;
+        }
+    }
+
+    ggml_aligned_free(ptr, size);
+}
+
+bool ggml_backend_cpu_get_placement(const void * ptr, size_t size, struct ggml_backend_cpu_placement * placement) {
+    memset(placement, 0, sizeof(*placement));
+
+    const uintptr_t begin = (uintptr_t) ptr;
+    const uintptr_t end   = begin + size;
+
+    // page sizes and huge pages of the mappings that overlap the range, in proportion of the overlap
+    FILE * f = fopen("/proc/self/smaps", "r");
+    if (f == nullptr) {
+        return false;
+    }
+
+    double frac = 0.0; // of the current mapping in the range
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        uint64_t vm_begin = 0;
+        uint64_t vm_end   = 0;
+        if (sscanf(line, "%" SCNx64 "-%" SCNx64 " ", &vm_begin, &vm_end) == 2 && strchr(line, '-') < strchr(line, ' ')) {
+            const uint64_t lo = std::max<uint64_t>(vm_begin, begin);
+            const uint64_t hi = std::min<uint64_t>(vm_end,   end);
+            frac = hi > lo ? (double) (hi - lo) / (vm_end - vm_begin) : 0.0;
+            continue;
+        }
+        if (frac == 0.0) {
+            continue;
+        }
+
+        char key[64];
+        unsigned long long kb = 0;
+        if (sscanf(line, "%63[^:]: %llu kB", key, &kb) != 2) {
+            continue;
+        }
+        const size_t bytes = (size_t) (kb * 1024 * frac);
+
+        if (strcmp(key, "Rss") == 0) {
+            placement->resident += bytes;
+        } else if (strcmp(key, "AnonHugePages") == 0 || strcmp(key, "FilePmdMapped") == 0) {
+            placement->huge += bytes;
+        } else if (strcmp(key, "Private_Hugetlb") == 0 || strcmp(key, "Shared_Hugetlb") == 0) {
+            // not counted in Rss
+            placement->resident += bytes;
+            placement->huge     += bytes;
+        } else if (strcmp(key, "KernelPageSize") == 0) {
+            placement->page_size = std::max(placement->page_size, (size_t) kb * 1024);
+        }
+    }
+    fclose(f);
+
+    // the node of a sample of the pages
+    const size_t page  = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t first = begin / page;
+    const size_t last  = (end + page - 1) / page;
+    const size_t n     = std::min<size_t>(last - first, GGML_PAGES_N_SAMPLES);
+
+    std::vector<void *> pages(n);
+    std::vector<int>    status(n, -1);
+    for (size_t i = 0; i < n; i++) {
+        pages[i] = (void *) ((first + i*(last - first)/n) * page);
+    }
+
+    if (n > 0 && syscall(SYS_move_pages, 0, n, pages.data(), nullptr, status.data(), 0) == 0) {
+        for (size_t i = 0; i < n; i++) {
+            // negative for the pages that are not in memory
+            if (status[i] >= 0 && status[i] < GGML_BACKEND_CPU_MAX_NODES) {
+                placement->n_node_pages[status[i]]++;
+                placement->n_sampled++;
+            }
+        }
+    }
+
+    return true;
+}
+
+#else
+
+void * ggml_backend_cpu_pages_alloc(size_t size) {
+    return ggml_aligned_malloc(size);
+}
+
+void ggml_backend_cpu_pages_free(void * ptr, size_t size) {
+    ggml_aligned_free(ptr, size);
+}
+
+bool ggml_backend_cpu_get_placement(const void * ptr, size_t size, struct ggml_backend_cpu_placement * placement) {
+    GGML_UNUSED(ptr);
+    GGML_UNUSED(size);
+    memset(placement, 0, sizeof(*placement));
+    return false;
+}
+
+#endif
@@ -524,6 +524,12 @@ void ggml_barrier(struct ggml_threadpool * tp);
 void ggml_threadpool_chunk_set(struct ggml_threadpool * tp, int value);
 int  ggml_threadpool_chunk_add(struct ggml_threadpool * tp, int value);
 
+// work-stealing chunk scheduler: the first thread calls ggml_threadpool_chunks_init() before a barrier, then every
+// thread calls ggml_threadpool_chunks_next() until it returns -1
+void ggml_threadpool_chunks_init(struct ggml_threadpool * tp, int nth, int nchunk);
+int  ggml_threadpool_chunks_next(struct ggml_threadpool * tp, int ith);
+bool ggml_threadpool_chunks_steal(const struct ggml_threadpool * tp);
+
 #ifdef __cplusplus
 }
 #endif
@@ -488,6 +488,17 @@ struct ggml_threadpool {
     uint32_t     poll;        // Polling level (0 - no polling)
 
     enum ggml_status ec;
+
+    // barrier elision, see ggml_graph_compute_node_sync()
+    uint8_t * node_sync;      // [node_sync_size] whether a barrier follows the node
+    int       node_sync_size;
+    uint64_t  node_sync_key;  // graph the flags were computed for
+    bool      node_sync_all;  // GGML_CPU_DISABLE_BARRIER_ELISION: a barrier after every node
+
+    // chunk scheduler, see ggml_threadpool_chunks_init()
+    bool      chunk_steal;    // false with GGML_CPU_DISABLE_WORK_STEALING: chunks from current_chunk in order
+    int       chunk_nth;      // threads of the current op
+    int       chunk_nchunk;   // chunks of the current op
 };
 
 // Per-thread state
@@ -500,6 +511,15 @@ struct ggml_compute_state {
     bool cpumask[GGML_MAX_N_THREADS];
     struct ggml_threadpool * threadpool;
     int ith;
+
+    // chunk scheduler, see ggml_threadpool_chunks_init()
+    atomic_int GGML_CACHE_ALIGN chunk_next; // next chunk of the range of the thread, also taken by the other threads
+    int     chunk_end;
+    int     chunk_done;   // chunks computed by the thread in the current op
+    int64_t chunk_t0;     // start of the current op in the thread (us), -1 before its first chunk
+    int64_t chunk_time;   // time in the ops since the last update of the weights (us)
+    float   chunk_share;  // sum of the fractions of these ops computed by the thread
+    float   chunk_weight; // relative throughput of the thread, the share of the chunks it starts with
 };
 
 // Helpers for polling loops
@@ -605,6 +625,142 @@ int ggml_threadpool_chunk_add(struct ggml_threadpool * tp, int value) {
     return atomic_fetch_add_explicit(&tp->current_chunk, value, memory_order_relaxed);
 }
 
+// work-stealing chunk scheduler
+//
+// the chunks of an op are split into one contiguous range per thread, sized by the throughput measured for the thread
+// in the previous ops, so that a thread on a slower core or sharing its core starts with less work. a thread takes
+// the chunks of its range in order and then steals from the thread with the most chunks left, so that the op ends
+// when the work runs out rather than when the slowest thread is done with its share
+
+#define GGML_CHUNK_RATE_US 2000 // time in the ops of the first thread between two updates of the weights
+
+bool ggml_threadpool_chunks_steal(const struct ggml_threadpool * tp) {
+    return tp->chunk_steal;
+}
+
+// sets the weights of the threads from the throughput measured since the last update
+static void ggml_threadpool_chunks_update_weights(struct ggml_threadpool * tp, int nth) {
+    struct ggml_compute_state * workers = tp->workers;
+
+    float rate[GGML_MAX_N_THREADS];
+    float rate_sum = 0.0f;
+    int   n_rate   = 0;
+
+    for (int j = 0; j < nth; j++) {
+        rate[j] = workers[j].chunk_time > 0 ? workers[j].chunk_share / workers[j].chunk_time : 0.0f;
+        if (rate[j] > 0.0f) {
+            rate_sum += rate[j];
+            n_rate++;
+        }
+    }
+
+    for (int j = 0; j < nth; j++) {
+        if (rate[j] > 0.0f) {
+            // smoothed, and bounded so that a thread that was descheduled once still gets some of the work
+            const float w = MIN(MAX(rate[j] * n_rate / rate_sum, 0.25f), 4.0f);
+            workers[j].chunk_weight = 0.5f*workers[j].chunk_weight + 0.5f*w;
+        }
+        workers[j].chunk_time  = 0;
+        workers[j].chunk_share = 0.0f;
+    }
+}
+
+void ggml_threadpool_chunks_init(struct ggml_threadpool * tp, int nth, int nchunk) {
+    struct ggml_compute_state * workers = tp->workers;
+
+    tp->chunk_nth    = nth;
+    tp->chunk_nchunk = nchunk;
+
+    for (int j = 0; j < nth; j++) {
+        workers[j].chunk_done = 0;
+        workers[j].chunk_t0   = -1;
+    }
+
+    if (!tp->chunk_steal) {
+        // every thread starts at ith, so the first unprocessed chunk is nth
+        atomic_store_explicit(&tp->current_chunk, nth, memory_order_relaxed);
+        return;
+    }
+
+    if (workers[0].chunk_time >= GGML_CHUNK_RATE_US) {
+        ggml_threadpool_chunks_update_weights(tp, nth);
+    }
+
+    // the weights only matter with a few chunks per thread, an even split keeps the chunks of a thread together
+    // otherwise (e.g. one chunk per thread on NUMA)
+    const bool weighted = nchunk >= 2*nth;
+
+    float w_sum = 0.0f;
+    for (int j = 0; j < nth; j++) {
+        w_sum += weighted ? workers[j].chunk_weight : 1.0f;
+    }
+
+    float w_acc = 0.0f;
+    int   begin = 0;
+    for (int j = 0; j < nth; j++) {
+        w_acc += weighted ? workers[j].chunk_weight : 1.0f;
+
+        const int end = j == nth - 1 ? nchunk : MIN((int) (nchunk * (w_acc / w_sum) + 0.5f), nchunk);
+
+        atomic_store_explicit(&workers[j].chunk_next, begin, memory_order_relaxed);
+        workers[j].chunk_end = end;
+
+        begin = MAX(begin, end);
+    }
+}
+
+int ggml_threadpool_chunks_next(struct ggml_threadpool * tp, int ith) {
+    struct ggml_compute_state * workers = tp->workers;
+    struct ggml_compute_state * w       = &workers[ith];
+
+    const int nth    = tp->chunk_nth;
+    const int nchunk = tp->chunk_nchunk;
+
+    if (!tp->chunk_steal) {
+        const int chunk = w->chunk_done++ == 0 ? ith : atomic_fetch_add_explicit(&tp->current_chunk, 1, memory_order_relaxed);
+        return chunk < nchunk ? chunk : -1;
+    }
+
+    if (w->chunk_t0 < 0) {
+        w->chunk_t0 = ggml_time_us();
+    }
+
+    int chunk = atomic_fetch_add_explicit(&w->chunk_next, 1, memory_order_relaxed);
+    if (chunk < w->chunk_end) {
+        w->chunk_done++;
+        return chunk;
+    }
+
+    // steal from the thread with the most chunks left
+    while (true) {
+        int victim = -1;
+        int n_left = 0;
+        for (int k = 1; k < nth; k++) {
+            const int j = (ith + k) % nth;
+            const int n = workers[j].chunk_end - atomic_load_explicit(&workers[j].chunk_next, memory_order_relaxed);
+            if (n > n_left) {
+                victim = j;
+                n_left = n;
+            }
+        }
+        if (victim < 0) {
+            break;
+        }
+
+        chunk = atomic_fetch_add_explicit(&workers[victim].chunk_next, 1, memory_order_relaxed);
+        if (chunk < workers[victim].chunk_end) {
+            w->chunk_done++;
+            return chunk;
+        }
+    }
+
+    // the op is done for this thread
+    w->chunk_time  += ggml_time_us() - w->chunk_t0;
+    w->chunk_share += (float) w->chunk_done / nchunk;
+
+    return -1;
+}
+
 #if defined(__gnu_linux__)
 static cpu_set_t ggml_get_numa_affinity(void) {
     cpu_set_t cpuset;
@@ -1337,9 +1493,40 @@ UseGgmlGemm1:;
     #endif
     }
 
+    // This is the size of the first dimension of the result, so we can iterate that way. (see the ASSERT above, these are the same numbers)
+    const int64_t nr0 = ne0;
+
+    // This is the size of the rest of the dimensions of the result
+    const int64_t nr1 = ne1 * ne2 * ne3;
+
+    // Now select a reasonable chunk size.
+    int chunk_size = 16;
+
+    // We need to step up the size if it's small
+    if (nr0 == 1 || nr1 == 1) {
+        chunk_size = 64;
+    }
+
+    // distribute the work across the inner or outer loop based on which one is larger
+    // The number of chunks in the 0/1 dim.
+    // CEIL(nr0/chunk_size)
+    int64_t nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
+    int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
+
+    // If the chunking is poor for the number of threads on this setup, scrap the whole plan.  Re-chunk it by thread.
+    //   Also, chunking by thread was measured to have perform better on NUMA systems.  See https://github.com/ggml-org/llama.cpp/pull/6915
+    //   In theory, chunking should be just as useful on NUMA and non NUMA systems, but testing disagreed with that.
+    //   With work stealing, 4 chunks per thread leave room to balance the threads (e.g. the decode of a small model).
+    if (nchunk0 * nchunk1 < nth * 4 || ggml_is_numa()) {
+        const int64_t nchunk = ggml_threadpool_chunks_steal(params->threadpool) && !ggml_is_numa() ? nth * 4 : nth;
+
+        // distribute the thread work across the inner or outer loop based on which one is larger
+        nchunk0 = nr0 > nr1 ? MIN(nchunk, nr0) : 1; // parallelize by src0 rows
+        nchunk1 = nr0 > nr1 ? 1 : MIN(nchunk, nr1); // parallelize by src1 rows
+    }
+
     if (ith == 0) {
-        // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-        atomic_store_explicit(&params->threadpool->current_chunk, nth, memory_order_relaxed);
+        ggml_threadpool_chunks_init(params->threadpool, nth, nchunk0 * nchunk1);
     }
 
     ggml_barrier(params->threadpool);
@@ -1368,43 +1555,12 @@ UseGgmlGemm1:;
 UseGgmlGemm2:;
 #endif
 
-    // This is the size of the first dimension of the result, so we can iterate that way. (see the ASSERT above, these are the same numbers)
-    const int64_t nr0 = ne0;
-
-    // This is the size of the rest of the dimensions of the result
-    const int64_t nr1 = ne1 * ne2 * ne3;
-
-    // Now select a reasonable chunk size.
-    int chunk_size = 16;
-
-    // We need to step up the size if it's small
-    if (nr0 == 1 || nr1 == 1) {
-        chunk_size = 64;
-    }
-
-    // distribute the work across the inner or outer loop based on which one is larger
-    // The number of chunks in the 0/1 dim.
-    // CEIL(nr0/chunk_size)
-    int64_t nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
-    int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
-
-    // If the chunking is poor for the number of threads on this setup, scrap the whole plan.  Re-chunk it by thread.
-    //   Also, chunking by thread was measured to have perform better on NUMA systems.  See https://github.com/ggml-org/llama.cpp/pull/6915
-    //   In theory, chunking should be just as useful on NUMA and non NUMA systems, but testing disagreed with that.
-    if (nchunk0 * nchunk1 < nth * 4 || ggml_is_numa()) {
-        // distribute the thread work across the inner or outer loop based on which one is larger
-        nchunk0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-        nchunk1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
-    }
-
     // The number of elements in each chunk
     const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
     const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
-    // The first chunk comes from our thread_id, the rest will get auto-assigned.
-    int current_chunk = ith;
-
-    while (current_chunk < nchunk0 * nchunk1) {
+    for (int current_chunk = ggml_threadpool_chunks_next(params->threadpool, ith); current_chunk >= 0;
+             current_chunk = ggml_threadpool_chunks_next(params->threadpool, ith)) {
         const int64_t ith0 = current_chunk % nchunk0;
         const int64_t ith1 = current_chunk / nchunk0;
 
@@ -1423,12 +1579,6 @@ UseGgmlGemm2:;
             num_rows_per_vec_dot = 1;
         }
         ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
-
-        if (nth >= nchunk0 * nchunk1) {
-            break;
-        }
-
-        current_chunk = atomic_fetch_add_explicit(&params->threadpool->current_chunk, 1, memory_order_relaxed);
     }
 }
 
@@ -2664,6 +2814,101 @@ static void ggml_thread_cpumask_next(const bool * global_mask, bool * local_mask
     }
 }
 
+#if defined(__gnu_linux__)
+// the capacity of a core as reported by the kernel (or its max frequency), to tell the classes of a hybrid cpu apart
+static int64_t ggml_cpu_core_capacity(int cpu) {
+    static const char * paths[] = {
+        "/sys/devices/system/cpu/cpu%d/cpu_capacity",
+        "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq",
+    };
+
+    for (size_t i = 0; i < sizeof(paths)/sizeof(paths[0]); i++) {
+        char path[128];
+        snprintf(path, sizeof(path), paths[i], cpu);
+
+        FILE * f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        long long value = 0;
+        const int n = fscanf(f, "%lld", &value);
+        fclose(f);
+        if (n == 1 && value > 0) {
+            return value;
+        }
+    }
+
+    return 0;
+}
+
+// places the threads on the classes of cores of a hybrid cpu, the fastest class first, and lets every thread move
+// only between the cores of its class, so that the throughput measured for a thread by the chunk scheduler holds
+static bool ggml_thread_cpumask_core_classes(struct ggml_compute_state * workers, int n_threads) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return false;
+    }
+
+    const int n_cpu = MIN((int) sysconf(_SC_NPROCESSORS_ONLN), GGML_MAX_N_THREADS);
+
+    int64_t capacity[GGML_MAX_N_THREADS];
+    int64_t classes[GGML_MAX_N_THREADS]; // distinct capacities, in decreasing order
+    int     n_class_cpu[GGML_MAX_N_THREADS];
+    int     n_classes = 0;
+
+    for (int cpu = 0; cpu < n_cpu; cpu++) {
+        capacity[cpu] = CPU_ISSET(cpu, &allowed) ? ggml_cpu_core_capacity(cpu) : 0;
+        if (capacity[cpu] == 0) {
+            continue;
+        }
+        int c = 0;
+        while (c < n_classes && classes[c] > capacity[cpu]) {
+            c++;
+        }
+        if (c == n_classes || classes[c] != capacity[cpu]) {
+            memmove(&classes[c + 1],     &classes[c],     (n_classes - c)*sizeof(classes[0]));
+            memmove(&n_class_cpu[c + 1], &n_class_cpu[c], (n_classes - c)*sizeof(n_class_cpu[0]));
+            classes[c]     = capacity[cpu];
+            n_class_cpu[c] = 0;
+            n_classes++;
+        }
+        n_class_cpu[c]++;
+    }
+
+    if (n_classes < 2) {
+        GGML_LOG_INFO("%s: the cores are all of the same class, default affinity\n", __func__);
+        return false;
+    }
+
+    // fill the classes in order, the threads beyond the number of cores go round-robin
+    int c = 0;
+    int n = 0;
+    for (int j = 0; j < n_threads; j++) {
+        if (n == n_class_cpu[c]) {
+            c = (c + 1) % n_classes;
+            n = 0;
+        }
+        n++;
+
+        memset(workers[j].cpumask, 0, GGML_MAX_N_THREADS);
+        for (int cpu = 0; cpu < n_cpu; cpu++) {
+            workers[j].cpumask[cpu] = capacity[cpu] == classes[c];
+        }
+    }
+
+    GGML_LOG_INFO("%s: %d classes of cores, the first with %d cores\n", __func__, n_classes, n_class_cpu[0]);
+
+    return true;
+}
+#else
+static bool ggml_thread_cpumask_core_classes(struct ggml_compute_state * workers, int n_threads) {
+    GGML_UNUSED(workers);
+    GGML_UNUSED(n_threads);
+    return false;
+}
+#endif
+
 void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     if (!threadpool) return;
 
@@ -2690,6 +2935,8 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     ggml_cond_destroy(&threadpool->cond);
 #endif // GGML_USE_OPENMP
 
+    free(threadpool->node_sync);
+
     const size_t workers_size = sizeof(struct ggml_compute_state) * n_threads;
     ggml_aligned_free(threadpool->workers, workers_size);
     ggml_aligned_free(threadpool, sizeof(struct ggml_threadpool));
@@ -2959,6 +3206,231 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+// barrier elision
+//
+// a barrier is only needed between two nodes when a thread may still be writing memory that the next node reads, or
+// reading memory that it writes, or when the nodes share state of the threadpool. consecutive light ops, that do not
+// synchronize inside, run without a barrier in between as long as they do not touch the memory of the nodes since the
+// last barrier. a light op with a single row is computed by the first thread alone, so a chain of them (the add, norm,
+// mul, scale, ... of the hidden state of a decode step) also runs without barriers, as the data stays in one thread
+
+#define GGML_NODE_SYNC_MAX_RUN 8 // max nodes between two barriers
+
+enum ggml_node_sync_type {
+    GGML_NODE_SYNC_TYPE_BARRIER, // may synchronize inside or use shared state, barriers before and after
+    GGML_NODE_SYNC_TYPE_FREE,    // no synchronization and no work buffer
+    GGML_NODE_SYNC_TYPE_WDATA,   // no synchronization, uses a slice of the work buffer per thread
+};
+
+static enum ggml_node_sync_type ggml_node_sync_type(const struct ggml_tensor * node) {
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        // extra buffer types (repack, amx, ...) have their own implementations
+        if (node->src[i] && node->src[i]->extra) {
+            return GGML_NODE_SYNC_TYPE_BARRIER;
+        }
+    }
+
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            // quantized src0 is converted through the work buffer
+            return ggml_is_quantized(node->src[0]->type) ? GGML_NODE_SYNC_TYPE_WDATA : GGML_NODE_SYNC_TYPE_FREE;
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            return ggml_is_quantized(node->type) ? GGML_NODE_SYNC_TYPE_WDATA : GGML_NODE_SYNC_TYPE_FREE;
+        case GGML_OP_ADD_ID:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_SCALE:
+        case GGML_OP_CLAMP:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_L2_NORM:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_SET_ROWS:
+        case GGML_OP_UNARY:
+        case GGML_OP_GLU:
+            return GGML_NODE_SYNC_TYPE_FREE;
+        case GGML_OP_ROPE:
+        case GGML_OP_SOFT_MAX:
+            return GGML_NODE_SYNC_TYPE_WDATA;
+        default:
+            return GGML_NODE_SYNC_TYPE_BARRIER;
+    }
+}
+
+// true if the whole node is computed by the first thread: a single row of an op that splits the rows between the threads
+static bool ggml_node_sync_first_thread(const struct ggml_tensor * node) {
+    if (ggml_nrows(node) != 1) {
+        return false;
+    }
+
+    switch (node->op) {
+        case GGML_OP_ADD:
+            return !ggml_is_quantized(node->src[0]->type);
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SCALE:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_L2_NORM:
+            return true;
+        case GGML_OP_UNARY:
+            switch (ggml_get_unary_op(node)) {
+                case GGML_UNARY_OP_RELU:
+                case GGML_UNARY_OP_GELU:
+                case GGML_UNARY_OP_GELU_ERF:
+                case GGML_UNARY_OP_SILU:
+                    return true;
+                default:
+                    return false;
+            }
+        case GGML_OP_GLU:
+            switch (ggml_get_glu_op(node)) {
+                case GGML_GLU_OP_REGLU:
+                case GGML_GLU_OP_GEGLU:
+                case GGML_GLU_OP_SWIGLU:
+                    return true;
+                default:
+                    return false;
+            }
+        default:
+            return false;
+    }
+}
+
+static bool ggml_node_sync_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a->data == NULL || b->data == NULL) {
+        return true;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// true if node must wait for prev to be complete in all threads
+static bool ggml_node_sync_depends(const struct ggml_tensor * node, const struct ggml_tensor * prev) {
+    if (ggml_node_sync_overlap(node, prev)) {
+        return true;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (node->src[i] && ggml_node_sync_overlap(node->src[i], prev)) {
+            return true;
+        }
+        if (prev->src[i] && ggml_node_sync_overlap(node, prev->src[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint64_t ggml_node_sync_key(const struct ggml_cgraph * cgraph, int n_threads) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ (uint64_t) (uintptr_t) cgraph ^ ((uint64_t) n_threads << 48);
+
+    #define GGML_NODE_SYNC_HASH(v) do { h ^= (uint64_t) (v); h *= 0x100000001b3ULL; h ^= h >> 29; } while (0)
+
+    GGML_NODE_SYNC_HASH(cgraph->n_nodes);
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        // the graphs of the next batches often reuse the same tensors and memory with other shapes
+        GGML_NODE_SYNC_HASH((uintptr_t) node);
+        GGML_NODE_SYNC_HASH((uintptr_t) node->data);
+        GGML_NODE_SYNC_HASH(((uint64_t) node->op << 32) | node->flags);
+        GGML_NODE_SYNC_HASH(((uint64_t) node->type << 32) | (uint32_t) node->op_params[0]);
+        for (int k = 0; k < GGML_MAX_DIMS; k++) {
+            GGML_NODE_SYNC_HASH(node->ne[k]);
+        }
+        for (int j = 0; j < GGML_MAX_SRC && node->src[j]; j++) {
+            const struct ggml_tensor * src = node->src[j];
+
+            GGML_NODE_SYNC_HASH((uintptr_t) src->data ^ (src->extra != NULL));
+            GGML_NODE_SYNC_HASH(((uint64_t) src->type << 32) | (uint32_t) ggml_nbytes(src));
+        }
+    }
+
+    #undef GGML_NODE_SYNC_HASH
+
+    return h;
+}
+
+// computes tp->node_sync for the graph, reusing the flags of the previous call if the graph is unchanged
+static void ggml_graph_compute_node_sync(struct ggml_threadpool * tp, const struct ggml_cgraph * cgraph, int n_threads) {
+    const int n_nodes = cgraph->n_nodes;
+
+    if (n_nodes > tp->node_sync_size) {
+        free(tp->node_sync);
+        tp->node_sync      = malloc(n_nodes);
+        tp->node_sync_size = n_nodes;
+        tp->node_sync_key  = 0;
+        GGML_ASSERT(tp->node_sync != NULL);
+    }
+
+    const uint64_t key = ggml_node_sync_key(cgraph, n_threads);
+    if (key == tp->node_sync_key) {
+        return;
+    }
+    tp->node_sync_key = key;
+
+    uint8_t * sync = tp->node_sync;
+    memset(sync, 1, n_nodes);
+
+    if (tp->node_sync_all || n_threads == 1) {
+        return;
+    }
+
+    // the compute nodes since the last barrier
+    int  run[GGML_NODE_SYNC_MAX_RUN];
+    int  n_run     = 0;
+    bool run_wdata = false;
+
+    enum ggml_node_sync_type type_prev = GGML_NODE_SYNC_TYPE_BARRIER;
+
+    for (int i = 0; i < n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (ggml_op_is_empty(node->op) || (node->flags & GGML_TENSOR_FLAG_COMPUTE) == 0) {
+            continue;
+        }
+
+        const enum ggml_node_sync_type type = ggml_node_sync_type(node);
+
+        // two nodes that use the work buffer could overlap in it, as the slices depend on the shape
+        bool elide = n_run > 0 && n_run < GGML_NODE_SYNC_MAX_RUN &&
+            type      != GGML_NODE_SYNC_TYPE_BARRIER &&
+            type_prev != GGML_NODE_SYNC_TYPE_BARRIER &&
+            !(type == GGML_NODE_SYNC_TYPE_WDATA && run_wdata);
+
+        const bool first_thread = elide && ggml_node_sync_first_thread(node);
+
+        for (int k = 0; k < n_run && elide; k++) {
+            const struct ggml_tensor * prev = cgraph->nodes[run[k]];
+
+            elide = !ggml_node_sync_depends(node, prev) || (first_thread && ggml_node_sync_first_thread(prev));
+        }
+
+        if (elide) {
+            sync[run[n_run - 1]] = 0;
+        } else {
+            n_run     = 0;
+            run_wdata = false;
+        }
+
+        run[n_run++] = i;
+        run_wdata    = run_wdata || type == GGML_NODE_SYNC_TYPE_WDATA;
+        type_prev    = type;
+    }
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -2997,6 +3469,11 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
         ggml_compute_forward(&params, node);
 
+        // without a barrier, the threads may be at different nodes and can only be aborted at the next barrier
+        if (!tp->node_sync[node_n]) {
+            continue;
+        }
+
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
             atomic_store_explicit(&tp->abort, node_n + 1, memory_order_relaxed);
@@ -3179,6 +3656,13 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->poll             = tpp->poll;
         threadpool->prio             = tpp->prio;
         threadpool->ec               = GGML_STATUS_SUCCESS;
+        threadpool->node_sync        = NULL;
+        threadpool->node_sync_size   = 0;
+        threadpool->node_sync_key    = 0;
+        threadpool->node_sync_all    = getenv("GGML_CPU_DISABLE_BARRIER_ELISION") != NULL;
+        threadpool->chunk_steal      = getenv("GGML_CPU_DISABLE_WORK_STEALING") == NULL;
+        threadpool->chunk_nth        = 0;
+        threadpool->chunk_nchunk     = 0;
     }
 
     // Allocate and init workers state
@@ -3187,17 +3671,22 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
 
     memset(workers, 0, workers_size);
     for (int j = 0; j < tpp->n_threads; j++) {
-        workers[j].threadpool = threadpool;
-        workers[j].ith        = j;
+        workers[j].threadpool   = threadpool;
+        workers[j].ith          = j;
+        workers[j].chunk_weight = 1.0f;
     }
 
     threadpool->workers = workers;
 
+    // GGML_CPU_CORE_CLASS_AFFINITY: without an explicit mask, keep every thread on one class of cores of a hybrid cpu
+    const bool core_classes = !ggml_thread_cpumask_is_valid(tpp->cpumask) && getenv("GGML_CPU_CORE_CLASS_AFFINITY") &&
+        ggml_thread_cpumask_core_classes(workers, tpp->n_threads);
+
 #ifdef GGML_USE_OPENMP
     int32_t cpumask_iter = 0;
 
     // Compute CPU masks for each thread
-    for (int j = 0; j < tpp->n_threads; j++) {
+    for (int j = 0; j < tpp->n_threads && !core_classes; j++) {
         ggml_thread_cpumask_next(tpp->cpumask, workers[j].cpumask, tpp->strict_cpu, &cpumask_iter);
     }
 #else // GGML_USE_OPENMP
@@ -3210,13 +3699,17 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
     int32_t cpumask_iter = 0;
 
     for (int j = 1; j < tpp->n_threads; j++) {
-        ggml_thread_cpumask_next(tpp->cpumask, workers[j].cpumask, tpp->strict_cpu, &cpumask_iter);
+        if (!core_classes) {
+            ggml_thread_cpumask_next(tpp->cpumask, workers[j].cpumask, tpp->strict_cpu, &cpumask_iter);
+        }
 
         int32_t rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_secondary_thread, &workers[j]);
         GGML_ASSERT(rc == 0);
     }
 
-    ggml_thread_cpumask_next(tpp->cpumask, workers[0].cpumask, tpp->strict_cpu, &cpumask_iter);
+    if (!core_classes) {
+        ggml_thread_cpumask_next(tpp->cpumask, workers[0].cpumask, tpp->strict_cpu, &cpumask_iter);
+    }
 
     if (!threadpool->pause) {
         // Update main thread prio and affinity at the start, otherwise we'll do it in resume
@@ -3262,6 +3755,16 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+#ifndef GGML_USE_OPENMP
+    if (n_threads > threadpool->n_threads) {
+        GGML_LOG_WARN("cplan requested more threads (%d) than available (%d)\n", n_threads, threadpool->n_threads);
+        n_threads = threadpool->n_threads;
+    }
+#endif
+
+    // the flags hold for any number of threads > 1, including the number that OpenMP actually starts
+    ggml_graph_compute_node_sync(threadpool, cgraph, n_threads);
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -3287,11 +3790,6 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         ggml_graph_compute_thread(&threadpool->workers[0]);
     }
 #else
-    if (n_threads > threadpool->n_threads) {
-        GGML_LOG_WARN("cplan requested more threads (%d) than available (%d)\n", n_threads, threadpool->n_threads);
-        n_threads = threadpool->n_threads;
-    }
-
     // Kick all threads to start the new graph
     ggml_graph_compute_kickoff(threadpool, n_threads);
 
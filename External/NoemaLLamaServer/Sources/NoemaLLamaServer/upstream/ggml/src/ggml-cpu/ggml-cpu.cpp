@@ -661,6 +661,14 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
     if (strcmp(name, "ggml_backend_cpu_set_use_ref") == 0) {
         return (void *)ggml_backend_cpu_set_use_ref;
     }
+#ifdef GGML_USE_CPU_REPACK
+    if (strcmp(name, "ggml_backend_cpu_repack_buffer_set_cache") == 0) {
+        return (void *)ggml_backend_cpu_repack_buffer_set_cache;
+    }
+    if (strcmp(name, "ggml_backend_cpu_repack_buffer_save_cache") == 0) {
+        return (void *)ggml_backend_cpu_repack_buffer_save_cache;
+    }
+#endif
 
     // threadpool - TODO:  move to ggml-base
     if (strcmp(name, "ggml_threadpool_new") == 0) {
@@ -8856,7 +8856,7 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         }
 
         if (ith == 0) {
-            ggml_threadpool_chunk_set(params->threadpool, nth);
+            ggml_threadpool_chunks_init(params->threadpool, nth, nchunk);
         }
 
         ggml_barrier(params->threadpool);
@@ -8872,9 +8872,8 @@ static void ggml_compute_forward_flash_attn_ext_f16(
 #ifdef GGML_SIMD
         use_tiled &= (DV % GGML_F32_EPR == 0);
 #endif
-        int current_chunk = ith;
-
-        while (current_chunk < nchunk) {
+        for (int current_chunk = ggml_threadpool_chunks_next(params->threadpool, ith); current_chunk >= 0;
+                 current_chunk = ggml_threadpool_chunks_next(params->threadpool, ith)) {
             const int64_t ir0 = dr * current_chunk;
             const int64_t ir1 = MIN(ir0 + dr, nr);
 
@@ -8883,8 +8882,6 @@ static void ggml_compute_forward_flash_attn_ext_f16(
             } else {
                 ggml_compute_forward_flash_attn_ext_f16_one_chunk(params, dst, ir0, ir1, 0, nek1, nullptr, 0);
             }
-
-            current_chunk = ggml_threadpool_chunk_add(params->threadpool, 1);
         }
     }
 }
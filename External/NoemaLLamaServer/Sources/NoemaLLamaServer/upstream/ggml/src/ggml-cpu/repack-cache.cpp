@@ -0,0 +1,321 @@
+#include "repack-cache.h"
+
+#include "ggml-impl.h"
+#include "ggml-cpu.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#if defined(_WIN32)
+#    define WIN32_LEAN_AND_MEAN
+#    ifndef NOMINMAX
+#        define NOMINMAX
+#    endif
+#    include <windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
+#define GGML_REPACK_CACHE_MAGIC   0x43505247 // "GRPC"
+#define GGML_REPACK_CACHE_VERSION 1          // increment when a repacked layout changes
+#define GGML_REPACK_CACHE_ALIGN   64         // alignment of the tensor data in the file
+
+// the features that select the repacked layout of a tensor, see ggml_repack_get_optimal_repack_type()
+static std::string ggml_repack_cache_features() {
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+            "v%d avx2=%d avx512=%d neon=%d dotprod=%d i8mm=%d sve=%d sve_cnt=%d rvv=%d rvv_vlen=%d",
+            GGML_REPACK_CACHE_VERSION,
+            ggml_cpu_has_avx2(), ggml_cpu_has_avx512(),
+            ggml_cpu_has_neon(), ggml_cpu_has_dotprod(), ggml_cpu_has_matmul_int8(),
+            ggml_cpu_has_sve(), ggml_cpu_get_sve_cnt(),
+            ggml_cpu_has_riscv_v(), ggml_cpu_get_rvv_vlen());
+    return buf;
+}
+
+static uint64_t ggml_repack_cache_hash(const std::string & s) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    for (const char c : s) {
+        h ^= (uint8_t) c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+ggml_repack_cache::~ggml_repack_cache() {
+    unmap();
+}
+
+void ggml_repack_cache::unmap() {
+    if (addr == nullptr) {
+        return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(addr);
+#else
+    munmap(addr, size);
+#endif
+    addr = nullptr;
+    size = 0;
+}
+
+bool ggml_repack_cache::open(const char * path) {
+    features = ggml_repack_cache_features();
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-%016" PRIx64 ".repack", ggml_repack_cache_hash(features));
+    fname = std::string(path) + suffix;
+
+#if defined(_WIN32)
+    HANDLE hfile = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile == INVALID_HANDLE_VALUE) {
+        return true; // written by save()
+    }
+    LARGE_INTEGER fsize;
+    if (GetFileSizeEx(hfile, &fsize) && fsize.QuadPart > 0) {
+        HANDLE hmap = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hmap) {
+            addr = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+            size = addr ? (size_t) fsize.QuadPart : 0;
+            CloseHandle(hmap);
+        }
+    }
+    CloseHandle(hfile);
+#else
+    const int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return true; // written by save()
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void * ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr != MAP_FAILED) {
+            addr = ptr;
+            size = st.st_size;
+        }
+    }
+    close(fd);
+#endif
+
+    if (addr == nullptr) {
+        GGML_LOG_WARN("%s: failed to map %s, the weights will be repacked\n", __func__, fname.c_str());
+        return true;
+    }
+
+    if (!read_index()) {
+        GGML_LOG_WARN("%s: %s is not a valid repack cache for this CPU, it will be replaced\n", __func__, fname.c_str());
+        entries.clear();
+        unmap();
+        return true;
+    }
+
+    GGML_LOG_INFO("%s: mapped %zu repacked tensors (%.2f MiB) from %s\n", __func__,
+            entries.size(), size / 1024.0 / 1024.0, fname.c_str());
+
+    return true;
+}
+
+bool ggml_repack_cache::read_index() {
+    const uint8_t * cur = (const uint8_t *) addr;
+    const uint8_t * end = cur + size;
+
+    const auto read = [&](void * dst, size_t n) {
+        if ((size_t) (end - cur) < n) {
+            return false;
+        }
+        memcpy(dst, cur, n);
+        cur += n;
+        return true;
+    };
+    const auto read_str = [&](std::string & dst) {
+        uint32_t n = 0;
+        if (!read(&n, sizeof(n)) || (size_t) (end - cur) < n) {
+            return false;
+        }
+        dst.assign((const char *) cur, n);
+        cur += n;
+        return true;
+    };
+
+    uint32_t magic   = 0;
+    uint32_t version = 0;
+    if (!read(&magic, sizeof(magic)) || magic != GGML_REPACK_CACHE_MAGIC ||
+        !read(&version, sizeof(version)) || version != GGML_REPACK_CACHE_VERSION) {
+        return false;
+    }
+
+    std::string file_features;
+    if (!read_str(file_features) || file_features != features) {
+        return false;
+    }
+
+    uint64_t n_tensors = 0;
+    if (!read(&n_tensors, sizeof(n_tensors))) {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < n_tensors; ++i) {
+        std::string name;
+        entry e;
+        int32_t  type = 0;
+        uint64_t offs = 0;
+        uint64_t n    = 0;
+        if (!read_str(name) || !read_str(e.layout) ||
+            !read(&type, sizeof(type)) || !read(e.ne, sizeof(e.ne)) ||
+            !read(&offs, sizeof(offs)) || !read(&n, sizeof(n))) {
+            return false;
+        }
+        if (offs > size || n > size - offs || offs % GGML_REPACK_CACHE_ALIGN != 0) {
+            return false;
+        }
+        e.type = (ggml_type) type;
+        e.offs = offs;
+        e.size = n;
+        entries[name] = std::move(e);
+    }
+
+    return true;
+}
+
+const void * ggml_repack_cache::find(const struct ggml_tensor * t, const char * layout) {
+    const auto it = entries.find(t->name);
+
+    const bool hit = it != entries.end() &&
+        it->second.type   == t->type &&
+        it->second.size   == ggml_nbytes(t) &&
+        it->second.layout == layout &&
+        memcmp(it->second.ne, t->ne, sizeof(t->ne)) == 0;
+
+    if (!hit) {
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tensors.push_back({ t, layout });
+        n_hit++;
+    }
+
+    return (const uint8_t *) addr + it->second.offs;
+}
+
+void ggml_repack_cache::add(const struct ggml_tensor * t, const char * layout) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tensors.push_back({ t, layout });
+    n_miss++;
+}
+
+bool ggml_repack_cache::save() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (n_miss == 0) {
+        if (n_hit > 0) {
+            GGML_LOG_INFO("%s: %d repacked tensors loaded from %s\n", __func__, n_hit, fname.c_str());
+        }
+        return true;
+    }
+
+    // the header and the index, with the offsets of the data
+    std::vector<uint8_t> head;
+
+    const auto write = [&](const void * src, size_t n) {
+        head.insert(head.end(), (const uint8_t *) src, (const uint8_t *) src + n);
+    };
+    const auto write_str = [&](const std::string & s) {
+        const uint32_t n = s.size();
+        write(&n, sizeof(n));
+        write(s.data(), n);
+    };
+
+    size_t n_head = sizeof(uint32_t)*2 + sizeof(uint32_t) + features.size() + sizeof(uint64_t);
+    for (const auto & p : tensors) {
+        n_head += sizeof(uint32_t) + strlen(p.t->name) + sizeof(uint32_t) + p.layout.size() +
+                  sizeof(int32_t) + sizeof(p.t->ne) + sizeof(uint64_t)*2;
+    }
+
+    const uint32_t magic     = GGML_REPACK_CACHE_MAGIC;
+    const uint32_t version   = GGML_REPACK_CACHE_VERSION;
+    const uint64_t n_tensors = tensors.size();
+
+    write(&magic,   sizeof(magic));
+    write(&version, sizeof(version));
+    write_str(features);
+    write(&n_tensors, sizeof(n_tensors));
+
+    std::vector<uint64_t> offs(tensors.size());
+
+    uint64_t offs_cur = GGML_PAD(n_head, GGML_REPACK_CACHE_ALIGN);
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        const auto * t = tensors[i].t;
+
+        const int32_t  type = t->type;
+        const uint64_t n    = ggml_nbytes(t);
+
+        offs[i] = offs_cur;
+
+        write_str(t->name);
+        write_str(tensors[i].layout);
+        write(&type, sizeof(type));
+        write(t->ne, sizeof(t->ne));
+        write(&offs[i], sizeof(offs[i]));
+        write(&n, sizeof(n));
+
+        offs_cur = GGML_PAD(offs_cur + n, GGML_REPACK_CACHE_ALIGN);
+    }
+    GGML_ASSERT(head.size() == n_head);
+
+    // write a temporary file that replaces the cache once complete, so that a concurrent load never sees a partial
+    // file and the processes that map the previous file keep their pages
+#if defined(_WIN32)
+    const unsigned long pid = GetCurrentProcessId();
+#else
+    const unsigned long pid = getpid();
+#endif
+    const std::string fname_tmp = fname + ".tmp." + std::to_string(pid);
+
+    FILE * f = fopen(fname_tmp.c_str(), "wb");
+    if (f == nullptr) {
+        GGML_LOG_ERROR("%s: failed to create %s\n", __func__, fname_tmp.c_str());
+        return false;
+    }
+
+    static const uint8_t zeros[GGML_REPACK_CACHE_ALIGN] = { 0 };
+
+    bool ok = fwrite(head.data(), 1, head.size(), f) == head.size();
+
+    size_t pos = head.size();
+    for (size_t i = 0; i < tensors.size() && ok; ++i) {
+        const auto * t = tensors[i].t;
+        const size_t n = ggml_nbytes(t);
+
+        ok = fwrite(zeros, 1, offs[i] - pos, f) == offs[i] - pos &&
+             fwrite(t->data, 1, n, f) == n;
+
+        pos = offs[i] + n;
+    }
+
+    ok = fclose(f) == 0 && ok;
+
+    std::error_code ec;
+    if (ok) {
+        std::filesystem::rename(fname_tmp, fname, ec);
+    }
+    if (!ok || ec) {
+        GGML_LOG_ERROR("%s: failed to write %s\n", __func__, fname.c_str());
+        std::filesystem::remove(fname_tmp, ec);
+        return false;
+    }
+
+    GGML_LOG_INFO("%s: %d repacked tensors loaded from the cache, %d repacked, written to %s (%.2f MiB)\n", __func__,
+            n_hit, n_miss, fname.c_str(), pos / 1024.0 / 1024.0);
+
+    n_hit += n_miss;
+    n_miss = 0;
+
+    return true;
+}
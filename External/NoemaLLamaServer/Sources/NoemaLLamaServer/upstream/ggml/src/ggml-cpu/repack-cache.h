@@ -0,0 +1,73 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// GGML internal header
+
+// persisted cache of the repacked weights of a CPU_REPACK buffer
+//
+// the file holds the tensors of one buffer in their repacked layout. it is mapped read-only, and the tensors found in
+// it point into the mapping instead of being repacked into the buffer, so that the processes that load the same model
+// share the pages through the page cache, and a load only faults in the pages that are used
+//
+// the file name is suffixed with a fingerprint of the CPU features that select the repacked layouts, and every
+// tensor records its layout, so that a cache written on another CPU or by another version is never used
+struct ggml_repack_cache {
+    ggml_repack_cache() = default;
+    ~ggml_repack_cache();
+
+    ggml_repack_cache(const ggml_repack_cache &) = delete;
+    ggml_repack_cache & operator=(const ggml_repack_cache &) = delete;
+
+    // map the file <path>-<cpu fingerprint>.repack if it exists, returns false if the cache cannot be used at all
+    bool open(const char * path);
+
+    // the repacked data of the tensor, or nullptr if the tensor is not in the cache
+    // the tensor is remembered to be written back by save()
+    const void * find(const struct ggml_tensor * t, const char * layout);
+
+    // remember a tensor that was repacked into the buffer, to be written by save()
+    void add(const struct ggml_tensor * t, const char * layout);
+
+    // write all remembered tensors to the file, if any of them was not in the cache
+    // the file is replaced through a temporary file, so that the processes that map the old file are not affected
+    bool save();
+
+private:
+    struct entry {
+        ggml_type type;
+        int64_t   ne[GGML_MAX_DIMS];
+        size_t    offs; // from the start of the file
+        size_t    size;
+
+        std::string layout;
+    };
+
+    struct pending {
+        const struct ggml_tensor * t;
+        std::string layout;
+    };
+
+    std::string fname;
+    std::string features;
+
+    void * addr = nullptr;
+    size_t size = 0;
+
+    std::unordered_map<std::string, entry> entries;
+
+    std::mutex mutex; // the tensors may be set from several threads
+
+    std::vector<pending> tensors;
+
+    int n_hit  = 0;
+    int n_miss = 0;
+
+    bool read_index();
+    void unmap();
+};
@@ -15,8 +15,11 @@
 #include <cstring>
 #include <cassert>
 #include <cstdio>  // for GGML_ASSERT
+#include <memory>
+#include <string>
 
 #include "repack.h"
+#include "repack-cache.h"
 
 #if defined(__GNUC__)
 #pragma GCC diagnostic ignored "-Woverlength-strings"
@@ -4153,6 +4156,9 @@ template <> void gemm<block_q2_K, 1, 16, GGML_TYPE_Q8_K>(int n, float * s, size_
 class tensor_traits_base : public ggml::cpu::tensor_traits {
   public:
     virtual int repack(struct ggml_tensor * t, const void * data, size_t data_size) = 0;
+
+    // name of the repacked layout of t, e.g. q4_0_8x8
+    virtual std::string layout(const struct ggml_tensor * t) const = 0;
 };
 
 template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PARAM_TYPE> class tensor_traits : public tensor_traits_base {
@@ -4345,16 +4351,13 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PAR
         nchunk0                  = MIN(nchunk0, max_nchunk);
 
         if (ith == 0) {
-            // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-            ggml_threadpool_chunk_set(params->threadpool, nth);
+            ggml_threadpool_chunks_init(params->threadpool, nth, nchunk0 * nchunk1);
         }
 
         ggml_barrier(params->threadpool);
 
-        // The first chunk comes from our thread_id, the rest will get auto-assigned.
-        int current_chunk = ith;
-
-        while (current_chunk < nchunk0 * nchunk1) {
+        for (int current_chunk = ggml_threadpool_chunks_next(params->threadpool, ith); current_chunk >= 0;
+                 current_chunk = ggml_threadpool_chunks_next(params->threadpool, ith)) {
             const int64_t ith0 = current_chunk % nchunk0;
             const int64_t ith1 = current_chunk / nchunk0;
 
@@ -4373,13 +4376,10 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PAR
 
             // Make sure current plane is the last one before exiting
             if (src0_start >= src0_end) {
-                current_chunk = ggml_threadpool_chunk_add(params->threadpool, 1);
                 continue;
             }
 
             forward_mul_mat_one_chunk(params, dst, src0_start, src0_end, src1_start, src1_end);
-
-            current_chunk = ggml_threadpool_chunk_add(params->threadpool, 1);
         }
     }
 
@@ -4521,6 +4521,10 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PAR
                        (int) NB_COLS, (int) INTER_SIZE);
         return ggml::cpu::repack::repack<BLOC_TYPE, INTER_SIZE, NB_COLS>(t, data, data_size);
     }
+
+    std::string layout(const struct ggml_tensor * t) const override {
+        return std::string(ggml_type_name(t->type)) + "_" + std::to_string(NB_COLS) + "x" + std::to_string(INTER_SIZE);
+    }
 };
 
 }  // namespace ggml::cpu::repack
@@ -4723,6 +4727,24 @@ static const ggml::cpu::tensor_traits * ggml_repack_get_optimal_repack_type(cons
     return nullptr;
 }
 
+// the memory of the buffer, as in a CPU buffer, and the optional cache of its repacked tensors
+struct ggml_backend_cpu_repack_buffer_context {
+    void * data;
+
+    std::unique_ptr<ggml_repack_cache> cache;
+};
+
+static void ggml_backend_cpu_repack_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    auto * ctx = (ggml_backend_cpu_repack_buffer_context *) buffer->context;
+    ggml_backend_cpu_pages_free(ctx->data, buffer->size);
+    delete ctx;
+}
+
+static void * ggml_backend_cpu_repack_buffer_get_base(ggml_backend_buffer_t buffer) {
+    auto * ctx = (ggml_backend_cpu_repack_buffer_context *) buffer->context;
+    return (void *) GGML_PAD((uintptr_t) ctx->data, TENSOR_ALIGNMENT);
+}
+
 static enum ggml_status ggml_backend_cpu_repack_buffer_init_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor) {
     tensor->extra = (void *) const_cast<ggml::cpu::tensor_traits *>(ggml_repack_get_optimal_repack_type(tensor));
 
@@ -4730,18 +4752,60 @@ static enum ggml_status ggml_backend_cpu_repack_buffer_init_tensor(ggml_backend_
     return GGML_STATUS_SUCCESS;
 }
 
+static void ggml_backend_cpu_repack_buffer_memset_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor,
+                                                          uint8_t value, size_t offset, size_t size) {
+    memset((char *) tensor->data + offset, value, size);
+
+    GGML_UNUSED(buffer);
+}
+
 static void ggml_backend_cpu_repack_buffer_set_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor,
                                                        const void * data, size_t offset, size_t size) {
     GGML_ASSERT(offset == 0);
     GGML_ASSERT(size == ggml_nbytes(tensor));
 
+    auto * ctx         = (ggml_backend_cpu_repack_buffer_context *) buffer->context;
     auto tensor_traits = (ggml::cpu::repack::tensor_traits_base *) tensor->extra;
-    auto OK            = tensor_traits->repack(tensor, data, size);
+
+    if (ctx->cache) {
+        const std::string layout = tensor_traits->layout(tensor);
+
+        // the tensor uses the read-only mapping of the cache, and data is not read at all
+        const void * cached = ctx->cache->find(tensor, layout.c_str());
+        if (cached) {
+            tensor->data = const_cast<void *>(cached);
+            return;
+        }
+
+        auto OK = tensor_traits->repack(tensor, data, size);
+        GGML_ASSERT(OK == 0);
+
+        ctx->cache->add(tensor, layout.c_str());
+        return;
+    }
+
+    auto OK = tensor_traits->repack(tensor, data, size);
 
     GGML_ASSERT(OK == 0);
-    GGML_UNUSED(buffer);
 }
 
+static void ggml_backend_cpu_repack_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
+    auto * ctx = (ggml_backend_cpu_repack_buffer_context *) buffer->context;
+    memset(ctx->data, value, buffer->size);
+}
+
+static const struct ggml_backend_buffer_i ggml_backend_cpu_repack_buffer_i = {
+    /* .free_buffer     = */ ggml_backend_cpu_repack_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_cpu_repack_buffer_get_base,
+    /* .init_tensor     = */ ggml_backend_cpu_repack_buffer_init_tensor,
+    /* .memset_tensor   = */ ggml_backend_cpu_repack_buffer_memset_tensor,
+    /* .set_tensor      = */ ggml_backend_cpu_repack_buffer_set_tensor,
+    /* .get_tensor      = */ nullptr,
+    /* .cpy_tensor      = */ nullptr,
+    /* .clear           = */ ggml_backend_cpu_repack_buffer_clear,
+    /* .reset           = */ nullptr,
+};
+
 static const char * ggml_backend_cpu_repack_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
     return "CPU_REPACK";
 
@@ -4749,18 +4813,44 @@ static const char * ggml_backend_cpu_repack_buffer_type_get_name(ggml_backend_bu
 }
 
 static ggml_backend_buffer_t ggml_backend_cpu_repack_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
-    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), size);
+    // the memory is only touched by the tensors that are repacked, the tensors found in the cache leave it untouched
+    void * data = ggml_backend_cpu_pages_alloc(size);
 
-    if (buffer == nullptr) {
+    if (data == nullptr) {
+        GGML_LOG_ERROR("%s: failed to allocate buffer of size %zu\n", __func__, size);
         return nullptr;
     }
 
-    buffer->buft              = buft;
-    buffer->iface.init_tensor = ggml_backend_cpu_repack_buffer_init_tensor;
-    buffer->iface.set_tensor  = ggml_backend_cpu_repack_buffer_set_tensor;
-    buffer->iface.get_tensor  = nullptr;
-    buffer->iface.cpy_tensor  = nullptr;
-    return buffer;
+    auto * ctx = new ggml_backend_cpu_repack_buffer_context { data, nullptr };
+
+    return ggml_backend_buffer_init(buft, ggml_backend_cpu_repack_buffer_i, ctx, size);
+}
+
+bool ggml_backend_cpu_repack_buffer_set_cache(ggml_backend_buffer_t buffer, const char * path) {
+    if (buffer == nullptr || buffer->iface.free_buffer != ggml_backend_cpu_repack_buffer_free_buffer) {
+        return false;
+    }
+
+    auto * ctx = (ggml_backend_cpu_repack_buffer_context *) buffer->context;
+
+    auto cache = std::make_unique<ggml_repack_cache>();
+    if (!cache->open(path)) {
+        return false;
+    }
+
+    ctx->cache = std::move(cache);
+
+    return true;
+}
+
+bool ggml_backend_cpu_repack_buffer_save_cache(ggml_backend_buffer_t buffer) {
+    if (buffer == nullptr || buffer->iface.free_buffer != ggml_backend_cpu_repack_buffer_free_buffer) {
+        return false;
+    }
+
+    auto * ctx = (ggml_backend_cpu_repack_buffer_context *) buffer->context;
+
+    return ctx->cache && ctx->cache->save();
 }
 
 static size_t ggml_backend_cpu_repack_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
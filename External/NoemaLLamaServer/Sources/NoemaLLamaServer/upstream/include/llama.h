@@ -309,6 +309,10 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // directory of the persisted cache of the weights repacked for the CPU, NULL to repack at every load
+        // the cached weights are mapped read-only, and shared by the processes that load the same model
+        const char * repack_cache_dir;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;      // only load the vocabulary, no weights
         bool use_mmap;        // use mmap if possible
@@ -1,5 +1,6 @@
 #include "llama-impl.h"
 
+#include "ggml-backend.h"
 #include "gguf.h"
 #include "llama.h"
 
@@ -116,6 +117,36 @@ std::string llama_format_tensor_shape(const struct ggml_tensor * t) {
     return buf;
 }
 
+std::string llama_format_buffer_placement(struct ggml_backend_buffer * buf) {
+    // the placement is read from /proc/self/smaps and move_pages(), which is only worth it to check a policy
+    ggml_backend_cpu_hugepages hugepages;
+    ggml_backend_cpu_numa_alloc numa;
+    ggml_backend_cpu_get_alloc_policy(&hugepages, &numa);
+    if (hugepages == GGML_BACKEND_CPU_HUGEPAGES_NONE && numa == GGML_BACKEND_CPU_NUMA_ALLOC_DEFAULT) {
+        return "";
+    }
+
+    if (!ggml_backend_buffer_is_host(buf) || ggml_backend_buffer_get_base(buf) == nullptr) {
+        return "";
+    }
+
+    ggml_backend_cpu_placement placement;
+    if (!ggml_backend_cpu_get_placement(ggml_backend_buffer_get_base(buf), ggml_backend_buffer_get_size(buf), &placement) || placement.resident == 0) {
+        return "";
+    }
+
+    std::string res = format("%zu KiB pages, %.1f%% huge", placement.page_size/1024, 100.0*placement.huge/placement.resident);
+    if (placement.n_sampled > 0) {
+        res += ", nodes";
+        for (int i = 0; i < GGML_BACKEND_CPU_MAX_NODES; i++) {
+            if (placement.n_node_pages[i] > 0) {
+                res += format(" %d: %.0f%%", i, 100.0*placement.n_node_pages[i]/placement.n_sampled);
+            }
+        }
+    }
+    return res;
+}
+
 static std::string gguf_data_to_str(enum gguf_type type, const void * data, int i) {
     switch (type) {
         case GGUF_TYPE_UINT8:   return std::to_string(((const uint8_t  *)data)[i]);
@@ -68,6 +68,10 @@ std::string format(const char * fmt, ...);
 std::string llama_format_tensor_shape(const std::vector<int64_t> & ne);
 std::string llama_format_tensor_shape(const struct ggml_tensor * t);
 
+// page size, share of huge pages and NUMA nodes of the memory of a host buffer
+// empty if not available, or if the CPU buffers use the default allocation policy (ggml_backend_cpu_set_alloc_policy)
+std::string llama_format_buffer_placement(struct ggml_backend_buffer * buf);
+
 std::string gguf_kv_to_str(const struct gguf_context * ctx_gguf, int i);
 
 #define LLAMA_TENSOR_NAME_FATTN   "__fattn__"
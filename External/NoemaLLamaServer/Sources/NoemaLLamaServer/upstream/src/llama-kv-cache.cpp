@@ -267,6 +267,12 @@ llama_kv_cache::llama_kv_cache(
         LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
 
         ggml_backend_buffer_clear(buf, 0);
+
+        const std::string placement = llama_format_buffer_placement(buf);
+        if (!placement.empty()) {
+            LLAMA_LOG_INFO("%s: %10s KV buffer placement: %s\n", __func__, ggml_backend_buffer_name(buf), placement.c_str());
+        }
+
         ctxs_bufs.emplace_back(std::move(ctx), buf);
     }
 
@@ -135,6 +135,26 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD) ((uint64_t) (offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &overlapped);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read < chunk_size || chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
     uint32_t read_u32() {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -340,6 +360,85 @@ struct llama_file::impl {
         }
     }
 
+    // reads len bytes at offset with pread, the reads past the end of the file return zeros
+    // returns false if the file rejects the buffer (direct I/O and a buffer that the DMA controller cannot access)
+    bool pread_full(void * ptr, size_t len, size_t offset) const {
+        const int fd_read = fd != -1 ? fd : fileno(fp);
+
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = ::pread(fd_read, reinterpret_cast<char *>(ptr) + bytes_read, len - bytes_read, offset + bytes_read);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (fd != -1 && (errno == EFAULT || errno == EINVAL)) {
+                    return false;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                // EOF: allow if this read was only pulling alignment padding past file end
+                if (offset + bytes_read >= size) {
+                    std::memset(reinterpret_cast<char *>(ptr) + bytes_read, 0, len - bytes_read);
+                    return true;
+                }
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += (size_t) ret;
+        }
+        return true;
+    }
+
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        if (len == 0) {
+            return;
+        }
+        errno = 0;
+
+        // with direct I/O, the buffer, the offset and the size must be aligned, otherwise the data goes through an
+        // aligned bounce buffer
+        const bool aligned = ((reinterpret_cast<uintptr_t>(ptr) | offset | len) & (alignment - 1)) == 0;
+        if (!has_direct_io() || aligned) {
+            if (pread_full(ptr, len, offset)) {
+                return;
+            }
+            if (!has_direct_io()) {
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+        }
+
+        const size_t chunk_size = std::min<size_t>(len, 64*1024*1024);
+
+        void * raw_buffer = nullptr;
+        int ret = posix_memalign(&raw_buffer, alignment, chunk_size + 2*alignment);
+        if (ret != 0) {
+            throw std::runtime_error(format("posix_memalign failed with error %d", ret));
+        }
+
+        struct aligned_buffer_deleter {
+            void operator()(void * p) const { free(p); }
+        };
+        std::unique_ptr<void, aligned_buffer_deleter> buffer(raw_buffer);
+
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            const size_t cur_offset            = offset + bytes_read;
+            const size_t aligned_offset        = cur_offset & ~(alignment - 1);
+            const size_t offset_from_alignment = cur_offset - aligned_offset;
+            const size_t n                     = std::min(len - bytes_read, chunk_size);
+            const size_t bytes_to_read         = (offset_from_alignment + n + alignment - 1) & ~(alignment - 1);
+
+            if (!pread_full(buffer.get(), bytes_to_read, aligned_offset)) {
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            memcpy(reinterpret_cast<char *>(ptr) + bytes_read, reinterpret_cast<char *>(buffer.get()) + offset_from_alignment, n);
+
+            bytes_read += n;
+        }
+    }
+
     uint32_t read_u32() {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -417,6 +516,7 @@ int llama_file::file_id() const {
 
 void llama_file::seek(size_t offset, int whence) const { pimpl->seek(offset, whence); }
 void llama_file::read_raw(void * ptr, size_t len) { pimpl->read_raw(ptr, len); }
+void llama_file::read_raw_at(void * ptr, size_t len, size_t offset) const { pimpl->read_raw_at(ptr, len, offset); }
 #ifdef _WIN32
 void llama_file::read_raw_unsafe(void * ptr, size_t len) { pimpl->read_raw(ptr, len); }
 #else
@@ -479,6 +579,19 @@ struct llama_mmap::impl {
         }
     }
 
+    void prefetch(size_t first, size_t last) {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        first = first & ~(page_size - 1);
+        last  = std::min(last, size);
+        if (last <= first) {
+            return;
+        }
+        if (posix_madvise((uint8_t *) addr + first, last - first, POSIX_MADV_WILLNEED)) {
+            LLAMA_LOG_WARN("warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n",
+                    strerror(errno));
+        }
+    }
+
     void unmap_fragment(size_t first, size_t last) {
         int page_size = sysconf(_SC_PAGESIZE);
         align_range(&first, &last, page_size);
@@ -569,6 +682,29 @@ struct llama_mmap::impl {
         }
     }
 
+    void prefetch(size_t first, size_t last) {
+#if _WIN32_WINNT >= 0x602
+        BOOL (WINAPI *pPrefetchVirtualMemory) (HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+        HMODULE hKernel32 = GetModuleHandleW(L"kernel32.dll");
+
+        pPrefetchVirtualMemory = (decltype(pPrefetchVirtualMemory))(void *) GetProcAddress(hKernel32, "PrefetchVirtualMemory");
+
+        last = std::min(last, size);
+        if (pPrefetchVirtualMemory && last > first) {
+            WIN32_MEMORY_RANGE_ENTRY range;
+            range.VirtualAddress = (uint8_t *) addr + first;
+            range.NumberOfBytes = (SIZE_T) (last - first);
+            if (!pPrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
+                LLAMA_LOG_WARN("warning: PrefetchVirtualMemory failed: %s\n",
+                        llama_format_win_err(GetLastError()).c_str());
+            }
+        }
+#else
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+#endif
+    }
+
     void unmap_fragment(size_t first, size_t last) {
         GGML_UNUSED(first);
         GGML_UNUSED(last);
@@ -597,6 +733,11 @@ struct llama_mmap::impl {
         throw std::runtime_error("mmap not supported");
     }
 
+    void prefetch(size_t first, size_t last) {
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
+
     void unmap_fragment(size_t first, size_t last) {
         GGML_UNUSED(first);
         GGML_UNUSED(last);
@@ -616,6 +757,7 @@ size_t llama_mmap::size() const { return pimpl->size; }
 void * llama_mmap::addr() const { return pimpl->addr; }
 
 void llama_mmap::unmap_fragment(size_t first, size_t last) { pimpl->unmap_fragment(first, last); }
+void llama_mmap::prefetch(size_t first, size_t last) { pimpl->prefetch(first, last); }
 
 #if defined(_POSIX_MEMLOCK_RANGE) || defined(_WIN32)
 const bool llama_mmap::SUPPORTED  = true;
@@ -28,6 +28,7 @@ struct llama_file {
     void read_raw(void * ptr, size_t len);
     void read_raw_unsafe(void * ptr, size_t len);
     void read_aligned_chunk(void * dest, size_t size);
+    void read_raw_at(void * ptr, size_t len, size_t offset) const; // at an offset, leaves the position of the file untouched
     uint32_t read_u32();
 
     void write_raw(const void * ptr, size_t len) const;
@@ -50,6 +51,9 @@ struct llama_mmap {
 
     void unmap_fragment(size_t first, size_t last);
 
+    // ask the OS to read [first, last) ahead, for mappings created without prefetch
+    void prefetch(size_t first, size_t last);
+
     static const bool SUPPORTED;
 
 private:
@@ -7,11 +7,16 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
-#include <future>
+#include <filesystem>
+#include <mutex>
 #include <regex>
+#include <thread>
 
 static const size_t kiB = 1024;
 static const size_t MiB = 1024*kiB;
@@ -100,6 +105,39 @@ static std::vector<std::string> llama_get_list_splits(const std::string & path,
     return paths;
 }
 
+// identity of the model files: a hash of their paths, then a hash of their paths, sizes and modification times
+// used to key caches derived from the weights, without reading the weights. the first part is shared by all versions
+// of the same files, so that the caches of a replaced model can be found
+static std::string llama_get_files_id(const std::vector<std::string> & paths) {
+    uint64_t h_path = 0xcbf29ce484222325ULL; // FNV-1a
+    uint64_t h      = 0xcbf29ce484222325ULL;
+    const auto hash = [](uint64_t & acc, const void * data, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            acc ^= ((const uint8_t *) data)[i];
+            acc *= 0x100000001b3ULL;
+        }
+    };
+
+    for (const auto & path : paths) {
+        std::error_code ec;
+
+        const std::string abs   = std::filesystem::absolute(path, ec).string();
+        const uint64_t    size  = std::filesystem::file_size(path, ec);
+        const int64_t     mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+        if (ec) {
+            return "";
+        }
+
+        hash(h_path, abs.data(), abs.size());
+
+        hash(h, abs.data(), abs.size());
+        hash(h, &size,  sizeof(size));
+        hash(h, &mtime, sizeof(mtime));
+    }
+
+    return format("%016" PRIx64 "-%016" PRIx64, h_path, h);
+}
+
 namespace GGUFMeta {
     template <typename T, gguf_type gt_, T (*gfun)(const gguf_context *, const int64_t)>
     struct GKV_Base_Type {
@@ -661,6 +699,8 @@ llama_model_loader::llama_model_loader(
 
             LLAMA_LOG_INFO("%s: additional %d GGUFs metadata loaded.\n",  __func__, n_split - 1);
         }
+
+        files_id = llama_get_files_id(splits.empty() ? std::vector<std::string> { fname } : splits);
     } else if (file != nullptr) {
         struct ggml_context * ctx = NULL;
         struct gguf_init_params params = {
@@ -1396,6 +1436,195 @@ void llama_model_loader::load_data_for(struct ggml_tensor * cur) const {
     }
 }
 
+// a part of a tensor for the loader threads
+struct llama_load_job {
+    ggml_tensor * cur;
+
+    const llama_file * file; // source file, nullptr if the data is in a mapping
+    const uint8_t    * src;  // source data in the mapping
+
+    size_t offs;   // of the part in the file
+    size_t offset; // of the part in the tensor
+    size_t size;
+
+    bool set; // copy the data into the tensor, otherwise only validate it
+};
+
+// whether ggml_backend_tensor_set can be called on the tensor from several threads at once
+static bool llama_tensor_set_is_thread_safe(const ggml_tensor * cur) {
+    if (ggml_backend_buffer_is_host(cur->buffer)) {
+        return true;
+    }
+    // the CPU extra buffer types convert the data (repack) in the calling thread
+    auto * dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(cur->buffer));
+    return dev && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU;
+}
+
+// loads the jobs with a pool of threads, in the order of the file: each thread reads a part, validates it and converts
+// it to the layout of its buffer, so that the reads are in flight while the data of the previous parts is processed.
+// the data of the buffers that are not in host memory goes through staging memory, of at most max_staging bytes
+struct llama_load_pool {
+    llama_load_pool(std::vector<llama_load_job> && jobs, int n_threads, size_t max_staging, bool check_tensors) :
+            jobs(std::move(jobs)), max_staging(max_staging), check_tensors(check_tensors) {
+        n_workers = n_running = std::min<int>(n_threads, this->jobs.size());
+        for (int i = 0; i < n_workers; ++i) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ~llama_load_pool() {
+        abort();
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+
+    // returns true when all the jobs are done, or after the timeout
+    bool wait_for(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return cv_done.wait_for(lock, timeout, [this] { return n_running == 0; });
+    }
+
+    void abort() {
+        std::lock_guard<std::mutex> lock(mutex);
+        aborted = true;
+        cv_staging.notify_all();
+    }
+
+    // bytes of the jobs done
+    size_t size_done() const {
+        return n_done.load(std::memory_order_relaxed);
+    }
+
+    int n_threads() const {
+        return n_workers;
+    }
+
+    // rethrows the first error of the threads, returns the tensors with invalid data
+    std::vector<const ggml_tensor *> finish() {
+        for (auto & w : workers) {
+            w.join();
+        }
+        workers.clear();
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        std::sort(invalid.begin(), invalid.end());
+        invalid.erase(std::unique(invalid.begin(), invalid.end()), invalid.end());
+        return invalid;
+    }
+
+private:
+    void work() {
+        while (true) {
+            const size_t i = next.fetch_add(1, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (aborted || i >= jobs.size()) {
+                    if (--n_running == 0) {
+                        cv_done.notify_all();
+                    }
+                    return;
+                }
+            }
+
+            try {
+                run(jobs[i]);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                aborted = true;
+                cv_staging.notify_all();
+            }
+
+            n_done.fetch_add(jobs[i].size, std::memory_order_relaxed);
+        }
+    }
+
+    void run(const llama_load_job & job) {
+        const uint8_t * data = job.src;
+
+        if (job.file && ggml_backend_buffer_is_host(job.cur->buffer)) {
+            // directly into the tensor
+            uint8_t * dst = (uint8_t *) job.cur->data + job.offset;
+            job.file->read_raw_at(dst, job.size, job.offs);
+            validate(job, dst);
+            return;
+        }
+
+        if (job.file) {
+            if (!staging_acquire(job.size)) {
+                return;
+            }
+            try {
+                std::vector<no_init<uint8_t>> buf(job.size);
+                job.file->read_raw_at(buf.data(), job.size, job.offs);
+                validate(job, (const uint8_t *) buf.data());
+                ggml_backend_tensor_set(job.cur, buf.data(), job.offset, job.size);
+            } catch (...) {
+                staging_release(job.size);
+                throw;
+            }
+            staging_release(job.size);
+            return;
+        }
+
+        validate(job, data);
+        if (job.set) {
+            ggml_backend_tensor_set(job.cur, data, job.offset, job.size);
+        }
+    }
+
+    void validate(const llama_load_job & job, const uint8_t * data) {
+        if (check_tensors && !ggml_validate_row_data(job.cur->type, data, job.size)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            invalid.push_back(job.cur);
+        }
+    }
+
+    // a job larger than max_staging waits for the staging memory to be unused and takes it alone
+    bool staging_acquire(size_t size) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_staging.wait(lock, [&] { return aborted || staging_used == 0 || staging_used + size <= max_staging; });
+        if (aborted) {
+            return false;
+        }
+        staging_used += size;
+        return true;
+    }
+
+    void staging_release(size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        staging_used -= size;
+        cv_staging.notify_all();
+    }
+
+    const std::vector<llama_load_job> jobs;
+    const size_t max_staging;
+    const bool check_tensors;
+
+    std::vector<std::thread> workers;
+    int n_workers = 0;
+
+    std::atomic<size_t> next   { 0 };
+    std::atomic<size_t> n_done { 0 };
+
+    std::mutex mutex;
+    std::condition_variable cv_done;
+    std::condition_variable cv_staging;
+
+    int    n_running    = 0;
+    bool   aborted      = false;
+    size_t staging_used = 0;
+
+    std::exception_ptr error;
+    std::vector<const ggml_tensor *> invalid;
+};
+
 bool llama_model_loader::load_all_data(
         struct ggml_context * ctx,
         llama_buf_map & bufs,
@@ -1411,7 +1640,6 @@ bool llama_model_loader::load_all_data(
     GGML_ASSERT(size_data != 0 && "call init_mappings() first");
 
     std::vector<no_init<uint8_t>> read_buf;
-    std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
 
     // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
     // NVMe raid configurations might require more / larger buffers.
@@ -1511,6 +1739,24 @@ bool llama_model_loader::load_all_data(
             ggml_backend_name(upload_backend));
     }
 
+    // the tensors that can be loaded from several threads go to the loader threads, the others are loaded in order by
+    // this thread while the loader threads run
+    std::vector<llama_load_job> jobs;
+    std::vector<ggml_tensor *>  tensors_seq;
+
+    // host tensors are split into parts of whole rows, so that the large tensors are read by several threads
+    const auto add_jobs = [&](ggml_tensor * cur, const llama_file * file, const uint8_t * src, size_t offs, bool set) {
+        const size_t n_size   = ggml_nbytes(cur);
+        const size_t row_size = ggml_row_size(cur->type, cur->ne[0]);
+        const bool   split    = (!set || ggml_backend_buffer_is_host(cur->buffer)) && row_size > 0 && n_size % row_size == 0;
+        const size_t part     = split ? std::max(row_size, 64*MiB / row_size * row_size) : n_size;
+
+        for (size_t offset = 0; offset < n_size; offset += part) {
+            const size_t size = std::min(part, n_size - offset);
+            jobs.push_back({ cur, file, src ? src + offset : nullptr, offs + offset, offset, size, set });
+        }
+    };
+
     for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
         const auto * weight = get_weight(ggml_get_name(cur));
         if (weight == nullptr) {
@@ -1518,12 +1764,6 @@ bool llama_model_loader::load_all_data(
             continue;
         }
 
-        if (progress_callback) {
-            if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
-                return false;
-            }
-        }
-
         size_t n_size = ggml_nbytes(cur);
 
         if (use_mmap) {
@@ -1534,12 +1774,6 @@ bool llama_model_loader::load_all_data(
             }
             uint8_t * data = (uint8_t *) mapping->addr() + weight->offs;
 
-            if (check_tensors) {
-                validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
-                    return std::make_pair(cur, ggml_validate_row_data(cur->type, data, n_size));
-                }));
-            }
-
             GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
             if (buf_mmap && cur->data == nullptr) {
                 ggml_backend_tensor_alloc(buf_mmap, cur, data);
@@ -1551,82 +1785,120 @@ bool llama_model_loader::load_all_data(
                 auto & mmap_used = mmaps_used[weight->idx];
                 mmap_used.first  = std::min(mmap_used.first,  weight->offs);
                 mmap_used.second = std::max(mmap_used.second, weight->offs + n_size);
-            } else {
-                ggml_backend_tensor_set(cur, data, 0, n_size);
-            }
-        } else {
-            const auto & file = files.at(weight->idx);
 
-            if (ggml_backend_buffer_is_host(cur->buffer)) {
-                file->seek(weight->offs, SEEK_SET);
-                file->read_raw(cur->data, n_size);
                 if (check_tensors) {
-                    validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                        return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
-                    }));
+                    add_jobs(cur, nullptr, data, weight->offs, false);
+                    size_load_data += n_size;
+                } else {
+                    size_done += n_size;
                 }
+            } else if (llama_tensor_set_is_thread_safe(cur)) {
+                add_jobs(cur, nullptr, data, weight->offs, true);
+                size_load_data += n_size;
+            } else {
+                tensors_seq.push_back(cur);
+                size_load_data += n_size;
+            }
+        } else {
+            if (llama_tensor_set_is_thread_safe(cur)) {
+                add_jobs(cur, files.at(weight->idx).get(), nullptr, weight->offs, true);
             } else {
-                // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
-                if (upload_backend) {
-                    size_t offset = weight->offs;
-                    alignment = file->read_alignment();
-                    size_t aligned_offset = offset & ~(alignment - 1);
-                    size_t offset_from_alignment = offset - aligned_offset;
-                    file->seek(aligned_offset, SEEK_SET);
+                tensors_seq.push_back(cur);
+            }
+            size_load_data += n_size;
+        }
+    }
 
-                    // Calculate aligned read boundaries
-                    size_t read_start = aligned_offset;
-                    size_t read_end = (offset + n_size + alignment - 1) & ~(alignment - 1);
+    const int64_t t_start_us = ggml_time_us();
 
-                    size_t bytes_read = 0;
-                    size_t data_read = 0;  // Actual tensor data copied (excluding padding)
+    // the threads wait for the reads most of the time, use a few more than the cores on small systems
+    const int n_threads = std::min(std::max<int>(std::thread::hardware_concurrency(), 4), 16);
 
-                    while (bytes_read < read_end - read_start) {
-                        size_t read_size = std::min<size_t>(buffer_size, read_end - read_start - bytes_read);
+    llama_load_pool pool(std::move(jobs), n_threads, 512*MiB, check_tensors);
 
-                        // Align the destination pointer within the pinned buffer
-                        uintptr_t ptr_dest_aligned = (reinterpret_cast<uintptr_t>(host_ptrs[buffer_idx]) + alignment - 1) & ~(alignment - 1);
+    const auto progress = [&]() {
+        return progress_callback == nullptr || progress_callback((float) (size_done + pool.size_done()) / size_data, progress_callback_user_data);
+    };
 
-                        // Wait for previous upload to complete before reusing buffer
-                        ggml_backend_event_synchronize(events[buffer_idx]);
+    for (ggml_tensor * cur : tensors_seq) {
+        const auto * weight = get_weight(ggml_get_name(cur));
 
-                        // Read aligned chunk from file
-                        file->read_raw_unsafe(reinterpret_cast<void *>(ptr_dest_aligned), read_size);
+        if (!progress()) {
+            return false;
+        }
 
-                        // Calculate actual data portion (excluding alignment padding)
-                        uintptr_t ptr_data = ptr_dest_aligned;
-                        size_t data_to_copy = read_size;
+        size_t n_size = ggml_nbytes(cur);
 
-                        // Skip alignment padding at start of first chunk
-                        if (bytes_read == 0) {
-                            ptr_data += offset_from_alignment;
-                            data_to_copy -= offset_from_alignment;
-                        }
+        if (use_mmap) {
+            const auto & mapping = mappings.at(weight->idx);
+            uint8_t * data = (uint8_t *) mapping->addr() + weight->offs;
 
-                        // Trim alignment padding at end of last chunk
-                        if (aligned_offset + bytes_read + read_size > offset + n_size) {
-                            data_to_copy -= (read_end - (offset + n_size));
-                        }
+            ggml_backend_tensor_set(cur, data, 0, n_size);
+            if (check_tensors && !ggml_validate_row_data(cur->type, data, n_size)) {
+                throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
+            }
+        } else {
+            // positional reads, the loader threads read from the same files
+            const auto & file = files.at(weight->idx);
+
+            // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
+            if (upload_backend) {
+                size_t offset = weight->offs;
+                alignment = file->read_alignment();
+                size_t aligned_offset = offset & ~(alignment - 1);
+                size_t offset_from_alignment = offset - aligned_offset;
+
+                // Calculate aligned read boundaries
+                size_t read_start = aligned_offset;
+                size_t read_end = (offset + n_size + alignment - 1) & ~(alignment - 1);
+
+                size_t bytes_read = 0;
+                size_t data_read = 0;  // Actual tensor data copied (excluding padding)
+
+                while (bytes_read < read_end - read_start) {
+                    size_t read_size = std::min<size_t>(buffer_size, read_end - read_start - bytes_read);
+
+                    // Align the destination pointer within the pinned buffer
+                    uintptr_t ptr_dest_aligned = (reinterpret_cast<uintptr_t>(host_ptrs[buffer_idx]) + alignment - 1) & ~(alignment - 1);
+
+                    // Wait for previous upload to complete before reusing buffer
+                    ggml_backend_event_synchronize(events[buffer_idx]);
 
-                        // Async upload actual data to GPU
-                        ggml_backend_tensor_set_async(upload_backend, cur,
-                                                      reinterpret_cast<void *>(ptr_data), data_read, data_to_copy);
-                        ggml_backend_event_record(events[buffer_idx], upload_backend);
+                    // Read aligned chunk from file
+                    file->read_raw_at(reinterpret_cast<void *>(ptr_dest_aligned), read_size, read_start + bytes_read);
 
-                        data_read += data_to_copy;
-                        bytes_read += read_size;
+                    // Calculate actual data portion (excluding alignment padding)
+                    uintptr_t ptr_data = ptr_dest_aligned;
+                    size_t data_to_copy = read_size;
 
-                        ++buffer_idx;
-                        buffer_idx %= n_buffers;
+                    // Skip alignment padding at start of first chunk
+                    if (bytes_read == 0) {
+                        ptr_data += offset_from_alignment;
+                        data_to_copy -= offset_from_alignment;
                     }
-                } else {
-                    read_buf.resize(n_size);
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(read_buf.data(), n_size);
-                    ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
-                    if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
-                        throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
+
+                    // Trim alignment padding at end of last chunk
+                    if (aligned_offset + bytes_read + read_size > offset + n_size) {
+                        data_to_copy -= (read_end - (offset + n_size));
                     }
+
+                    // Async upload actual data to GPU
+                    ggml_backend_tensor_set_async(upload_backend, cur,
+                                                  reinterpret_cast<void *>(ptr_data), data_read, data_to_copy);
+                    ggml_backend_event_record(events[buffer_idx], upload_backend);
+
+                    data_read += data_to_copy;
+                    bytes_read += read_size;
+
+                    ++buffer_idx;
+                    buffer_idx %= n_buffers;
+                }
+            } else {
+                read_buf.resize(n_size);
+                file->read_raw_at(read_buf.data(), n_size, weight->offs);
+                ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
+                if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
+                    throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
                 }
             }
         }
@@ -1634,6 +1906,27 @@ bool llama_model_loader::load_all_data(
         size_done += n_size;
     }
 
+    // report the progress of the loader threads until they are done
+    while (!pool.wait_for(std::chrono::milliseconds(100))) {
+        if (!progress()) {
+            return false;
+        }
+    }
+
+    // check validation results
+    const auto invalid = pool.finish();
+    for (const ggml_tensor * cur : invalid) {
+        LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(cur));
+    }
+    if (!invalid.empty()) {
+        throw std::runtime_error("found tensors with invalid data");
+    }
+
+    size_done += pool.size_done();
+
+    t_load_data_us += ggml_time_us() - t_start_us;
+    n_load_threads  = std::max(n_load_threads, pool.n_threads());
+
     // free temporary resources used for async uploads
     for (auto * event : events) {
         ggml_backend_event_synchronize(event);
@@ -1644,19 +1937,6 @@ bool llama_model_loader::load_all_data(
     }
     ggml_backend_free(upload_backend);
 
-    // check validation results
-    bool validation_failed = false;
-    for (auto & future : validation_result) {
-        auto result = future.get();
-        if (!result.second) {
-            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(result.first));
-            validation_failed = true;
-        }
-    }
-    if (validation_failed) {
-        throw std::runtime_error("found tensors with invalid data");
-    }
-
     // check if this is the last call and do final cleanup
     if (size_done >= size_data) {
         // unmap offloaded tensors and metadata
@@ -1670,6 +1950,13 @@ bool llama_model_loader::load_all_data(
                 }
             }
         }
+
+        if (size_load_data > 0) {
+            const double t_load = t_load_data_us / 1e6;
+            LLAMA_LOG_INFO("%s: loaded %.2f MiB of tensor data in %.2f s (%.2f MiB/s, %d loader threads)\n", __func__,
+                    size_load_data/1024.0/1024.0, t_load, t_load > 0 ? size_load_data/1024.0/1024.0/t_load : 0.0, n_load_threads);
+        }
+
         if (progress_callback) {
             // Even though the model is done loading, we still honor
             // cancellation since we need to free allocations.
@@ -86,6 +86,8 @@ struct llama_model_loader {
 
     llama_mmaps mappings;
 
+    std::string files_id; // identity of the model files (<paths>-<version>), empty if the model is not loaded from files
+
     std::map<std::string, llama_tensor_weight, weight_name_comparer> weights_map;
     std::unordered_map<std::string, llama_model_kv_override> kv_overrides;
     const llama_model_tensor_buft_override * tensor_buft_overrides;
@@ -101,6 +103,11 @@ struct llama_model_loader {
 
     size_t size_done = 0;
     size_t size_data = 0;
+
+    // throughput of load_all_data(), the tensors used in place in a mapping excluded
+    int64_t t_load_data_us = 0;
+    size_t  size_load_data = 0;
+    int     n_load_threads = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
     // define a comparator for the buft -> ctx map to ensure that the order is well-defined:
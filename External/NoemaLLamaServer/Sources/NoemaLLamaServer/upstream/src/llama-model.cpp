@@ -22,6 +22,7 @@
 #include <cstdint>
 #include <cstring>
 #include <cmath>
+#include <filesystem>
 #include <functional>
 #include <map>
 #include <regex>
@@ -2609,6 +2610,33 @@ void llama_model::load_vocab(llama_model_loader & ml) {
     vocab.load(ml, kv);
 }
 
+// remove the repack caches of earlier versions of the same model files (same paths, other size or modification time),
+// which are never used again. the caches are named <files_id>-<cpu fingerprint>.repack, files_id is <paths>-<version>
+static void llama_repack_cache_prune(const std::string & dir, const std::string & files_id) {
+    const size_t n_paths = files_id.find('-');
+    if (n_paths == std::string::npos) {
+        return;
+    }
+
+    const std::string prefix_paths = files_id.substr(0, n_paths + 1);
+    const std::string prefix_cur   = files_id + "-";
+
+    std::error_code ec;
+    for (auto it = std::filesystem::directory_iterator(dir, ec); !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+        const std::string name = it->path().filename().string();
+
+        if (name.rfind(prefix_paths, 0) != 0 || name.rfind(prefix_cur, 0) == 0 || name.find(".repack") == std::string::npos) {
+            continue;
+        }
+
+        // the processes that still map the file keep their pages
+        std::error_code ec_rm;
+        if (std::filesystem::remove(it->path(), ec_rm)) {
+            LLAMA_LOG_INFO("%s: removed the repack cache of an earlier version of the model: %s\n", __func__, name.c_str());
+        }
+    }
+}
+
 bool llama_model::load_tensors(llama_model_loader & ml) {
     const auto & split_mode   = params.split_mode;
     const auto & use_mlock    = params.use_mlock;
@@ -7763,7 +7791,11 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &pimpl->mlock_mmaps : nullptr);
+    // with a repack cache, the source pages of the cached tensors are never read - do not populate the whole mapping,
+    // the ranges of the other buffers are prefetched below once the cache is attached
+    const bool use_repack_cache = params.repack_cache_dir && params.repack_cache_dir[0] != '\0' && !ml.files_id.empty() && !ml.no_alloc;
+
+    ml.init_mappings(!use_repack_cache, use_mlock ? &pimpl->mlock_mmaps : nullptr);
     pimpl->mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -7774,6 +7806,28 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     const size_t n_max_backend_buffer = ml.ctx_map.size() * ml.files.size();
     pimpl->ctxs_bufs.reserve(n_max_backend_buffer);
 
+    // the CPU_REPACK buffers with a persisted cache of their repacked weights
+    std::vector<ggml_backend_buffer_t> repack_cache_bufs;
+
+    auto * repack_cache_set_fn  = (decltype(ggml_backend_cpu_repack_buffer_set_cache)  *) nullptr;
+    auto * repack_cache_save_fn = (decltype(ggml_backend_cpu_repack_buffer_save_cache) *) nullptr;
+
+    if (use_repack_cache) {
+        auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+        if (cpu_dev) {
+            auto * cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
+            repack_cache_set_fn  = (decltype(repack_cache_set_fn))  ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_repack_buffer_set_cache");
+            repack_cache_save_fn = (decltype(repack_cache_save_fn)) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_repack_buffer_save_cache");
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(params.repack_cache_dir, ec);
+        if (ec) {
+            LLAMA_LOG_WARN("%s: failed to create the repack cache directory %s: %s\n", __func__, params.repack_cache_dir, ec.message().c_str());
+            repack_cache_set_fn = nullptr;
+        }
+    }
+
     for (auto & [buft, ctx_ptr] : ml.ctx_map) {
         ggml_context * ctx = ctx_ptr.get();
 
@@ -7852,6 +7906,30 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
             ggml_backend_buffer_set_usage(buf.get(), GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
         }
 
+        bool has_repack_cache = false;
+        if (repack_cache_set_fn && repack_cache_save_fn) {
+            // there is a single buffer per buffer type here, so the model files identify the cache
+            const std::string path = std::string(params.repack_cache_dir) + "/" + ml.files_id;
+            for (auto & buf : bufs) {
+                if (repack_cache_set_fn(buf.get(), path.c_str())) {
+                    repack_cache_bufs.push_back(buf.get());
+                    has_repack_cache = true;
+                }
+            }
+        }
+
+        // the tensors of a buffer with a cache are read from the model only on a miss, one at a time as they are set
+        if (use_repack_cache && ml.use_mmap && !has_repack_cache) {
+            for (uint32_t idx = 0; idx < ml.files.size(); idx++) {
+                void * addr = nullptr;
+                size_t first, last; // NOLINT
+                ml.get_mapping_range(&first, &last, &addr, idx, ctx);
+                if (first < last) {
+                    ml.mappings.at(idx)->prefetch(first, last);
+                }
+            }
+        }
+
         pimpl->ctxs_bufs.emplace_back(std::move(ctx_ptr), std::move(bufs));
 
         ctx_buf_maps.emplace_back(ctx, buf_map);
@@ -7899,6 +7977,25 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    // persist the repacked tensors that were not in the cache
+    for (auto * buf : repack_cache_bufs) {
+        repack_cache_save_fn(buf);
+    }
+
+    if (!repack_cache_bufs.empty()) {
+        llama_repack_cache_prune(params.repack_cache_dir, ml.files_id);
+    }
+
+    // where the host buffers ended up, once their pages are touched
+    for (auto & [_, bufs] : pimpl->ctxs_bufs) {
+        for (auto & buf : bufs) {
+            const std::string placement = llama_format_buffer_placement(buf.get());
+            if (!placement.empty()) {
+                LLAMA_LOG_INFO("%s: %12s model buffer placement: %s\n", __func__, ggml_backend_buffer_name(buf.get()), placement.c_str());
+            }
+        }
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             pimpl->mappings.emplace_back(std::move(mapping));
@@ -8947,6 +9044,7 @@ llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.repack_cache_dir            =*/ nullptr,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_direct_io               =*/ false,
@@ -0,0 +1,274 @@
+// microbenchmark of the chunk scheduler of the CPU backend with slow threads
+//
+// the matrix multiplications of the decode step of a small dense model are computed with the threads pinned to one
+// core each, while noise threads share the cores of some of them and take a part of their time, as a busy neighbour on
+// a shared host or a slower core would. the step time percentiles are reported with the chunks taken in order from a
+// shared counter (GGML_CPU_DISABLE_WORK_STEALING) and with the work-stealing scheduler, and the outputs must be
+// identical
+//
+// usage: llama-cpu-chunk-bench [n_embd=2048] [n_layer=8] [n_steps=200] [n_threads=8] [n_slow=1] [duty=50]
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+#if defined(__gnu_linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct bench_graph {
+    ggml_context * ctx = nullptr;
+    ggml_cgraph  * gf  = nullptr;
+
+    ggml_tensor * out = nullptr;
+};
+
+static void fill(ggml_tensor * t, std::mt19937 & rng, float scale) {
+    std::uniform_real_distribution<float> dist(-scale, scale);
+
+    std::vector<float> f(ggml_nelements(t));
+    for (auto & v : f) {
+        v = dist(rng);
+    }
+
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(t->data, f.data(), ggml_nbytes(t));
+    } else {
+        ggml_quantize_chunk(t->type, f.data(), t->data, 0, ggml_nrows(t), t->ne[0], nullptr);
+    }
+}
+
+// the q, k, v, o, gate, up and down projections of every layer for one token, with a norm in between so that the
+// values stay in range
+static void graph_build(bench_graph & g, int n_embd, int n_layer) {
+    const int n_ff = GGML_PAD(n_embd*11/4, 128);
+
+    size_t mem = ggml_graph_overhead() + (16*n_layer + 8)*ggml_tensor_overhead();
+    mem += n_layer*(4*ggml_row_size(GGML_TYPE_Q4_0, n_embd)*n_embd + 3*ggml_row_size(GGML_TYPE_Q4_0, n_embd)*n_ff);
+    mem += n_layer*16*ggml_row_size(GGML_TYPE_F32, n_ff) + 16*n_layer*GGML_MEM_ALIGN;
+
+    ggml_init_params params = { mem, nullptr, false };
+    g.ctx = ggml_init(params);
+
+    ggml_context * ctx = g.ctx;
+
+    std::mt19937 rng(42);
+
+    ggml_tensor * x = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+    fill(x, rng, 1.0f);
+
+    const auto weight = [&](int n_in, int n_out) {
+        ggml_tensor * w = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, n_in, n_out);
+        fill(w, rng, 1.0f/sqrtf(n_in));
+        return w;
+    };
+
+    g.gf = ggml_new_graph(ctx);
+
+    for (int il = 0; il < n_layer; ++il) {
+        ggml_tensor * cur = ggml_rms_norm(ctx, x, 1e-6f);
+
+        ggml_tensor * q = ggml_mul_mat(ctx, weight(n_embd, n_embd), cur);
+        ggml_tensor * k = ggml_mul_mat(ctx, weight(n_embd, n_embd), cur);
+        ggml_tensor * v = ggml_mul_mat(ctx, weight(n_embd, n_embd), cur);
+
+        cur = ggml_mul_mat(ctx, weight(n_embd, n_embd), ggml_add(ctx, ggml_add(ctx, q, k), v));
+        x   = ggml_add(ctx, x, cur);
+
+        cur = ggml_rms_norm(ctx, x, 1e-6f);
+        cur = ggml_swiglu_split(ctx, ggml_mul_mat(ctx, weight(n_embd, n_ff), cur), ggml_mul_mat(ctx, weight(n_embd, n_ff), cur));
+        cur = ggml_mul_mat(ctx, weight(n_ff, n_embd), cur);
+
+        x = ggml_add(ctx, x, cur);
+    }
+
+    g.out = ggml_rms_norm(ctx, x, 1e-6f);
+
+    ggml_build_forward_expand(g.gf, g.out);
+}
+
+static bool pin_thread(int cpu) {
+#if defined(__gnu_linux__)
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+// busy for duty% of every millisecond on the core of a ggml thread
+struct noise {
+    std::atomic<bool> stop { false };
+    std::vector<std::thread> threads;
+
+    void start(const std::vector<int> & cpus, int duty) {
+        stop = false;
+        for (const int cpu : cpus) {
+            threads.emplace_back([this, cpu, duty]() {
+                if (!pin_thread(cpu)) {
+                    fprintf(stderr, "warning: failed to pin the noise thread to cpu %d\n", cpu);
+                }
+                const auto period = std::chrono::microseconds(1000);
+                const auto busy   = period*duty/100;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    const auto t0 = std::chrono::steady_clock::now();
+                    while (std::chrono::steady_clock::now() - t0 < busy) {
+                        // spin
+                    }
+                    std::this_thread::sleep_until(t0 + period);
+                }
+            });
+        }
+    }
+
+    void join() {
+        stop = true;
+        for (auto & t : threads) {
+            t.join();
+        }
+        threads.clear();
+    }
+};
+
+struct bench_result {
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+
+    std::vector<float> out;
+};
+
+static bench_result run(bench_graph & g, int n_threads, int n_steps, bool steal) {
+    ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+
+    // one core per thread, so that the noise threads share the cores of the threads they slow down
+    for (int i = 0; i < n_threads && i < GGML_MAX_N_THREADS; ++i) {
+        tpp.cpumask[i] = true;
+    }
+    tpp.strict_cpu = true;
+    tpp.poll       = 50;
+
+    // the threadpool reads the variable when it is created
+    if (steal) {
+        unsetenv("GGML_CPU_DISABLE_WORK_STEALING");
+    } else {
+        setenv("GGML_CPU_DISABLE_WORK_STEALING", "1", 1);
+    }
+    ggml_threadpool * tp = ggml_threadpool_new(&tpp);
+    unsetenv("GGML_CPU_DISABLE_WORK_STEALING");
+
+    ggml_cplan cplan = ggml_graph_plan(g.gf, n_threads, tp);
+
+    std::vector<uint8_t> work(cplan.work_size);
+    cplan.work_data = work.data();
+
+    // a chunk that is never computed leaves zeros in the output
+    for (int i = 0; i < ggml_graph_n_nodes(g.gf); ++i) {
+        ggml_tensor * node = ggml_graph_node(g.gf, i);
+        memset(node->data, 0, ggml_nbytes(node));
+    }
+
+    // warmup, and time for the scheduler to measure the threads
+    for (int i = 0; i < 10; ++i) {
+        ggml_graph_compute(g.gf, &cplan);
+    }
+
+    std::vector<double> t_step(n_steps);
+    for (int i = 0; i < n_steps; ++i) {
+        const auto t0 = std::chrono::steady_clock::now();
+        ggml_graph_compute(g.gf, &cplan);
+        const auto t1 = std::chrono::steady_clock::now();
+        t_step[i] = std::chrono::duration<double, std::micro>(t1 - t0).count();
+    }
+
+    ggml_threadpool_free(tp);
+
+    bench_result res;
+    res.mean = 0.0;
+    for (const double t : t_step) {
+        res.mean += t / n_steps;
+    }
+    std::sort(t_step.begin(), t_step.end());
+    res.p50 = t_step[n_steps*50/100];
+    res.p90 = t_step[n_steps*90/100];
+    res.p99 = t_step[std::min(n_steps*99/100, n_steps - 1)];
+    res.max = t_step.back();
+
+    res.out.resize(ggml_nelements(g.out));
+    memcpy(res.out.data(), g.out->data, ggml_nbytes(g.out));
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    const int n_embd    = argc > 1 ? atoi(argv[1]) : 2048;
+    const int n_layer   = argc > 2 ? atoi(argv[2]) : 8;
+    const int n_steps   = argc > 3 ? std::max(1, atoi(argv[3])) : 200;
+    const int n_threads = argc > 4 ? atoi(argv[4]) : 8;
+    const int n_slow    = argc > 5 ? atoi(argv[5]) : 1;
+    const int duty      = argc > 6 ? atoi(argv[6]) : 50;
+
+    ggml_cpu_init();
+
+    bench_graph g;
+    graph_build(g, n_embd, n_layer);
+
+    // the workers take the first cores and the main thread the last one, slow down the last workers
+    std::vector<int> slow_cpus;
+    for (int i = 0; i < n_slow && i < n_threads; ++i) {
+        slow_cpus.push_back(n_threads - 2 - i >= 0 ? n_threads - 2 - i : n_threads - 1);
+    }
+
+    printf("n_embd = %d, n_layer = %d, %d threads, %d steps, %d slow threads (%d%% of their core taken)\n\n",
+            n_embd, n_layer, n_threads, n_steps, (int) slow_cpus.size(), duty);
+
+    printf("%-8s | %-8s | %10s | %10s | %10s | %10s | %10s\n", "noise", "chunks", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+    printf("---------+----------+------------+------------+------------+------------+-----------\n");
+
+    std::vector<float> out_ref;
+
+    for (const bool with_noise : { false, true }) {
+        noise nz;
+        if (with_noise) {
+            nz.start(slow_cpus, duty);
+        }
+
+        for (const bool steal : { false, true }) {
+            const bench_result res = run(g, n_threads, n_steps, steal);
+
+            if (out_ref.empty()) {
+                out_ref = res.out;
+            } else if (res.out != out_ref) {
+                fprintf(stderr, "error: the outputs differ\n");
+                return 1;
+            }
+
+            printf("%-8s | %-8s | %10.1f | %10.1f | %10.1f | %10.1f | %10.1f\n", with_noise ? "yes" : "no",
+                    steal ? "stealing" : "in order", res.mean, res.p50, res.p90, res.p99, res.max);
+        }
+
+        if (with_noise) {
+            nz.join();
+        }
+    }
+
+    ggml_free(g.ctx);
+
+    return 0;
+}
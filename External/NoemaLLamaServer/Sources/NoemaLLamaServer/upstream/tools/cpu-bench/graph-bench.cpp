@@ -0,0 +1,290 @@
+// microbenchmark of the synchronization of the CPU backend on a decode step
+//
+// a single token goes through the layers of a small dense model (rms norm, q/k/v, rope, kv store, attention over n_kv
+// cached tokens, output, swiglu ffn), with the memory of the intermediate tensors reused as by ggml-alloc. the graph is
+// computed with a barrier after every node (GGML_CPU_DISABLE_BARRIER_ELISION) and with barrier elision, for each
+// number of threads, and the outputs must be identical
+//
+// usage: llama-cpu-graph-bench [n_embd=896] [n_layer=24] [n_kv=512] [n_steps=100] [threads=4,8,16]
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+struct bench_model {
+    int n_embd;
+    int n_ff;
+    int n_head;
+    int n_head_dim;
+    int n_layer;
+    int n_kv;
+
+    ggml_context * ctx_w = nullptr;
+
+    std::vector<ggml_tensor *> attn_norm, wq, wk, wv, wo, ffn_norm, w_gate, w_up, w_down, k_cache, v_cache;
+
+    ggml_tensor * out_norm = nullptr;
+};
+
+static void fill(ggml_tensor * t, std::mt19937 & rng, float scale) {
+    std::uniform_real_distribution<float> dist(-scale, scale);
+
+    std::vector<float> f(ggml_nelements(t));
+    for (auto & v : f) {
+        v = dist(rng);
+    }
+
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(t->data, f.data(), ggml_nbytes(t));
+    } else if (t->type == GGML_TYPE_F16) {
+        ggml_fp32_to_fp16_row(f.data(), (ggml_fp16_t *) t->data, f.size());
+    } else {
+        ggml_quantize_chunk(t->type, f.data(), t->data, 0, ggml_nrows(t), t->ne[0], nullptr);
+    }
+}
+
+static void model_init(bench_model & m) {
+    const int L = m.n_layer;
+
+    const size_t n_tensors = 11*L + 1;
+
+    size_t mem = n_tensors*ggml_tensor_overhead();
+    mem += L*(2*ggml_row_size(GGML_TYPE_F32, m.n_embd) +
+              4*ggml_row_size(GGML_TYPE_Q4_0, m.n_embd)*m.n_embd +
+              3*ggml_row_size(GGML_TYPE_Q4_0, m.n_embd)*m.n_ff +
+              2*ggml_row_size(GGML_TYPE_F16, m.n_embd)*m.n_kv);
+    mem += ggml_row_size(GGML_TYPE_F32, m.n_embd) + n_tensors*GGML_MEM_ALIGN;
+
+    ggml_init_params params = { mem, nullptr, false };
+    m.ctx_w = ggml_init(params);
+
+    std::mt19937 rng(42);
+
+    for (int il = 0; il < L; ++il) {
+        m.attn_norm.push_back(ggml_new_tensor_1d(m.ctx_w, GGML_TYPE_F32, m.n_embd));
+        m.wq       .push_back(ggml_new_tensor_2d(m.ctx_w, GGML_TYPE_Q4_0, m.n_embd, m.n_embd));
+        m.wk       .push_back(ggml_new_tensor_2d(m.ctx_w, GGML_TYPE_Q4_0, m.n_embd, m.n_embd));
+        m.wv       .push_back(ggml_new_tensor_2d(m.ctx_w, GGML_TYPE_Q4_0, m.n_embd, m.n_embd));
+        m.wo       .push_back(ggml_new_tensor_2d(m.ctx_w, GGML_TYPE_Q4_0, m.n_embd, m.n_embd));
+        m.ffn_norm .push_back(ggml_new_tensor_1d(m.ctx_w, GGML_TYPE_F32, m.n_embd));
+        m.w_gate   .push_back(ggml_new_tensor_2d(m.ctx_w, GGML_TYPE_Q4_0, m.n_embd, m.n_ff));
+        m.w_up     .push_back(ggml_new_tensor_2d(m.ctx_w, GGML_TYPE_Q4_0, m.n_embd, m.n_ff));
+        m.w_down   .push_back(ggml_new_tensor_2d(m.ctx_w, GGML_TYPE_Q4_0, m.n_ff,   m.n_embd));
+        m.k_cache  .push_back(ggml_new_tensor_3d(m.ctx_w, GGML_TYPE_F16, m.n_head_dim, m.n_kv, m.n_head));
+        m.v_cache  .push_back(ggml_new_tensor_3d(m.ctx_w, GGML_TYPE_F16, m.n_kv, m.n_head_dim, m.n_head));
+    }
+    m.out_norm = ggml_new_tensor_1d(m.ctx_w, GGML_TYPE_F32, m.n_embd);
+
+    for (ggml_tensor * t = ggml_get_first_tensor(m.ctx_w); t; t = ggml_get_next_tensor(m.ctx_w, t)) {
+        fill(t, rng, t->ne[1] == 1 ? 1.0f : 1.0f/sqrtf(t->ne[0]));
+    }
+}
+
+struct bench_graph {
+    ggml_context * ctx = nullptr;
+    ggml_cgraph  * gf  = nullptr;
+
+    ggml_gallocr_t galloc = nullptr;
+
+    ggml_tensor * inp  = nullptr;
+    ggml_tensor * pos  = nullptr;
+    ggml_tensor * mask = nullptr;
+    ggml_tensor * out  = nullptr;
+
+    std::vector<float> inp_data;
+};
+
+static void graph_build(bench_graph & g, const bench_model & m) {
+    ggml_init_params params = { ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE*2 + ggml_graph_overhead_custom(GGML_DEFAULT_GRAPH_SIZE*2, false), nullptr, true };
+    g.ctx = ggml_init(params);
+
+    ggml_context * ctx = g.ctx;
+
+    g.gf = ggml_new_graph_custom(ctx, GGML_DEFAULT_GRAPH_SIZE*2, false);
+
+    g.inp  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, m.n_embd, 1);
+    g.pos  = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
+    g.mask = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, m.n_kv, 1);
+    ggml_set_input(g.inp);
+    ggml_set_input(g.pos);
+    ggml_set_input(g.mask);
+
+    const float kq_scale = 1.0f/sqrtf(m.n_head_dim);
+
+    ggml_tensor * x = g.inp;
+    for (int il = 0; il < m.n_layer; ++il) {
+        ggml_tensor * cur = ggml_rms_norm(ctx, x, 1e-6f);
+        cur = ggml_mul(ctx, cur, m.attn_norm[il]);
+
+        ggml_tensor * q = ggml_reshape_3d(ctx, ggml_mul_mat(ctx, m.wq[il], cur), m.n_head_dim, m.n_head, 1);
+        ggml_tensor * k = ggml_reshape_3d(ctx, ggml_mul_mat(ctx, m.wk[il], cur), m.n_head_dim, m.n_head, 1);
+        ggml_tensor * v = ggml_mul_mat(ctx, m.wv[il], cur);
+
+        q = ggml_rope_ext(ctx, q, g.pos, nullptr, m.n_head_dim, 0, 4096, 10000.0f, 1.0f, 0.0f, 1.0f, 32.0f, 1.0f);
+        k = ggml_rope_ext(ctx, k, g.pos, nullptr, m.n_head_dim, 0, 4096, 10000.0f, 1.0f, 0.0f, 1.0f, 32.0f, 1.0f);
+
+        // store the new k and v in the last cell of the cache
+        ggml_tensor * k_cell = ggml_view_3d(ctx, m.k_cache[il], m.n_head_dim, 1, m.n_head,
+                m.k_cache[il]->nb[1], m.k_cache[il]->nb[2], (m.n_kv - 1)*m.k_cache[il]->nb[1]);
+        ggml_tensor * v_cell = ggml_view_3d(ctx, m.v_cache[il], 1, m.n_head_dim, m.n_head,
+                m.v_cache[il]->nb[1], m.v_cache[il]->nb[2], (m.n_kv - 1)*m.v_cache[il]->nb[0]);
+        ggml_build_forward_expand(g.gf, ggml_cpy(ctx, ggml_permute(ctx, k, 0, 2, 1, 3), k_cell));
+        ggml_build_forward_expand(g.gf,
+                ggml_cpy(ctx, ggml_reshape_3d(ctx, v, 1, m.n_head_dim, m.n_head), v_cell));
+
+        ggml_tensor * kq = ggml_mul_mat(ctx, m.k_cache[il], ggml_permute(ctx, q, 0, 2, 1, 3));
+        kq = ggml_soft_max_ext(ctx, kq, g.mask, kq_scale, 0.0f);
+
+        ggml_tensor * kqv = ggml_mul_mat(ctx, m.v_cache[il], kq);
+        cur = ggml_cont_2d(ctx, ggml_permute(ctx, kqv, 0, 2, 1, 3), m.n_embd, 1);
+        cur = ggml_mul_mat(ctx, m.wo[il], cur);
+
+        x = ggml_add(ctx, x, cur);
+
+        cur = ggml_rms_norm(ctx, x, 1e-6f);
+        cur = ggml_mul(ctx, cur, m.ffn_norm[il]);
+        cur = ggml_swiglu_split(ctx, ggml_mul_mat(ctx, m.w_gate[il], cur), ggml_mul_mat(ctx, m.w_up[il], cur));
+        cur = ggml_mul_mat(ctx, m.w_down[il], cur);
+        cur = ggml_scale(ctx, cur, 0.5f);
+
+        x = ggml_add(ctx, x, cur);
+    }
+
+    g.out = ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-6f), m.out_norm);
+    ggml_set_output(g.out);
+
+    ggml_build_forward_expand(g.gf, g.out);
+
+    g.galloc = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+    if (!ggml_gallocr_reserve(g.galloc, g.gf) || !ggml_gallocr_alloc_graph(g.galloc, g.gf)) {
+        fprintf(stderr, "error: failed to allocate the graph\n");
+        exit(1);
+    }
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    g.inp_data.resize(m.n_embd);
+    for (auto & v : g.inp_data) {
+        v = dist(rng);
+    }
+}
+
+// the memory of the inputs is reused after their last use, so they are set before every step, as llama_decode does
+static void graph_set_inputs(bench_graph & g) {
+    memcpy(g.inp->data, g.inp_data.data(), ggml_nbytes(g.inp));
+    *(int32_t *) g.pos->data = g.mask->ne[0] - 1;
+    memset(g.mask->data, 0, ggml_nbytes(g.mask));
+}
+
+// time per step in us, and the output of the last step
+static double run(bench_graph & g, ggml_threadpool * tp, int n_threads, int n_steps, std::vector<float> & out) {
+    ggml_cplan cplan = ggml_graph_plan(g.gf, n_threads, tp);
+
+    std::vector<uint8_t> work(cplan.work_size);
+    cplan.work_data = work.data();
+
+    // warmup
+    for (int i = 0; i < 3; ++i) {
+        graph_set_inputs(g);
+        ggml_graph_compute(g.gf, &cplan);
+    }
+
+    const auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_steps; ++i) {
+        graph_set_inputs(g);
+        ggml_graph_compute(g.gf, &cplan);
+    }
+    const auto t1 = std::chrono::steady_clock::now();
+
+    out.resize(ggml_nelements(g.out));
+    memcpy(out.data(), g.out->data, ggml_nbytes(g.out));
+
+    return std::chrono::duration<double, std::micro>(t1 - t0).count() / n_steps;
+}
+
+int main(int argc, char ** argv) {
+    bench_model m;
+    m.n_embd     = argc > 1 ? atoi(argv[1]) : 896;
+    m.n_layer    = argc > 2 ? atoi(argv[2]) : 24;
+    m.n_kv       = argc > 3 ? atoi(argv[3]) : 512;
+    m.n_head_dim = 64;
+    m.n_head     = m.n_embd / m.n_head_dim;
+    m.n_ff       = GGML_PAD(m.n_embd*11/2, 128);
+
+    const int n_steps = argc > 4 ? atoi(argv[4]) : 100;
+
+    std::vector<int> threads;
+    {
+        std::string s = argc > 5 ? argv[5] : "4,8,16";
+        for (size_t pos = 0; pos < s.size(); ) {
+            size_t end = s.find(',', pos);
+            if (end == std::string::npos) {
+                end = s.size();
+            }
+            threads.push_back(atoi(s.substr(pos, end - pos).c_str()));
+            pos = end + 1;
+        }
+    }
+
+    ggml_cpu_init();
+
+    model_init(m);
+
+    bench_graph g;
+    graph_build(g, m);
+
+    int n_compute = 0;
+    for (int i = 0; i < ggml_graph_n_nodes(g.gf); ++i) {
+        n_compute += ggml_graph_node(g.gf, i)->op != GGML_OP_NONE && ggml_graph_node(g.gf, i)->op != GGML_OP_VIEW &&
+                     ggml_graph_node(g.gf, i)->op != GGML_OP_RESHAPE && ggml_graph_node(g.gf, i)->op != GGML_OP_PERMUTE;
+    }
+
+    printf("n_embd = %d, n_ff = %d, n_layer = %d, n_kv = %d: %d nodes, %d computed per step\n\n",
+            m.n_embd, m.n_ff, m.n_layer, m.n_kv, ggml_graph_n_nodes(g.gf), n_compute);
+
+    printf("%8s | %14s | %14s | %10s | %10s | %8s\n", "threads", "barriers us/t", "elided us/t", "barr. t/s", "elid. t/s", "speedup");
+    printf("---------+----------------+----------------+------------+------------+---------\n");
+
+    for (const int n_threads : threads) {
+        ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+
+        // the threadpool reads the variable when it is created
+        setenv("GGML_CPU_DISABLE_BARRIER_ELISION", "1", 1);
+        ggml_threadpool * tp_all = ggml_threadpool_new(&tpp);
+        unsetenv("GGML_CPU_DISABLE_BARRIER_ELISION");
+        ggml_threadpool * tp_elided = ggml_threadpool_new(&tpp);
+
+        std::vector<float> out_all;
+        std::vector<float> out_elided;
+
+        const double us_all    = run(g, tp_all,    n_threads, n_steps, out_all);
+        const double us_elided = run(g, tp_elided, n_threads, n_steps, out_elided);
+
+        ggml_threadpool_free(tp_all);
+        ggml_threadpool_free(tp_elided);
+
+        if (out_all != out_elided) {
+            fprintf(stderr, "error: %d threads: the outputs differ\n", n_threads);
+            return 1;
+        }
+
+        printf("%8d | %14.1f | %14.1f | %10.1f | %10.1f | %7.2fx\n", n_threads, us_all, us_elided,
+                1e6/us_all, 1e6/us_elided, us_all/us_elided);
+    }
+
+    ggml_gallocr_free(g.galloc);
+    ggml_free(g.ctx);
+    ggml_free(m.ctx_w);
+
+    return 0;
+}
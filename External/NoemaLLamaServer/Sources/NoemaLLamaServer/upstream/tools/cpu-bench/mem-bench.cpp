@@ -0,0 +1,200 @@
+// microbenchmark of the memory placement of the CPU buffers on a decode step
+//
+// the weights of a decode step are read once per token, so its speed is bound by the memory bandwidth. the weights are
+// allocated in a CPU buffer with each allocation policy (regular pages, transparent huge pages, hugetlbfs pages, and
+// the same interleaved over the NUMA nodes), written by the main thread as the model loader does, and multiplied by a
+// single token. the bandwidth, the page size and the node placement of the buffer are reported, and the outputs must
+// be identical
+//
+// usage: llama-cpu-mem-bench [size_mib=1024] [n_steps=20] [n_threads=8]
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+struct bench_policy {
+    const char * name;
+
+    ggml_backend_cpu_hugepages hugepages;
+    ggml_backend_cpu_numa_alloc numa;
+};
+
+struct bench_result {
+    bool   ok = false;
+    double gbs = 0.0;
+
+    ggml_backend_cpu_placement placement = {};
+
+    std::vector<float> out;
+};
+
+// the rows of the weights are copies of a few quantized rows, quantizing all of them would take longer than the bench
+static void fill_weight(ggml_tensor * w, const std::vector<uint8_t> & rows, size_t n_rows) {
+    const size_t row_size = ggml_row_size(w->type, w->ne[0]);
+    for (int64_t i = 0; i < w->ne[1]; ++i) {
+        memcpy((char *) w->data + i*row_size, rows.data() + (i % n_rows)*row_size, row_size);
+    }
+}
+
+static std::string placement_str(const ggml_backend_cpu_placement & p) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%6zu KiB | %5.1f%%", p.page_size/1024, p.resident ? 100.0*p.huge/p.resident : 0.0);
+
+    std::string res = buf;
+    res += " | ";
+    for (int i = 0; i < GGML_BACKEND_CPU_MAX_NODES; ++i) {
+        if (p.n_node_pages[i] > 0) {
+            snprintf(buf, sizeof(buf), "N%d %.0f%% ", i, 100.0*p.n_node_pages[i]/p.n_sampled);
+            res += buf;
+        }
+    }
+    return res;
+}
+
+static bench_result run(const bench_policy & policy, size_t size, int n_steps, int n_threads) {
+    const int n_embd   = 4096;
+    const int n_rows   = 4096;
+    const size_t w_size = ggml_row_size(GGML_TYPE_Q4_0, n_embd)*n_rows;
+    const int n_weight = std::max<int>(1, size / w_size);
+
+    bench_result res;
+
+    ggml_backend_cpu_set_alloc_policy(policy.hugepages, policy.numa);
+
+    ggml_init_params params_w = { ggml_tensor_overhead()*n_weight, nullptr, true };
+    ggml_context * ctx_w = ggml_init(params_w);
+
+    std::vector<ggml_tensor *> w(n_weight);
+    for (auto & t : w) {
+        t = ggml_new_tensor_2d(ctx_w, GGML_TYPE_Q4_0, n_embd, n_rows);
+    }
+
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx_w, ggml_backend_cpu_buffer_type());
+
+    ggml_backend_cpu_set_alloc_policy(GGML_BACKEND_CPU_HUGEPAGES_NONE, GGML_BACKEND_CPU_NUMA_ALLOC_DEFAULT);
+
+    if (buf == nullptr) {
+        ggml_free(ctx_w);
+        return res;
+    }
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f/64, 1.0f/64);
+
+    const size_t n_src_rows = 64;
+    std::vector<float> src(n_src_rows*n_embd);
+    for (auto & v : src) {
+        v = dist(rng);
+    }
+    std::vector<uint8_t> rows(ggml_row_size(GGML_TYPE_Q4_0, n_embd)*n_src_rows);
+    ggml_quantize_chunk(GGML_TYPE_Q4_0, src.data(), rows.data(), 0, n_src_rows, n_embd, nullptr);
+
+    // first touch by the main thread, as the model loader does
+    for (auto * t : w) {
+        fill_weight(t, rows, n_src_rows);
+    }
+
+    ggml_backend_cpu_get_placement(ggml_backend_buffer_get_base(buf), ggml_backend_buffer_get_size(buf), &res.placement);
+
+    size_t mem = ggml_graph_overhead() + (2*n_weight + 2)*ggml_tensor_overhead();
+    mem += (n_weight + 1)*ggml_row_size(GGML_TYPE_F32, std::max(n_embd, n_rows)) + (n_weight + 2)*GGML_MEM_ALIGN;
+
+    ggml_init_params params = { mem, nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * x = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+    for (int i = 0; i < n_embd; ++i) {
+        ggml_set_f32_1d(x, i, dist(rng)*64);
+    }
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    std::vector<ggml_tensor *> y(n_weight);
+    for (int i = 0; i < n_weight; ++i) {
+        y[i] = ggml_mul_mat(ctx, w[i], x);
+        ggml_build_forward_expand(gf, y[i]);
+    }
+
+    ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+    ggml_threadpool * tp = ggml_threadpool_new(&tpp);
+
+    ggml_cplan cplan = ggml_graph_plan(gf, n_threads, tp);
+    std::vector<uint8_t> work(cplan.work_size);
+    cplan.work_data = work.data();
+
+    ggml_graph_compute(gf, &cplan); // warmup
+
+    const auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_steps; ++i) {
+        ggml_graph_compute(gf, &cplan);
+    }
+    const auto t1 = std::chrono::steady_clock::now();
+
+    const double t_step = std::chrono::duration<double>(t1 - t0).count() / n_steps;
+
+    res.ok  = true;
+    res.gbs = (double) n_weight*w_size / t_step / 1e9;
+
+    for (auto * t : y) {
+        res.out.insert(res.out.end(), (const float *) t->data, (const float *) t->data + ggml_nelements(t));
+    }
+
+    ggml_threadpool_free(tp);
+    ggml_free(ctx);
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx_w);
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    const size_t size      = (argc > 1 ? atoll(argv[1]) : 1024) << 20;
+    const int    n_steps   = argc > 2 ? std::max(1, atoi(argv[2])) : 20;
+    const int    n_threads = argc > 3 ? atoi(argv[3]) : 8;
+
+    ggml_cpu_init();
+
+    const bench_policy policies[] = {
+        { "default",             GGML_BACKEND_CPU_HUGEPAGES_NONE,     GGML_BACKEND_CPU_NUMA_ALLOC_DEFAULT    },
+        { "thp",                 GGML_BACKEND_CPU_HUGEPAGES_THP,      GGML_BACKEND_CPU_NUMA_ALLOC_DEFAULT    },
+        { "explicit",            GGML_BACKEND_CPU_HUGEPAGES_EXPLICIT, GGML_BACKEND_CPU_NUMA_ALLOC_DEFAULT    },
+        { "interleave",          GGML_BACKEND_CPU_HUGEPAGES_NONE,     GGML_BACKEND_CPU_NUMA_ALLOC_INTERLEAVE },
+        { "thp + interleave",    GGML_BACKEND_CPU_HUGEPAGES_THP,      GGML_BACKEND_CPU_NUMA_ALLOC_INTERLEAVE },
+    };
+
+    printf("%zu MiB of Q4_0 weights, %d threads, %d steps\n\n", size >> 20, n_threads, n_steps);
+
+    printf("%-18s | %8s | %10s | %6s | %s\n", "policy", "GB/s", "page", "huge", "nodes");
+    printf("-------------------+----------+------------+--------+------------------\n");
+
+    std::vector<float> out_ref;
+
+    for (const auto & policy : policies) {
+        const bench_result res = run(policy, size, n_steps, n_threads);
+        if (!res.ok) {
+            printf("%-18s | failed to allocate the weights\n", policy.name);
+            continue;
+        }
+
+        if (out_ref.empty()) {
+            out_ref = res.out;
+        } else if (res.out != out_ref) {
+            fprintf(stderr, "error: the outputs differ\n");
+            return 1;
+        }
+
+        printf("%-18s | %8.2f | %s\n", policy.name, res.gbs, placement_str(res.placement).c_str());
+    }
+
+    return 0;
+}
@@ -0,0 +1,210 @@
+// microbenchmark of the result path between the slot loop and the streaming HTTP threads
+//
+// one producer thread plays the slot loop: every step it sends one partial result per live stream
+// (followed by a final result after the last token). every stream has its own consumer thread that
+// receives the results and formats them as SSE events, like the HTTP handlers do. reported is the
+// rate of tokens delivered as SSE for:
+//   - shared: the previous server_response (one vector, one mutex, one condition variable for all)
+//   - channel: per-reader SPSC channels
+//   - channel+coalesce: channels, merging up to 8 tokens per event while a reader is behind
+//
+// usage: llama-server-queue-bench [n_tokens_per_stream=2000] [streams=1,8,32,128]
+
+#include "server-common.h"
+#include "server-queue.h"
+#include "server-task.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+// the previous implementation, kept here as the baseline
+struct shared_response {
+    std::unordered_set<int> waiting_task_ids;
+    std::vector<server_task_result_ptr> queue_results;
+
+    std::mutex mutex_results;
+    std::condition_variable condition_results;
+
+    void add_waiting_task_id(int id_task) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.insert(id_task);
+    }
+
+    server_task_result_ptr recv(int id_task) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            condition_results.wait(lock, [&]{ return !queue_results.empty(); });
+
+            for (size_t i = 0; i < queue_results.size(); i++) {
+                if (queue_results[i]->id == id_task) {
+                    server_task_result_ptr res = std::move(queue_results[i]);
+                    queue_results.erase(queue_results.begin() + i);
+                    return res;
+                }
+            }
+        }
+    }
+
+    void send(server_task_result_ptr && result) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        if (waiting_task_ids.count(result->id)) {
+            queue_results.emplace_back(std::move(result));
+            condition_results.notify_all();
+        }
+    }
+
+    void flush() {}
+};
+
+struct channel_response {
+    server_response res;
+    std::vector<server_response_channel_ptr> channels;
+
+    explicit channel_response(int n_coalesce) {
+        res.set_coalesce(n_coalesce);
+    }
+
+    void add_waiting_task_id(int id_task) {
+        channels[id_task] = res.add_waiting_task_id(id_task);
+    }
+
+    server_task_result_ptr recv(int id_task) {
+        while (true) {
+            server_task_result_ptr r = res.recv_with_timeout(*channels[id_task], 1);
+            if (r) {
+                return r;
+            }
+        }
+    }
+
+    void send(server_task_result_ptr && result) {
+        res.send(std::move(result));
+    }
+
+    void flush() {
+        res.flush();
+    }
+};
+
+struct bench_result {
+    double   t_s;
+    uint64_t n_tokens;
+    uint64_t n_events;
+    uint64_t n_bytes;
+};
+
+template <typename Response>
+static bench_result run(Response & response, int n_streams, int n_tokens) {
+    for (int i = 0; i < n_streams; ++i) {
+        response.add_waiting_task_id(i);
+    }
+
+    std::atomic<uint64_t> n_tokens_total = 0;
+    std::atomic<uint64_t> n_events_total = 0;
+    std::atomic<uint64_t> n_bytes_total  = 0;
+
+    const auto t_start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> consumers;
+    for (int i = 0; i < n_streams; ++i) {
+        consumers.emplace_back([&, i]() {
+            uint64_t n_tok = 0, n_ev = 0, n_bytes = 0;
+            while (true) {
+                server_task_result_ptr res = response.recv(i);
+                if (res->is_stop()) {
+                    break;
+                }
+                auto * partial = static_cast<server_task_result_cmpl_partial *>(res.get());
+                if (partial->tokens.front() != llama_token(1000 + n_tok)) {
+                    fprintf(stderr, "error: stream %d received token %d out of order\n", i, partial->tokens.front());
+                    exit(1);
+                }
+                partial->is_updated = true;
+                const std::string sse = format_oai_sse(partial->to_json());
+                n_tok   += partial->tokens.size();
+                n_bytes += sse.size();
+                n_ev++;
+            }
+            n_tokens_total += n_tok;
+            n_events_total += n_ev;
+            n_bytes_total  += n_bytes;
+        });
+    }
+
+    // the slot loop
+    for (int t = 0; t < n_tokens; ++t) {
+        for (int i = 0; i < n_streams; ++i) {
+            auto res = std::make_unique<server_task_result_cmpl_partial>();
+            res->id        = i;
+            res->content   = " token";
+            res->tokens    = { 1000 + t };
+            res->n_decoded = t + 1;
+            res->n_prompt_tokens = 32;
+            response.send(std::move(res));
+        }
+        response.flush();
+    }
+    for (int i = 0; i < n_streams; ++i) {
+        auto res = std::make_unique<server_task_result_cmpl_final>();
+        res->id = i;
+        response.send(std::move(res));
+    }
+
+    for (auto & th : consumers) {
+        th.join();
+    }
+
+    const double t_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+    return { t_s, n_tokens_total.load(), n_events_total.load(), n_bytes_total.load() };
+}
+
+int main(int argc, char ** argv) {
+    const int n_tokens = argc > 1 ? atoi(argv[1]) : 2000;
+
+    std::vector<int> streams = { 1, 8, 32, 128 };
+    if (argc > 2) {
+        streams.clear();
+        for (const auto & s : string_split<int>(argv[2], ',')) {
+            streams.push_back(s);
+        }
+    }
+
+    printf("%8s | %-18s | %12s | %10s | %10s\n", "streams", "queue", "tokens/s", "events", "tokens/ev");
+    printf("---------+--------------------+--------------+------------+-----------\n");
+
+    for (const int n_streams : streams) {
+        const auto report = [&](const char * name, const bench_result & r) {
+            printf("%8d | %-18s | %12.0f | %10llu | %10.2f\n", n_streams, name, r.n_tokens / r.t_s,
+                    (unsigned long long) r.n_events, r.n_events ? double(r.n_tokens) / r.n_events : 0.0);
+            if (r.n_tokens != (uint64_t) n_streams * n_tokens) {
+                printf("error: delivered %llu tokens, expected %llu\n",
+                        (unsigned long long) r.n_tokens, (unsigned long long) n_streams * n_tokens);
+                exit(1);
+            }
+        };
+
+        {
+            shared_response response;
+            report("shared", run(response, n_streams, n_tokens));
+        }
+        {
+            channel_response response(1);
+            response.channels.resize(n_streams);
+            report("channel", run(response, n_streams, n_tokens));
+        }
+        {
+            channel_response response(8);
+            response.channels.resize(n_streams);
+            report("channel+coalesce", run(response, n_streams, n_tokens));
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,410 @@
+// replay of a request trace against the slot scheduler, with a simple cost model of the slot loop
+//
+// every step of the simulated slot loop decodes one token for each generating slot and processes up to n_batch prompt
+// tokens of the slots that are still in prompt processing, like update_slots. the step takes
+//   t_step_ms + n_prompt_tokens*t_prompt_ms + n_gen_slots*t_gen_ms
+// a new request goes to a slot through server_scheduler::select_slot, or is deferred. when a slot is released, one
+// deferred task is picked by server_scheduler::pick and then assigned a slot, like server_queue::pop_deferred_task.
+// the cached prompt of the chosen slot is reused up to the longest common prefix. the prompt cache is not simulated.
+//
+// trace: one JSON object per line
+//   {"t": 0.25, "prefix": 3, "n_prefix": 1500, "n_prompt": 200, "n_predict": 128, "user": "a", "priority": 0}
+//   t: arrival in seconds; the prompt is n_prefix tokens shared by all requests with the same prefix id,
+//   followed by n_prompt tokens unique to the request ("tokens": [...] can be given instead)
+// without a trace, a synthetic multi-user chat trace is generated (--dump writes it out)
+//
+// usage: llama-server-schedule-sim [-t trace.jsonl] [-n n_requests=400] [-r requests_per_s=1] [-np n_slots=4]
+//                                  [-b n_batch=2048] [-s sim=0.1] [-w max_wait_ms=30000] [--dump out.jsonl]
+//                                  [policies=fifo cache shortest fair priority,cache ...]
+
+#include "server-common.h"
+#include "server-schedule.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+struct sim_request {
+    double      t_arrival = 0.0; // s
+    llama_tokens tokens;
+    int32_t     n_predict = 0;
+    std::string user;
+    int32_t     priority  = 0;
+
+    int n_prefix  = 0; // for --dump
+    int id_prefix = -1;
+};
+
+struct sim_costs {
+    double t_step_ms   = 12.0; // fixed cost of a step
+    double t_prompt_ms = 0.15; // per prompt token
+    double t_gen_ms    = 0.8;  // per generating slot
+};
+
+static llama_tokens make_prompt(int id_prefix, int n_prefix, int id_request, int n_prompt) {
+    llama_tokens res;
+    res.reserve(n_prefix + n_prompt);
+    for (int i = 0; i < n_prefix; ++i) {
+        res.push_back(1000 + (id_prefix*7919 + i) % 30000);
+    }
+    for (int i = 0; i < n_prompt; ++i) {
+        res.push_back(40000 + (id_request*104729 + i*31) % 20000);
+    }
+    return res;
+}
+
+static std::vector<sim_request> load_trace(const std::string & path) {
+    std::vector<sim_request> res;
+
+    std::ifstream f(path);
+    if (!f) {
+        fprintf(stderr, "error: failed to open '%s'\n", path.c_str());
+        exit(1);
+    }
+
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        const json j = json::parse(line);
+
+        sim_request req;
+        req.t_arrival = json_value(j, "t",         0.0);
+        req.n_predict = json_value(j, "n_predict", 128);
+        req.user      = json_value(j, "user",      std::string());
+        req.priority  = json_value(j, "priority",  0);
+        if (j.contains("tokens")) {
+            req.tokens = j.at("tokens").get<llama_tokens>();
+        } else {
+            req.id_prefix = json_value(j, "prefix",   -1);
+            req.n_prefix  = req.id_prefix < 0 ? 0 : json_value(j, "n_prefix", 0);
+            req.tokens    = make_prompt(req.id_prefix, req.n_prefix, (int) res.size(), json_value(j, "n_prompt", 64));
+        }
+        res.push_back(std::move(req));
+    }
+
+    std::stable_sort(res.begin(), res.end(), [](const sim_request & a, const sim_request & b) {
+        return a.t_arrival < b.t_arrival;
+    });
+
+    return res;
+}
+
+// chat traffic of several users over a few long system prompts; one user sends half of the requests
+static std::vector<sim_request> make_trace(int n_requests, double rate, FILE * dump) {
+    std::mt19937 rng(42);
+    std::exponential_distribution<double> gap(rate);
+    std::uniform_int_distribution<int> pick_prefix(0, 7);
+    std::uniform_int_distribution<int> pick_user(0, 7);
+    std::uniform_int_distribution<int> n_prompt(16, 768);
+    std::uniform_int_distribution<int> n_predict(16, 384);
+    std::uniform_real_distribution<double> u01(0.0, 1.0);
+
+    std::vector<sim_request> res;
+
+    double t = 0.0;
+    for (int i = 0; i < n_requests; ++i) {
+        t += gap(rng);
+
+        sim_request req;
+        req.t_arrival = t;
+        req.id_prefix = pick_prefix(rng);
+        req.n_prefix  = 512 + 256*req.id_prefix;
+        req.n_predict = n_predict(rng);
+        req.user      = u01(rng) < 0.5 ? "heavy" : "user" + std::to_string(pick_user(rng));
+        req.priority  = u01(rng) < 0.1 ? 1 : 0;
+
+        const int n = n_prompt(rng);
+        req.tokens = make_prompt(req.id_prefix, req.n_prefix, i, n);
+
+        if (dump) {
+            fprintf(dump, "{\"t\": %.4f, \"prefix\": %d, \"n_prefix\": %d, \"n_prompt\": %d, \"n_predict\": %d, \"user\": \"%s\", \"priority\": %d}\n",
+                    req.t_arrival, req.id_prefix, req.n_prefix, n, req.n_predict, req.user.c_str(), req.priority);
+        }
+
+        res.push_back(std::move(req));
+    }
+
+    return res;
+}
+
+struct sim_result {
+    std::vector<double> ttft;      // ms
+    std::vector<double> ttft_prio; // ms, requests with priority > 0
+    double t_total_s  = 0.0;
+    uint64_t n_gen    = 0;
+    uint64_t n_prompt = 0;
+    uint64_t n_reused = 0;
+};
+
+struct sim_slot {
+    int id = -1;
+    int id_req = -1; // -1 = idle
+
+    server_tokens tokens;
+
+    int64_t t_last_used = -1;
+
+    size_t  n_past      = 0; // prompt tokens processed
+    int32_t n_generated = 0;
+};
+
+static sim_result simulate(const std::string & policies, const std::vector<sim_request> & reqs,
+        int n_slots, int n_batch, float sim, int64_t max_wait_ms, const sim_costs & costs) {
+    server_scheduler scheduler;
+    scheduler.slot_prompt_similarity = sim;
+    scheduler.max_wait_ms            = max_wait_ms;
+    if (!scheduler.init(policies)) {
+        fprintf(stderr, "error: invalid policies '%s', available: %s\n", policies.c_str(), server_sched_policy_names().c_str());
+        exit(1);
+    }
+
+    std::vector<server_tokens> prompts;
+    prompts.reserve(reqs.size());
+    for (const auto & req : reqs) {
+        prompts.emplace_back(req.tokens, false);
+    }
+
+    std::vector<sim_slot> slots(n_slots);
+    for (int i = 0; i < n_slots; ++i) {
+        slots[i].id = i;
+    }
+
+    std::deque<int> deferred;
+    std::vector<int64_t> t_queued(reqs.size(), -1);
+
+    sim_result res;
+
+    int64_t t_us = 0; // simulated time
+
+    const auto views = [&]() {
+        std::vector<server_sched_slot> v(slots.size());
+        for (size_t i = 0; i < slots.size(); ++i) {
+            v[i].id          = slots[i].id;
+            v[i].available   = slots[i].id_req < 0;
+            v[i].tokens      = &slots[i].tokens;
+            v[i].t_last_used = slots[i].t_last_used;
+        }
+        return v;
+    };
+
+    const auto launch = [&](int id_req) -> bool {
+        const auto choice = scheduler.select_slot(prompts[id_req], views());
+        if (choice.idx < 0) {
+            return false;
+        }
+
+        auto & slot = slots[choice.idx];
+        const auto & req = reqs[id_req];
+
+        scheduler.on_launch(req.user, "", req.tokens.size(), t_us);
+
+        const size_t n_reuse = std::min(slot.tokens.get_common_prefix(prompts[id_req]), req.tokens.size() - 1);
+
+        slot.id_req      = id_req;
+        slot.tokens      = server_tokens(req.tokens, false);
+        slot.n_past      = n_reuse;
+        slot.n_generated = 0;
+
+        res.n_prompt += req.tokens.size();
+        res.n_reused += n_reuse;
+
+        return true;
+    };
+
+    const auto pick = [&]() {
+        if (deferred.empty()) {
+            return;
+        }
+
+        std::vector<server_sched_task> tasks(deferred.size());
+        for (size_t i = 0; i < deferred.size(); ++i) {
+            const int id_req = deferred[i];
+
+            tasks[i].id          = id_req;
+            tasks[i].tokens      = &prompts[id_req];
+            tasks[i].key         = reqs[id_req].user;
+            tasks[i].priority    = reqs[id_req].priority;
+            tasks[i].t_queued_us = t_queued[id_req];
+        }
+
+        const int idx = std::max(0, scheduler.pick(tasks, views(), t_us));
+
+        const int id_req = deferred[idx];
+        deferred.erase(deferred.begin() + idx);
+
+        if (!launch(id_req)) {
+            deferred.push_back(id_req);
+        }
+    };
+
+    size_t i_next = 0;
+    size_t n_done = 0;
+
+    while (n_done < reqs.size()) {
+        bool busy = false;
+        for (const auto & slot : slots) {
+            busy = busy || slot.id_req >= 0;
+        }
+
+        // idle: jump to the next arrival
+        if (!busy && deferred.empty() && i_next < reqs.size()) {
+            t_us = std::max<int64_t>(t_us, reqs[i_next].t_arrival*1e6);
+        }
+
+        // new requests
+        while (i_next < reqs.size() && reqs[i_next].t_arrival*1e6 <= t_us) {
+            const int id_req = i_next++;
+            if (!launch(id_req)) {
+                t_queued[id_req] = t_us;
+                deferred.push_back(id_req);
+            }
+        }
+
+        // one step of the slot loop
+        int n_gen_slots = 0;
+        int n_prompt    = 0;
+
+        std::vector<int> first_token;
+
+        for (auto & slot : slots) {
+            if (slot.id_req < 0) {
+                continue;
+            }
+
+            const auto & req = reqs[slot.id_req];
+
+            if (slot.n_past < req.tokens.size()) {
+                const int n = std::min<int>(req.tokens.size() - slot.n_past, n_batch - n_prompt);
+                slot.n_past += n;
+                n_prompt    += n;
+                if (slot.n_past == req.tokens.size()) {
+                    first_token.push_back(slot.id);
+                }
+            } else {
+                n_gen_slots++;
+            }
+        }
+
+        t_us += (costs.t_step_ms + n_prompt*costs.t_prompt_ms + n_gen_slots*costs.t_gen_ms)*1000.0;
+
+        for (int id : first_token) {
+            const auto & req = reqs[slots[id].id_req];
+            const double ttft = t_us/1000.0 - req.t_arrival*1000.0;
+            res.ttft.push_back(ttft);
+            if (req.priority > 0) {
+                res.ttft_prio.push_back(ttft);
+            }
+            slots[id].n_generated = 1;
+        }
+
+        int n_released = 0;
+
+        for (auto & slot : slots) {
+            if (slot.id_req < 0 || slot.n_past < reqs[slot.id_req].tokens.size()) {
+                continue;
+            }
+
+            if (std::find(first_token.begin(), first_token.end(), slot.id) == first_token.end()) {
+                slot.n_generated++;
+            }
+            slot.tokens.push_back(100000 + slot.id_req);
+
+            if (slot.n_generated >= reqs[slot.id_req].n_predict) {
+                res.n_gen += slot.n_generated;
+                slot.id_req      = -1;
+                slot.t_last_used = t_us;
+                n_done++;
+                n_released++;
+            }
+        }
+
+        // every released slot takes one deferred task
+        for (int i = 0; i < n_released; ++i) {
+            pick();
+        }
+    }
+
+    res.t_total_s = t_us/1e6;
+
+    return res;
+}
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) {
+        return 0.0;
+    }
+    std::sort(v.begin(), v.end());
+    const size_t i = std::min(v.size() - 1, (size_t) (p*(v.size() - 1) + 0.5));
+    return v[i];
+}
+
+int main(int argc, char ** argv) {
+    std::string trace_path;
+    std::string dump_path;
+
+    int     n_requests  = 400;
+    double  rate        = 1.0;
+    int     n_slots     = 4;
+    int     n_batch     = 2048;
+    float   sim         = 0.1f;
+    int64_t max_wait_ms = 30000;
+
+    std::vector<std::string> policies;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if      (arg == "-t"     && has_value) { trace_path  = argv[++i]; }
+        else if (arg == "-n"     && has_value) { n_requests  = atoi(argv[++i]); }
+        else if (arg == "-r"     && has_value) { rate        = atof(argv[++i]); }
+        else if (arg == "-np"    && has_value) { n_slots     = atoi(argv[++i]); }
+        else if (arg == "-b"     && has_value) { n_batch     = atoi(argv[++i]); }
+        else if (arg == "-s"     && has_value) { sim         = atof(argv[++i]); }
+        else if (arg == "-w"     && has_value) { max_wait_ms = atoll(argv[++i]); }
+        else if (arg == "--dump" && has_value) { dump_path   = argv[++i]; }
+        else if (arg[0] == '-') {
+            fprintf(stderr, "usage: %s [-t trace.jsonl] [-n n_requests] [-r requests_per_s] [-np n_slots] [-b n_batch] [-s sim] [-w max_wait_ms] [--dump out.jsonl] [policies ...]\n", argv[0]);
+            return 1;
+        } else {
+            policies.push_back(arg);
+        }
+    }
+
+    if (policies.empty()) {
+        policies = { "fifo", "cache", "shortest", "fair", "priority,cache" };
+    }
+
+    std::vector<sim_request> reqs;
+    if (!trace_path.empty()) {
+        reqs = load_trace(trace_path);
+    } else {
+        FILE * dump = dump_path.empty() ? nullptr : fopen(dump_path.c_str(), "w");
+        reqs = make_trace(n_requests, rate, dump);
+        if (dump) {
+            fclose(dump);
+        }
+    }
+
+    printf("%zu requests, %d slots, n_batch = %d, sim = %.2f, max wait = %lld ms\n\n",
+            reqs.size(), n_slots, n_batch, sim, (long long) max_wait_ms);
+
+    printf("%-18s | %10s | %10s | %14s | %10s | %8s\n", "policy", "p50 TTFT", "p99 TTFT", "p99 TTFT prio", "tokens/s", "reused");
+    printf("-------------------+------------+------------+----------------+------------+---------\n");
+
+    for (const auto & policy : policies) {
+        const sim_result r = simulate(policy, reqs, n_slots, n_batch, sim, max_wait_ms, sim_costs());
+
+        printf("%-18s | %7.0f ms | %7.0f ms | %11.0f ms | %10.1f | %7.1f%%\n", policy.c_str(),
+                percentile(r.ttft, 0.50), percentile(r.ttft, 0.99), percentile(r.ttft_prio, 0.99),
+                r.n_gen / r.t_total_s, r.n_prompt ? 100.0*r.n_reused/r.n_prompt : 0.0);
+    }
+
+    return 0;
+}
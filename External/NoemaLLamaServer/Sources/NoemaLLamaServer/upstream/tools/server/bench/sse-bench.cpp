@@ -0,0 +1,263 @@
+// golden test and microbenchmark of the SSE serialization of streamed results
+//
+// golden: random partial and final results of every response type are written by server_sse_writer and by the
+// generic path (to_json() + format_*_sse()), and the bytes must be identical. the corpus covers the text-only chunks of
+// the fast path as well as everything it leaves to the generic path (first chunk, progress, probabilities, timings,
+// tool calls, invalid UTF-8, strings that need escaping)
+//
+// bench: rate of text-only chunks serialized per response type, by the generic path and by the writer
+//
+// usage: llama-server-sse-bench [n_golden=20000] [n_bench=200000]
+
+#include "server-common.h"
+#include "server-task.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static const std::vector<std::string> texts = {
+    "",
+    "hello",
+    " world",
+    "\"quoted\"",
+    "back\\slash",
+    "\n\t\r\b\f",
+    std::string("nul\0byte", 8),
+    "\x01\x1f\x7f",
+    "h\xc3\xa9llo \xe4\xb8\x96\xe7\x95\x8c \xf0\x9f\x99\x82",
+    "\xff\xfe",       // invalid UTF-8
+    "\xe4\xb8",       // cut in the middle of a character
+    "</s><|im_end|>",
+    "{\"json\": [1, 2, 3]}",
+    "a much longer piece of text that spans many tokens, as a merged chunk of a slow reader would",
+};
+
+static const std::vector<task_response_type> res_types = {
+    TASK_RESPONSE_TYPE_NONE,
+    TASK_RESPONSE_TYPE_OAI_CMPL,
+    TASK_RESPONSE_TYPE_OAI_CHAT,
+    TASK_RESPONSE_TYPE_OAI_RESP,
+    TASK_RESPONSE_TYPE_ANTHROPIC,
+};
+
+static const char * res_type_name(task_response_type res_type) {
+    switch (res_type) {
+        case TASK_RESPONSE_TYPE_NONE:      return "native";
+        case TASK_RESPONSE_TYPE_OAI_CMPL:  return "oai-cmpl";
+        case TASK_RESPONSE_TYPE_OAI_CHAT:  return "oai-chat";
+        case TASK_RESPONSE_TYPE_OAI_RESP:  return "oai-resp";
+        case TASK_RESPONSE_TYPE_ANTHROPIC: return "anthropic";
+        default:                           return "?";
+    }
+}
+
+static std::string format_generic(task_response_type res_type, server_task_result & result) {
+    const json res_json = result.to_json();
+    if (res_type == TASK_RESPONSE_TYPE_ANTHROPIC) {
+        return format_anthropic_sse(res_json);
+    }
+    if (res_type == TASK_RESPONSE_TYPE_OAI_RESP) {
+        return format_oai_resp_sse(res_json);
+    }
+    return format_oai_sse(res_json);
+}
+
+// a random result, the same one for the same seed
+static server_task_result_ptr make_result(task_response_type res_type, uint32_t seed) {
+    std::mt19937 rng(seed);
+
+    const auto pick = [&]() -> const std::string & { return texts[rng() % texts.size()]; };
+    const auto coin = [&](int n) { return rng() % n == 0; };
+
+    if (coin(20)) {
+        auto res = std::make_unique<server_task_result_cmpl_final>();
+        res->index                 = rng() % 3;
+        res->content               = pick();
+        res->stream                = true;
+        res->include_usage         = coin(2);
+        res->truncated             = false;
+        res->n_decoded             = rng() % 100;
+        res->n_prompt_tokens       = rng() % 1000;
+        res->n_prompt_tokens_cache = 0;
+        res->n_tokens_cached       = res->n_decoded + res->n_prompt_tokens;
+        res->has_new_line          = false;
+        res->stop                  = STOP_TYPE_EOS;
+        res->post_sampling_probs   = false;
+        res->res_type              = res_type;
+        res->oaicompat_model       = pick();
+        res->oaicompat_cmpl_id     = "chatcmpl-" + std::to_string(rng());
+        res->is_updated            = true;
+        return res;
+    }
+
+    auto res = std::make_unique<server_task_result_cmpl_partial>();
+    res->index                 = rng() % 3;
+    res->id_slot               = rng() % 4;
+    res->content               = pick();
+    res->tokens                = { llama_token(rng() % 1000), llama_token(rng() % 1000) };
+    res->n_decoded             = coin(4) ? 1 : 1 + rng() % 100;
+    res->n_prompt_tokens       = rng() % 1000;
+    res->n_prompt_tokens_cache = 0;
+    res->res_type              = res_type;
+    res->verbose               = coin(8);
+    res->is_progress           = coin(8);
+    res->is_updated            = true;
+
+    res->oaicompat_model       = coin(2) ? "model" : pick();
+    res->oaicompat_cmpl_id     = "chatcmpl-" + std::to_string(rng() % 4);
+    res->oai_resp_reasoning_id = "rs_" + pick();
+    res->oai_resp_message_id   = "msg_" + pick();
+    res->oai_resp_fc_id        = "fc_1";
+
+    res->thinking_block_started  = coin(2);
+    res->text_block_started      = coin(2);
+    res->anthropic_has_reasoning = coin(2);
+
+    if (coin(8)) {
+        res->timings.prompt_n = rng() % 3;
+    }
+    if (coin(8)) {
+        res->prob_output.tok          = 1;
+        res->prob_output.prob         = 0.5f;
+        res->prob_output.text_to_send = pick();
+        res->prob_output.probs        = { { 1, pick(), 0.5f }, { 2, pick(), 0.25f } };
+    }
+
+    const int n_diffs = rng() % 3;
+    for (int i = 0; i < n_diffs; ++i) {
+        common_chat_msg_diff diff;
+        switch (rng() % 5) {
+            case 0: diff.content_delta = pick(); break;
+            case 1: diff.reasoning_content_delta = pick(); break;
+            case 2: diff.content_delta = pick(); diff.reasoning_content_delta = pick(); break;
+            case 3:
+                diff.tool_call_index           = 0;
+                diff.tool_call_delta.id        = "call_1";
+                diff.tool_call_delta.name      = coin(2) ? "get_weather" : "";
+                diff.tool_call_delta.arguments = pick();
+                break;
+            default: break;
+        }
+        res->oaicompat_msg_diffs.push_back(diff);
+    }
+
+    return res;
+}
+
+static int run_golden(int n) {
+    int n_fast = 0;
+
+    for (const auto res_type : res_types) {
+        server_sse_writer writer(res_type);
+        std::string out;
+
+        for (int i = 0; i < n; ++i) {
+            // "created" holds the current time - retry if the second changed in between
+            for (int attempt = 0; ; ++attempt) {
+                auto res_ref = make_result(res_type, i);
+                auto res_cur = make_result(res_type, i);
+
+                const std::string ref = format_generic(res_type, *res_ref);
+
+                auto * partial = dynamic_cast<server_task_result_cmpl_partial *>(res_cur.get());
+                {
+                    std::string tmp;
+                    n_fast += partial != nullptr && server_sse_writer(res_type).write_text(*partial, tmp);
+                }
+
+                writer.write(*res_cur, out);
+
+                if (out == ref) {
+                    break;
+                }
+                if (attempt > 0) {
+                    fprintf(stderr, "error: %s, case %d: output differs\n--- expected:\n%s\n--- got:\n%s\n",
+                            res_type_name(res_type), i, ref.c_str(), out.c_str());
+                    return 1;
+                }
+            }
+        }
+    }
+
+    printf("golden: %d cases per response type, all identical (%.1f%% on the fast path)\n\n",
+            n, 100.0 * n_fast / (n * res_types.size()));
+
+    return 0;
+}
+
+static void run_bench(int n) {
+    printf("%-10s | %14s | %14s | %8s\n", "type", "generic ns/ev", "writer ns/ev", "speedup");
+    printf("-----------+----------------+----------------+---------\n");
+
+    static const std::vector<std::string> pieces = { " the", " quick", " brown", " fox", "\n", " \"jumps\"", " over", " 42" };
+
+    for (const auto res_type : res_types) {
+        server_task_result_cmpl_partial res;
+        res.index           = 0;
+        res.id_slot         = 0;
+        res.n_decoded       = 2;
+        res.n_prompt_tokens = 100;
+        res.res_type        = res_type;
+        res.is_updated      = true;
+
+        res.n_prompt_tokens_cache = 0;
+
+        res.oaicompat_model        = "model";
+        res.oaicompat_cmpl_id      = "chatcmpl-0123456789";
+        res.oai_resp_message_id    = "msg_0123456789";
+        res.thinking_block_started = true;
+        res.text_block_started     = true;
+        res.oaicompat_msg_diffs.resize(1);
+
+        const auto set_text = [&](int i) {
+            res.content = pieces[i % pieces.size()];
+            res.tokens  = { llama_token(i % 1000) };
+            res.oaicompat_msg_diffs[0].content_delta = res.content;
+        };
+
+        size_t n_bytes = 0;
+
+        const auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; ++i) {
+            set_text(i);
+            n_bytes += format_generic(res_type, res).size();
+        }
+        const auto t1 = std::chrono::steady_clock::now();
+
+        server_sse_writer writer(res_type);
+        std::string out;
+        for (int i = 0; i < n; ++i) {
+            set_text(i);
+            writer.write(res, out);
+            n_bytes -= out.size();
+        }
+        const auto t2 = std::chrono::steady_clock::now();
+
+        if (n_bytes != 0) {
+            fprintf(stderr, "error: %s: the writer produced a different amount of bytes\n", res_type_name(res_type));
+            exit(1);
+        }
+
+        const double ns_generic = std::chrono::duration<double, std::nano>(t1 - t0).count() / n;
+        const double ns_writer  = std::chrono::duration<double, std::nano>(t2 - t1).count() / n;
+
+        printf("%-10s | %14.0f | %14.0f | %7.1fx\n", res_type_name(res_type), ns_generic, ns_writer, ns_generic / ns_writer);
+    }
+}
+
+int main(int argc, char ** argv) {
+    const int n_golden = argc > 1 ? atoi(argv[1]) : 20000;
+    const int n_bench  = argc > 2 ? atoi(argv[2]) : 200000;
+
+    if (run_golden(n_golden) != 0) {
+        return 1;
+    }
+
+    run_bench(n_bench);
+
+    return 0;
+}
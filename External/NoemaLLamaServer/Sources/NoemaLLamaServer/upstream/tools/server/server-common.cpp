@@ -9,6 +9,8 @@
 
 #include "server-common.h"
 
+#include <algorithm>
+#include <cctype>
 #include <random>
 #include <sstream>
 #include <fstream>
@@ -388,6 +390,10 @@ const llama_tokens & server_tokens::get_text_tokens() const {
     return tokens;
 }
 
+const llama_tokens & server_tokens::get_tokens_raw() const {
+    return tokens;
+}
+
 void server_tokens::set_token(llama_pos pos, llama_token id) {
     GGML_ASSERT(!has_mtmd); // only allow this if mtmd is disabled
     tokens[pos] = id;
@@ -652,6 +658,250 @@ llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_prompt,
     return prompt_tokens;
 }
 
+//
+// server_tokenize_cache
+//
+
+static bool is_special_token(const llama_vocab * vocab, llama_token id) {
+    return llama_vocab_get_attr(vocab, id) & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_USER_DEFINED | LLAMA_TOKEN_ATTR_UNKNOWN);
+}
+
+void server_tokenize_cache::init(const llama_vocab * vocab) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    this->vocab = vocab;
+
+    entries.clear();
+    boundaries.clear();
+    specials.clear();
+
+    n_verify = 0;
+
+    // the tokens added after the text would end up in the middle of the next prompt
+    enabled = !llama_vocab_get_add_eos(vocab) && !llama_vocab_get_add_sep(vocab);
+    if (!enabled) {
+        SRV_INF("%s", "tokenize cache disabled, the tokenizer adds tokens after the text\n");
+        return;
+    }
+
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        if (is_special_token(vocab, id)) {
+            specials.push_back(llama_vocab_get_text(vocab, id));
+        }
+    }
+}
+
+bool server_tokenize_cache::is_boundary(llama_token id) {
+    const auto it = boundaries.find(id);
+    if (it != boundaries.end()) {
+        return it->second;
+    }
+
+    const std::string s = llama_vocab_get_text(vocab, id);
+
+    bool res = !s.empty();
+    for (size_t i = 0; i < specials.size() && res; ++i) {
+        const auto & t = specials[i];
+
+        // t starts within s and continues after it
+        for (size_t q = 0; q < s.size() && res; ++q) {
+            const size_t n = s.size() - q;
+            res = !(t.size() > n && t.compare(0, n, s, q, n) == 0);
+        }
+
+        // t contains s and continues after it
+        for (size_t k = t.find(s); k != std::string::npos && res; k = t.find(s, k + 1)) {
+            res = k + s.size() >= t.size();
+        }
+    }
+
+    boundaries[id] = res;
+
+    return res;
+}
+
+std::vector<server_tokenize_cache::cut> server_tokenize_cache::find_cuts(const std::string & text, const llama_tokens & tokens, cut from) {
+    // the BOS added by the tokenizer is not part of the text
+    if (from.n_tokens == 0 && !tokens.empty() && llama_vocab_get_add_bos(vocab) && tokens[0] == llama_vocab_bos(vocab)) {
+        from.n_tokens = 1;
+    }
+
+    std::unordered_map<llama_token, std::vector<size_t>> pos;
+    for (size_t i = from.n_tokens; i < tokens.size(); ++i) {
+        if (is_special_token(vocab, tokens[i])) {
+            pos[tokens[i]].push_back(i);
+        }
+    }
+
+    std::vector<cut> res;
+
+    for (const auto & [id, idxs] : pos) {
+        if (!is_boundary(id)) {
+            continue;
+        }
+
+        const std::string s = llama_vocab_get_text(vocab, id);
+
+        // the occurrences of the text map to the tokens only if each of them became this token
+        std::vector<cut> cur;
+
+        size_t n = 0;
+        for (size_t p = text.find(s, from.n_chars); p != std::string::npos && n <= idxs.size(); p = text.find(s, p + s.size())) {
+            const size_t e = p + s.size();
+            if (n < idxs.size() && e < text.size() && !isspace((unsigned char) text[e])) {
+                cur.push_back({ e, idxs[n] + 1 });
+            }
+            n++;
+        }
+
+        if (n == idxs.size()) {
+            res.insert(res.end(), cur.begin(), cur.end());
+        }
+    }
+
+    std::sort(res.begin(), res.end(), [](const cut & a, const cut & b) {
+        return a.n_chars < b.n_chars;
+    });
+
+    return res;
+}
+
+llama_tokens server_tokenize_cache::tokenize(const std::string & text) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    const llama_vocab * vocab_cur = vocab;
+
+    if (!enabled) {
+        lock.unlock();
+        return common_tokenize(vocab_cur, text, true, true);
+    }
+
+    // the longest cut of a cached prompt that the text starts with
+    cut              best = { 0, 0 };
+    std::vector<cut> cuts;
+    llama_tokens     res;
+
+    for (const auto & e : entries) {
+        if (e.cuts.empty() || e.cuts.back().n_chars <= best.n_chars) {
+            continue;
+        }
+
+        const size_t n_max = std::min(e.cuts.back().n_chars, text.size());
+        const size_t n     = std::mismatch(text.begin(), text.begin() + n_max, e.text.begin()).first - text.begin();
+
+        auto it = std::upper_bound(e.cuts.begin(), e.cuts.end(), n, [](size_t n, const cut & c) {
+            return n < c.n_chars;
+        });
+
+        // the spaces after the cut can be stripped by the special token before it
+        while (it != e.cuts.begin() && (it - 1)->n_chars < text.size() && isspace((unsigned char) text[(it - 1)->n_chars])) {
+            --it;
+        }
+
+        if (it == e.cuts.begin() || (it - 1)->n_chars <= best.n_chars) {
+            continue;
+        }
+
+        best = *(it - 1);
+
+        cuts.assign(e.cuts.begin(), it);
+        res.assign(e.tokens.begin(), e.tokens.begin() + best.n_tokens);
+    }
+
+    const bool verify = n_verify < N_VERIFY;
+
+    lock.unlock();
+
+    if (best.n_chars > 0) {
+        const llama_tokens rest = common_tokenize(vocab_cur, text.substr(best.n_chars), false, true);
+        res.insert(res.end(), rest.begin(), rest.end());
+    } else {
+        res = common_tokenize(vocab_cur, text, true, true);
+    }
+
+    bool valid = true;
+
+    if (verify) {
+        if (best.n_chars > 0) {
+            valid = res == common_tokenize(vocab_cur, text, true, true);
+        } else {
+            lock.lock();
+            const auto cuts_new = find_cuts(text, res, { 0, 0 });
+            lock.unlock();
+
+            if (!cuts_new.empty()) {
+                const cut & c = cuts_new.back();
+
+                const llama_tokens head = common_tokenize(vocab_cur, text.substr(0, c.n_chars), true, true);
+                const llama_tokens tail = common_tokenize(vocab_cur, text.substr(c.n_chars), false, true);
+
+                valid = head.size() == c.n_tokens && tail.size() == res.size() - c.n_tokens &&
+                        std::equal(head.begin(), head.end(), res.begin()) &&
+                        std::equal(tail.begin(), tail.end(), res.begin() + c.n_tokens);
+            }
+        }
+    }
+
+    lock.lock();
+
+    if (vocab_cur != vocab || !enabled) {
+        // the model was reloaded meanwhile
+        return res;
+    }
+
+    if (!valid) {
+        SRV_WRN("%s", "tokenize cache disabled, the tokens of a cut prompt do not match the tokens of the full prompt\n");
+
+        enabled = false;
+        entries.clear();
+
+        return common_tokenize(vocab_cur, text, true, true);
+    }
+
+    if (verify) {
+        n_verify++;
+    }
+
+    if (best.n_chars > 0) {
+        stats.n_hit++;
+        stats.n_tokens_reused += best.n_tokens;
+        stats.n_tokens        += res.size() - best.n_tokens;
+    } else {
+        stats.n_miss++;
+        stats.n_tokens        += res.size();
+    }
+
+    const auto cuts_new = find_cuts(text, res, best);
+    cuts.insert(cuts.end(), cuts_new.begin(), cuts_new.end());
+
+    if (cuts.empty()) {
+        return res;
+    }
+
+    // a cached prompt that this one continues past its last cut is not needed anymore
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        const size_t n = it->cuts.back().n_chars;
+        if (n <= text.size() && text.compare(0, n, it->text, 0, n) == 0) {
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    entries.push_front({ text, res, std::move(cuts) });
+    if (entries.size() > N_ENTRIES_MAX) {
+        entries.pop_back();
+    }
+
+    return res;
+}
+
+server_tokenize_cache_stats server_tokenize_cache::get_stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
 size_t validate_utf8(const std::string& text) {
     size_t len = text.size();
     if (len == 0) return 0;
@@ -734,11 +984,14 @@ server_tokens process_mtmd_prompt(mtmd_context * mctx, std::string prompt, std::
  * - "prompt": [12, 34, "string", 56, 78]
  * - "prompt": { "prompt_string": "string", "multimodal_data": [ "base64" ] }
  */
-static server_tokens tokenize_input_subprompt(const llama_vocab * vocab, mtmd_context * mctx, const json & json_prompt, bool add_special, bool parse_special) {
+static server_tokens tokenize_input_subprompt(const llama_vocab * vocab, mtmd_context * mctx, const json & json_prompt, bool add_special, bool parse_special, server_tokenize_cache * cache = nullptr) {
     constexpr char JSON_STRING_PROMPT_KEY[] = "prompt_string";
     constexpr char JSON_MTMD_DATA_KEY[] = "multimodal_data";
     const bool has_mtmd = mctx != nullptr;
-    if (json_prompt.is_string() || json_is_array_of_mixed_numbers_strings(json_prompt)) {
+    if (cache && json_prompt.is_string() && add_special && parse_special) {
+        // string, possibly sharing a prefix with an earlier prompt
+        return server_tokens(cache->tokenize(json_prompt.get<std::string>()), false);
+    } else if (json_prompt.is_string() || json_is_array_of_mixed_numbers_strings(json_prompt)) {
         // string or mixed
         llama_tokens tmp = tokenize_mixed(vocab, json_prompt, add_special, parse_special);
         return server_tokens(tmp, false);
@@ -768,15 +1021,15 @@ static server_tokens tokenize_input_subprompt(const llama_vocab * vocab, mtmd_co
    }
 }
 
-std::vector<server_tokens> tokenize_input_prompts(const llama_vocab * vocab, mtmd_context * mctx, const json & json_prompt, bool add_special, bool parse_special) {
+std::vector<server_tokens> tokenize_input_prompts(const llama_vocab * vocab, mtmd_context * mctx, const json & json_prompt, bool add_special, bool parse_special, server_tokenize_cache * cache) {
     std::vector<server_tokens> result;
     if (json_prompt.is_array() && !json_is_array_and_contains_numbers(json_prompt)) {
         result.reserve(json_prompt.size());
         for (const auto & p : json_prompt) {
-            result.push_back(tokenize_input_subprompt(vocab, mctx, p,add_special, parse_special));
+            result.push_back(tokenize_input_subprompt(vocab, mctx, p,add_special, parse_special, cache));
         }
     } else {
-        result.push_back(tokenize_input_subprompt(vocab, mctx, json_prompt, add_special, parse_special));
+        result.push_back(tokenize_input_subprompt(vocab, mctx, json_prompt, add_special, parse_special, cache));
     }
     if (result.empty()) {
         throw std::runtime_error("\"prompt\" must not be empty");
@@ -9,7 +9,10 @@
 #define JSON_ASSERT GGML_ASSERT
 #include <nlohmann/json.hpp>
 
+#include <list>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <cinttypes>
 
@@ -189,6 +192,10 @@ public:
     // for compatibility with speculative decoding, ctx shift, slot save/load
     const llama_tokens & get_text_tokens() const;
 
+    // every position, with LLAMA_TOKEN_NULL where media is - only for indexing, as it does not see which media it is
+    // (get_common_prefix does)
+    const llama_tokens & get_tokens_raw() const;
+
     // for compatibility with speculative decoding
     void set_token(llama_pos pos, llama_token id);
 
@@ -196,6 +203,10 @@ public:
 
     bool empty() const { return tokens.empty(); }
 
+    // true if any position holds a media chunk - has_mtmd only says that the server has a projector loaded, and is
+    // set for text-only prompts as well
+    bool has_media() const { return !map_idx_to_media.empty(); }
+
     void clear() {
         map_idx_to_media.clear();
         tokens.clear();
@@ -245,6 +256,67 @@ json json_get_nested_values(const std::vector<std::string> & paths, const json &
  */
 llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_prompt, bool add_special, bool parse_special);
 
+struct server_tokenize_cache_stats {
+    uint64_t n_hit           = 0; // prompts that reused the tokens of an earlier prompt
+    uint64_t n_miss          = 0;
+    uint64_t n_tokens_reused = 0;
+    uint64_t n_tokens        = 0; // tokens produced by the tokenizer
+};
+
+// tokens of recent prompts, reused for the shared prefix of the next ones (system prompt, tools, earlier turns)
+//
+// the tokenizer splits the text at the special tokens and tokenizes the pieces in between independently, so the tokens
+// up to a special token do not depend on the text that follows. each prompt is cut after the special tokens that are
+// followed by a non-space character (a special token can strip the spaces after it), and a new prompt that starts with
+// the text of a cut only tokenizes the rest. the first few cuts are checked against a full tokenization, and the cache
+// disables itself if they do not match
+struct server_tokenize_cache {
+    static constexpr size_t N_ENTRIES_MAX = 16;
+    static constexpr int    N_VERIFY      = 4;
+
+    // clears the cache, call again when the model is reloaded
+    void init(const llama_vocab * vocab);
+
+    // same as common_tokenize(vocab, text, true, true)
+    llama_tokens tokenize(const std::string & text);
+
+    server_tokenize_cache_stats get_stats() const;
+
+private:
+    struct cut {
+        size_t n_chars;  // text before the cut
+        size_t n_tokens; // tokens of that text
+    };
+
+    struct entry {
+        std::string  text;
+        llama_tokens tokens;
+
+        std::vector<cut> cuts; // ascending
+    };
+
+    // the cuts of the text after the given one
+    std::vector<cut> find_cuts(const std::string & text, const llama_tokens & tokens, cut from);
+
+    // whether no other special token can match across the end of this one
+    bool is_boundary(llama_token id);
+
+    mutable std::mutex mutex;
+
+    const llama_vocab * vocab = nullptr;
+
+    bool enabled = false;
+    int  n_verify = 0;
+
+    std::vector<std::string> specials; // text of all special tokens
+
+    std::unordered_map<llama_token, bool> boundaries;
+
+    std::list<entry> entries; // most recently used first
+
+    server_tokenize_cache_stats stats;
+};
+
 // return the last index of character that can form a valid string
 // if the last character is potentially cut in half, return the index before the cut
 // if validate_utf8(text) == text.size(), then the whole text is valid utf8
@@ -271,7 +343,8 @@ std::vector<server_tokens> tokenize_input_prompts(
                                         mtmd_context * mctx,
                                         const json & json_prompt,
                                         bool add_special,
-                                        bool parse_special);
+                                        bool parse_special,
+                                        server_tokenize_cache * cache = nullptr);
 
 //
 // OAI utils
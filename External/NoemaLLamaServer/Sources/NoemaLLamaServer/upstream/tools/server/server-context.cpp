@@ -3,6 +3,8 @@
 #include "server-http.h"
 #include "server-task.h"
 #include "server-queue.h"
+#include "server-schedule.h"
+#include "server-slot-io.h"
 
 #include "common.h"
 #include "llama.h"
@@ -502,6 +504,13 @@ struct server_metrics {
         t_tokens_generation_total  += slot.t_token_generation;
     }
 
+    void on_embd_batch(uint64_t n_tokens, uint64_t t_ms) {
+        n_prompt_tokens_processed_total += n_tokens;
+        n_prompt_tokens_processed       += n_tokens;
+        t_prompt_processing             += t_ms;
+        t_prompt_processing_total       += t_ms;
+    }
+
     void on_decoded(const std::vector<server_slot> & slots) {
         n_decode_total++;
         for (const auto & slot : slots) {
@@ -542,6 +551,13 @@ public:
     // note: chat_params must not be refreshed upon existing sleeping state
     server_chat_params chat_params;
 
+    // tokens of recent prompts, used by the HTTP threads
+    server_tokenize_cache tokenize_cache;
+
+    // file I/O of the slot save/restore actions
+    // note: declared after the queues, so that the pending jobs complete before the queues are destroyed
+    server_slot_io slot_io;
+
     ~server_context_impl() {
         if (!sleeping) {
             // destroy() is already called when entering sleeping state
@@ -565,6 +581,9 @@ private:
 
     llama_model_ptr model_dft;
 
+    // draft model context shared by the slots, one sequence per slot
+    common_speculative_shared * spec_shared = nullptr;
+
     bool add_bos_token = true;
 
     int32_t n_ctx; // total context for all clients / slots
@@ -581,8 +600,14 @@ private:
 
     json json_webui_settings = json::object();
 
-    // Necessary similarity of prompt for slot selection
-    float slot_prompt_similarity = 0.0f;
+    // slot selection and ordering of the deferred tasks
+    server_scheduler scheduler;
+
+    // prompt tokens per step next to the generating slots
+    server_prefill_budget prefill_budget;
+
+    // embedding and rerank inputs of concurrent requests, waiting to share an encoder pass
+    server_embd_batcher embd_batcher;
 
     std::string model_name; // name of the loaded model, to be used by API
     std::set<std::string> model_aliases; // additional names for the model
@@ -605,6 +630,9 @@ private:
             slot.spec = nullptr;
         }
 
+        common_speculative_shared_free(spec_shared);
+        spec_shared = nullptr;
+
         llama_batch_free(batch);
     }
 
@@ -658,6 +686,8 @@ private:
 
         vocab = llama_model_get_vocab(model);
 
+        tokenize_cache.init(vocab);
+
         n_ctx = llama_n_ctx(ctx);
 
         add_bos_token = llama_vocab_get_add_bos(vocab);
@@ -669,8 +699,9 @@ private:
 
             auto params_dft = params_base;
 
-            params_dft.n_parallel   = 1;
-            params_dft.n_ctx        = params_spec.n_ctx == 0 ? llama_n_ctx_seq(ctx) : params_spec.n_ctx;
+            // a single draft context for all slots, with the same per-slot context as the target
+            params_dft.n_parallel   = params_base.n_parallel;
+            params_dft.n_ctx        = params_spec.n_ctx == 0 ? llama_n_ctx(ctx) : params_spec.n_ctx*(params_base.kv_unified ? 1 : params_base.n_parallel);
             params_dft.n_batch      = llama_n_ctx_seq(ctx);
             params_dft.devices      = params_spec.devices;
             params_dft.model        = params_spec.mparams_dft;
@@ -756,7 +787,14 @@ private:
         }
 
         // Necessary similarity of prompt for slot selection
-        slot_prompt_similarity = params_base.slot_prompt_similarity;
+        scheduler.slot_prompt_similarity = params_base.slot_prompt_similarity;
+        scheduler.max_wait_ms            = params_base.slot_schedule_max_wait;
+
+        if (!scheduler.init(params_base.slot_schedule)) {
+            SRV_ERR("invalid slot schedule '%s', available policies: %s\n", params_base.slot_schedule.c_str(), server_sched_policy_names().c_str());
+            return false;
+        }
+        SRV_INF("slot schedule: %s\n", scheduler.name().c_str());
 
         // setup slots
         SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
@@ -776,6 +814,14 @@ private:
             SRV_WRN("%s", "speculative decoding not supported by this context\n");
         }
 
+        if (can_spec && params_base.speculative.model_dft) {
+            spec_shared = common_speculative_shared_init(params_base.speculative, ctx, params_base.n_parallel);
+            if (spec_shared == nullptr) {
+                SRV_ERR("%s", "failed to create the draft context\n");
+                return false;
+            }
+        }
+
         // initialize slots
         for (int i = 0; i < params_base.n_parallel; i++) {
             server_slot slot;
@@ -789,7 +835,7 @@ private:
 
             // try speculative decoding
             if (can_spec) {
-                slot.spec = common_speculative_init(params_base.speculative, slot.ctx);
+                slot.spec = common_speculative_init(params_base.speculative, slot.ctx, spec_shared, slot.id);
                 if (slot.spec) {
                     if (mctx) {
                         SRV_ERR("%s\n", "speculative decoding is not supported with multimodal");
@@ -837,6 +883,47 @@ private:
             SRV_WRN("%s", "use `--cache-ram 0` to disable the prompt cache\n");
 
             prompt_cache = std::make_unique<server_prompt_cache>(params_base.cache_ram_mib, n_ctx);
+
+            if (!params_base.cache_disk_path.empty()) {
+                // states are only valid for the same weights and KV cache layout. the model and adapter files are
+                // identified by path, size and modification time, so that a finetune with the same architecture or a
+                // re-downloaded file never restores states computed with other weights
+                const auto file_key = [](const std::string & path, std::string & key) {
+                    std::error_code ec;
+                    const std::string abs   = std::filesystem::absolute(path, ec).string();
+                    const uint64_t    size  = ec ? 0 : std::filesystem::file_size(path, ec);
+                    const int64_t     mtime = ec ? 0 : std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+                    if (ec) {
+                        return false;
+                    }
+
+                    key += string_format("|%s|%" PRIu64 "|%" PRId64, abs.c_str(), size, mtime);
+                    return true;
+                };
+
+                char desc[256];
+                llama_model_desc(model, desc, sizeof(desc));
+
+                std::string model_key = string_format("%s|%d|%d|%d", desc,
+                        (int) params_base.cache_type_k, (int) params_base.cache_type_v, (int) params_base.swa_full);
+
+                bool ok = file_key(params_base.model.path, model_key);
+                for (const auto & la : params_base.lora_adapters) {
+                    ok = ok && file_key(la.path, model_key);
+                    model_key += string_format("|%g", la.scale);
+                }
+
+                if (ok) {
+                    uint64_t model_id = 0xcbf29ce484222325ull;
+                    for (const char c : model_key) {
+                        model_id = (model_id ^ (uint8_t) c) * 0x100000001b3ull;
+                    }
+
+                    prompt_cache->disk = std::make_unique<server_prompt_disk>(params_base.cache_disk_path, params_base.cache_disk_mib, model_id);
+                } else {
+                    SRV_WRN("cannot identify the model files, the disk prompt cache is disabled: %s\n", params_base.model.path.c_str());
+                }
+            }
         } else {
             SRV_WRN("%s", "prompt cache is disabled - use `--cache-ram N` to enable it\n");
         }
@@ -875,6 +962,33 @@ private:
         });
         queue_tasks.on_update_slots([this]() {
             update_slots();
+            queue_results.flush();
+        });
+
+        queue_results.set_coalesce(params_base.n_stream_coalesce);
+
+        if (!params_base.slot_save_path.empty()) {
+            slot_io.start();
+        }
+        prefill_budget.init(llama_n_batch(ctx), params_base.n_prefill_budget, params_base.prefill_target_itl);
+
+        if (params_base.embedding && params_base.embd_batch_window >= 0) {
+            // with a KV cache, the sequences belong to the slots
+            if (llama_get_memory(ctx) != nullptr) {
+                SRV_WRN("%s: --embd-batch-window requires a model without KV cache, disabling\n", __func__);
+            } else {
+                // with a unified KV cache, an encoder pass takes any seq id that llama_batch accepts
+                const int32_t n_seq_max = params_base.kv_unified ? (int32_t) llama_max_parallel_sequences() : (int32_t) llama_n_seq_max(ctx);
+
+                // an input that does not fit goes through a slot, which reports the error
+                embd_batcher.init(params_base.embd_batch_window, std::min<int32_t>(llama_n_ubatch(ctx), slots.front().n_ctx), n_seq_max);
+
+                SRV_INF("embedding micro-batching: window = %d ms, n_tokens_max = %d, n_seq_max = %d\n",
+                        params_base.embd_batch_window, embd_batcher.n_tokens_max, embd_batcher.n_seq_max);
+            }
+        }
+        queue_tasks.on_pick_deferred([this](const std::deque<server_task> & tasks) {
+            return pick_deferred_task(tasks);
         });
         queue_tasks.on_sleeping_state([this](bool sleeping) {
             handle_sleeping_state(sleeping);
@@ -963,71 +1077,64 @@ private:
         return nullptr;
     }
 
-    server_slot * get_available_slot(const server_task & task) {
-        server_slot * ret = nullptr;
+    // view of the slots for the scheduler
+    std::vector<server_sched_slot> get_sched_slots() const {
+        std::vector<server_sched_slot> res(slots.size());
 
-        bool update_cache = false;
+        for (size_t i = 0; i < slots.size(); ++i) {
+            res[i].id          = slots[i].id;
+            res[i].available   = !slots[i].is_processing();
+            res[i].tokens      = &slots[i].prompt.tokens;
+            res[i].t_last_used = slots[i].t_last_used;
+        }
 
-        // find the slot that has at least n% prompt similarity
-        if (ret == nullptr && slot_prompt_similarity != 0.0f) {
-            float sim_best = 0;
+        return res;
+    }
 
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
+    // pick the deferred task to run next on the available slots, called by queue_tasks when a slot is released
+    size_t pick_deferred_task(const std::deque<server_task> & tasks) {
+        std::vector<server_sched_task> views(tasks.size());
 
-                const auto & tokens = slot.prompt.tokens;
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            const auto & task = tasks[i];
 
-                // skip the slot if it does not contains cached tokens
-                if (tokens.empty()) {
-                    continue;
-                }
+            views[i].id          = task.id;
+            views[i].id_slot     = task.id_slot;
+            views[i].tokens      = &task.tokens;
+            views[i].key         = task.params.sched_key;
+            views[i].sub_key     = task.params.sched_user;
+            views[i].priority    = task.params.priority;
+            views[i].t_queued_us = task.t_queued_us;
+        }
 
-                // fraction of the Longest Common Prefix length with respect to the input prompt length
-                const float sim_cur = float(tokens.get_common_prefix(task.tokens)) / task.tokens.size();
+        const int idx = scheduler.pick(views, get_sched_slots(), ggml_time_us());
 
-                // select the current slot if the criteria match
-                if (sim_cur > sim_best && sim_cur > slot_prompt_similarity) {
-                    sim_best = sim_cur;
+        // none can run now - keep the previous behavior and let the first one try again
+        return idx < 0 ? 0 : idx;
+    }
 
-                    ret = &slot;
-                }
-            }
+    server_slot * get_available_slot(const server_task & task) {
+        server_slot * ret = nullptr;
 
-            if (ret != nullptr) {
-                const float f_keep = (sim_best*task.tokens.size()) / ret->prompt.tokens.size();
+        bool update_cache = false;
+
+        const auto choice = scheduler.select_slot(task.tokens, get_sched_slots());
+
+        if (choice.idx >= 0) {
+            ret = &slots[choice.idx];
+
+            if (choice.by_lcp) {
+                const float f_keep = (choice.sim*task.tokens.size()) / ret->prompt.tokens.size();
 
                 SLT_INF(*ret, "selected slot by LCP similarity, sim_best = %.3f (> %.3f thold), f_keep = %.3f\n",
-                        sim_best, slot_prompt_similarity, f_keep);
+                        choice.sim, scheduler.slot_prompt_similarity, f_keep);
 
                 // if we are about to lose a large portion of the existing context - save it in the prompt cache
                 if (f_keep < 0.5f) {
                     update_cache = true;
                 }
-            }
-        }
-
-        // find the slot that has been least recently used
-        if (ret == nullptr) {
-            int64_t t_last = -1;
-
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
-
-                // select the current slot if the criteria match
-                if (!ret || slot.t_last_used <= t_last) {
-                    t_last = slot.t_last_used;
-                    ret = &slot;
-                }
-            }
-
-            if (ret != nullptr) {
-                SLT_INF(*ret, "selected slot by LRU, t_last = %" PRId64 "\n", t_last);
+            } else {
+                SLT_INF(*ret, "selected slot by LRU, t_last = %" PRId64 "\n", ret->t_last_used);
 
                 update_cache = true;
             }
@@ -1110,6 +1217,8 @@ private:
     }
 
     bool launch_slot_with_task(server_slot & slot, server_task && task) {
+        scheduler.on_launch(task.params.sched_key, task.params.sched_user, task.tokens.size(), ggml_time_us());
+
         // process per-request lora adapters
         if (!task.params.lora.empty()) {
             auto task_loras = construct_lora_list(task.params.lora);
@@ -1476,6 +1585,7 @@ private:
         // populate res.probs_output
         if (slot.task->params.sampling.n_probs > 0) {
             res->prob_output = tkn; // copy the token probs
+            res->has_probs   = true;
         }
 
         // populate timings if this is final response or timings_per_token is enabled
@@ -1549,39 +1659,71 @@ private:
         queue_results.send(std::move(res));
     }
 
-    void send_embedding(const server_slot & slot, const llama_batch & batch) {
+    // run the file I/O of a slot action on the I/O thread - the task then comes back to the decode loop with the state
+    void submit_slot_io(const server_task & task, std::shared_ptr<server_slot_state> && state) {
+        auto action = task.slot_action;
+        action.state = std::move(state);
+
+        slot_io.submit([this, type = task.type, id = task.id, action]() {
+            auto & state = *action.state;
+
+            // an exception (e.g. bad_alloc on a corrupt file) must not terminate the I/O thread - the task reports it
+            try {
+                if (type == SERVER_TASK_TYPE_SLOT_SAVE) {
+                    state.write(action.filepath, action.compress);
+
+                    // the snapshot is in the file now
+                    std::vector<uint8_t>().swap(state.buf);
+                } else {
+                    state.read(action.filepath);
+                }
+            } catch (const std::exception & e) {
+                state.release();
+                state.error = e.what();
+            }
+
+            server_task done(type);
+            done.id          = id;
+            done.slot_action = action;
+
+            queue_tasks.post(std::move(done));
+        });
+    }
+
+    // the embedding of sequence seq_id of the evaluated batch
+    void send_embedding(const server_task & task, llama_seq_id seq_id, const llama_batch & batch) {
         auto res = std::make_unique<server_task_result_embd>();
-        res->id        = slot.task->id;
-        res->index     = slot.task->index;
-        res->n_tokens  = slot.task->n_tokens();
-        res->res_type  = slot.task->params.res_type;
+        res->id        = task.id;
+        res->index     = task.index;
+        res->n_tokens  = task.n_tokens();
+        res->res_type  = task.params.res_type;
 
         const int n_embd_out = llama_model_n_embd_out(model);
 
         std::vector<float> embd_res(n_embd_out, 0.0f);
 
         for (int i = 0; i < batch.n_tokens; ++i) {
-            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id) {
+            if (!batch.logits[i] || batch.seq_id[i][0] != seq_id) {
                 continue;
             }
 
             const float * embd = nullptr;
-            if (llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE) {
+            if (llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE) {
                 embd = llama_get_embeddings_ith(ctx, i);
             } else {
                 embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
             }
 
             if (embd == nullptr) {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+                SRV_ERR("failed to get embeddings, id_task = %d, token = %d, seq_id = %d\n", task.id, batch.token[i], batch.seq_id[i][0]);
 
                 res->embedding.push_back(std::vector<float>(n_embd_out, 0.0f));
                 continue;
             }
 
             // normalize only when there is pooling
-            if (llama_pooling_type(slot.ctx) != LLAMA_POOLING_TYPE_NONE) {
-                common_embd_normalize(embd, embd_res.data(), n_embd_out, slot.task->params.embd_normalize);
+            if (llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE) {
+                common_embd_normalize(embd, embd_res.data(), n_embd_out, task.params.embd_normalize);
                 res->embedding.push_back(embd_res);
                 break;
             }
@@ -1589,19 +1731,20 @@ private:
             res->embedding.emplace_back(embd, embd + n_embd_out);
         }
 
-        SLT_DBG(slot, "%s", "sending embeddings\n");
+        SRV_DBG("sending embeddings, id_task = %d\n", task.id);
 
         queue_results.send(std::move(res));
     }
 
-    void send_rerank(const server_slot & slot, const llama_batch & batch) {
+    // the rerank score of sequence seq_id of the evaluated batch
+    void send_rerank(const server_task & task, llama_seq_id seq_id, const llama_batch & batch) {
         auto res = std::make_unique<server_task_result_rerank>();
-        res->id       = slot.task->id;
-        res->index    = slot.task->index;
-        res->n_tokens = slot.task->n_tokens();
+        res->id       = task.id;
+        res->index    = task.index;
+        res->n_tokens = task.n_tokens();
 
         for (int i = 0; i < batch.n_tokens; ++i) {
-            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id) {
+            if (!batch.logits[i] || batch.seq_id[i][0] != seq_id) {
                 continue;
             }
 
@@ -1611,7 +1754,7 @@ private:
             }
 
             if (embd == NULL) {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+                SRV_ERR("failed to get embeddings, id_task = %d, token = %d, seq_id = %d\n", task.id, batch.token[i], batch.seq_id[i][0]);
 
                 res->score = -1e6;
                 continue;
@@ -1620,7 +1763,7 @@ private:
             res->score = embd[0];
         }
 
-        SLT_DBG(slot, "sending rerank result, res.score = %f\n", res->score);
+        SRV_DBG("sending rerank result, id_task = %d, res.score = %f\n", task.id, res->score);
 
         queue_results.send(std::move(res));
     }
@@ -1720,6 +1863,16 @@ private:
                         }
                     }
 
+                    if (task.need_embd() && can_batch_embd(task)) {
+                        if (!task.tokens.validate(ctx)) {
+                            send_error(task, "Prompt contains invalid tokens", ERROR_TYPE_INVALID_REQUEST);
+                            break;
+                        }
+
+                        embd_batcher.push(std::move(task), ggml_time_us());
+                        break;
+                    }
+
                     const int id_slot = task.id_slot;
                     const int id_task = task.id;
 
@@ -1771,6 +1924,11 @@ private:
                 } break;
             case SERVER_TASK_TYPE_CANCEL:
                 {
+                    // drop the input if it still waits for an encoder pass
+                    if (embd_batcher.cancel(task.id_target)) {
+                        break;
+                    }
+
                     // release slot linked with the task id
                     for (auto & slot : slots) {
                         if (slot.task && slot.task->id == task.id_target) {
@@ -1826,6 +1984,16 @@ private:
                     res->n_decode_total          = metrics.n_decode_total;
                     res->n_busy_slots_total      = metrics.n_busy_slots_total;
 
+                    if (prompt_cache) {
+                        res->prompt_cache = prompt_cache->get_stats();
+                    }
+
+                    res->prefill    = prefill_budget.get_stats();
+                    res->embd_batch = embd_batcher.get_stats();
+
+                    res->tokenize_cache      = tokenize_cache.get_stats();
+                    res->chat_template_cache = common_chat_templates_get_cache_stats(chat_params.tmpls.get());
+
                     if (task.metrics_reset_bucket) {
                         metrics.reset_bucket();
                     }
@@ -1833,6 +2001,27 @@ private:
                 } break;
             case SERVER_TASK_TYPE_SLOT_SAVE:
                 {
+                    // the file has been written
+                    if (task.slot_action.state) {
+                        const auto & state = *task.slot_action.state;
+
+                        if (!state.error.empty()) {
+                            send_error(task, "Unable to save slot: " + state.error, ERROR_TYPE_SERVER);
+                            break;
+                        }
+
+                        auto res = std::make_unique<server_task_result_slot_save_load>();
+                        res->id       = task.id;
+                        res->id_slot  = task.slot_action.id_slot;
+                        res->filename = task.slot_action.filename;
+                        res->is_save  = true;
+                        res->n_tokens = state.tokens.size();
+                        res->n_bytes  = state.n_file_bytes;
+                        res->t_ms     = (ggml_time_us() - state.t_start_us) / 1000.0;
+                        queue_results.send(std::move(res));
+                        break;
+                    }
+
                     if (!check_no_mtmd(task.id)) {
                         break;
                     }
@@ -1850,27 +2039,18 @@ private:
                         break;
                     }
 
-                    const size_t token_count = slot->prompt.tokens.size();
-                    const int64_t t_start = ggml_time_us();
-
-                    std::string filename = task.slot_action.filename;
-                    std::string filepath = task.slot_action.filepath;
+                    // snapshot the state into memory - the slot is free again right after
+                    auto state = std::make_shared<server_slot_state>();
+                    state->t_start_us = ggml_time_us();
+                    state->tokens     = slot->prompt.tokens.get_text_tokens();
 
-                    const llama_tokens & tokens = slot->prompt.tokens.get_text_tokens();
-                    const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id, tokens.data(), token_count);
+                    state->buf.resize(llama_state_seq_get_size(ctx, slot->id));
+                    state->buf.resize(llama_state_seq_get_data(ctx, state->buf.data(), state->buf.size(), slot->id));
 
-                    const int64_t t_end = ggml_time_us();
-                    const double t_save_ms = (t_end - t_start) / 1000.0;
+                    SLT_INF(*slot, "saving %zu tokens (%.3f MiB) to '%s'%s\n", state->tokens.size(), state->buf.size() / 1024.0 / 1024.0,
+                            task.slot_action.filename.c_str(), task.slot_action.compress ? " with compression" : "");
 
-                    auto res = std::make_unique<server_task_result_slot_save_load>();
-                    res->id       = task.id;
-                    res->id_slot  = id_slot;
-                    res->filename = filename;
-                    res->is_save  = true;
-                    res->n_tokens = token_count;
-                    res->n_bytes  = nwrite;
-                    res->t_ms     = t_save_ms;
-                    queue_results.send(std::move(res));
+                    submit_slot_io(task, std::move(state));
                 } break;
             case SERVER_TASK_TYPE_SLOT_RESTORE:
                 {
@@ -1888,36 +2068,46 @@ private:
                         break;
                     }
 
-                    const int64_t t_start = ggml_time_us();
+                    // read the file first
+                    if (!task.slot_action.state) {
+                        auto state = std::make_shared<server_slot_state>();
+                        state->t_start_us = ggml_time_us();
+
+                        submit_slot_io(task, std::move(state));
+                        break;
+                    }
+
+                    auto & state = *task.slot_action.state;
 
-                    std::string filename = task.slot_action.filename;
-                    std::string filepath = task.slot_action.filepath;
+                    if (!state.error.empty()) {
+                        SRV_ERR("failed to read slot file: %s\n", state.error.c_str());
+                        send_error(task, "Unable to restore slot, invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
+                        break;
+                    }
 
-                    llama_tokens tokens;
-                    tokens.resize(slot->n_ctx);
-                    size_t token_count = 0;
-                    size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, tokens.data(), tokens.size(), &token_count);
+                    size_t nread = 0;
+                    if (state.tokens.size() <= (size_t) slot->n_ctx) {
+                        nread = llama_state_seq_set_data(ctx, state.data, state.size, slot->id);
+                    }
                     if (nread == 0) {
                         slot->prompt.tokens.clear(); // KV may already been invalidated?
                         send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
-                    tokens.resize(token_count);
                     slot->prompt.tokens.clear();
-                    slot->prompt.tokens.insert(tokens);
-
-                    const int64_t t_end = ggml_time_us();
-                    const double t_restore_ms = (t_end - t_start) / 1000.0;
+                    slot->prompt.tokens.insert(state.tokens);
 
                     auto res = std::make_unique<server_task_result_slot_save_load>();
                     res->id       = task.id;
                     res->id_slot  = id_slot;
-                    res->filename = filename;
+                    res->filename = task.slot_action.filename;
                     res->is_save  = false;
-                    res->n_tokens = token_count;
-                    res->n_bytes  = nread;
-                    res->t_ms     = t_restore_ms;
+                    res->n_tokens = state.tokens.size();
+                    res->n_bytes  = state.n_file_bytes;
+                    res->t_ms     = (ggml_time_us() - state.t_start_us) / 1000.0;
                     queue_results.send(std::move(res));
+
+                    state.release();
                 } break;
             case SERVER_TASK_TYPE_SLOT_ERASE:
                 {
@@ -1981,6 +2171,11 @@ private:
                     for (size_t i = 0; i < new_loras.size(); ++i) {
                         SRV_INF("set lora adapter idx=%zu scale=%f\n", i, new_loras[i].scale);
                     }
+                    // the disk tier is keyed by the adapters it was opened with - stop spilling states computed with others
+                    if (prompt_cache && prompt_cache->disk && !are_lora_equal(new_loras, params_base.lora_adapters)) {
+                        SRV_WRN("%s", "lora adapters changed, the disk prompt cache is disabled until restart\n");
+                        prompt_cache->disk.reset();
+                    }
                     // TODO @ngxson : make lora_adapters a dedicated member of server_context
                     params_base.lora_adapters = new_loras;
                     auto res = std::make_unique<server_task_result_apply_lora>();
@@ -1990,7 +2185,98 @@ private:
         }
     }
 
+    // whether an embedding or rerank task can share an encoder pass with the inputs of other requests
+    bool can_batch_embd(const server_task & task) const {
+        return
+            embd_batcher.enabled() &&
+            task.id_slot == -1 &&
+            !task.tokens.has_media() &&
+            !task.tokens.empty() &&
+            task.n_tokens() <= embd_batcher.n_tokens_max;
+    }
+
+    // evaluate the pending embedding and rerank inputs once they are ready, one sequence per input
+    void update_embd_batch() {
+        if (embd_batcher.ready(ggml_time_us())) {
+            process_embd_batch(embd_batcher.take(ggml_time_us()));
+        }
+
+        if (embd_batcher.empty()) {
+            return;
+        }
+
+        bool all_idle = true;
+        for (const auto & slot : slots) {
+            all_idle = all_idle && !slot.is_processing();
+        }
+
+        // nothing else to do - wait for more inputs until the window is over
+        if (all_idle && !embd_batcher.ready(ggml_time_us())) {
+            queue_tasks.wait_for_task(embd_batcher.t_wait_us(ggml_time_us()));
+        }
+
+        // come back for the remaining inputs
+        server_task task(SERVER_TASK_TYPE_NEXT_RESPONSE);
+        task.id = queue_tasks.get_new_id();
+        queue_tasks.post(std::move(task));
+    }
+
+    void process_embd_batch(std::vector<server_task> && tasks) {
+        const int64_t t_start = ggml_time_us();
+
+        common_batch_clear(batch);
+
+        for (size_t s = 0; s < tasks.size(); ++s) {
+            const auto & tokens = tasks[s].tokens;
+            for (size_t i = 0; i < tokens.size(); ++i) {
+                common_batch_add(batch, tokens[i], i, { (llama_seq_id) s }, true);
+            }
+        }
+
+        // the batcher packs only inputs with the same adapters
+        auto lora = tasks.front().params.lora.empty() ? params_base.lora_adapters : construct_lora_list(tasks.front().params.lora);
+
+        common_set_adapter_lora(ctx, lora);
+        llama_set_embeddings(ctx, true);
+
+        const int32_t n_tokens = batch.n_tokens;
+
+        const int ret = llama_decode(ctx, batch);
+        if (ret != 0) {
+            SRV_ERR("failed to encode the embedding batch, n_inputs = %zu, n_tokens = %d, ret = %d\n", tasks.size(), n_tokens, ret);
+
+            for (const auto & cur : tasks) {
+                send_error(cur, "Compute error.");
+            }
+        } else {
+            for (size_t s = 0; s < tasks.size(); ++s) {
+                if (tasks[s].type == SERVER_TASK_TYPE_EMBEDDING) {
+                    send_embedding(tasks[s], s, batch);
+                } else {
+                    send_rerank(tasks[s], s, batch);
+                }
+            }
+        }
+
+        common_batch_clear(batch);
+
+        const int64_t t_batch_us = ggml_time_us() - t_start;
+
+        metrics.on_embd_batch(n_tokens, t_batch_us/1000);
+
+        SRV_DBG("embedding batch, n_inputs = %zu, n_tokens = %d, n_pending = %zu, t = %.2f ms\n",
+                tasks.size(), n_tokens, (size_t) embd_batcher.get_stats().n_pending, t_batch_us/1000.0);
+    }
+
     void update_slots() {
+        // the embedding and rerank inputs batched across requests do not use the slots
+        if (!embd_batcher.empty()) {
+            update_embd_batch();
+        }
+
+        // keep the loop awake until the pending slot files are written or read
+        const bool slot_io_pending = slot_io.n_pending() > 0;
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -2007,7 +2293,15 @@ private:
                     has_reported_http_ready = true;
                     noema_llama_server_report_http_ready();
                 }
-                SRV_INF("%s", "all slots are idle\n");
+                if (slot_io_pending) {
+                    queue_tasks.wait_for_task(100*1000);
+
+                    server_task task(SERVER_TASK_TYPE_NEXT_RESPONSE);
+                    task.id = queue_tasks.get_new_id();
+                    queue_tasks.post(std::move(task));
+                } else if (embd_batcher.empty()) {
+                    SRV_INF("%s", "all slots are idle\n");
+                }
 
                 return;
             }
@@ -2094,6 +2388,7 @@ private:
         };
 
         // first, add sampled tokens from any ongoing sequences
+        std::vector<server_slot *> slots_gen;
         for (auto & slot : slots) {
             if (slot.state != SLOT_STATE_GENERATING) {
                 continue;
@@ -2106,25 +2401,49 @@ private:
                 continue;
             }
 
-            // generate draft tokens in speculative decoding mode
-            // TODO: rework to have a single draft llama_context shared across all slots [TAG_SERVER_SPEC_REWORK]
-            //       perform the speculative drafting for all sequences at the same time in a single batch
-            const int n_draft_max = slot.get_n_draft_max();
-            if (n_draft_max > 0) {
+            slots_gen.push_back(&slot);
+        }
+
+        // generate draft tokens in speculative decoding mode
+        // the slots share a single draft context, so the drafts of all sequences are evaluated in one batch per step
+        std::vector<int> n_draft_max(slots_gen.size(), 0);
+        std::vector<common_speculative_request> spec_reqs;
+
+        for (size_t k = 0; k < slots_gen.size(); ++k) {
+            auto & slot = *slots_gen[k];
+
+            n_draft_max[k] = slot.get_n_draft_max();
+            if (n_draft_max[k] > 0) {
                 if (mctx) {
                     // we should never reach this, as speculative is automatically disabled if mmproj is loaded
                     GGML_ABORT("not supported by multimodal");
                 }
 
-                const llama_tokens & cached_text_tokens = slot.prompt.tokens.get_text_tokens();
+                common_speculative_request req;
+                req.spec    = slot.spec;
+                req.params  = &slot.task->params.speculative;
+                req.prompt  = &slot.prompt.tokens.get_text_tokens();
+                req.id_last = slot.sampled;
+
+                spec_reqs.push_back(std::move(req));
+            }
+        }
+
+        if (!spec_reqs.empty()) {
+            common_speculative_draft_batch(spec_reqs);
+        }
+
+        size_t i_spec_req = 0;
 
-                const auto & params_spec = slot.task->params.speculative;
+        for (size_t k = 0; k < slots_gen.size(); ++k) {
+            auto & slot = *slots_gen[k];
 
-                llama_tokens draft = common_speculative_draft(slot.spec, params_spec, cached_text_tokens, slot.sampled);
+            if (n_draft_max[k] > 0) {
+                llama_tokens draft = std::move(spec_reqs[i_spec_req++].result);
 
-                if (draft.size() > (size_t) n_draft_max) {
-                    SLT_WRN(slot, "draft size %d exceeds max %d, truncating\n", (int) draft.size(), n_draft_max);
-                    draft.resize(n_draft_max);
+                if (draft.size() > (size_t) n_draft_max[k]) {
+                    SLT_WRN(slot, "draft size %d exceeds max %d, truncating\n", (int) draft.size(), n_draft_max[k]);
+                    draft.resize(n_draft_max[k]);
                 }
 
                 // add the sampled token to the batch
@@ -2170,6 +2489,11 @@ private:
         float  alora_scale       = -1.0f;
         size_t alora_disabled_id = 0;
 
+        // the prompt tokens that share the batch with the generating slots are capped by the prefill budget,
+        // so that a long prompt does not delay the next token of every generating slot by a full n_batch
+        const int32_t n_decode       = batch.n_tokens;
+        const int32_t n_batch_prompt = std::min<int64_t>(n_batch, (int64_t) n_decode + prefill_budget.get(n_decode));
+
         // next, batch any pending prompts without exceeding n_batch
         if (params_base.cont_batching || batch.n_tokens == 0) {
             for (auto & slot : slots) {
@@ -2486,6 +2810,9 @@ private:
                         }
                     }
 
+                    // a prompt that cannot be split is not subject to the budget
+                    const int32_t n_batch_slot = slot.can_split() ? n_batch_prompt : n_batch;
+
                     // truncate any tokens that are beyond n_past for this slot
                     const llama_pos p0 = slot.prompt.tokens.pos_next();
 
@@ -2557,7 +2884,7 @@ private:
                     }
 
                     // add prompt tokens for processing in the current batch
-                    while (slot.prompt.n_tokens() < slot.task->n_tokens() && batch.n_tokens < n_batch) {
+                    while (slot.prompt.n_tokens() < slot.task->n_tokens() && batch.n_tokens < n_batch_slot) {
                         // get next token to process
                         llama_token cur_tok = input_tokens[slot.prompt.n_tokens()];
                         if (cur_tok == LLAMA_TOKEN_NULL) {
@@ -2698,7 +3025,7 @@ private:
                     slot_batched = &slot;
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch_prompt) {
                     break;
                 }
             }
@@ -2730,6 +3057,18 @@ private:
             n_empty_consecutive = 0;
         }
 
+        const int32_t n_prefill = batch.n_tokens - n_decode;
+
+        // the budget held prompt tokens back if it filled up while some prompt was still pending
+        bool prefill_limited = false;
+        if (batch.n_tokens >= n_batch_prompt && n_batch_prompt < n_batch) {
+            for (const auto & slot : slots) {
+                prefill_limited = prefill_limited || slot.state == SLOT_STATE_PROCESSING_PROMPT;
+            }
+        }
+
+        const int64_t t_step_start = ggml_time_us();
+
         int32_t i_next = 0;
 
         // process the created batch of tokens
@@ -2843,14 +3182,14 @@ private:
                 if (slot.state == SLOT_STATE_DONE_PROMPT) {
                     if (slot.task->type == SERVER_TASK_TYPE_EMBEDDING) {
                         // prompt evaluated for embedding
-                        send_embedding(slot, batch_view);
+                        send_embedding(*slot.task, slot.id, batch_view);
                         slot.release();
                         slot.i_batch = -1;
                         continue; // continue loop of slots
                     }
 
                     if (slot.task->type == SERVER_TASK_TYPE_RERANK) {
-                        send_rerank(slot, batch_view);
+                        send_rerank(*slot.task, slot.id, batch_view);
                         slot.release();
                         slot.i_batch = -1;
                         continue; // continue loop of slots
@@ -2970,6 +3309,15 @@ private:
             }
         }
 
+        if (batch.n_tokens > 0) {
+            const double t_step_ms = (ggml_time_us() - t_step_start) / 1e3;
+
+            prefill_budget.update(n_decode, n_prefill, prefill_limited, t_step_ms);
+
+            SRV_DBG("step: n_decode = %d, n_prefill = %d, budget = %d%s, t_step = %.2f ms\n",
+                    n_decode, n_prefill, prefill_budget.get_stats().n_budget, prefill_limited ? " (limited)" : "", t_step_ms);
+        }
+
         SRV_DBG("%s", "run slots completed\n");
     }
 
@@ -3085,6 +3433,24 @@ void server_context::on_sleeping_changed(std::function<void(bool)> callback) {
 // server_routes
 //
 
+// API key of a request, from the Authorization or X-Api-Key header (empty if none)
+static std::string get_api_key(const server_http_req & req) {
+    std::string res;
+    for (const auto & [key, value] : req.headers) {
+        std::string name = key;
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (name == "authorization") {
+            const std::string prefix = "Bearer ";
+            res = value.rfind(prefix, 0) == 0 ? value.substr(prefix.size()) : value;
+            break;
+        }
+        if (name == "x-api-key") {
+            res = value;
+        }
+    }
+    return res;
+}
+
 std::unique_ptr<server_res_generator> server_routes::handle_completions_impl(
             const server_http_req & req,
             server_task_type type,
@@ -3112,7 +3478,7 @@ std::unique_ptr<server_res_generator> server_routes::handle_completions_impl(
             inputs.push_back(process_mtmd_prompt(ctx_server.mctx, prompt.get<std::string>(), files));
         } else {
             // Everything else, including multimodal completions.
-            inputs = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, prompt, true, true);
+            inputs = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, prompt, true, true, &tokenize_cache);
         }
 
         // tasks.reserve(inputs.size()); // TODO: this is inaccurate due to child tasks
@@ -3131,6 +3497,9 @@ std::unique_ptr<server_res_generator> server_routes::handle_completions_impl(
                     data);
             task.id_slot = json_value(data, "id_slot", -1);
 
+            // the fair share goes to the API key first, the "user" field only splits the share of its key
+            task.params.sched_key = get_api_key(req);
+
             // OAI-compat
             task.params.res_type          = res_type;
             task.params.oaicompat_cmpl_id = completion_id;
@@ -3207,17 +3576,12 @@ std::unique_ptr<server_res_generator> server_routes::handle_completions_impl(
 
         // next responses are streamed
         // to be sent immediately
-        json first_result_json = first_result->to_json();
-        if (res_type == TASK_RESPONSE_TYPE_ANTHROPIC) {
-            res->data = format_anthropic_sse(first_result_json);
-        } else if (res_type == TASK_RESPONSE_TYPE_OAI_RESP) {
-            res->data = format_oai_resp_sse(first_result_json);
-        } else {
-            res->data = format_oai_sse(first_result_json);
-        }
+        server_sse_writer writer(res_type);
+        writer.write(*first_result, res->data);
+
         res->status = 200;
         res->content_type = "text/event-stream";
-        res->next = [res_this = res.get(), res_type, &req](std::string & output) -> bool {
+        res->next = [res_this = res.get(), res_type, &req, writer = std::move(writer)](std::string & output) mutable -> bool {
             static auto format_error = [](task_response_type res_type, const json & res_json) {
                 if (res_type == TASK_RESPONSE_TYPE_ANTHROPIC) {
                     return format_anthropic_sse({
@@ -3280,14 +3644,7 @@ std::unique_ptr<server_res_generator> server_routes::handle_completions_impl(
                         dynamic_cast<server_task_result_cmpl_partial*>(result.get()) != nullptr
                         || dynamic_cast<server_task_result_cmpl_final*>(result.get()) != nullptr
                     );
-                    json res_json = result->to_json();
-                    if (res_type == TASK_RESPONSE_TYPE_ANTHROPIC) {
-                        output = format_anthropic_sse(res_json);
-                    } else if (res_type == TASK_RESPONSE_TYPE_OAI_RESP) {
-                        output = format_oai_resp_sse(res_json);
-                    } else {
-                        output = format_oai_sse(res_json);
-                    }
+                    writer.write(*result, output);
                 }
 
                 // has next data, continue
@@ -3313,6 +3670,7 @@ std::unique_ptr<server_res_generator> server_routes::create_response(bool bypass
 server_routes::server_routes(const common_params & params, server_context & ctx_server)
         : params(params),
           ctx_server(*ctx_server.impl),
+          tokenize_cache(ctx_server.impl->tokenize_cache),
           queue_tasks(ctx_server.impl->queue_tasks),
           queue_results(ctx_server.impl->queue_results) {
     init_routes();
@@ -3396,6 +3754,98 @@ void server_routes::init_routes() {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) res_task->n_busy_slots_total / std::max((float) res_task->n_decode_total, 1.f)}
+            }, {
+                    {"name",  "prompt_cache_lookups_total"},
+                    {"help",  "Number of prompt cache lookups."},
+                    {"value",  res_task->prompt_cache.n_lookups}
+            }, {
+                    {"name",  "prompt_cache_hits_total"},
+                    {"help",  "Number of prompt cache lookups that restored a cached state."},
+                    {"value",  res_task->prompt_cache.n_hits}
+            }, {
+                    {"name",  "prompt_cache_hit_tokens_total"},
+                    {"help",  "Prompt tokens reused from restored cache states (sum of hit depths)."},
+                    {"value",  res_task->prompt_cache.n_hit_tokens}
+            }, {
+                    {"name",  "prompt_cache_restored_bytes_total"},
+                    {"help",  "Bytes of state restored from the prompt cache."},
+                    {"value",  res_task->prompt_cache.n_bytes_loaded}
+            }, {
+                    {"name",  "prompt_cache_restore_seconds_total"},
+                    {"help",  "Time spent restoring prompt cache states."},
+                    {"value",  res_task->prompt_cache.t_restore_us / 1.e6}
+            }, {
+                    {"name",  "prompt_cache_evictions_total"},
+                    {"help",  "Number of prompt cache states evicted by the size or token limits."},
+                    {"value",  res_task->prompt_cache.n_evicted}
+            }, {
+                    {"name",  "prompt_cache_disk_hits_total"},
+                    {"help",  "Number of prompt cache hits served from the disk tier."},
+                    {"value",  res_task->prompt_cache.n_disk_hits}
+            }, {
+                    {"name",  "prompt_cache_disk_writes_total"},
+                    {"help",  "Number of evicted prompt cache states written to the disk tier."},
+                    {"value",  res_task->prompt_cache.n_disk_writes}
+            }, {
+                    {"name",  "prompt_cache_disk_dropped_total"},
+                    {"help",  "Number of evicted prompt cache states dropped because the disk write queue was full."},
+                    {"value",  res_task->prompt_cache.n_disk_dropped}
+            }, {
+                    {"name",  "batch_steps_total"},
+                    {"help",  "Number of slot update steps that decoded a batch."},
+                    {"value",  res_task->prefill.n_steps}
+            }, {
+                    {"name",  "batch_prefill_tokens_total"},
+                    {"help",  "Prompt tokens decoded by the slot update steps."},
+                    {"value",  res_task->prefill.n_prefill_tokens}
+            }, {
+                    {"name",  "batch_decode_tokens_total"},
+                    {"help",  "Tokens of generating slots decoded by the slot update steps."},
+                    {"value",  res_task->prefill.n_decode_tokens}
+            }, {
+                    {"name",  "batch_prefill_limited_total"},
+                    {"help",  "Number of steps where the prefill budget held prompt tokens back."},
+                    {"value",  res_task->prefill.n_steps_limited}
+            }, {
+                    {"name",  "embd_batches_total"},
+                    {"help",  "Number of encoder passes shared by the embedding and rerank inputs of concurrent requests."},
+                    {"value",  res_task->embd_batch.n_batches}
+            }, {
+                    {"name",  "embd_batch_inputs_total"},
+                    {"help",  "Number of embedding and rerank inputs evaluated in shared encoder passes."},
+                    {"value",  res_task->embd_batch.n_inputs}
+            }, {
+                    {"name",  "embd_batch_tokens_total"},
+                    {"help",  "Number of tokens evaluated in shared encoder passes."},
+                    {"value",  res_task->embd_batch.n_tokens}
+            }, {
+                    {"name",  "embd_batch_wait_seconds_total"},
+                    {"help",  "Total time the embedding and rerank inputs waited for their encoder pass."},
+                    {"value",  res_task->embd_batch.t_wait_us / 1.e6}
+            }, {
+                    {"name",  "tokenize_cache_hits_total"},
+                    {"help",  "Number of prompts that reused the tokens of an earlier prompt."},
+                    {"value",  res_task->tokenize_cache.n_hit}
+            }, {
+                    {"name",  "tokenize_cache_misses_total"},
+                    {"help",  "Number of prompts tokenized from the start."},
+                    {"value",  res_task->tokenize_cache.n_miss}
+            }, {
+                    {"name",  "tokenize_cache_tokens_reused_total"},
+                    {"help",  "Prompt tokens reused from earlier prompts."},
+                    {"value",  res_task->tokenize_cache.n_tokens_reused}
+            }, {
+                    {"name",  "tokenize_cache_tokens_total"},
+                    {"help",  "Prompt tokens produced by the tokenizer."},
+                    {"value",  res_task->tokenize_cache.n_tokens}
+            }, {
+                    {"name",  "chat_template_cache_hits_total"},
+                    {"help",  "Number of chat requests that reused the parser and grammar of an earlier request."},
+                    {"value",  res_task->chat_template_cache.n_hit}
+            }, {
+                    {"name",  "chat_template_cache_misses_total"},
+                    {"help",  "Number of chat requests that built their parser and grammar."},
+                    {"value",  res_task->chat_template_cache.n_miss}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3413,6 +3863,50 @@ void server_routes::init_routes() {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of requests deferred."},
                     {"value",  (uint64_t) res_task->n_tasks_deferred}
+            },{
+                    {"name",  "prompt_cache_hit_depth"},
+                    {"help",  "Average number of prompt tokens reused per prompt cache hit."},
+                    {"value",  res_task->prompt_cache.n_hits ? (double) res_task->prompt_cache.n_hit_tokens / res_task->prompt_cache.n_hits : 0.}
+            },{
+                    {"name",  "prompt_cache_states"},
+                    {"help",  "Number of states in the prompt cache."},
+                    {"value",  res_task->prompt_cache.n_states}
+            },{
+                    {"name",  "prompt_cache_bytes"},
+                    {"help",  "Size of the states in the prompt cache."},
+                    {"value",  res_task->prompt_cache.n_bytes}
+            },{
+                    {"name",  "prompt_cache_shared_bytes"},
+                    {"help",  "Token storage saved by keeping shared prompt prefixes once."},
+                    {"value",  res_task->prompt_cache.n_bytes_shared}
+            },{
+                    {"name",  "prompt_cache_disk_states"},
+                    {"help",  "Number of states in the disk tier of the prompt cache."},
+                    {"value",  res_task->prompt_cache.n_disk_states}
+            },{
+                    {"name",  "prompt_cache_disk_bytes"},
+                    {"help",  "Size of the disk tier of the prompt cache."},
+                    {"value",  res_task->prompt_cache.n_disk_bytes}
+            },{
+                    {"name",  "batch_prefill_budget"},
+                    {"help",  "Max prompt tokens per step next to generating slots."},
+                    {"value",  res_task->prefill.n_budget}
+            },{
+                    {"name",  "batch_prefill_tokens"},
+                    {"help",  "Prompt tokens of the last step."},
+                    {"value",  res_task->prefill.n_prefill_last}
+            },{
+                    {"name",  "batch_decode_tokens"},
+                    {"help",  "Tokens of generating slots in the last step."},
+                    {"value",  res_task->prefill.n_decode_last}
+            },{
+                    {"name",  "batch_step_seconds"},
+                    {"help",  "Duration of the last step."},
+                    {"value",  res_task->prefill.t_step_last_ms / 1.e3}
+            },{
+                    {"name",  "embd_batch_pending"},
+                    {"help",  "Number of embedding and rerank inputs waiting for an encoder pass."},
+                    {"value",  res_task->embd_batch.n_pending}
             }}}
         };
 
@@ -4067,6 +4561,7 @@ std::unique_ptr<server_res_generator> server_routes::handle_slots_save(const ser
         task.slot_action.id_slot  = id_slot;
         task.slot_action.filename = filename;
         task.slot_action.filepath = filepath;
+        task.slot_action.compress = json_value(request_data, "compress", params.slot_save_compress);
         rd.post_task(std::move(task));
     }
 
@@ -140,6 +140,8 @@ private:
     const common_params & params;
     const server_context_impl & ctx_server;
 
+    server_tokenize_cache & tokenize_cache;
+
     server_queue & queue_tasks;
     server_response & queue_results;
     std::unique_ptr<server_res_generator> create_response(bool bypass_sleep = false);
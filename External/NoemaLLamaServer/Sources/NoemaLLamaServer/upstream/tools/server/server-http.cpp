@@ -393,8 +393,9 @@ static void process_handler_response(server_http_req_ptr && request, server_http
         // convert to shared_ptr as both chunked_content_provider() and on_complete() need to use it
         std::shared_ptr<server_http_req> q_ptr = std::move(request);
         std::shared_ptr<server_http_res> r_ptr = std::move(response);
-        const auto chunked_content_provider = [response = r_ptr](size_t, httplib::DataSink & sink) -> bool {
-            std::string chunk;
+        // the chunk buffer is reused for the whole stream
+        const auto chunked_content_provider = [response = r_ptr, chunk = std::string()](size_t, httplib::DataSink & sink) mutable -> bool {
+            chunk.clear();
             bool has_next = response->next(chunk);
             if (!chunk.empty()) {
                 if (!sink.write(chunk.data(), chunk.size())) {
@@ -4,6 +4,7 @@
 #include "log.h"
 
 #include <chrono>
+#include <thread>
 
 #define QUE_INF(fmt, ...) LOG_INF("que  %12.*s: " fmt, 12, __func__, __VA_ARGS__)
 #define QUE_WRN(fmt, ...) LOG_WRN("que  %12.*s: " fmt, 12, __func__, __VA_ARGS__)
@@ -63,6 +64,10 @@ int server_queue::post(std::vector<server_task> && tasks, bool front) {
 void server_queue::defer(server_task && task) {
     std::unique_lock<std::mutex> lock(mutex_tasks);
     QUE_DBG("defer task, id = %d\n", task.id);
+    // keep the time of the first deferral, a task that is re-deferred keeps its place
+    if (task.t_queued_us < 0) {
+        task.t_queued_us = ggml_time_us();
+    }
     queue_tasks_deferred.push_back(std::move(task));
     time_last_task = ggml_time_ms();
     condition_tasks.notify_one();
@@ -88,11 +93,14 @@ void server_queue::pop_deferred_task(int id_slot) {
                 break;
             }
         }
-        // if not tasks found using the slot, just pop the first deferred task (default behavior)
+        // if not tasks found using the slot, let the scheduler choose (default: the first deferred task)
         if (!found) {
-            QUE_DBG("pop deferred task, id_task = %d\n", queue_tasks_deferred.front().id);
-            queue_tasks.emplace_front(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+            const size_t idx = callback_pick_deferred ? callback_pick_deferred(queue_tasks_deferred) : 0;
+            GGML_ASSERT(idx < queue_tasks_deferred.size());
+            auto it = queue_tasks_deferred.begin() + idx;
+            QUE_DBG("pop deferred task, id_task = %d (%zu/%zu)\n", it->id, idx, queue_tasks_deferred.size());
+            queue_tasks.emplace_front(std::move(*it));
+            queue_tasks_deferred.erase(it);
         }
     }
     time_last_task = ggml_time_ms();
@@ -116,6 +124,13 @@ void server_queue::wait_until_no_sleep() {
     }
 }
 
+void server_queue::wait_for_task(int64_t timeout_us) {
+    std::unique_lock<std::mutex> lock(mutex_tasks);
+    condition_tasks.wait_for(lock, std::chrono::microseconds(timeout_us), [&]{
+        return !queue_tasks.empty() || !running;
+    });
+}
+
 void server_queue::terminate() {
     std::unique_lock<std::mutex> lock(mutex_tasks);
     running = false;
@@ -221,65 +236,171 @@ void server_queue::cleanup_pending_task(int id_target) {
         queue_tasks_deferred.end());
 }
 
+//
+// server_response_channel
+//
+
+server_response_channel::~server_response_channel() {
+    const size_t t = tail.load(std::memory_order_acquire);
+    for (size_t h = head.load(std::memory_order_relaxed); h != t; ++h) {
+        delete ring[h & (CAPACITY - 1)];
+    }
+}
+
+void server_response_channel::push(server_task_result_ptr && result) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+
+    // once a result went to the overflow queue, the following ones must too, to keep the order
+    if (!has_overflow.load(std::memory_order_acquire) && t - head.load(std::memory_order_acquire) < CAPACITY) {
+        ring[t & (CAPACITY - 1)] = result.release();
+
+        // seq_cst pairs with the consumer's store to `waiting` followed by its load of `tail`
+        tail.store(t + 1, std::memory_order_seq_cst);
+
+        if (waiting.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv.notify_one();
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    overflow.push_back(std::move(result));
+    has_overflow.store(true, std::memory_order_release);
+    cv.notify_one();
+}
+
+bool server_response_channel::drained() const {
+    return !has_overflow.load(std::memory_order_acquire) &&
+        head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed);
+}
+
+server_task_result_ptr server_response_channel::pop_ready(bool locked) {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h != tail.load(std::memory_order_seq_cst)) {
+        server_task_result_ptr res(ring[h & (CAPACITY - 1)]);
+        head.store(h + 1, std::memory_order_release);
+        return res;
+    }
+
+    if (has_overflow.load(std::memory_order_acquire)) {
+        std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+        if (!locked) {
+            lock.lock();
+        }
+
+        if (!overflow.empty()) {
+            server_task_result_ptr res = std::move(overflow.front());
+            overflow.pop_front();
+            if (overflow.empty()) {
+                has_overflow.store(false, std::memory_order_release);
+            }
+            return res;
+        }
+    }
+
+    return nullptr;
+}
+
+server_task_result_ptr server_response_channel::pop(int64_t timeout_ms) {
+    server_task_result_ptr res = pop_ready(false);
+    if (res) {
+        return res;
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        waiting.store(true, std::memory_order_seq_cst);
+
+        res = pop_ready(true);
+        if (res || closed.load(std::memory_order_acquire)) {
+            break;
+        }
+
+        if (cv.wait_until(lock, deadline) == std::cv_status::timeout) {
+            res = pop_ready(true);
+            break;
+        }
+    }
+    waiting.store(false, std::memory_order_relaxed);
+
+    return res;
+}
+
+void server_response_channel::close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed.store(true, std::memory_order_release);
+    cv.notify_all();
+}
+
 //
 // server_response
 //
 
-void server_response::add_waiting_task_id(int id_task) {
-    RES_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+server_response_channel_ptr server_response::add_waiting_task_id(int id_task) {
+    RES_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) channels.size());
+
+    auto channel = std::make_shared<server_response_channel>();
 
     std::unique_lock<std::mutex> lock(mutex_results);
-    waiting_task_ids.insert(id_task);
+    channels[id_task] = channel;
+
+    return channel;
 }
 
-void server_response::add_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
+server_response_channel_ptr server_response::add_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
+    auto channel = std::make_shared<server_response_channel>();
+
     std::unique_lock<std::mutex> lock(mutex_results);
 
     for (const auto & id_task : id_tasks) {
-        RES_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
-        waiting_task_ids.insert(id_task);
+        RES_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) channels.size());
+        channels[id_task] = channel;
     }
+
+    return channel;
 }
 
 void server_response::remove_waiting_task_id(int id_task) {
-    RES_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+    RES_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) channels.size());
 
-    std::unique_lock<std::mutex> lock(mutex_results);
-    waiting_task_ids.erase(id_task);
-    // make sure to clean up all pending results
-    queue_results.erase(
-        std::remove_if(queue_results.begin(), queue_results.end(), [id_task](const server_task_result_ptr & res) {
-            return res->id == id_task;
-        }),
-        queue_results.end());
+    server_response_channel_ptr channel;
+    {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        auto it = channels.find(id_task);
+        if (it == channels.end()) {
+            return;
+        }
+        channel = std::move(it->second);
+        channels.erase(it);
+    }
+
+    // pending results are freed together with the channel, once the reader releases it
+    channel->detached.store(true, std::memory_order_release);
 }
 
 void server_response::remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
     std::unique_lock<std::mutex> lock(mutex_results);
 
     for (const auto & id_task : id_tasks) {
-        RES_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-        waiting_task_ids.erase(id_task);
+        RES_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) channels.size());
+
+        auto it = channels.find(id_task);
+        if (it == channels.end()) {
+            continue;
+        }
+        it->second->detached.store(true, std::memory_order_release);
+        channels.erase(it);
     }
 }
 
 server_task_result_ptr server_response::recv(const std::unordered_set<int> & id_tasks) {
     while (true) {
-        std::unique_lock<std::mutex> lock(mutex_results);
-        condition_results.wait(lock, [&]{
-            if (!running) {
-                RES_DBG("%s : queue result stop\n", "recv");
-                std::terminate(); // we cannot return here since the caller is HTTP code
-            }
-            return !queue_results.empty();
-        });
-
-        for (size_t i = 0; i < queue_results.size(); i++) {
-            if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                server_task_result_ptr res = std::move(queue_results[i]);
-                queue_results.erase(queue_results.begin() + i);
-                return res;
-            }
+        server_task_result_ptr res = recv_with_timeout(id_tasks, 60);
+        if (res) {
+            return res;
         }
     }
 
@@ -287,28 +408,36 @@ server_task_result_ptr server_response::recv(const std::unordered_set<int> & id_
 }
 
 server_task_result_ptr server_response::recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
-    while (true) {
+    server_response_channel_ptr channel;
+    {
         std::unique_lock<std::mutex> lock(mutex_results);
-
-        for (int i = 0; i < (int) queue_results.size(); i++) {
-            if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                server_task_result_ptr res = std::move(queue_results[i]);
-                queue_results.erase(queue_results.begin() + i);
-                return res;
+        for (const auto & id_task : id_tasks) {
+            auto it = channels.find(id_task);
+            if (it != channels.end()) {
+                channel = it->second;
+                break;
             }
         }
+    }
 
-        std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
-        if (!running) {
-            RES_DBG("%s : queue result stop\n", __func__);
-            std::terminate(); // we cannot return here since the caller is HTTP code
-        }
-        if (cr_res == std::cv_status::timeout) {
-            return nullptr;
-        }
+    if (!channel) {
+        // none of the tasks is waiting - nothing will ever arrive
+        std::this_thread::sleep_for(std::chrono::seconds(timeout));
+        return nullptr;
     }
 
-    // should never reach here
+    return recv_with_timeout(*channel, timeout);
+}
+
+server_task_result_ptr server_response::recv_with_timeout(server_response_channel & channel, int timeout) {
+    server_task_result_ptr res = channel.pop(int64_t(timeout) * 1000);
+
+    if (!running) {
+        RES_DBG("%s : queue result stop\n", __func__);
+        std::terminate(); // we cannot return here since the caller is HTTP code
+    }
+
+    return res;
 }
 
 server_task_result_ptr server_response::recv(int id_task) {
@@ -316,24 +445,96 @@ server_task_result_ptr server_response::recv(int id_task) {
     return recv(id_tasks);
 }
 
+void server_response::publish_staged(server_response_channel & channel) {
+    channel.n_staged = 0;
+    channel.push(std::move(channel.staged));
+}
+
 void server_response::send(server_task_result_ptr && result) {
     RES_DBG("sending result for task id = %d\n", result->id);
 
-    std::unique_lock<std::mutex> lock(mutex_results);
-    for (const auto & id_task : waiting_task_ids) {
-        if (result->id == id_task) {
-            RES_DBG("task id = %d pushed to result queue\n", result->id);
+    server_response_channel_ptr channel;
+    {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        auto it = channels.find(result->id);
+        if (it == channels.end()) {
+            return;
+        }
+        channel = it->second;
+    }
+
+    RES_DBG("task id = %d pushed to result queue\n", result->id);
 
-            queue_results.emplace_back(std::move(result));
-            condition_results.notify_all();
+    auto & staged = channel->staged;
+
+    if (n_coalesce > 1) {
+        auto * partial = dynamic_cast<server_task_result_cmpl_partial *>(result.get());
+
+        if (partial && partial->can_coalesce()) {
+            auto * prev = staged ? static_cast<server_task_result_cmpl_partial *>(staged.get()) : nullptr;
+
+            if (prev && prev->id == partial->id) {
+                prev->merge(std::move(*partial));
+
+                if (++channel->n_staged >= n_coalesce || channel->drained()) {
+                    publish_staged(*channel);
+                }
+                return;
+            }
+
+            if (staged) {
+                publish_staged(*channel);
+            }
+
+            // the reader is behind - hold the result back and merge the next tokens into it
+            if (!channel->drained()) {
+                staged = std::move(result);
+                channel->n_staged = 1;
+                if (!channel->listed) {
+                    channel->listed = true;
+                    channels_staged.push_back(std::move(channel));
+                }
+                return;
+            }
+
+            channel->push(std::move(result));
             return;
         }
     }
+
+    if (staged) {
+        publish_staged(*channel);
+    }
+
+    channel->push(std::move(result));
+}
+
+void server_response::flush() {
+    for (size_t i = 0; i < channels_staged.size();) {
+        auto & channel = *channels_staged[i];
+
+        if (channel.staged && !channel.detached.load(std::memory_order_acquire) && channel.drained()) {
+            publish_staged(channel);
+        }
+
+        if (!channel.staged || channel.detached.load(std::memory_order_acquire)) {
+            channel.staged.reset();
+            channel.listed = false;
+            channels_staged[i] = std::move(channels_staged.back());
+            channels_staged.pop_back();
+        } else {
+            ++i;
+        }
+    }
 }
 
 void server_response::terminate() {
     running = false;
-    condition_results.notify_all();
+
+    std::unique_lock<std::mutex> lock(mutex_results);
+    for (auto & it : channels) {
+        it.second->close();
+    }
 }
 
 //
@@ -346,7 +547,7 @@ void server_response_reader::post_task(server_task && task, bool front) {
     task.index = 0;
     id_tasks.insert(task.id);
     states.push_back(task.create_state());
-    queue_results.add_waiting_task_id(task.id);
+    channel = queue_results.add_waiting_task_id(task.id);
     queue_tasks.post(std::move(task), front);
 }
 
@@ -365,7 +566,7 @@ void server_response_reader::post_tasks(std::vector<server_task> && tasks, bool
         }
     }
     GGML_ASSERT(states.size() == id_tasks.size());
-    queue_results.add_waiting_task_ids(id_tasks);
+    channel = queue_results.add_waiting_task_ids(id_tasks);
     queue_tasks.post(std::move(tasks), front);
 }
 
@@ -377,7 +578,8 @@ bool server_response_reader::has_next() const {
 // note: if one error is received, it will stop further processing and return error result
 server_task_result_ptr server_response_reader::next(const std::function<bool()> & should_stop) {
     while (true) {
-        server_task_result_ptr result = queue_results.recv_with_timeout(id_tasks, polling_interval_seconds);
+        GGML_ASSERT(channel && "no task posted");
+        server_task_result_ptr result = queue_results.recv_with_timeout(*channel, polling_interval_seconds);
         if (result == nullptr) {
             // timeout, check stop condition
             if (should_stop()) {
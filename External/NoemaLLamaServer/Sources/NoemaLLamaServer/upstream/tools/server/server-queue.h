@@ -2,10 +2,15 @@
 
 #include "server-task.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <condition_variable>
 #include <deque>
+#include <memory>
 #include <mutex>
 #include <vector>
+#include <unordered_map>
 #include <unordered_set>
 
 // struct for managing server tasks
@@ -29,6 +34,7 @@ private:
     std::function<void(server_task &&)> callback_new_task;
     std::function<void(void)>           callback_update_slots;
     std::function<void(bool)>           callback_sleeping_state;
+    std::function<size_t(const std::deque<server_task> &)> callback_pick_deferred;
 
 public:
     // Add a new task to the end of the queue
@@ -44,7 +50,7 @@ public:
     int get_new_id();
 
     // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    // prioritize tasks that use the specified slot (otherwise, pop the first deferred task)
+    // prioritize tasks that use the specified slot (otherwise, the task chosen by callback_pick_deferred)
     void pop_deferred_task(int id_slot);
 
     // if sleeping, request exiting sleep state and wait until it is done
@@ -59,6 +65,9 @@ public:
     // end the start_loop routine
     void terminate();
 
+    // called from the loop: block until a new task is posted or the timeout expires
+    void wait_for_task(int64_t timeout_us);
+
     /**
      * Main loop consists of these steps:
      * - Wait until a new task arrives
@@ -95,6 +104,12 @@ public:
         callback_update_slots = std::move(callback);
     }
 
+    // Register the function that chooses which deferred task runs when a slot is released
+    // returns the index in the deferred queue (the first task if not set)
+    void on_pick_deferred(std::function<size_t(const std::deque<server_task> &)> callback) {
+        callback_pick_deferred = std::move(callback);
+    }
+
     // Register callback for sleeping state change; multiple callbacks are allowed
     // note: when entering sleeping state, the callback is called AFTER sleeping is set to true
     //       when leaving sleeping state, the callback is called BEFORE sleeping is set to false
@@ -114,26 +129,90 @@ private:
     void cleanup_pending_task(int id_target);
 };
 
+// single-producer/single-consumer channel carrying the results of the tasks of one reader
+// the producer is the thread that sends results (the slot loop), the consumer is the reader's HTTP thread
+// results go through a lock-free ring; the mutex is only taken to park an idle consumer or when the ring is full
+struct server_response_channel {
+    static constexpr size_t CAPACITY = 256; // must be a power of 2
+
+    server_response_channel() = default;
+    ~server_response_channel();
+
+    server_response_channel(const server_response_channel &) = delete;
+    server_response_channel & operator=(const server_response_channel &) = delete;
+
+    // producer side
+    void push(server_task_result_ptr && result);
+
+    // true if the consumer has taken everything that was pushed
+    bool drained() const;
+
+    // consumer side, returns nullptr on timeout or once the channel is closed
+    server_task_result_ptr pop(int64_t timeout_ms);
+
+    // wakes up the consumer for good
+    void close();
+
+    bool is_closed() const {
+        return closed.load(std::memory_order_acquire);
+    }
+
+    // set when the reader is gone; the producer drops its coalescing state for this channel
+    std::atomic<bool> detached{false};
+
+    // only touched by the producer: a partial result held back while the consumer is behind
+    server_task_result_ptr staged;
+    int32_t n_staged = 0;
+    bool    listed   = false; // in server_response::channels_staged
+
+private:
+    std::array<server_task_result *, CAPACITY> ring;
+
+    alignas(64) std::atomic<size_t> head{0}; // next slot the consumer reads
+    alignas(64) std::atomic<size_t> tail{0}; // next slot the producer writes
+
+    std::atomic<bool> has_overflow{false};
+    std::atomic<bool> waiting{false};
+    std::atomic<bool> closed{false};
+
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    // results pushed while the ring was full, in order, after everything in the ring
+    std::deque<server_task_result_ptr> overflow;
+
+    server_task_result_ptr pop_ready(bool locked);
+};
+
+using server_response_channel_ptr = std::shared_ptr<server_response_channel>;
+
 // struct for managing server responses
 // in most cases, use server_response_reader to retrieve results
+// each reader gets its own channel, so a result only wakes up the thread that waits for it
 struct server_response {
 private:
-    bool running = true;
+    std::atomic<bool> running{true};
 
     // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
-
-    // the main result queue (using ptr for polymorphism)
-    std::vector<server_task_result_ptr> queue_results;
+    std::unordered_map<int, server_response_channel_ptr> channels;
 
     std::mutex mutex_results;
-    std::condition_variable condition_results;
+
+    // max number of tokens merged into one partial result while a reader is behind (1 = no coalescing)
+    int32_t n_coalesce = 1;
+
+    // producer side: channels holding a staged partial result
+    std::vector<server_response_channel_ptr> channels_staged;
+
+    void publish_staged(server_response_channel & channel);
 
 public:
     // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task);
+    // the results of the task are delivered to the returned channel
+    server_response_channel_ptr add_waiting_task_id(int id_task);
 
-    void add_waiting_task_ids(const std::unordered_set<int> & id_tasks);
+    // all of the tasks share one channel
+    server_response_channel_ptr add_waiting_task_ids(const std::unordered_set<int> & id_tasks);
 
     // when the request is finished, we can remove task associated with it
     void remove_waiting_task_id(int id_task);
@@ -148,12 +227,24 @@ public:
     // if timeout is reached, nullptr is returned
     server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout);
 
+    // same as recv_with_timeout(), on the channel returned by add_waiting_task_id(s)
+    server_task_result_ptr recv_with_timeout(server_response_channel & channel, int timeout);
+
     // single-task version of recv()
     server_task_result_ptr recv(int id_task);
 
     // Send a new result to a waiting id_task
     void send(server_task_result_ptr && result);
 
+    // publish the staged partial results whose readers have caught up
+    // called by the producer once per update of the slots
+    void flush();
+
+    // must be called before any result is sent
+    void set_coalesce(int32_t n_tokens) {
+        n_coalesce = std::max(1, n_tokens);
+    }
+
     // terminate the waiting loop
     void terminate();
 };
@@ -165,6 +256,7 @@ struct server_response_reader {
     std::unordered_set<int> id_tasks;
     server_queue & queue_tasks;
     server_response & queue_results;
+    server_response_channel_ptr channel;
     size_t received_count = 0;
     bool cancelled = false;
     int polling_interval_seconds;
@@ -0,0 +1,501 @@
+#include "server-schedule.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+//
+// policies
+//
+
+struct server_sched_policy_fifo : server_sched_policy {
+    const char * name() const override { return "fifo"; }
+
+    int compare(const server_sched_task & a, const server_sched_task & b) const override {
+        if (a.t_queued_us != b.t_queued_us) {
+            return a.t_queued_us < b.t_queued_us ? -1 : 1;
+        }
+        return 0;
+    }
+};
+
+struct server_sched_policy_cache : server_sched_policy {
+    const char * name() const override { return "cache"; }
+
+    bool need_reuse() const override { return true; }
+
+    int compare(const server_sched_task & a, const server_sched_task & b) const override {
+        if (a.n_reuse != b.n_reuse) {
+            return a.n_reuse > b.n_reuse ? -1 : 1;
+        }
+        return 0;
+    }
+};
+
+struct server_sched_policy_shortest : server_sched_policy {
+    const char * name() const override { return "shortest"; }
+
+    bool need_reuse() const override { return true; }
+
+    int compare(const server_sched_task & a, const server_sched_task & b) const override {
+        const size_t n_a = a.tokens->size() - a.n_reuse;
+        const size_t n_b = b.tokens->size() - b.n_reuse;
+        if (n_a != n_b) {
+            return n_a < n_b ? -1 : 1;
+        }
+        return 0;
+    }
+};
+
+struct server_sched_policy_fair : server_sched_policy {
+    // the usage of a key halves every this many seconds
+    static constexpr double t_half_life_s = 60.0;
+
+    struct usage {
+        double  n_tokens = 0.0;
+        int64_t t_us     = 0;
+    };
+
+    std::unordered_map<std::string, usage> usages;
+
+    // decayed usage at the time of the last prepare()
+    std::unordered_map<std::string, double> cur;
+
+    const char * name() const override { return "fair"; }
+
+    static double decay(const usage & u, int64_t t_now_us) {
+        return u.n_tokens*std::exp2(-double(t_now_us - u.t_us)/(t_half_life_s*1e6));
+    }
+
+    void prepare(int64_t t_now_us) override {
+        cur.clear();
+
+        for (auto it = usages.begin(); it != usages.end(); ) {
+            const double n = decay(it->second, t_now_us);
+            if (n < 1.0) {
+                // forget idle keys
+                it = usages.erase(it);
+                continue;
+            }
+            cur[it->first] = n;
+            ++it;
+        }
+    }
+
+    double get(const std::string & key) const {
+        const auto it = cur.find(key);
+        return it == cur.end() ? 0.0 : it->second;
+    }
+
+    // the usage of a sub-key is tracked under the key, so that new sub-keys do not add to the share of a key
+    static std::string sub_usage_key(const std::string & key, const std::string & sub_key) {
+        return key + '\0' + sub_key;
+    }
+
+    int compare(const server_sched_task & a, const server_sched_task & b) const override {
+        double n_a;
+        double n_b;
+        if (a.key != b.key) {
+            n_a = get(a.key);
+            n_b = get(b.key);
+        } else if (a.sub_key != b.sub_key) {
+            n_a = get(sub_usage_key(a.key, a.sub_key));
+            n_b = get(sub_usage_key(b.key, b.sub_key));
+        } else {
+            return 0;
+        }
+        if (n_a != n_b) {
+            return n_a < n_b ? -1 : 1;
+        }
+        return 0;
+    }
+
+    void add(const std::string & key, size_t n_tokens, int64_t t_now_us) {
+        auto & u = usages[key];
+
+        u.n_tokens = decay(u, t_now_us) + n_tokens;
+        u.t_us     = t_now_us;
+    }
+
+    void on_launch(const std::string & key, const std::string & sub_key, size_t n_tokens, int64_t t_now_us) override {
+        add(key, n_tokens, t_now_us);
+        if (!sub_key.empty()) {
+            add(sub_usage_key(key, sub_key), n_tokens, t_now_us);
+        }
+    }
+};
+
+struct server_sched_policy_priority : server_sched_policy {
+    const char * name() const override { return "priority"; }
+
+    int compare(const server_sched_task & a, const server_sched_task & b) const override {
+        if (a.priority != b.priority) {
+            return a.priority > b.priority ? -1 : 1;
+        }
+        return 0;
+    }
+};
+
+server_sched_policy_ptr server_sched_policy_init(const std::string & name) {
+    if (name == "fifo")     return std::make_unique<server_sched_policy_fifo>();
+    if (name == "cache")    return std::make_unique<server_sched_policy_cache>();
+    if (name == "shortest") return std::make_unique<server_sched_policy_shortest>();
+    if (name == "fair")     return std::make_unique<server_sched_policy_fair>();
+    if (name == "priority") return std::make_unique<server_sched_policy_priority>();
+
+    return nullptr;
+}
+
+std::string server_sched_policy_names() {
+    return "fifo, cache, shortest, fair, priority";
+}
+
+//
+// server_scheduler
+//
+
+bool server_scheduler::init(const std::string & names) {
+    policies.clear();
+
+    for (const auto & name : string_split<std::string>(names, ',')) {
+        if (name.empty()) {
+            continue;
+        }
+
+        auto policy = server_sched_policy_init(name);
+        if (!policy) {
+            return false;
+        }
+
+        add_policy(std::move(policy));
+    }
+
+    return true;
+}
+
+void server_scheduler::add_policy(server_sched_policy_ptr policy) {
+    policies.push_back(std::move(policy));
+}
+
+std::string server_scheduler::name() const {
+    std::string res;
+    for (const auto & policy : policies) {
+        if (!res.empty()) {
+            res += ",";
+        }
+        res += policy->name();
+    }
+    return res.empty() ? "fifo" : res;
+}
+
+server_scheduler::slot_choice server_scheduler::select_slot(const server_tokens & tokens, const std::vector<server_sched_slot> & slots) const {
+    slot_choice res;
+
+    // find the slot that has at least n% prompt similarity
+    if (slot_prompt_similarity != 0.0f && !tokens.empty()) {
+        float sim_best = 0;
+
+        for (size_t i = 0; i < slots.size(); ++i) {
+            const auto & slot = slots[i];
+
+            // skip the slot if it is not available or does not contain cached tokens
+            if (!slot.available || slot.tokens == nullptr || slot.tokens->empty()) {
+                continue;
+            }
+
+            // fraction of the Longest Common Prefix length with respect to the input prompt length
+            const float sim_cur = float(slot.tokens->get_common_prefix(tokens)) / tokens.size();
+
+            // select the current slot if the criteria match
+            if (sim_cur > sim_best && sim_cur > slot_prompt_similarity) {
+                sim_best = sim_cur;
+
+                res.idx = i;
+            }
+        }
+
+        if (res.idx != -1) {
+            res.sim    = sim_best;
+            res.by_lcp = true;
+
+            return res;
+        }
+    }
+
+    // find the slot that has been least recently used
+    int64_t t_last = -1;
+
+    for (size_t i = 0; i < slots.size(); ++i) {
+        const auto & slot = slots[i];
+
+        if (!slot.available) {
+            continue;
+        }
+
+        if (res.idx == -1 || slot.t_last_used <= t_last) {
+            t_last  = slot.t_last_used;
+            res.idx = i;
+        }
+    }
+
+    return res;
+}
+
+int server_scheduler::pick(std::vector<server_sched_task> & tasks, const std::vector<server_sched_slot> & slots, int64_t t_now_us) {
+    bool need_reuse = false;
+    for (auto & policy : policies) {
+        policy->prepare(t_now_us);
+        need_reuse = need_reuse || policy->need_reuse();
+    }
+
+    const auto find_slot = [&](int id_slot) -> const server_sched_slot * {
+        for (const auto & slot : slots) {
+            if (slot.id == id_slot) {
+                return &slot;
+            }
+        }
+        return nullptr;
+    };
+
+    const auto reuse = [](const server_sched_slot & slot, const server_sched_task & task) -> size_t {
+        if (!slot.available || slot.tokens == nullptr || task.tokens == nullptr) {
+            return 0;
+        }
+        return slot.tokens->get_common_prefix(*task.tokens);
+    };
+
+    bool any_available = false;
+    for (const auto & slot : slots) {
+        any_available = any_available || slot.available;
+    }
+
+    const int64_t t_max_wait_us = max_wait_ms < 0 ? -1 : max_wait_ms*1000;
+
+    int  best          = -1;
+    bool best_starving = false;
+
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        auto & task = tasks[i];
+
+        task.n_reuse = 0;
+
+        // a task that requested a busy slot has to keep waiting
+        if (task.id_slot != -1) {
+            const auto * slot = find_slot(task.id_slot);
+            if (slot == nullptr || !slot->available) {
+                continue;
+            }
+            if (need_reuse) {
+                task.n_reuse = reuse(*slot, task);
+            }
+        } else {
+            if (!any_available) {
+                continue;
+            }
+            if (need_reuse) {
+                for (const auto & slot : slots) {
+                    task.n_reuse = std::max(task.n_reuse, reuse(slot, task));
+                }
+            }
+        }
+
+        const bool starving = t_max_wait_us >= 0 && t_now_us - task.t_queued_us > t_max_wait_us;
+
+        if (best == -1) {
+            best          = i;
+            best_starving = starving;
+            continue;
+        }
+
+        const auto & cur = tasks[best];
+
+        if (starving != best_starving) {
+            if (starving) {
+                best          = i;
+                best_starving = true;
+            }
+            continue;
+        }
+
+        int cmp = 0;
+        if (!starving) {
+            for (const auto & policy : policies) {
+                cmp = policy->compare(task, cur);
+                if (cmp != 0) {
+                    break;
+                }
+            }
+        }
+
+        // FIFO for the rest
+        if (cmp == 0 && task.t_queued_us != cur.t_queued_us) {
+            cmp = task.t_queued_us < cur.t_queued_us ? -1 : 1;
+        }
+
+        if (cmp < 0) {
+            best          = i;
+            best_starving = starving;
+        }
+    }
+
+    return best;
+}
+
+void server_scheduler::on_launch(const std::string & key, const std::string & sub_key, size_t n_tokens, int64_t t_now_us) {
+    for (auto & policy : policies) {
+        policy->on_launch(key, sub_key, n_tokens, t_now_us);
+    }
+}
+
+//
+// server_prefill_budget
+//
+
+void server_prefill_budget::init(int32_t n_batch, int32_t n_budget, double t_target_ms) {
+    this->n_max       = n_budget > 0 ? std::min(n_budget, n_batch) : n_batch;
+    this->t_target_ms = t_target_ms;
+
+    n_cur = n_max;
+
+    stats = {};
+    stats.n_budget = n_cur;
+}
+
+int32_t server_prefill_budget::get(int32_t n_decode) const {
+    // nobody waits for a token - no reason to hold the prompt back
+    if (n_decode == 0) {
+        return INT32_MAX;
+    }
+
+    return n_cur;
+}
+
+void server_prefill_budget::update(int32_t n_decode, int32_t n_prefill, bool limited, double t_step_ms) {
+    // weight of a new measurement
+    static constexpr double alpha = 0.2;
+
+    const auto ema = [](double cur, double x) {
+        return cur > 0.0 ? cur + alpha*(x - cur) : x;
+    };
+
+    stats.n_steps++;
+    stats.n_steps_limited  += limited;
+    stats.n_prefill_tokens += n_prefill;
+    stats.n_decode_tokens  += n_decode;
+    stats.n_prefill_last    = n_prefill;
+    stats.n_decode_last     = n_decode;
+    stats.t_step_last_ms    = t_step_ms;
+
+    if (n_prefill == 0) {
+        if (n_decode > 0) {
+            stats.t_decode_ms = ema(stats.t_decode_ms, t_step_ms);
+        }
+    } else {
+        // without a decode estimate yet, the whole step is attributed to the prompt
+        const double t_prefill_ms = n_decode > 0 ? std::max(0.0, t_step_ms - stats.t_decode_ms) : t_step_ms;
+
+        stats.t_token_ms = ema(stats.t_token_ms, t_prefill_ms/n_prefill);
+    }
+
+    if (t_target_ms > 0.0 && stats.t_token_ms > 0.0) {
+        const double n = (t_target_ms - stats.t_decode_ms)/stats.t_token_ms;
+
+        n_cur = (int32_t) std::max<double>(std::min(N_MIN, n_max), std::min<double>(n_max, n));
+    }
+
+    stats.n_budget = n_cur;
+}
+
+//
+// server_embd_batcher
+//
+
+void server_embd_batcher::init(int32_t t_window_ms, int32_t n_tokens_max, int32_t n_seq_max) {
+    this->t_window_us  = t_window_ms < 0 ? -1 : (int64_t) t_window_ms*1000;
+    this->n_tokens_max = n_tokens_max;
+    this->n_seq_max    = std::min<int32_t>(n_seq_max, llama_max_parallel_sequences());
+}
+
+void server_embd_batcher::push(server_task && task, int64_t t_now_us) {
+    n_tokens_pending += task.tokens.size();
+
+    pending.push_back({ std::move(task), t_now_us });
+}
+
+bool server_embd_batcher::cancel(int id_task) {
+    for (auto it = pending.begin(); it != pending.end(); ++it) {
+        if (it->task.id == id_task) {
+            n_tokens_pending -= it->task.tokens.size();
+            pending.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool server_embd_batcher::ready(int64_t t_now_us) const {
+    if (pending.empty()) {
+        return false;
+    }
+
+    return
+        t_wait_us(t_now_us) == 0 ||
+        n_tokens_pending >= n_tokens_max ||
+        (int32_t) pending.size() >= n_seq_max;
+}
+
+int64_t server_embd_batcher::t_wait_us(int64_t t_now_us) const {
+    if (pending.empty()) {
+        return 0;
+    }
+
+    return std::max<int64_t>(0, pending.front().t_queued_us + t_window_us - t_now_us);
+}
+
+std::vector<server_task> server_embd_batcher::take(int64_t t_now_us) {
+    std::vector<server_task> res;
+
+    if (pending.empty()) {
+        return res;
+    }
+
+    const server_task_type type = pending.front().task.type;
+    const auto         lora     = pending.front().task.params.lora;
+
+    int32_t n_tokens = 0;
+
+    // the oldest input always runs - the caller makes sure that a single input fits
+    for (auto it = pending.begin(); it != pending.end() && (int32_t) res.size() < n_seq_max; ) {
+        const int32_t n_tokens_cur = it->task.tokens.size();
+
+        const bool fits = res.empty() || (
+                it->task.type == type &&
+                it->task.params.lora == lora &&
+                n_tokens + n_tokens_cur <= n_tokens_max);
+
+        if (!fits) {
+            ++it;
+            continue;
+        }
+
+        n_tokens         += n_tokens_cur;
+        n_tokens_pending -= n_tokens_cur;
+
+        stats.t_wait_us += t_now_us - it->t_queued_us;
+
+        res.push_back(std::move(it->task));
+        it = pending.erase(it);
+    }
+
+    stats.n_batches++;
+    stats.n_inputs += res.size();
+    stats.n_tokens += n_tokens;
+
+    return res;
+}
+
+server_embd_batch_stats server_embd_batcher::get_stats() const {
+    server_embd_batch_stats res = stats;
+    res.n_pending = pending.size();
+    return res;
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "server-common.h"
+#include "server-task.h"
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// slot scheduling: which slot a new task goes to, and which deferred task runs when a slot is released
+//
+// the deferred tasks are ordered by a list of policies in order of precedence, e.g. "priority,cache" runs the highest
+// priority class first, and among equals the task that reuses the longest cached prefix. remaining ties are FIFO.
+// a task that waited longer than max_wait_ms goes ahead of all others, so that no policy can starve it
+
+// a slot, as seen by the scheduler
+struct server_sched_slot {
+    int id = -1;
+
+    bool available = false;
+
+    const server_tokens * tokens = nullptr; // cached prompt of the slot
+
+    int64_t t_last_used = -1;
+};
+
+// a task waiting for a slot, as seen by the scheduler
+struct server_sched_task {
+    int id      = -1;
+    int id_slot = -1; // requested slot, -1 = any
+
+    const server_tokens * tokens = nullptr;
+
+    std::string key;          // fair share key: the API key
+    std::string sub_key;      // fair share within the key: the "user" field
+    int32_t     priority = 0; // higher runs first, within [-task_params::PRIORITY_MAX, task_params::PRIORITY_MAX]
+
+    int64_t t_queued_us = 0;
+
+    // filled by the scheduler: longest common prefix with the cached prompt of an available slot
+    size_t n_reuse = 0;
+};
+
+struct server_sched_policy {
+    virtual ~server_sched_policy() = default;
+
+    virtual const char * name() const = 0;
+
+    // whether compare() uses server_sched_task::n_reuse
+    virtual bool need_reuse() const { return false; }
+
+    // called before the tasks are compared
+    virtual void prepare(int64_t t_now_us) { GGML_UNUSED(t_now_us); }
+
+    // < 0 if a should run before b, > 0 if b should run first, 0 if the policy has no preference
+    virtual int compare(const server_sched_task & a, const server_sched_task & b) const = 0;
+
+    // called when a task is assigned a slot
+    virtual void on_launch(const std::string & key, const std::string & sub_key, size_t n_tokens, int64_t t_now_us) {
+        GGML_UNUSED(key);
+        GGML_UNUSED(sub_key);
+        GGML_UNUSED(n_tokens);
+        GGML_UNUSED(t_now_us);
+    }
+};
+
+using server_sched_policy_ptr = std::unique_ptr<server_sched_policy>;
+
+// available policies:
+//   fifo     - order of arrival
+//   cache    - longest prefix reused from the cached prompt of an available slot first
+//   shortest - fewest prompt tokens left to process first
+//   fair     - least recent usage (decayed prompt tokens) per fair share key first, then per sub-key within a key
+//   priority - highest priority class first
+// returns nullptr for an unknown name
+server_sched_policy_ptr server_sched_policy_init(const std::string & name);
+
+// comma separated list of the available policies
+std::string server_sched_policy_names();
+
+struct server_scheduler {
+    struct slot_choice {
+        int   idx    = -1;    // index in the slot list, -1 if no slot is available
+        float sim    = 0.0f;  // similarity with the cached prompt, if selected by LCP
+        bool  by_lcp = false; // false if selected by LRU
+    };
+
+    // the tasks that waited longer than this run first, in order of arrival (-1 = no limit)
+    int64_t max_wait_ms = -1;
+
+    // how much the prompt of a task must match the cached prompt of a slot to select the slot by LCP (0 = disabled)
+    float slot_prompt_similarity = 0.0f;
+
+    // comma separated list of policies, in order of precedence
+    // returns false if a policy is unknown
+    bool init(const std::string & policies);
+
+    void add_policy(server_sched_policy_ptr policy);
+
+    std::string name() const;
+
+    // choose an available slot for a new task:
+    // the slot with the most similar cached prompt, otherwise the least recently used one
+    slot_choice select_slot(const server_tokens & tokens, const std::vector<server_sched_slot> & slots) const;
+
+    // index of the deferred task to run next, -1 if none of them can run on the available slots
+    int pick(std::vector<server_sched_task> & tasks, const std::vector<server_sched_slot> & slots, int64_t t_now_us);
+
+    void on_launch(const std::string & key, const std::string & sub_key, size_t n_tokens, int64_t t_now_us);
+
+private:
+    std::vector<server_sched_policy_ptr> policies;
+};
+
+// budget of prompt tokens that may share a batch with the generating slots (chunked prefill)
+//
+// a long prompt would otherwise fill every batch up to n_batch, and each generating slot waits for the whole batch for
+// its next token. the budget caps the prompt tokens of a step that also decodes; steps without generating slots still
+// use the full n_batch. with a target inter-token latency, the budget follows the measured cost of the steps:
+//   n_budget = (t_target - t_decode)/t_token
+// where t_decode is the time of a step without prompt tokens and t_token the extra time per prompt token
+struct server_prefill_budget {
+    static constexpr int32_t N_MIN = 64; // the prompt always progresses by at least this many tokens per step
+
+    int32_t n_max       = 0;   // cap of the budget
+    double  t_target_ms = 0.0; // target inter-token latency, 0 = fixed budget
+
+    // n_batch     - the batch size
+    // n_budget    - max prompt tokens per step next to generating slots (0 = n_batch)
+    // t_target_ms - target inter-token latency in ms (0 = keep the budget at n_budget)
+    void init(int32_t n_batch, int32_t n_budget, double t_target_ms);
+
+    // the number of prompt tokens that can join a batch with n_decode tokens of generating slots
+    int32_t get(int32_t n_decode) const;
+
+    // record a step: its prompt and decode tokens, whether the budget held tokens back, and its duration
+    void update(int32_t n_decode, int32_t n_prefill, bool limited, double t_step_ms);
+
+    const server_prefill_stats & get_stats() const { return stats; }
+
+private:
+    int32_t n_cur = 0;
+
+    server_prefill_stats stats;
+};
+
+// micro-batching of the embedding and rerank inputs of concurrent requests
+//
+// without a KV cache every input is evaluated whole in a single encoder pass and keeps no state afterwards, so the
+// inputs of different requests can share one pass with a distinct sequence id each. a burst of small requests would
+// otherwise run in passes of at most one input per slot, leaving most of the batch empty. the inputs wait in order of
+// arrival until the oldest one waited for the window, or until they fill a batch
+struct server_embd_batcher {
+    int64_t t_window_us  = -1; // -1 = disabled
+    int32_t n_tokens_max = 0;  // tokens per batch
+    int32_t n_seq_max    = 0;  // inputs per batch
+
+    // t_window_ms  - max time the oldest input waits for others (0 = take the queued inputs right away, -1 = disabled)
+    // n_tokens_max - tokens that fit in one encoder pass (n_ubatch)
+    // n_seq_max    - sequences that fit in one encoder pass, at most llama_max_parallel_sequences()
+    void init(int32_t t_window_ms, int32_t n_tokens_max, int32_t n_seq_max);
+
+    bool enabled() const { return t_window_us >= 0; }
+    bool empty()   const { return pending.empty(); }
+
+    void push(server_task && task, int64_t t_now_us);
+
+    // drop a pending input, returns false if it is not pending
+    bool cancel(int id_task);
+
+    // whether the pending inputs should run now: the window of the oldest one is over, or they fill a batch
+    bool ready(int64_t t_now_us) const;
+
+    // time until the window of the oldest input is over
+    int64_t t_wait_us(int64_t t_now_us) const;
+
+    // the inputs of the next batch: the oldest one, and the following ones of the same type and adapters that fit
+    std::vector<server_task> take(int64_t t_now_us);
+
+    server_embd_batch_stats get_stats() const;
+
+private:
+    struct entry {
+        server_task task;
+        int64_t     t_queued_us;
+    };
+
+    std::deque<entry> pending;
+
+    int32_t n_tokens_pending = 0;
+
+    server_embd_batch_stats stats;
+};
@@ -0,0 +1,565 @@
+#include "server-slot-io.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// compressed slot file:
+//   u32 magic, u32 version, u64 size of the uncompressed file
+//   blocks: u32 uncompressed size, u32 stored size, data - a block that does not compress is stored as is
+static constexpr uint32_t SLOT_FILE_MAGIC_LZ4   = 0x6c7a7371u; // 'lzsq'
+static constexpr uint32_t SLOT_FILE_VERSION_LZ4 = 1;
+static constexpr size_t   SLOT_FILE_BLOCK       = 4u << 20;
+
+//
+// LZ4 block format
+//
+
+static constexpr size_t LZ4_MIN_MATCH     = 4;
+static constexpr size_t LZ4_LAST_LITERALS = 5;  // the data ends with at least this many literals
+static constexpr size_t LZ4_MF_LIMIT      = 12; // the last match starts at least this many bytes before the end
+static constexpr size_t LZ4_MAX_OFFSET    = 65535;
+static constexpr int    LZ4_HASH_LOG      = 16;
+
+static uint32_t read_u32(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read_u64(const uint8_t * p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz4_hash(uint32_t v) {
+    return (v*2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static void lz4_put_len(uint8_t *& op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t) len;
+}
+
+size_t server_lz4_compress_bound(size_t n) {
+    return n + n/255 + 16;
+}
+
+size_t server_lz4_compress(const uint8_t * src, size_t n, uint8_t * dst) {
+    uint8_t * op = dst;
+
+    size_t anchor = 0;
+
+    // n_match = 0 for the literals at the end
+    const auto put_seq = [&](size_t n_lit, size_t offset, size_t n_match) {
+        const size_t n_ml = n_match > 0 ? n_match - LZ4_MIN_MATCH : 0;
+
+        *op++ = (uint8_t) ((std::min<size_t>(n_lit, 15) << 4) | std::min<size_t>(n_ml, 15));
+        if (n_lit >= 15) {
+            lz4_put_len(op, n_lit - 15);
+        }
+
+        if (n_lit > 0) {
+            memcpy(op, src + anchor, n_lit);
+            op += n_lit;
+        }
+
+        if (n_match > 0) {
+            *op++ = (uint8_t) (offset & 0xff);
+            *op++ = (uint8_t) (offset >> 8);
+            if (n_ml >= 15) {
+                lz4_put_len(op, n_ml - 15);
+            }
+        }
+    };
+
+    if (n > LZ4_MF_LIMIT) {
+        std::vector<uint32_t> table(1 << LZ4_HASH_LOG, 0);
+
+        const size_t ip_end    = n - LZ4_MF_LIMIT;
+        const size_t match_end = n - LZ4_LAST_LITERALS;
+
+        size_t ip = 0;
+        while (ip < ip_end) {
+            const uint32_t seq = read_u32(src + ip);
+            const uint32_t h   = lz4_hash(seq);
+            const size_t   ref = table[h];
+
+            table[h] = (uint32_t) ip;
+
+            if (ref < ip && ip - ref <= LZ4_MAX_OFFSET && read_u32(src + ref) == seq) {
+                size_t len = LZ4_MIN_MATCH;
+                while (ip + len + 8 <= match_end && memcmp(src + ref + len, src + ip + len, 8) == 0) {
+                    len += 8;
+                }
+                while (ip + len < match_end && src[ref + len] == src[ip + len]) {
+                    len++;
+                }
+
+                put_seq(ip - anchor, ip - ref, len);
+
+                ip    += len;
+                anchor = ip;
+                continue;
+            }
+
+            // move faster through data that does not compress
+            ip += 1 + ((ip - anchor) >> 6);
+        }
+    }
+
+    put_seq(n - anchor, 0, 0);
+
+    return op - dst;
+}
+
+int64_t server_lz4_decompress(const uint8_t * src, size_t n, uint8_t * dst, size_t n_dst) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    const auto get_len = [&](size_t & len) {
+        uint8_t b;
+        do {
+            if (ip >= n) {
+                return false;
+            }
+            b = src[ip++];
+            len += b;
+        } while (b == 255);
+        return true;
+    };
+
+    while (ip < n) {
+        const uint8_t token = src[ip++];
+
+        size_t n_lit = token >> 4;
+        if (n_lit == 15 && !get_len(n_lit)) {
+            return -1;
+        }
+        if (n_lit > n - ip || n_lit > n_dst - op) {
+            return -1;
+        }
+
+        if (n_lit > 0) {
+            memcpy(dst + op, src + ip, n_lit);
+            ip += n_lit;
+            op += n_lit;
+        }
+
+        // the last sequence has only literals
+        if (ip == n) {
+            break;
+        }
+
+        if (n - ip < 2) {
+            return -1;
+        }
+
+        const size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+
+        size_t n_match = token & 15;
+        if (n_match == 15 && !get_len(n_match)) {
+            return -1;
+        }
+        n_match += LZ4_MIN_MATCH;
+
+        if (n_match > n_dst - op) {
+            return -1;
+        }
+
+        const uint8_t * ref = dst + op - offset;
+        if (offset >= n_match) {
+            memcpy(dst + op, ref, n_match);
+        } else {
+            // the match overlaps the output - repeat the last offset bytes
+            for (size_t i = 0; i < n_match; ++i) {
+                dst[op + i] = ref[i];
+            }
+        }
+        op += n_match;
+    }
+
+    return op;
+}
+
+//
+// server_slot_state
+//
+
+server_slot_state::~server_slot_state() {
+    release();
+}
+
+bool server_slot_state::write(const std::string & path, bool compress) {
+    const std::string path_tmp = path + ".tmp";
+
+    FILE * f = fopen(path_tmp.c_str(), "wb");
+    if (f == nullptr) {
+        error = "failed to open " + path_tmp;
+        return false;
+    }
+
+    // the header of llama_state_seq_save_file()
+    std::vector<uint8_t> head(3*sizeof(uint32_t) + tokens.size()*sizeof(llama_token));
+    {
+        const uint32_t hdr[3] = { LLAMA_STATE_SEQ_MAGIC, LLAMA_STATE_SEQ_VERSION, (uint32_t) tokens.size() };
+
+        memcpy(head.data(), hdr, sizeof(hdr));
+        if (!tokens.empty()) {
+            memcpy(head.data() + sizeof(hdr), tokens.data(), tokens.size()*sizeof(llama_token));
+        }
+    }
+
+    bool   ok        = true;
+    size_t n_written = 0;
+
+    const auto put = [&](const void * src, size_t n) {
+        ok = ok && fwrite(src, 1, n, f) == n;
+        n_written += n;
+    };
+
+    if (!compress) {
+        put(head.data(), head.size());
+        put(buf.data(),  buf.size());
+    } else {
+        const uint64_t n_raw = head.size() + buf.size();
+
+        const uint32_t hdr[2] = { SLOT_FILE_MAGIC_LZ4, SLOT_FILE_VERSION_LZ4 };
+        put(hdr,    sizeof(hdr));
+        put(&n_raw, sizeof(n_raw));
+
+        std::vector<uint8_t> block;
+        std::vector<uint8_t> out(server_lz4_compress_bound(SLOT_FILE_BLOCK));
+
+        // the blocks cover the header followed by the state
+        for (size_t pos = 0; pos < n_raw && ok; ) {
+            const size_t n_block = std::min<size_t>(SLOT_FILE_BLOCK, n_raw - pos);
+
+            const uint8_t * src = nullptr;
+            if (pos + n_block <= head.size()) {
+                src = head.data() + pos;
+            } else if (pos >= head.size()) {
+                src = buf.data() + (pos - head.size());
+            } else {
+                block.assign(head.begin() + pos, head.end());
+                block.insert(block.end(), buf.begin(), buf.begin() + (n_block - block.size()));
+                src = block.data();
+            }
+
+            const size_t n_comp = server_lz4_compress(src, n_block, out.data());
+            const bool   stored = n_comp >= n_block;
+
+            const uint32_t bhdr[2] = { (uint32_t) n_block, (uint32_t) (stored ? n_block : n_comp) };
+            put(bhdr, sizeof(bhdr));
+            put(stored ? src : out.data(), bhdr[1]);
+
+            pos += n_block;
+        }
+    }
+
+    ok = fclose(f) == 0 && ok;
+
+    if (ok) {
+        std::error_code ec;
+        std::filesystem::rename(path_tmp, path, ec);
+        if (ec) {
+            error = "failed to rename " + path_tmp + ": " + ec.message();
+            ok = false;
+        }
+    } else {
+        error = "failed to write " + path_tmp;
+    }
+
+    if (!ok) {
+        std::remove(path_tmp.c_str());
+        return false;
+    }
+
+    n_file_bytes = n_written;
+    compressed   = compress;
+
+    return true;
+}
+
+bool server_slot_state::read(const std::string & path) {
+    release();
+
+    const uint8_t * src = nullptr;
+    size_t          n   = 0;
+
+#if defined(_WIN32)
+    std::vector<uint8_t> file;
+    {
+        FILE * f = fopen(path.c_str(), "rb");
+        if (f == nullptr) {
+            error = "failed to open " + path;
+            return false;
+        }
+
+        uint8_t tmp[1 << 16];
+        for (size_t n_read; (n_read = fread(tmp, 1, sizeof(tmp), f)) > 0; ) {
+            file.insert(file.end(), tmp, tmp + n_read);
+        }
+        fclose(f);
+    }
+    src = file.data();
+    n   = file.size();
+#else
+    {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error = "failed to open " + path;
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            close(fd);
+            error = "failed to read " + path;
+            return false;
+        }
+
+        void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (addr == MAP_FAILED) {
+            error = "failed to map " + path;
+            return false;
+        }
+
+        posix_madvise(addr, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+        map_addr = addr;
+        map_size = st.st_size;
+    }
+    src = (const uint8_t *) map_addr;
+    n   = map_size;
+#endif
+
+    n_file_bytes = n;
+
+    if (n >= 4*sizeof(uint32_t) && read_u32(src) == SLOT_FILE_MAGIC_LZ4) {
+        if (read_u32(src + 4) != SLOT_FILE_VERSION_LZ4) {
+            error = "unknown version of compressed slot file";
+            release();
+            return false;
+        }
+
+        const uint64_t n_raw = read_u64(src + 8);
+
+        // the block headers must add up to n_raw and cover the file before anything is allocated
+        {
+            uint64_t n_sum = 0;
+
+            size_t ip = 16;
+            while (n - ip >= 2*sizeof(uint32_t)) {
+                const size_t n_block = read_u32(src + ip);
+                const size_t n_comp  = read_u32(src + ip + 4);
+                ip += 2*sizeof(uint32_t);
+
+                // LZ4 cannot compress by more than a factor of 255
+                if (n_block > SLOT_FILE_BLOCK || n_comp > n - ip || n_block > 255*(uint64_t) n_comp) {
+                    break;
+                }
+
+                n_sum += n_block;
+                ip    += n_comp;
+            }
+
+            if (ip != n || n_sum != n_raw) {
+                error = "invalid compressed slot file";
+                release();
+                return false;
+            }
+        }
+
+        std::vector<uint8_t> raw(n_raw);
+
+        size_t ip = 16;
+        size_t op = 0;
+        while (ip < n) {
+            if (n - ip < 2*sizeof(uint32_t)) {
+                break;
+            }
+
+            const size_t n_block = read_u32(src + ip);
+            const size_t n_comp  = read_u32(src + ip + 4);
+            ip += 2*sizeof(uint32_t);
+
+            if (n_comp > n - ip || n_block > n_raw - op) {
+                break;
+            }
+
+            if (n_comp == n_block) {
+                memcpy(raw.data() + op, src + ip, n_block);
+            } else if (server_lz4_decompress(src + ip, n_comp, raw.data() + op, n_block) != (int64_t) n_block) {
+                break;
+            }
+
+            ip += n_comp;
+            op += n_block;
+        }
+
+        if (ip != n || op != n_raw) {
+            error = "invalid compressed slot file";
+            release();
+            return false;
+        }
+
+        // the decompressed data replaces the file
+        release();
+        buf = std::move(raw);
+
+        n_file_bytes = n;
+        compressed   = true;
+
+        return parse(buf.data(), buf.size());
+    }
+
+#if defined(_WIN32)
+    buf = std::move(file);
+    src = buf.data();
+#else
+    // load the pages here, so that the copy into the context does not wait for the disk
+    {
+        volatile uint8_t sum = 0;
+        for (size_t i = 0; i < n; i += 4096) {
+            sum += src[i];
+        }
+        (void) sum;
+    }
+#endif
+
+    compressed = false;
+
+    return parse(src, n);
+}
+
+bool server_slot_state::parse(const uint8_t * src, size_t n) {
+    if (n < 3*sizeof(uint32_t)) {
+        error = "invalid slot file";
+        return false;
+    }
+
+    const uint32_t magic    = read_u32(src);
+    const uint32_t version  = read_u32(src + 4);
+    const uint32_t n_tokens = read_u32(src + 8);
+
+    if (magic != LLAMA_STATE_SEQ_MAGIC || version != LLAMA_STATE_SEQ_VERSION) {
+        error = "unknown (magic, version) of slot file";
+        return false;
+    }
+
+    const size_t off = 3*sizeof(uint32_t) + (size_t) n_tokens*sizeof(llama_token);
+    if (off > n) {
+        error = "invalid slot file";
+        return false;
+    }
+
+    tokens.resize(n_tokens);
+    if (n_tokens > 0) {
+        memcpy(tokens.data(), src + 3*sizeof(uint32_t), (size_t) n_tokens*sizeof(llama_token));
+    }
+
+    data = src + off;
+    size = n - off;
+
+    return true;
+}
+
+void server_slot_state::release() {
+    data = nullptr;
+    size = 0;
+
+    llama_tokens().swap(tokens);
+    std::vector<uint8_t>().swap(buf);
+
+#if !defined(_WIN32)
+    if (map_addr != nullptr) {
+        munmap(map_addr, map_size);
+    }
+#endif
+    map_addr = nullptr;
+    map_size = 0;
+}
+
+//
+// server_slot_io
+//
+
+server_slot_io::~server_slot_io() {
+    stop();
+}
+
+void server_slot_io::start() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (running) {
+        return;
+    }
+    running = true;
+
+    thread = std::thread([this]() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]{ return !jobs.empty() || !running; });
+                if (jobs.empty()) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                busy = true;
+            }
+
+            job();
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                busy = false;
+            }
+        }
+    });
+}
+
+void server_slot_io::stop() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        running = false;
+    }
+    cv.notify_all();
+
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void server_slot_io::submit(std::function<void()> && job) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    cv.notify_one();
+}
+
+size_t server_slot_io::n_pending() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return jobs.size() + (busy ? 1 : 0);
+}
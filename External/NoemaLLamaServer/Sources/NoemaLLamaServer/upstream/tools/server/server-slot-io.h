@@ -0,0 +1,94 @@
+#pragma once
+
+#include "common.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// slot save/restore off the decode loop
+//
+// a save takes a snapshot of the sequence into memory on the decode loop, and the file is written on the I/O thread.
+// a restore reads the file on the I/O thread, and the decode loop only copies the state into the context
+//
+// an uncompressed file has the format of llama_state_seq_save_file(). a compressed file holds the same bytes in
+// independent LZ4 blocks, so that a compressed file restores to exactly the state of an uncompressed one
+
+// LZ4 block format, without the frame format
+size_t server_lz4_compress_bound(size_t n);
+
+// returns the size of the compressed data, dst must hold server_lz4_compress_bound(n) bytes
+size_t server_lz4_compress(const uint8_t * src, size_t n, uint8_t * dst);
+
+// returns the size of the decompressed data, or -1 if the data is invalid or does not fit in dst
+int64_t server_lz4_decompress(const uint8_t * src, size_t n, uint8_t * dst, size_t n_dst);
+
+// the state of a sequence, on its way to or from a file
+struct server_slot_state {
+    llama_tokens tokens;
+
+    // the state as returned by llama_state_seq_get_data(), either in buf or in the mapped file
+    const uint8_t * data = nullptr;
+    size_t          size = 0;
+
+    std::vector<uint8_t> buf;
+
+    size_t n_file_bytes = 0; // bytes written or read
+    bool   compressed   = false;
+
+    int64_t t_start_us = 0;
+
+    std::string error; // set if the file could not be written or read
+
+    server_slot_state() = default;
+    ~server_slot_state();
+
+    server_slot_state(const server_slot_state &) = delete;
+    server_slot_state & operator=(const server_slot_state &) = delete;
+
+    // write the tokens and buf, through a temporary file that replaces the file once complete
+    bool write(const std::string & path, bool compress);
+
+    // read a file written by write() or llama_state_seq_save_file()
+    // an uncompressed file is mapped and its pages are loaded here, so that using the state does not wait for the disk
+    bool read(const std::string & path);
+
+    // drop the state once it is in the file or in the context
+    void release();
+
+private:
+    void * map_addr = nullptr;
+    size_t map_size = 0;
+
+    bool parse(const uint8_t * src, size_t n);
+};
+
+// runs the file I/O of the slot actions on a background thread, in order of submission
+struct server_slot_io {
+    ~server_slot_io();
+
+    void start();
+
+    // the pending jobs are completed before the thread exits
+    void stop();
+
+    void submit(std::function<void()> && job);
+
+    size_t n_pending();
+
+private:
+    std::thread thread;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::deque<std::function<void()>> jobs;
+
+    bool running = false;
+    bool busy    = false;
+};
@@ -8,6 +8,21 @@
 #include "speculative.h"
 #include "server-common.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using json = nlohmann::ordered_json;
 
 //
@@ -273,6 +288,8 @@ task_params server_task::params_from_json_cmpl(
     //params.t_max_prompt_ms  = json_value(data,       "t_max_prompt_ms",    defaults.t_max_prompt_ms); // TODO: implement
     params.t_max_predict_ms = json_value(data,       "t_max_predict_ms",   defaults.t_max_predict_ms);
     params.response_fields  = json_value(data,       "response_fields",    std::vector<std::string>());
+    params.priority         = std::clamp<int64_t>(json_value<int64_t>(data, "priority", 0), -task_params::PRIORITY_MAX, task_params::PRIORITY_MAX);
+    params.sched_user       = json_value(data,       "user",               std::string());
 
     params.sampling.top_k              = json_value(data, "top_k",               defaults.sampling.top_k);
     params.sampling.top_p              = json_value(data, "top_p",               defaults.sampling.top_p);
@@ -1359,6 +1376,82 @@ json server_task_result_cmpl_final::to_json_anthropic_stream() {
 //
 // server_task_result_cmpl_partial
 //
+// partial results are allocated on the slot loop and freed on the HTTP threads. freed blocks go to a
+// shared lock-free stack; an allocating thread takes the whole stack at once into a thread-local list,
+// so single nodes are never popped concurrently (no ABA)
+struct partial_result_block {
+    partial_result_block * next;
+};
+
+struct partial_result_list {
+    partial_result_block * head = nullptr;
+
+    ~partial_result_list() {
+        while (head) {
+            partial_result_block * next = head->next;
+            ::operator delete(head);
+            head = next;
+        }
+    }
+};
+
+// soft limit on the number of free blocks kept in the shared stack
+static constexpr size_t PARTIAL_RESULT_POOL_MAX = 4096;
+
+static std::atomic<partial_result_block *> g_partial_result_free{nullptr};
+static std::atomic<size_t>                 g_partial_result_n_free{0};
+
+static thread_local partial_result_list g_partial_result_local;
+
+void * server_task_result_cmpl_partial::operator new(size_t size) {
+    static_assert(sizeof(server_task_result_cmpl_partial) >= sizeof(partial_result_block));
+
+    if (size != sizeof(server_task_result_cmpl_partial)) {
+        return ::operator new(size);
+    }
+
+    auto & local = g_partial_result_local;
+    if (local.head == nullptr) {
+        local.head = g_partial_result_free.exchange(nullptr, std::memory_order_acquire);
+        g_partial_result_n_free.store(0, std::memory_order_relaxed);
+    }
+
+    if (local.head == nullptr) {
+        return ::operator new(size);
+    }
+
+    partial_result_block * block = local.head;
+    local.head = block->next;
+
+    return block;
+}
+
+void server_task_result_cmpl_partial::operator delete(void * ptr, size_t size) {
+    if (size != sizeof(server_task_result_cmpl_partial) ||
+        g_partial_result_n_free.fetch_add(1, std::memory_order_relaxed) >= PARTIAL_RESULT_POOL_MAX) {
+        if (size == sizeof(server_task_result_cmpl_partial)) {
+            g_partial_result_n_free.fetch_sub(1, std::memory_order_relaxed);
+        }
+        ::operator delete(ptr);
+        return;
+    }
+
+    auto * block = static_cast<partial_result_block *>(ptr);
+
+    partial_result_block * head = g_partial_result_free.load(std::memory_order_relaxed);
+    do {
+        block->next = head;
+    } while (!g_partial_result_free.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void server_task_result_cmpl_partial::merge(server_task_result_cmpl_partial && next) {
+    content += next.content;
+    tokens.insert(tokens.end(), next.tokens.begin(), next.tokens.end());
+
+    n_decoded = next.n_decoded;
+    timings   = next.timings;
+}
+
 void server_task_result_cmpl_partial::update(task_result_state & state) {
     is_updated = true;
     state.update_chat_msg(content, true, oaicompat_msg_diffs);
@@ -1789,6 +1882,263 @@ json server_task_result_cmpl_partial::to_json_anthropic() {
     return events;
 }
 
+//
+// server_sse_writer
+//
+
+// same output as the serializer of nlohmann::json for valid UTF-8
+static void json_escape_append(std::string & out, const std::string & str) {
+    static const char * hex = "0123456789abcdef";
+
+    out += '"';
+
+    size_t i0 = 0;
+    for (size_t i = 0; i < str.size(); ++i) {
+        const unsigned char c = str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        out.append(str, i0, i - i0);
+        i0 = i + 1;
+
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b";  break;
+            case '\f': out += "\\f";  break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default:
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xf];
+                break;
+        }
+    }
+    out.append(str, i0, std::string::npos);
+
+    out += '"';
+}
+
+static void append_int(std::string & out, int64_t value) {
+    char buf[32];
+    const int n = snprintf(buf, sizeof(buf), "%" PRId64, value);
+    out.append(buf, n);
+}
+
+const std::string & server_sse_writer::escaped::get(const std::string & str) {
+    if (esc.empty() || str != raw) {
+        // once per stream - let the JSON library replace invalid UTF-8 exactly as the generic path does
+        raw = str;
+        esc = safe_json_to_str(json(raw));
+    }
+    return esc;
+}
+
+void server_sse_writer::write(server_task_result & result, std::string & out) {
+    out.clear();
+
+    auto * partial = dynamic_cast<server_task_result_cmpl_partial *>(&result);
+    if (partial != nullptr && write_text(*partial, out)) {
+        return;
+    }
+
+    out.clear();
+
+    const json res_json = result.to_json();
+    if (res_type == TASK_RESPONSE_TYPE_ANTHROPIC) {
+        out = format_anthropic_sse(res_json);
+    } else if (res_type == TASK_RESPONSE_TYPE_OAI_RESP) {
+        out = format_oai_resp_sse(res_json);
+    } else {
+        out = format_oai_sse(res_json);
+    }
+}
+
+bool server_sse_writer::write_text(const server_task_result_cmpl_partial & result, std::string & out) {
+    GGML_ASSERT(result.is_updated && "update() must be called before write_text()");
+
+    // the first chunk, progress, probabilities and timings are rare - leave them to to_json()
+    if (result.is_progress || !result.prob_output.probs.empty() || result.n_decoded == 1) {
+        return false;
+    }
+
+    // invalid UTF-8 is replaced by the JSON serializer, and tool calls have their own events
+    if (!is_valid_utf8(result.content)) {
+        return false;
+    }
+    for (const auto & diff : result.oaicompat_msg_diffs) {
+        if (diff.tool_call_index != std::string::npos || !diff.tool_call_delta.name.empty() || !diff.tool_call_delta.arguments.empty() ||
+            !is_valid_utf8(diff.content_delta) || !is_valid_utf8(diff.reasoning_content_delta)) {
+            return false;
+        }
+    }
+
+    static const std::string fingerprint = [] {
+        std::string res;
+        json_escape_append(res, build_info);
+        return res;
+    }();
+
+    switch (res_type) {
+        case TASK_RESPONSE_TYPE_NONE:
+            {
+                if (result.timings.prompt_n > 0) {
+                    return false;
+                }
+
+                out += "data: {\"index\":";
+                append_int(out, result.index);
+                out += ",\"content\":";
+                json_escape_append(out, result.content);
+                out += ",\"tokens\":[";
+                for (size_t i = 0; i < result.tokens.size(); ++i) {
+                    if (i > 0) {
+                        out += ',';
+                    }
+                    append_int(out, result.tokens[i]);
+                }
+                out += "],\"stop\":false,\"id_slot\":";
+                append_int(out, result.id_slot);
+                out += ",\"tokens_predicted\":";
+                append_int(out, result.n_decoded);
+                out += ",\"tokens_evaluated\":";
+                append_int(out, result.n_prompt_tokens);
+                out += "}\n\n";
+            } break;
+        case TASK_RESPONSE_TYPE_OAI_CMPL:
+            {
+                if (result.verbose || result.timings.prompt_n >= 0) {
+                    return false;
+                }
+
+                out += "data: {\"choices\":[{\"text\":";
+                json_escape_append(out, result.content);
+                out += ",\"index\":";
+                append_int(out, result.index);
+                out += ",\"logprobs\":null,\"finish_reason\":null}],\"created\":";
+                append_int(out, std::time(0));
+                out += ",\"model\":";
+                out += model.get(result.oaicompat_model);
+                out += ",\"system_fingerprint\":";
+                out += fingerprint;
+                out += ",\"object\":\"text_completion\",\"id\":";
+                out += cmpl_id.get(result.oaicompat_cmpl_id);
+                out += "}\n\n";
+            } break;
+        case TASK_RESPONSE_TYPE_OAI_CHAT:
+            {
+                if (result.timings.prompt_n >= 0) {
+                    return false;
+                }
+
+                const std::time_t t = std::time(0);
+
+                for (const auto & diff : result.oaicompat_msg_diffs) {
+                    out += "data: {\"choices\":[{\"finish_reason\":null,\"index\":";
+                    append_int(out, result.index);
+                    out += ",\"delta\":{";
+                    if (!diff.reasoning_content_delta.empty()) {
+                        out += "\"reasoning_content\":";
+                        json_escape_append(out, diff.reasoning_content_delta);
+                    }
+                    if (!diff.content_delta.empty()) {
+                        if (!diff.reasoning_content_delta.empty()) {
+                            out += ',';
+                        }
+                        out += "\"content\":";
+                        json_escape_append(out, diff.content_delta);
+                    }
+                    out += "}}],\"created\":";
+                    append_int(out, t);
+                    out += ",\"id\":";
+                    out += cmpl_id.get(result.oaicompat_cmpl_id);
+                    out += ",\"model\":";
+                    out += model.get(result.oaicompat_model);
+                    out += ",\"system_fingerprint\":";
+                    out += fingerprint;
+                    out += ",\"object\":\"chat.completion.chunk\"}\n\n";
+                }
+            } break;
+        case TASK_RESPONSE_TYPE_OAI_RESP:
+            {
+                for (const auto & diff : result.oaicompat_msg_diffs) {
+                    // the events that open the output items
+                    if ((!diff.reasoning_content_delta.empty() && !result.thinking_block_started) ||
+                        (!diff.content_delta.empty()           && !result.text_block_started)) {
+                        return false;
+                    }
+                }
+
+                for (const auto & diff : result.oaicompat_msg_diffs) {
+                    if (!diff.reasoning_content_delta.empty()) {
+                        out += "event: response.reasoning_text.delta\n";
+                        out += "data: {\"type\":\"response.reasoning_text.delta\",\"delta\":";
+                        json_escape_append(out, diff.reasoning_content_delta);
+                        out += ",\"item_id\":";
+                        out += resp_reasoning_id.get(result.oai_resp_reasoning_id);
+                        out += "}\n\n";
+                    }
+                    if (!diff.content_delta.empty()) {
+                        out += "event: response.output_text.delta\n";
+                        out += "data: {\"type\":\"response.output_text.delta\",\"item_id\":";
+                        out += resp_message_id.get(result.oai_resp_message_id);
+                        out += ",\"delta\":";
+                        json_escape_append(out, diff.content_delta);
+                        out += "}\n\n";
+                    }
+                }
+            } break;
+        case TASK_RESPONSE_TYPE_ANTHROPIC:
+            {
+                const int64_t idx_thinking = 0;
+                const int64_t idx_text     = result.anthropic_has_reasoning ? 1 : 0;
+
+                bool thinking_started = result.thinking_block_started;
+                bool text_started     = result.text_block_started;
+
+                for (const auto & diff : result.oaicompat_msg_diffs) {
+                    if (!diff.reasoning_content_delta.empty()) {
+                        if (!thinking_started) {
+                            out += "event: content_block_start\n";
+                            out += "data: {\"type\":\"content_block_start\",\"index\":";
+                            append_int(out, idx_thinking);
+                            out += ",\"content_block\":{\"type\":\"thinking\",\"thinking\":\"\"}}\n\n";
+                            thinking_started = true;
+                        }
+                        out += "event: content_block_delta\n";
+                        out += "data: {\"type\":\"content_block_delta\",\"index\":";
+                        append_int(out, idx_thinking);
+                        out += ",\"delta\":{\"type\":\"thinking_delta\",\"thinking\":";
+                        json_escape_append(out, diff.reasoning_content_delta);
+                        out += "}}\n\n";
+                    }
+                    if (!diff.content_delta.empty()) {
+                        if (!text_started) {
+                            out += "event: content_block_start\n";
+                            out += "data: {\"type\":\"content_block_start\",\"index\":";
+                            append_int(out, idx_text);
+                            out += ",\"content_block\":{\"type\":\"text\",\"text\":\"\"}}\n\n";
+                            text_started = true;
+                        }
+                        out += "event: content_block_delta\n";
+                        out += "data: {\"type\":\"content_block_delta\",\"index\":";
+                        append_int(out, idx_text);
+                        out += ",\"delta\":{\"type\":\"text_delta\",\"text\":";
+                        json_escape_append(out, diff.content_delta);
+                        out += "}}\n\n";
+                    }
+                }
+            } break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
 //
 // server_task_result_embd
 //
@@ -1861,6 +2211,58 @@ json server_task_result_metrics::to_json() {
         { "n_decode_total",                  n_decode_total },
         { "n_busy_slots_total",              n_busy_slots_total },
 
+        { "prompt_cache", {
+            { "n_lookups",      prompt_cache.n_lookups },
+            { "n_hits",         prompt_cache.n_hits },
+            { "n_hit_tokens",   prompt_cache.n_hit_tokens },
+            { "n_bytes_loaded", prompt_cache.n_bytes_loaded },
+            { "t_restore_us",   prompt_cache.t_restore_us },
+            { "n_evicted",      prompt_cache.n_evicted },
+            { "n_states",       prompt_cache.n_states },
+            { "n_nodes",        prompt_cache.n_nodes },
+            { "n_bytes",        prompt_cache.n_bytes },
+            { "n_tokens",       prompt_cache.n_tokens },
+            { "n_bytes_shared", prompt_cache.n_bytes_shared },
+            { "n_disk_hits",    prompt_cache.n_disk_hits },
+            { "n_disk_writes",  prompt_cache.n_disk_writes },
+            { "n_disk_dropped", prompt_cache.n_disk_dropped },
+            { "n_disk_states",  prompt_cache.n_disk_states },
+            { "n_disk_bytes",   prompt_cache.n_disk_bytes },
+        }},
+
+        { "prefill", {
+            { "n_steps",          prefill.n_steps },
+            { "n_steps_limited",  prefill.n_steps_limited },
+            { "n_prefill_tokens", prefill.n_prefill_tokens },
+            { "n_decode_tokens",  prefill.n_decode_tokens },
+            { "n_budget",         prefill.n_budget },
+            { "n_prefill_last",   prefill.n_prefill_last },
+            { "n_decode_last",    prefill.n_decode_last },
+            { "t_step_last_ms",   prefill.t_step_last_ms },
+            { "t_decode_ms",      prefill.t_decode_ms },
+            { "t_token_ms",       prefill.t_token_ms },
+        }},
+
+        { "embd_batch", {
+            { "n_batches", embd_batch.n_batches },
+            { "n_inputs",  embd_batch.n_inputs },
+            { "n_tokens",  embd_batch.n_tokens },
+            { "t_wait_us", embd_batch.t_wait_us },
+            { "n_pending", embd_batch.n_pending },
+        }},
+
+        { "tokenize_cache", {
+            { "n_hit",           tokenize_cache.n_hit },
+            { "n_miss",          tokenize_cache.n_miss },
+            { "n_tokens_reused", tokenize_cache.n_tokens_reused },
+            { "n_tokens",        tokenize_cache.n_tokens },
+        }},
+
+        { "chat_template_cache", {
+            { "n_hit",  chat_template_cache.n_hit },
+            { "n_miss", chat_template_cache.n_miss },
+        }},
+
         { "slots",                           slots_data },
     };
 }
@@ -1934,50 +2336,802 @@ json server_task_result_apply_lora::to_json() {
     return json {{ "success", true }};
 }
 
+//
+// server_prompt_disk
+//
+
+// files are written with the state at this alignment so it can be mapped on 4k and 16k page systems
+static constexpr size_t PROMPT_DISK_ALIGN = 16384;
+
+// in addition to its full length, a prompt is indexed at every multiple of this many tokens
+static constexpr size_t PROMPT_DISK_BLOCK = 256;
+
+// evicted states waiting to be written - beyond this, new evictions are dropped instead of piling up in RAM
+static constexpr size_t PROMPT_DISK_MAX_PENDING = 4;
+
+// number of candidates from the index that are verified against their files on lookup
+static constexpr size_t PROMPT_DISK_MAX_VERIFY = 4;
+
+static constexpr char     PROMPT_DISK_MAGIC[8] = { 'L', 'L', 'P', 'R', 'O', 'M', 'P', 'T' };
+static constexpr uint32_t PROMPT_DISK_VERSION  = 1;
+
+struct server_prompt_disk_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t n_checkpoints;
+    uint64_t model_id;
+    uint64_t n_tokens;
+    int64_t  t_write; // microseconds since epoch, orders the files for eviction after a restart
+    uint64_t state_offset;
+    uint64_t state_size;
+};
+
+struct server_prompt_disk_checkpoint {
+    int32_t  pos_min;
+    int32_t  pos_max;
+    int64_t  n_tokens;
+    uint64_t size;
+};
+
+// FNV-1a over the token ids, so the hash of every prefix comes out of a single pass
+static constexpr uint64_t PROMPT_HASH_SEED = 0xcbf29ce484222325ull;
+
+static uint64_t prompt_hash_step(uint64_t h, llama_token t) {
+    return (h ^ (uint32_t) t) * 0x100000001b3ull;
+}
+
+static uint64_t prompt_hash(const llama_tokens & tokens) {
+    uint64_t h = PROMPT_HASH_SEED;
+    for (const llama_token t : tokens) {
+        h = prompt_hash_step(h, t);
+    }
+    return h;
+}
+
+// read-only view of a whole prompt file, mapped where mmap is available
+struct server_prompt_file {
+    const uint8_t * data = nullptr;
+    size_t          size = 0;
+
+    server_prompt_file() = default;
+    server_prompt_file(const server_prompt_file &) = delete;
+    server_prompt_file & operator=(const server_prompt_file &) = delete;
+
+    bool open(const std::string & path) {
+#ifdef _WIN32
+        std::ifstream f(path, std::ios::binary | std::ios::ate);
+        if (!f) {
+            return false;
+        }
+        buf.resize((size_t) f.tellg());
+        f.seekg(0);
+        if (!f.read((char *) buf.data(), buf.size())) {
+            return false;
+        }
+        data = buf.data();
+        size = buf.size();
+        return true;
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        void * addr = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        map  = addr;
+        data = (const uint8_t *) addr;
+        size = (size_t) st.st_size;
+        return true;
+#endif
+    }
+
+    ~server_prompt_file() {
+#ifndef _WIN32
+        if (map) {
+            munmap(map, size);
+        }
+#endif
+    }
+
+    // validates the header and the layout; `tokens` points into the file
+    bool parse(uint64_t model_id, server_prompt_disk_header & hdr, const llama_token *& tokens) const {
+        if (size < sizeof(hdr)) {
+            return false;
+        }
+        memcpy(&hdr, data, sizeof(hdr));
+        if (memcmp(hdr.magic, PROMPT_DISK_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != PROMPT_DISK_VERSION || hdr.model_id != model_id) {
+            return false;
+        }
+        if (hdr.n_tokens == 0 || hdr.n_tokens > (size - sizeof(hdr)) / sizeof(llama_token)) {
+            return false;
+        }
+        if (hdr.state_offset > size || hdr.state_size > size - hdr.state_offset) {
+            return false;
+        }
+        tokens = (const llama_token *) (data + sizeof(hdr));
+        return true;
+    }
+
+private:
+#ifdef _WIN32
+    std::vector<uint8_t> buf;
+#else
+    void * map = nullptr;
+#endif
+};
+
+server_prompt_disk::server_prompt_disk(const std::string & path, int32_t limit_size_mib, uint64_t model_id)
+    : dir(path), model_id(model_id) {
+    this->limit_size = 1024ull*1024ull*(limit_size_mib < 0 ? 0 : limit_size_mib);
+
+    if (!dir.empty() && dir.back() != DIRECTORY_SEPARATOR) {
+        dir += DIRECTORY_SEPARATOR;
+    }
+
+    if (!fs_create_directory_with_parents(dir)) {
+        SRV_WRN("failed to create prompt cache directory '%s'\n", dir.c_str());
+    }
+
+    // index the files left by a previous run, oldest first
+    std::vector<std::pair<entry, llama_tokens>> found;
+
+    for (const auto & file : fs_list(dir, false)) {
+        if (string_ends_with(file.name, ".prompt.tmp")) {
+            std::remove(file.path.c_str());
+            continue;
+        }
+        if (!string_ends_with(file.name, ".prompt")) {
+            continue;
+        }
+
+        server_prompt_file f;
+        server_prompt_disk_header hdr;
+        const llama_token * tokens = nullptr;
+
+        if (!f.open(file.path) || !f.parse(model_id, hdr, tokens)) {
+            // written for another model or KV cache type - leave it alone
+            continue;
+        }
+
+        entry e;
+        e.path     = file.path;
+        e.n_tokens = hdr.n_tokens;
+        e.n_bytes  = f.size;
+        e.t_write  = hdr.t_write;
+
+        found.emplace_back(std::move(e), llama_tokens(tokens, tokens + hdr.n_tokens));
+    }
+
+    std::sort(found.begin(), found.end(), [](const auto & a, const auto & b) {
+        return a.first.t_write < b.first.t_write;
+    });
+
+    for (auto & [e, tokens] : found) {
+        add(prompt_hash(tokens), std::move(e), tokens);
+    }
+
+    evict();
+
+    SRV_INF("prompt cache disk tier: '%s', %zu prompts, %.3f MiB (limit: %.3f MiB)\n",
+            dir.c_str(), entries.size(), n_bytes_total / (1024.0 * 1024.0), limit_size / (1024.0 * 1024.0));
+
+    writer = std::thread([this]() { write_loop(); });
+}
+
+server_prompt_disk::~server_prompt_disk() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+    }
+    cv.notify_all();
+
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+bool server_prompt_disk::spill(llama_tokens && tokens, server_prompt && prompt, bool wait) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (wait) {
+        cv.wait(lock, [&]() { return queue.size() < PROMPT_DISK_MAX_PENDING || !running; });
+    }
+
+    if (!running) {
+        return false;
+    }
+
+    if (queue.size() >= PROMPT_DISK_MAX_PENDING) {
+        n_dropped++;
+        return false;
+    }
+
+    queue.push_back({ std::move(tokens), std::move(prompt) });
+    lock.unlock();
+
+    cv.notify_all();
+
+    return true;
+}
+
+void server_prompt_disk::write_loop() {
+    while (true) {
+        pending cur;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return !queue.empty() || !running; });
+
+            // drain the queue before exiting so that the states survive the restart
+            if (queue.empty()) {
+                return;
+            }
+
+            cur = std::move(queue.front());
+            queue.pop_front();
+        }
+        cv.notify_all();
+
+        if (!write(cur)) {
+            SRV_WRN("failed to write prompt with %zu tokens to the disk cache\n", cur.tokens.size());
+        }
+    }
+}
+
+bool server_prompt_disk::write(const pending & cur) {
+    const uint64_t id = prompt_hash(cur.tokens);
+
+    const std::string path = dir + string_format("%016llx.prompt", (unsigned long long) id);
+    const std::string tmp  = path + ".tmp";
+
+    server_prompt_disk_header hdr = {};
+    memcpy(hdr.magic, PROMPT_DISK_MAGIC, sizeof(hdr.magic));
+    hdr.version       = PROMPT_DISK_VERSION;
+    hdr.n_checkpoints = cur.prompt.checkpoints.size();
+    hdr.model_id      = model_id;
+    hdr.n_tokens      = cur.tokens.size();
+    hdr.t_write       = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    hdr.state_size    = cur.prompt.data.size();
+
+    size_t offset = sizeof(hdr) + cur.tokens.size()*sizeof(llama_token);
+    for (const auto & checkpoint : cur.prompt.checkpoints) {
+        offset += sizeof(server_prompt_disk_checkpoint) + checkpoint.size();
+    }
+    hdr.state_offset = GGML_PAD(offset, PROMPT_DISK_ALIGN);
+
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f) {
+            return false;
+        }
+
+        f.write((const char *) &hdr, sizeof(hdr));
+        f.write((const char *) cur.tokens.data(), cur.tokens.size()*sizeof(llama_token));
+
+        for (const auto & checkpoint : cur.prompt.checkpoints) {
+            const server_prompt_disk_checkpoint rec = {
+                /*.pos_min  =*/ checkpoint.pos_min,
+                /*.pos_max  =*/ checkpoint.pos_max,
+                /*.n_tokens =*/ checkpoint.n_tokens,
+                /*.size     =*/ checkpoint.size(),
+            };
+            f.write((const char *) &rec, sizeof(rec));
+            f.write((const char *) checkpoint.data.data(), checkpoint.size());
+        }
+
+        const std::vector<char> pad(hdr.state_offset - offset, 0);
+        f.write(pad.data(), pad.size());
+        f.write((const char *) cur.prompt.data.data(), cur.prompt.data.size());
+
+        if (!f.good()) {
+            f.close();
+            std::remove(tmp.c_str());
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (entries.count(id)) {
+        erase(id, false);
+    }
+
+    // the file becomes visible only complete
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+
+    entry e;
+    e.path     = path;
+    e.n_tokens = cur.tokens.size();
+    e.n_bytes  = hdr.state_offset + hdr.state_size;
+    e.t_write  = hdr.t_write;
+
+    add(id, std::move(e), cur.tokens);
+
+    n_writes++;
+
+    // drop the cached prompts that are fully contained in the new one
+    uint64_t h = PROMPT_HASH_SEED;
+    for (size_t i = 0; i + 1 < cur.tokens.size(); ++i) {
+        h = prompt_hash_step(h, cur.tokens[i]);
+
+        auto it = entries.find(h);
+        if (it != entries.end() && it->second.n_tokens == i + 1) {
+            erase(h, true);
+        }
+    }
+
+    evict();
+
+    return true;
+}
+
+void server_prompt_disk::add(uint64_t id, entry && e, const llama_tokens & tokens) {
+    uint64_t h = PROMPT_HASH_SEED;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        h = prompt_hash_step(h, tokens[i]);
+
+        if ((i + 1) % PROMPT_DISK_BLOCK == 0 || i + 1 == tokens.size()) {
+            e.keys.push_back(h);
+            index.emplace(h, id);
+        }
+    }
+
+    n_bytes_total += e.n_bytes;
+
+    e.it_lru = lru.insert(lru.end(), id);
+
+    entries[id] = std::move(e);
+}
+
+void server_prompt_disk::erase(uint64_t id, bool unlink_file) {
+    auto it = entries.find(id);
+    if (it == entries.end()) {
+        return;
+    }
+
+    for (const uint64_t key : it->second.keys) {
+        auto range = index.equal_range(key);
+        for (auto ik = range.first; ik != range.second; ++ik) {
+            if (ik->second == id) {
+                index.erase(ik);
+                break;
+            }
+        }
+    }
+
+    lru.erase(it->second.it_lru);
+
+    n_bytes_total -= it->second.n_bytes;
+
+    if (unlink_file) {
+        std::remove(it->second.path.c_str());
+    }
+
+    entries.erase(it);
+}
+
+void server_prompt_disk::evict() {
+    while (limit_size > 0 && n_bytes_total > limit_size && !lru.empty()) {
+        erase(lru.front(), true);
+    }
+}
+
+std::vector<server_prompt_disk::match> server_prompt_disk::find(const llama_tokens & tokens) const {
+    // deepest indexed prefix per cached prompt
+    std::unordered_map<uint64_t, size_t> depth;
+    std::vector<std::pair<size_t, std::string>> candidates;
+    std::vector<uint64_t> ids;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (entries.empty()) {
+            return {};
+        }
+
+        uint64_t h = PROMPT_HASH_SEED;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            h = prompt_hash_step(h, tokens[i]);
+
+            auto range = index.equal_range(h);
+            for (auto it = range.first; it != range.second; ++it) {
+                depth[it->second] = i + 1;
+            }
+        }
+
+        for (const auto & [id, d] : depth) {
+            ids.push_back(id);
+        }
+
+        std::sort(ids.begin(), ids.end(), [&](uint64_t a, uint64_t b) {
+            return depth[a] > depth[b];
+        });
+
+        if (ids.size() > PROMPT_DISK_MAX_VERIFY) {
+            ids.resize(PROMPT_DISK_MAX_VERIFY);
+        }
+
+        for (const uint64_t id : ids) {
+            candidates.emplace_back(depth[id], entries.at(id).path);
+        }
+    }
+
+    std::vector<match> res;
+
+    for (size_t c = 0; c < ids.size(); ++c) {
+        server_prompt_file f;
+        server_prompt_disk_header hdr;
+        const llama_token * cached = nullptr;
+
+        if (!f.open(candidates[c].second) || !f.parse(model_id, hdr, cached)) {
+            continue;
+        }
+
+        // the hashes only suggest the prefix - count the tokens that really match
+        const size_t n = std::min<size_t>(hdr.n_tokens, tokens.size());
+
+        size_t lcp = 0;
+        while (lcp < n && cached[lcp] == tokens[lcp]) {
+            lcp++;
+        }
+
+        if (lcp > 0) {
+            res.push_back({ ids[c], lcp, (size_t) hdr.n_tokens });
+        }
+    }
+
+    std::sort(res.begin(), res.end(), [](const match & a, const match & b) {
+        return a.lcp > b.lcp;
+    });
+
+    return res;
+}
+
+bool server_prompt_disk::load(uint64_t id, server_prompt & prompt, llama_context * ctx, int32_t id_slot, bool has_mtmd, size_t & n_bytes) {
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = entries.find(id);
+        if (it == entries.end()) {
+            return false;
+        }
+
+        // the state moves into the slot - it will be saved again when the slot is evicted
+        path = it->second.path;
+        erase(id, false);
+    }
+
+    server_prompt_file f;
+    const bool opened = f.open(path);
+
+    // the mapping stays valid after the file is removed
+    std::remove(path.c_str());
+
+    server_prompt_disk_header hdr;
+    const llama_token * tokens = nullptr;
+
+    if (!opened || !f.parse(model_id, hdr, tokens)) {
+        SRV_WRN("failed to read prompt cache file '%s'\n", path.c_str());
+        return false;
+    }
+
+    std::list<server_prompt_checkpoint> checkpoints;
+
+    size_t offset = sizeof(hdr) + hdr.n_tokens*sizeof(llama_token);
+    for (uint32_t i = 0; i < hdr.n_checkpoints; ++i) {
+        server_prompt_disk_checkpoint rec;
+        if (offset + sizeof(rec) > hdr.state_offset) {
+            return false;
+        }
+        memcpy(&rec, f.data + offset, sizeof(rec));
+        offset += sizeof(rec);
+
+        if (rec.size > hdr.state_offset - offset) {
+            return false;
+        }
+
+        checkpoints.push_back({
+            /*.pos_min  =*/ rec.pos_min,
+            /*.pos_max  =*/ rec.pos_max,
+            /*.n_tokens =*/ rec.n_tokens,
+            /*.data     =*/ std::vector<uint8_t>(f.data + offset, f.data + offset + rec.size),
+        });
+        offset += rec.size;
+    }
+
+    const size_t n = llama_state_seq_set_data_ext(ctx, f.data + hdr.state_offset, hdr.state_size, id_slot, 0);
+    if (n != hdr.state_size) {
+        SRV_WRN("failed to restore state with size %zu from '%s'\n", (size_t) hdr.state_size, path.c_str());
+        return false;
+    }
+
+    prompt = server_prompt {
+        /*.tokens      =*/ server_tokens(llama_tokens(tokens, tokens + hdr.n_tokens), has_mtmd),
+        /*.data        =*/ {},
+        /*.checkpoints =*/ std::move(checkpoints),
+    };
+
+    n_bytes = hdr.state_size;
+
+    return true;
+}
+
+void server_prompt_disk::get_stats(server_prompt_cache_stats & stats) const {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    stats.n_disk_writes  = n_writes;
+    stats.n_disk_dropped = n_dropped;
+    stats.n_disk_states  = entries.size();
+    stats.n_disk_bytes   = n_bytes_total;
+}
+
 //
 // server_prompt_cache
 //
+
+// number of leading tokens of `tokens[i..]` that match `edge`
+static size_t prompt_cache_match(const llama_tokens & edge, const llama_tokens & tokens, size_t i) {
+    const size_t n = std::min(edge.size(), tokens.size() - i);
+
+    size_t k = 0;
+    while (k < n && edge[k] == tokens[i + k]) {
+        k++;
+    }
+
+    return k;
+}
+
 size_t server_prompt_cache::size() const {
-    size_t res = 0;
+    return n_bytes_total;
+}
+
+size_t server_prompt_cache::n_tokens() const {
+    return n_tokens_total;
+}
 
-    for (const auto & state : states) {
-        res += state.size();
+size_t server_prompt_cache::n_states() const {
+    return lru.size();
+}
+
+server_prompt_cache::~server_prompt_cache() {
+    if (!disk) {
+        return;
+    }
+
+    // hand the states still in RAM to the disk tier, so they survive the restart
+    while (!lru.empty()) {
+        auto * node = lru.front();
+        if (!node->state->tokens.has_media()) {
+            disk->spill(path(node), std::move(*node->state), true);
+        }
+        remove(node);
+    }
+
+    // waits for the pending writes
+    disk.reset();
+}
+
+server_prompt_cache_stats server_prompt_cache::get_stats() const {
+    server_prompt_cache_stats res = stats;
+
+    res.n_states       = lru.size();
+    res.n_nodes        = n_nodes;
+    res.n_bytes        = n_bytes_total;
+    res.n_tokens       = n_tokens_total;
+    res.n_bytes_shared = (n_tokens_total - std::min(n_tokens_total, n_tokens_tree))*sizeof(llama_token);
+
+    if (disk) {
+        disk->get_stats(res);
     }
 
     return res;
 }
 
-size_t server_prompt_cache::n_tokens() const {
-    size_t res = 0;
+llama_tokens server_prompt_cache::path(const server_prompt_cache_node * node) const {
+    llama_tokens res(node->depth);
 
-    for (const auto & state : states) {
-        res += state.n_tokens();
+    for (; node != &root; node = node->parent) {
+        std::copy(node->edge.begin(), node->edge.end(), res.begin() + (node->depth - node->edge.size()));
     }
 
     return res;
 }
 
+void server_prompt_cache::refresh(server_prompt_cache_node * node) {
+    for (; node != nullptr; node = node->parent) {
+        // a state at the node itself is always the shortest one in its subtree
+        server_prompt_cache_node * best = node->state ? node : nullptr;
+
+        if (best == nullptr) {
+            for (const auto & it : node->children) {
+                const auto * child = it.second.get();
+                if (child->best && (best == nullptr || child->best->depth < best->depth)) {
+                    best = child->best;
+                }
+            }
+        }
+
+        node->best = best;
+    }
+}
+
+server_prompt_cache_node * server_prompt_cache::insert(const llama_tokens & tokens) {
+    server_prompt_cache_node * node = &root;
+
+    size_t i = 0;
+    while (i < tokens.size()) {
+        auto it = node->children.find(tokens[i]);
+        if (it == node->children.end()) {
+            auto leaf = std::make_unique<server_prompt_cache_node>();
+            leaf->edge.assign(tokens.begin() + i, tokens.end());
+            leaf->parent = node;
+            leaf->depth  = tokens.size();
+
+            n_tokens_tree += leaf->edge.size();
+            n_nodes++;
+
+            node = (node->children[tokens[i]] = std::move(leaf)).get();
+            break;
+        }
+
+        server_prompt_cache_node * child = it->second.get();
+
+        const size_t k = prompt_cache_match(child->edge, tokens, i);
+        if (k < child->edge.size()) {
+            // split the edge: the new node becomes the branch point of the two prompts
+            auto mid = std::make_unique<server_prompt_cache_node>();
+            mid->edge.assign(child->edge.begin(), child->edge.begin() + k);
+            mid->parent = node;
+            mid->depth  = node->depth + k;
+            mid->best   = child->best;
+
+            auto owned = std::move(it->second);
+            owned->edge.erase(owned->edge.begin(), owned->edge.begin() + k);
+            owned->parent = mid.get();
+            mid->children[owned->edge[0]] = std::move(owned);
+
+            n_nodes++;
+
+            it->second = std::move(mid);
+            child = it->second.get();
+        }
+
+        node = child;
+        i   += k;
+    }
+
+    return node;
+}
+
+void server_prompt_cache::remove(server_prompt_cache_node * node) {
+    GGML_ASSERT(node->state);
+
+    lru.erase(node->it_lru);
+
+    n_bytes_total  -= node->n_bytes;
+    n_tokens_total -= node->depth;
+
+    node->state.reset();
+    node->n_bytes = 0;
+
+    // release the nodes that no other state depends on
+    while (node != &root && !node->state && node->children.empty()) {
+        server_prompt_cache_node * parent = node->parent;
+
+        n_tokens_tree -= node->edge.size();
+        n_nodes--;
+
+        parent->children.erase(node->edge[0]);
+        node = parent;
+    }
+
+    // a stateless node with a single child is no longer a branch point - merge it into the child
+    if (node != &root && !node->state && node->children.size() == 1) {
+        server_prompt_cache_node * parent = node->parent;
+
+        auto only = std::move(node->children.begin()->second);
+        only->edge.insert(only->edge.begin(), node->edge.begin(), node->edge.end());
+        only->parent = parent;
+
+        n_nodes--;
+
+        parent->children[node->edge[0]] = std::move(only); // destroys node
+        node = parent;
+    }
+
+    refresh(node);
+}
+
+void server_prompt_cache::evict_oldest() {
+    auto * node = lru.front();
+
+    // prompts with media cannot be written - their chunks live only in memory
+    if (disk && !node->state->tokens.has_media()) {
+        disk->spill(path(node), std::move(*node->state));
+    }
+
+    remove(node);
+
+    stats.n_evicted++;
+}
+
 server_prompt * server_prompt_cache::alloc(const server_prompt & prompt, size_t state_size) {
-    // first check if the current state is contained fully in the cache
-    for (auto it = states.begin(); it != states.end(); ++it) {
-        const int cur_lcp_len = it->tokens.get_common_prefix(prompt.tokens);
+    if (prompt.tokens.empty()) {
+        return nullptr;
+    }
+
+    // media positions are LLAMA_TOKEN_NULL in the tree, so a match there is confirmed with get_common_prefix below
+    const llama_tokens & tokens = prompt.tokens.get_tokens_raw();
 
-        if (cur_lcp_len == (int) prompt.tokens.size()) {
-            SRV_WRN("%s", " - prompt is already in the cache, skipping\n");
-            return nullptr;
+    // walk the prompt down the tree, collecting the cached prompts that it fully contains
+    std::vector<server_prompt_cache_node *> contained;
+
+    server_prompt_cache_node * node = &root;
+    server_prompt_cache_node * end  = nullptr; // the subtree below the end of the prompt, if it was reached
+
+    size_t i = 0;
+    while (true) {
+        if (node->state) {
+            contained.push_back(node);
+        }
+
+        if (i == tokens.size()) {
+            end = node;
+            break;
         }
+
+        auto it = node->children.find(tokens[i]);
+        if (it == node->children.end()) {
+            break;
+        }
+
+        server_prompt_cache_node * child = it->second.get();
+
+        const size_t k = prompt_cache_match(child->edge, tokens, i);
+        if (k < child->edge.size()) {
+            if (i + k == tokens.size()) {
+                end = child;
+            }
+            break;
+        }
+
+        node = child;
+        i   += k;
+    }
+
+    // media chunks are compared by id, which the tree does not see - confirm with the full comparison
+    const bool has_mtmd = prompt.tokens.has_mtmd;
+
+    // first check if the current state is contained fully in the cache
+    if (end && end->best && (!has_mtmd || prompt.tokens.get_common_prefix(end->best->state->tokens) == prompt.tokens.size())) {
+        SRV_WRN("%s", " - prompt is already in the cache, skipping\n");
+
+        lru.splice(lru.end(), lru, end->best->it_lru);
+
+        return nullptr;
     }
 
     // next, remove any cached prompts that are fully contained in the current prompt
-    for (auto it = states.begin(); it != states.end();) {
-        const int len = it->tokens.get_common_prefix(prompt.tokens);
+    for (auto * cur : contained) {
+        if (cur == end) {
+            continue;
+        }
 
-        if (len == (int) it->tokens.size()) {
-            SRV_WRN(" - removing obsolete cached prompt with length %d\n", len);
+        if (!has_mtmd || cur->state->tokens.get_common_prefix(prompt.tokens) == cur->state->tokens.size()) {
+            SRV_WRN(" - removing obsolete cached prompt with length %zu\n", cur->depth);
 
-            it = states.erase(it);
-        } else {
-            ++it;
+            remove(cur);
         }
     }
 
@@ -1998,14 +3152,28 @@ server_prompt * server_prompt_cache::alloc(const server_prompt & prompt, size_t
         return nullptr;
     }
 
-    auto & cur = states.emplace_back();
-    cur = {
-        /*.tokens      =*/ prompt.tokens.clone(),
+    auto * cur = insert(tokens);
+
+    if (cur->state) {
+        // a prompt with the same tokens but different media
+        remove(cur);
+        cur = insert(tokens);
+    }
+
+    cur->state = std::make_unique<server_prompt>(server_prompt {
+        /*.tokens      =*/ prompt.tokens.has_mtmd ? prompt.tokens.clone() : server_tokens(),
         /*.data        =*/ std::move(state_data),
         /*.checkpoints =*/ prompt.checkpoints,
-    };
+    });
+    cur->n_bytes = cur->state->size();
+    cur->it_lru  = lru.insert(lru.end(), cur);
+
+    n_bytes_total  += cur->n_bytes;
+    n_tokens_total += cur->depth;
 
-    return &cur;
+    refresh(cur);
+
+    return cur->state.get();
 }
 
 bool server_prompt_cache::load(server_prompt & prompt, const server_tokens & tokens_new, llama_context * ctx, int32_t id_slot) {
@@ -2016,13 +3184,65 @@ bool server_prompt_cache::load(server_prompt & prompt, const server_tokens & tok
 
     SRV_WRN(" - looking for better prompt, base f_keep = %.3f, sim = %.3f\n", f_keep_best, sim_best);
 
-    auto it_best = states.end();
+    stats.n_lookups++;
+
+    const llama_tokens & tokens = tokens_new.get_tokens_raw();
+
+    // every subtree that branches off the path of the new prompt shares exactly the prefix up to the
+    // branch point, so the shortest state in it is the only candidate worth considering there
+    std::vector<std::pair<size_t, server_prompt_cache_node *>> candidates;
+
+    server_prompt_cache_node * node = &root;
+
+    size_t i = 0;
+    while (true) {
+        if (i == tokens.size()) {
+            if (node->best) {
+                candidates.emplace_back(i, node->best);
+            }
+            break;
+        }
+
+        if (node->state) {
+            candidates.emplace_back(i, node);
+        }
+
+        auto it_next = node->children.find(tokens[i]);
+
+        for (auto it = node->children.begin(); it != node->children.end(); ++it) {
+            if (it != it_next && it->second->best) {
+                candidates.emplace_back(i, it->second->best);
+            }
+        }
+
+        if (it_next == node->children.end()) {
+            break;
+        }
+
+        server_prompt_cache_node * child = it_next->second.get();
+
+        const size_t k = prompt_cache_match(child->edge, tokens, i);
+        if (k < child->edge.size()) {
+            if (child->best) {
+                candidates.emplace_back(i + k, child->best);
+            }
+            break;
+        }
+
+        node = child;
+        i   += k;
+    }
+
+    server_prompt_cache_node * best = nullptr;
+    size_t lcp_hit = 0;
 
     // find the most similar cached prompt, that would also preserve the most context
-    for (auto it = states.begin(); it != states.end(); ++it) {
-        const int lcp_cur = it->tokens.get_common_prefix(tokens_new);
+    for (auto it = candidates.rbegin(); it != candidates.rend(); ++it) {
+        auto * cur = it->second;
 
-        const float f_keep_cur = float(lcp_cur) / it->tokens.size();
+        const size_t lcp_cur = tokens_new.has_mtmd ? cur->state->tokens.get_common_prefix(tokens_new) : it->first;
+
+        const float f_keep_cur = float(lcp_cur) / cur->depth;
         const float sim_cur    = float(lcp_cur) / tokens_new.size();
 
         // don't trash large prompts
@@ -2034,27 +3254,82 @@ bool server_prompt_cache::load(server_prompt & prompt, const server_tokens & tok
             f_keep_best = f_keep_cur;
             sim_best    = sim_cur;
 
-            it_best = it;
+            best    = cur;
+            lcp_hit = lcp_cur;
         }
     }
 
-    if (it_best != states.end()) {
+    uint64_t disk_id   = 0;
+    bool     disk_best = false;
+
+    // the disk tier competes with the same rules. it holds text-only prompts, and the media positions of the new
+    // prompt are LLAMA_TOKEN_NULL in `tokens`, so a match always ends before the first media chunk
+    if (disk) {
+        for (const auto & cur : disk->find(tokens)) {
+            const float f_keep_cur = float(cur.lcp) / cur.n_tokens;
+            const float sim_cur    = float(cur.lcp) / tokens_new.size();
+
+            if (f_keep_cur < 0.25f) {
+                continue;
+            }
+
+            if (f_keep_best < f_keep_cur && sim_best < sim_cur) {
+                f_keep_best = f_keep_cur;
+                sim_best    = sim_cur;
+
+                best      = nullptr;
+                lcp_hit   = cur.lcp;
+                disk_id   = cur.id;
+                disk_best = true;
+            }
+        }
+    }
+
+    if (disk_best) {
+        SRV_WRN(" - found better prompt on disk with f_keep = %.3f, sim = %.3f\n", f_keep_best, sim_best);
+
+        const int64_t t_start = ggml_time_us();
+
+        size_t size = 0;
+        if (!disk->load(disk_id, prompt, ctx, id_slot, tokens_new.has_mtmd, size)) {
+            return false;
+        }
+
+        stats.n_hits++;
+        stats.n_disk_hits++;
+        stats.n_hit_tokens   += lcp_hit;
+        stats.n_bytes_loaded += size;
+        stats.t_restore_us   += ggml_time_us() - t_start;
+    } else if (best != nullptr) {
         SRV_WRN(" - found better prompt with f_keep = %.3f, sim = %.3f\n", f_keep_best, sim_best);
 
-        const size_t size = it_best->data.size();
-        const size_t n = llama_state_seq_set_data_ext(ctx, it_best->data.data(), size, id_slot, 0);
+        const int64_t t_start = ggml_time_us();
+
+        const size_t size = best->state->data.size();
+        const size_t n = llama_state_seq_set_data_ext(ctx, best->state->data.data(), size, id_slot, 0);
         if (n != size) {
             SRV_WRN("failed to restore state with size %zu\n", size);
 
             return false;
         }
 
-        it_best->data.clear();
-        it_best->data.shrink_to_fit();
+        stats.n_hits++;
+        stats.n_hit_tokens   += lcp_hit;
+        stats.n_bytes_loaded += size;
+        stats.t_restore_us   += ggml_time_us() - t_start;
+
+        server_prompt & cur = *best->state;
 
-        prompt = std::move(*it_best);
+        cur.data.clear();
+        cur.data.shrink_to_fit();
+
+        if (!cur.tokens.has_mtmd) {
+            cur.tokens = server_tokens(path(best), false);
+        }
 
-        states.erase(it_best);
+        prompt = std::move(cur);
+
+        remove(best);
     }
 
     return true;
@@ -2063,14 +3338,10 @@ bool server_prompt_cache::load(server_prompt & prompt, const server_tokens & tok
 void server_prompt_cache::update() {
     if (limit_size > 0) {
         // always keep at least one state, regardless of the limits
-        while (states.size() > 1 && size() > limit_size) {
-            if (states.empty()) {
-                break;
-            }
-
-            SRV_WRN(" - cache size limit reached, removing oldest entry (size = %.3f MiB)\n", states.front().size() / (1024.0 * 1024.0));
+        while (lru.size() > 1 && size() > limit_size) {
+            SRV_WRN(" - cache size limit reached, removing oldest entry (size = %.3f MiB)\n", lru.front()->n_bytes / (1024.0 * 1024.0));
 
-            states.pop_front();
+            evict_oldest();
         }
     }
 
@@ -2081,23 +3352,20 @@ void server_prompt_cache::update() {
     const size_t limit_tokens_cur = limit_size > 0 ? std::max<size_t>(limit_tokens, limit_size/size_per_token) : limit_tokens;
 
     if (limit_tokens > 0) {
-        while (states.size() > 1 && n_tokens() > limit_tokens_cur) {
-            if (states.empty()) {
-                break;
-            }
-
+        while (lru.size() > 1 && n_tokens() > limit_tokens_cur) {
             SRV_WRN(" - cache token limit (%zu, est: %zu) reached, removing oldest entry (size = %.3f MiB)\n",
-                    limit_tokens, limit_tokens_cur, states.front().size() / (1024.0 * 1024.0));
+                    limit_tokens, limit_tokens_cur, lru.front()->n_bytes / (1024.0 * 1024.0));
 
-            states.pop_front();
+            evict_oldest();
         }
     }
 
-    SRV_WRN(" - cache state: %zu prompts, %.3f MiB (limits: %.3f MiB, %zu tokens, %zu est)\n",
-            states.size(), size() / (1024.0 * 1024.0), limit_size / (1024.0 * 1024.0), limit_tokens, limit_tokens_cur);
+    SRV_WRN(" - cache state: %zu prompts, %.3f MiB, %zu nodes, %zu tokens stored for %zu (limits: %.3f MiB, %zu tokens, %zu est)\n",
+            lru.size(), size() / (1024.0 * 1024.0), n_nodes, n_tokens_tree, n_tokens_total,
+            limit_size / (1024.0 * 1024.0), limit_tokens, limit_tokens_cur);
 
-    for (const auto & state : states) {
-        SRV_WRN("   - prompt %p: %7d tokens, checkpoints: %2zu, %9.3f MiB\n",
-                (const void *)&state, state.n_tokens(), state.checkpoints.size(), state.size() / (1024.0 * 1024.0));
+    for (const auto * node : lru) {
+        SRV_WRN("   - prompt %p: %7zu tokens, checkpoints: %2zu, %9.3f MiB\n",
+                (const void *)node, node->depth, node->state->checkpoints.size(), node->n_bytes / (1024.0 * 1024.0));
     }
 }
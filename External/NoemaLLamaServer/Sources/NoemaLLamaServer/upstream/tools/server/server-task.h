@@ -7,12 +7,19 @@
 #include <unordered_set>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
 
 // TODO: prevent including the whole server-common.h as we only use server_tokens
 #include "server-common.h"
 
 using json = nlohmann::ordered_json;
 
+struct server_slot_state;
+
 enum server_task_type {
     SERVER_TASK_TYPE_COMPLETION,
     SERVER_TASK_TYPE_EMBEDDING,
@@ -60,6 +67,13 @@ struct task_params {
 
     int32_t n_cache_reuse = 0; // min chunk size to attempt reusing from the cache via KV shifting (0 = disabled)
 
+    // scheduling of the deferred tasks
+    static constexpr int32_t PRIORITY_MAX = 16; // the "priority" field is clamped to [-PRIORITY_MAX, PRIORITY_MAX]
+
+    int32_t     priority = 0; // priority class, higher runs first with --slot-schedule priority
+    std::string sched_key;    // fair share key: the API key of the request
+    std::string sched_user;   // fair share within the key: the "user" field
+
     int64_t t_max_prompt_ms  = -1; // TODO: implement
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
 
@@ -135,6 +149,9 @@ struct server_task {
     int id_target = -1;
     int id_slot   = -1;
 
+    // time the task was first deferred because no slot was available
+    int64_t t_queued_us = -1;
+
     // used by parallel sampling (multiple completions from same prompt)
     int id_parent  = -1;
     // temporary store of child tasks for scheduling
@@ -158,6 +175,10 @@ struct server_task {
         int id_slot;
         std::string filename;
         std::string filepath;
+        bool compress = false; // save with LZ4 compression
+
+        // set once the file I/O is done, when the task comes back to the decode loop
+        std::shared_ptr<server_slot_state> state;
     };
     slot_action slot_action;
 
@@ -441,10 +462,24 @@ struct server_task_result_cmpl_partial : server_task_result {
     // for Anthropic API: track if any reasoning content has been generated
     bool anthropic_has_reasoning = false;
 
+    // prob_output is populated
+    bool has_probs = false;
+
     virtual bool is_stop() override {
         return false; // in stream mode, partial responses are not considered stop
     }
 
+    // consecutive tokens of a task can be merged into one result while its reader is behind
+    bool can_coalesce() const {
+        return !is_progress && !has_probs;
+    }
+
+    void merge(server_task_result_cmpl_partial && next);
+
+    // one of these is created for every streamed token - recycle the allocations
+    static void * operator new(size_t size);
+    static void operator delete(void * ptr, size_t size);
+
     virtual void update(task_result_state & state) override;
 
     virtual json to_json() override;
@@ -460,6 +495,38 @@ struct server_task_result_cmpl_partial : server_task_result {
     json to_json_anthropic();
 };
 
+// writes the SSE events of the results of a streamed completion
+//
+// to_json() builds a JSON DOM for every streamed token, only to serialize it right away. the chunks that carry nothing
+// but generated text - almost all of them - are written here straight into the output: the parts that stay the same
+// within a stream are escaped once, and only the text is escaped per chunk. the other results go through to_json() and
+// the format_*_sse() functions. both paths produce the same bytes
+struct server_sse_writer {
+    task_response_type res_type = TASK_RESPONSE_TYPE_NONE;
+
+    explicit server_sse_writer(task_response_type res_type) : res_type(res_type) {}
+
+    // replace the content of out with the SSE events of the result, reusing its allocation
+    void write(server_task_result & result, std::string & out);
+
+    // the events of a text-only partial result, false if the result needs the generic path
+    bool write_text(const server_task_result_cmpl_partial & result, std::string & out);
+
+private:
+    // a string of the stream, escaped as a JSON string when it changes
+    struct escaped {
+        std::string raw;
+        std::string esc;
+
+        const std::string & get(const std::string & str);
+    };
+
+    escaped model;
+    escaped cmpl_id;
+    escaped resp_reasoning_id;
+    escaped resp_message_id;
+};
+
 struct server_task_result_embd : server_task_result {
     std::vector<std::vector<float>> embedding;
 
@@ -498,6 +565,54 @@ struct server_task_result_error : server_task_result {
     virtual json to_json() override;
 };
 
+// counters and gauges of server_prompt_cache, reported through /metrics
+struct server_prompt_cache_stats {
+    uint64_t n_lookups      = 0;
+    uint64_t n_hits         = 0;
+    uint64_t n_hit_tokens   = 0; // sum of the hit depths, i.e. prompt tokens that were not evaluated again
+    uint64_t n_bytes_loaded = 0; // state bytes restored into a slot
+    uint64_t t_restore_us   = 0; // time spent restoring states
+    uint64_t n_evicted      = 0;
+
+    uint64_t n_states       = 0;
+    uint64_t n_nodes        = 0;
+    uint64_t n_bytes        = 0;
+    uint64_t n_tokens       = 0;
+    uint64_t n_bytes_shared = 0; // token storage saved by storing shared prefixes once
+
+    // disk tier
+    uint64_t n_disk_hits    = 0;
+    uint64_t n_disk_writes  = 0;
+    uint64_t n_disk_dropped = 0; // evicted states that were not written because the write queue was full
+    uint64_t n_disk_states  = 0;
+    uint64_t n_disk_bytes   = 0;
+};
+
+// per-step batch composition and the prefill budget, reported through /metrics
+struct server_prefill_stats {
+    uint64_t n_steps          = 0;
+    uint64_t n_steps_limited  = 0; // steps where the budget held prompt tokens back
+    uint64_t n_prefill_tokens = 0;
+    uint64_t n_decode_tokens  = 0;
+
+    int32_t n_budget       = 0; // current budget, prompt tokens per step next to generating slots
+    int32_t n_prefill_last = 0;
+    int32_t n_decode_last  = 0;
+    double  t_step_last_ms = 0.0;
+    double  t_decode_ms    = 0.0; // estimated step time without prompt tokens
+    double  t_token_ms     = 0.0; // estimated time per prompt token
+};
+
+// micro-batching of the embedding and rerank inputs of concurrent requests, reported through /metrics
+struct server_embd_batch_stats {
+    uint64_t n_batches = 0;
+    uint64_t n_inputs  = 0;
+    uint64_t n_tokens  = 0;
+    uint64_t t_wait_us = 0; // total time the inputs waited for their batch
+
+    int32_t n_pending = 0;
+};
+
 struct server_task_result_metrics : server_task_result {
     int n_idle_slots;
     int n_processing_slots;
@@ -521,6 +636,12 @@ struct server_task_result_metrics : server_task_result {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    server_prompt_cache_stats         prompt_cache;
+    server_prefill_stats              prefill;
+    server_embd_batch_stats           embd_batch;
+    server_tokenize_cache_stats       tokenize_cache;
+    common_chat_templates_cache_stats chat_template_cache;
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
@@ -603,13 +724,122 @@ struct server_prompt {
     }
 };
 
+// token radix tree over the cached prompts
+//   - each node owns the run of tokens on the edge from its parent, so shared prefixes are stored once
+//   - a node where a cached prompt ends owns its state; lookup walks the new prompt down the tree once
+//   - evicting a state releases the part of its subtree that no other state needs
+struct server_prompt_cache_node {
+    llama_tokens edge;
+
+    server_prompt_cache_node * parent = nullptr;
+
+    // keyed by the first token of the child's edge
+    std::map<llama_token, std::unique_ptr<server_prompt_cache_node>> children;
+
+    // number of tokens from the root to the end of this node
+    size_t depth = 0;
+
+    // the cached prompt that ends here, if any
+    // the tokens of text-only prompts live in the tree; prompts with media also keep their own copy
+    std::unique_ptr<server_prompt> state;
+    size_t n_bytes = 0;
+
+    std::list<server_prompt_cache_node *>::iterator it_lru;
+
+    // the state in this subtree with the fewest tokens - it keeps the largest fraction on a hit
+    server_prompt_cache_node * best = nullptr;
+};
+
+// second tier of server_prompt_cache: states evicted from RAM are written to a directory and promoted
+// back into a slot on a hit. one file per prompt - header, tokens, checkpoints, then the state at a
+// page-aligned offset so that it is restored straight from a read-only mapping
+// files are written by a background thread and indexed by the hashes of their token prefixes, so the
+// cache survives a restart as long as the model and the KV cache types stay the same
+struct server_prompt_disk {
+    struct match {
+        uint64_t id;
+        size_t   lcp;
+        size_t   n_tokens;
+    };
+
+    server_prompt_disk(const std::string & path, int32_t limit_size_mib, uint64_t model_id);
+    ~server_prompt_disk();
+
+    // queue a state for writing, does not block on I/O unless `wait` is set
+    // returns false if the queue is full and the state was dropped
+    bool spill(llama_tokens && tokens, server_prompt && prompt, bool wait = false);
+
+    // cached prompts that share a prefix with `tokens`, deepest first, with the prefix verified against the file
+    std::vector<match> find(const llama_tokens & tokens) const;
+
+    // restore the state of `id` into the slot and remove it from the tier. `has_mtmd` is the flag of the slot's tokens
+    bool load(uint64_t id, server_prompt & prompt, llama_context * ctx, int32_t id_slot, bool has_mtmd, size_t & n_bytes);
+
+    void get_stats(server_prompt_cache_stats & stats) const;
+
+private:
+    struct entry {
+        std::string path;
+
+        size_t  n_tokens = 0;
+        size_t  n_bytes  = 0;
+        int64_t t_write  = 0;
+
+        std::vector<uint64_t> keys;
+
+        std::list<uint64_t>::iterator it_lru;
+    };
+
+    struct pending {
+        llama_tokens  tokens;
+        server_prompt prompt;
+    };
+
+    std::string dir;
+    size_t      limit_size = 0; // in bytes, 0 = no limit
+    uint64_t    model_id   = 0;
+
+    mutable std::mutex mutex;
+
+    // keyed by the hash of the whole prompt
+    std::unordered_map<uint64_t, entry> entries;
+
+    // prefix hash -> id, for every block boundary of a prompt and for its full length
+    std::unordered_multimap<uint64_t, uint64_t> index;
+
+    // oldest first
+    std::list<uint64_t> lru;
+
+    size_t n_bytes_total = 0;
+
+    uint64_t n_writes  = 0;
+    uint64_t n_dropped = 0;
+
+    std::list<pending>      queue;
+    std::condition_variable cv;
+    bool                    running = true;
+    std::thread             writer;
+
+    void write_loop();
+    bool write(const pending & cur);
+
+    // the following require the mutex
+    void add(uint64_t id, entry && e, const llama_tokens & tokens);
+    void erase(uint64_t id, bool unlink_file);
+    void evict();
+};
+
 struct server_prompt_cache {
     server_prompt_cache(int32_t limit_size_mib, size_t limit_tokens) {
         this->limit_size   = 1024ull*1024ull*(limit_size_mib < 0 ? 0 : limit_size_mib);
         this->limit_tokens = limit_tokens;
     }
 
-    std::list<server_prompt> states;
+    // moves the remaining states to the disk tier, if there is one
+    ~server_prompt_cache();
+
+    // optional second tier for the states evicted from RAM
+    std::unique_ptr<server_prompt_disk> disk;
 
     // in bytes, 0 = no limit
     size_t limit_size = 0;
@@ -621,9 +851,40 @@ struct server_prompt_cache {
 
     size_t n_tokens() const;
 
+    size_t n_states() const;
+
+    server_prompt_cache_stats get_stats() const;
+
     server_prompt * alloc(const server_prompt & prompt, size_t state_size);
 
     bool load(server_prompt & prompt, const server_tokens & tokens_new, llama_context * ctx, int32_t id_slot);
 
     void update();
+
+private:
+    server_prompt_cache_node root;
+
+    // nodes that own a state, least recently used first
+    std::list<server_prompt_cache_node *> lru;
+
+    size_t n_bytes_total  = 0;
+    size_t n_tokens_total = 0; // sum of the cached prompt lengths
+    size_t n_tokens_tree  = 0; // tokens actually stored on the edges
+    size_t n_nodes        = 0;
+
+    server_prompt_cache_stats stats;
+
+    // returns the node where `tokens` ends, splitting an edge or adding a leaf if needed
+    server_prompt_cache_node * insert(const llama_tokens & tokens);
+
+    // drops the state of `node` and prunes or merges the nodes that are no longer needed
+    void remove(server_prompt_cache_node * node);
+
+    // removes the least recently used state, handing it to the disk tier if there is one
+    void evict_oldest();
+
+    // recompute `best` from `node` up to the root
+    void refresh(server_prompt_cache_node * node);
+
+    llama_tokens path(const server_prompt_cache_node * node) const;
 };
@@ -0,0 +1,204 @@
+// test of the micro-batching of the embedding and rerank inputs (server_embd_batcher)
+//
+// the batcher is driven with explicit timestamps: the inputs must wait for the window of the oldest one unless they
+// fill a batch by tokens or by sequences, a batch only packs inputs of the same type and adapters as the oldest one,
+// the other inputs keep their order for the next batches, and a cancelled input leaves no trace in the batches or in
+// the token count
+//
+// usage: test-embd-batcher
+
+#include "server-schedule.h"
+
+#include "llama.h"
+
+#include <cstdio>
+#include <map>
+#include <vector>
+
+static int n_failed = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "error: %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            n_failed++; \
+        } \
+    } while (0)
+
+static server_task make_task(int id, server_task_type type, int n_tokens, const std::map<int, float> & lora = {}) {
+    server_task task(type);
+    task.id          = id;
+    task.tokens      = server_tokens(llama_tokens(n_tokens, 1), false);
+    task.params.lora = lora;
+    return task;
+}
+
+static std::vector<int> ids(const std::vector<server_task> & tasks) {
+    std::vector<int> res;
+    for (const auto & task : tasks) {
+        res.push_back(task.id);
+    }
+    return res;
+}
+
+// the oldest input waits for the window, unless the pending inputs fill a batch
+static void test_window() {
+    server_embd_batcher b;
+    b.init(10, 64, 8);
+
+    CHECK(b.enabled());
+    CHECK(b.empty());
+    CHECK(!b.ready(0));
+
+    b.push(make_task(1, SERVER_TASK_TYPE_EMBEDDING, 4), 1000);
+    b.push(make_task(2, SERVER_TASK_TYPE_EMBEDDING, 4), 6000);
+
+    CHECK(!b.ready(1000));
+    CHECK(b.t_wait_us(1000) == 10000);
+    CHECK(!b.ready(10999));
+    CHECK(b.t_wait_us(10999) == 1);
+    CHECK(b.ready(11000));
+    CHECK(b.t_wait_us(20000) == 0);
+
+    CHECK(ids(b.take(11000)) == std::vector<int>({ 1, 2 }));
+    CHECK(b.empty());
+
+    const auto stats = b.get_stats();
+    CHECK(stats.n_batches == 1);
+    CHECK(stats.n_inputs  == 2);
+    CHECK(stats.n_tokens  == 8);
+    CHECK(stats.t_wait_us == 10000 + 5000);
+    CHECK(stats.n_pending == 0);
+
+    // the window of the next input starts when it is queued
+    b.push(make_task(3, SERVER_TASK_TYPE_EMBEDDING, 4), 50000);
+    CHECK(!b.ready(59999));
+    CHECK(b.ready(60000));
+
+    // no window: the queued inputs run right away
+    server_embd_batcher b0;
+    b0.init(0, 64, 8);
+    b0.push(make_task(1, SERVER_TASK_TYPE_EMBEDDING, 4), 0);
+    CHECK(b0.ready(0));
+
+    server_embd_batcher b_off;
+    b_off.init(-1, 64, 8);
+    CHECK(!b_off.enabled());
+}
+
+// a batch holds at most n_tokens_max tokens, the inputs that do not fit wait in order for the next one
+static void test_token_cap() {
+    server_embd_batcher b;
+    b.init(1000, 64, 8);
+
+    b.push(make_task(1, SERVER_TASK_TYPE_EMBEDDING, 30), 0);
+    b.push(make_task(2, SERVER_TASK_TYPE_EMBEDDING, 20), 0);
+    CHECK(!b.ready(0));
+
+    b.push(make_task(3, SERVER_TASK_TYPE_EMBEDDING, 20), 0); // 70 tokens pending
+    b.push(make_task(4, SERVER_TASK_TYPE_EMBEDDING, 10), 0);
+    CHECK(b.ready(0));
+
+    // 3 does not fit after 1 and 2, the smaller 4 behind it does
+    CHECK(ids(b.take(0)) == std::vector<int>({ 1, 2, 4 }));
+    CHECK(!b.ready(0));
+    CHECK(ids(b.take(0)) == std::vector<int>({ 3 }));
+
+    // an input of n_tokens_max alone fills a batch
+    b.push(make_task(5, SERVER_TASK_TYPE_EMBEDDING, 64), 0);
+    CHECK(b.ready(0));
+    CHECK(ids(b.take(0)) == std::vector<int>({ 5 }));
+}
+
+// a batch holds at most n_seq_max inputs, which is bounded by the seq ids llama_batch accepts
+static void test_seq_cap() {
+    server_embd_batcher b;
+    b.init(1000, 64, 3);
+
+    b.push(make_task(1, SERVER_TASK_TYPE_EMBEDDING, 1), 0);
+    b.push(make_task(2, SERVER_TASK_TYPE_EMBEDDING, 1), 0);
+    CHECK(!b.ready(0));
+
+    b.push(make_task(3, SERVER_TASK_TYPE_EMBEDDING, 1), 0);
+    b.push(make_task(4, SERVER_TASK_TYPE_EMBEDDING, 1), 0);
+    CHECK(b.ready(0));
+
+    CHECK(ids(b.take(0)) == std::vector<int>({ 1, 2, 3 }));
+    CHECK(!b.ready(0));
+    CHECK(ids(b.take(0)) == std::vector<int>({ 4 }));
+
+    server_embd_batcher b_max;
+    b_max.init(0, 1 << 20, 1 << 20);
+    CHECK(b_max.n_seq_max == (int32_t) llama_max_parallel_sequences());
+}
+
+// a batch only takes the inputs of the same type and adapters as the oldest one
+static void test_packing() {
+    server_embd_batcher b;
+    b.init(0, 64, 8);
+
+    const std::map<int, float> lora_a = { { 0, 1.0f } };
+    const std::map<int, float> lora_b = { { 0, 0.5f } };
+
+    b.push(make_task(1, SERVER_TASK_TYPE_EMBEDDING, 4),         0);
+    b.push(make_task(2, SERVER_TASK_TYPE_RERANK,    4),         0);
+    b.push(make_task(3, SERVER_TASK_TYPE_EMBEDDING, 4, lora_a), 0);
+    b.push(make_task(4, SERVER_TASK_TYPE_EMBEDDING, 4),         0);
+    b.push(make_task(5, SERVER_TASK_TYPE_RERANK,    4),         0);
+    b.push(make_task(6, SERVER_TASK_TYPE_EMBEDDING, 4, lora_b), 0);
+    b.push(make_task(7, SERVER_TASK_TYPE_EMBEDDING, 4, lora_a), 0);
+
+    CHECK(ids(b.take(0)) == std::vector<int>({ 1, 4 }));
+    CHECK(ids(b.take(0)) == std::vector<int>({ 2, 5 }));
+    CHECK(ids(b.take(0)) == std::vector<int>({ 3, 7 }));
+    CHECK(ids(b.take(0)) == std::vector<int>({ 6 }));
+    CHECK(b.empty());
+    CHECK(b.take(0).empty());
+
+    const auto stats = b.get_stats();
+    CHECK(stats.n_batches == 4);
+    CHECK(stats.n_inputs  == 7);
+    CHECK(stats.n_tokens  == 28);
+}
+
+// a cancelled input is dropped with its tokens
+static void test_cancel() {
+    server_embd_batcher b;
+    b.init(1000, 64, 8);
+
+    b.push(make_task(1, SERVER_TASK_TYPE_EMBEDDING, 10), 0);
+    b.push(make_task(2, SERVER_TASK_TYPE_EMBEDDING, 40), 0);
+    b.push(make_task(3, SERVER_TASK_TYPE_EMBEDDING, 20), 0);
+    CHECK(b.ready(0)); // 70 tokens pending
+
+    CHECK(b.cancel(2));
+    CHECK(!b.cancel(2));
+    CHECK(!b.cancel(42));
+    CHECK(!b.ready(0)); // 30 tokens pending
+    CHECK(b.get_stats().n_pending == 2);
+
+    // the oldest input can be cancelled, the window then follows the next one
+    b.push(make_task(4, SERVER_TASK_TYPE_EMBEDDING, 10), 500000);
+    CHECK(b.cancel(1));
+    CHECK(b.t_wait_us(500000) == 500000);
+
+    CHECK(ids(b.take(1000000)) == std::vector<int>({ 3, 4 }));
+    CHECK(b.empty());
+    CHECK(!b.cancel(3));
+
+    const auto stats = b.get_stats();
+    CHECK(stats.n_inputs == 2);
+    CHECK(stats.n_tokens == 30);
+}
+
+int main() {
+    test_window();
+    test_token_cap();
+    test_seq_cap();
+    test_packing();
+    test_cancel();
+
+    printf(n_failed == 0 ? "OK\n" : "FAIL\n");
+
+    return n_failed == 0 ? 0 : 1;
+}
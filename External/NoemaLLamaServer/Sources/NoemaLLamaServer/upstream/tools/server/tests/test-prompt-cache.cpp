@@ -0,0 +1,278 @@
+// test of the token radix tree of the server prompt cache, with and without mtmd
+//
+// a server started with a multimodal projector marks every prompt with has_mtmd, including text-only ones, and the
+// cache has to index those as well. the same sequence of saves and lookups is replayed with has_mtmd off and on, and
+// the hits, the restored prompts and the cache stats must be the same. the states are the (empty) sequence state of
+// a tiny random model that is written to a temporary file, so the restores go through llama_state_seq_set_data_ext
+//
+// the disk tier is checked the same way: text-only prompts are spilled with and without has_mtmd, restored by a new
+// cache over the same directory, and ignored by a cache opened for another model
+//
+// usage: test-prompt-cache
+
+#include "server-common.h"
+#include "server-task.h"
+
+#include "ggml.h"
+#include "gguf.h"
+#include "llama.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+static const int n_embd  = 64;
+static const int n_vocab = 256;
+
+static bool write_model(const std::string & path) {
+    gguf_context * gctx = gguf_init_empty();
+    gguf_set_val_str(gctx, "general.architecture", "llama");
+    gguf_set_val_u32(gctx, "llama.block_count", 1);
+    gguf_set_val_u32(gctx, "llama.context_length", 256);
+    gguf_set_val_u32(gctx, "llama.embedding_length", n_embd);
+    gguf_set_val_u32(gctx, "llama.feed_forward_length", 2*n_embd);
+    gguf_set_val_u32(gctx, "llama.attention.head_count", 4);
+    gguf_set_val_u32(gctx, "llama.attention.head_count_kv", 4);
+    gguf_set_val_f32(gctx, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+    gguf_set_val_u32(gctx, "llama.vocab_size", n_vocab);
+    gguf_set_val_str(gctx, "tokenizer.ggml.model", "none");
+
+    ggml_init_params params = { 16ull << 20, nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+
+    const auto add = [&](const char * name, int64_t ne0, int64_t ne1) {
+        ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name);
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = ne1 > 0 ? 0.01f*((i*7919) % 201 - 100)/100.0f : 1.0f;
+        }
+        gguf_add_tensor(gctx, t);
+    };
+
+    add("token_embd.weight",         n_embd,   n_vocab);
+    add("output_norm.weight",        n_embd,   0);
+    add("output.weight",             n_embd,   n_vocab);
+    add("blk.0.attn_norm.weight",    n_embd,   0);
+    add("blk.0.attn_q.weight",       n_embd,   n_embd);
+    add("blk.0.attn_k.weight",       n_embd,   n_embd);
+    add("blk.0.attn_v.weight",       n_embd,   n_embd);
+    add("blk.0.attn_output.weight",  n_embd,   n_embd);
+    add("blk.0.ffn_norm.weight",     n_embd,   0);
+    add("blk.0.ffn_gate.weight",     n_embd,   2*n_embd);
+    add("blk.0.ffn_up.weight",       n_embd,   2*n_embd);
+    add("blk.0.ffn_down.weight",     2*n_embd, n_embd);
+
+    const bool ok = gguf_write_to_file(gctx, path.c_str(), false);
+
+    gguf_free(gctx);
+    ggml_free(ctx);
+
+    return ok;
+}
+
+static llama_tokens range(llama_token first, int n) {
+    llama_tokens res(n);
+    for (int i = 0; i < n; ++i) {
+        res[i] = first + i;
+    }
+    return res;
+}
+
+static llama_tokens concat(llama_tokens a, const llama_tokens & b) {
+    a.insert(a.end(), b.begin(), b.end());
+    return a;
+}
+
+struct test_result {
+    std::vector<size_t> restored; // length of the prompt in the slot after each lookup, 0 if there was no hit
+    uint64_t n_hits   = 0;
+    uint64_t n_states = 0;
+    uint64_t n_nodes  = 0;
+    uint64_t n_tokens = 0;
+
+    bool operator==(const test_result & other) const {
+        return restored == other.restored && n_hits == other.n_hits && n_states == other.n_states &&
+               n_nodes == other.n_nodes && n_tokens == other.n_tokens;
+    }
+};
+
+static void save(server_prompt_cache & cache, const llama_tokens & tokens, bool has_mtmd, const std::vector<uint8_t> & state) {
+    const server_prompt prompt = { server_tokens(tokens, has_mtmd), {}, {} };
+
+    server_prompt * cur = cache.alloc(prompt, state.size());
+    if (cur != nullptr) {
+        cur->data = state;
+    }
+}
+
+static int run(llama_context * ctx, bool has_mtmd, const std::vector<uint8_t> & state, test_result & res) {
+    server_prompt_cache cache(64, 0);
+
+    const llama_tokens a = concat(range(1, 10), range(20, 10)); // 1..10 20..29
+    const llama_tokens b = concat(range(1, 10), range(50, 10)); // 1..10 50..59, branches off a
+    const llama_tokens c = range(1, 5);                         // contained in both
+
+    save(cache, a, has_mtmd, state);
+    save(cache, b, has_mtmd, state);
+    save(cache, c, has_mtmd, state); // already in the cache
+    save(cache, a, has_mtmd, state); // already in the cache
+
+    const std::vector<llama_tokens> lookups = {
+        concat(range(1, 10), range(50, 8)),  // b, lcp 18 of 20
+        concat(range(1, 10), range(20, 12)), // a, lcp 20 of 20
+        range(100, 10),                      // nothing in common
+    };
+
+    for (const auto & tokens : lookups) {
+        server_prompt prompt = { server_tokens(llama_tokens(), has_mtmd), {}, {} };
+        const server_tokens tokens_new(tokens, has_mtmd);
+
+        if (!cache.load(prompt, tokens_new, ctx, 0)) {
+            fprintf(stderr, "error: load failed (has_mtmd = %d)\n", has_mtmd);
+            return 1;
+        }
+
+        if (!prompt.tokens.empty() && prompt.tokens.get_common_prefix(tokens_new) < tokens.size()/2) {
+            fprintf(stderr, "error: restored a prompt that does not match the lookup (has_mtmd = %d)\n", has_mtmd);
+            return 1;
+        }
+
+        res.restored.push_back(prompt.tokens.size());
+    }
+
+    const server_prompt_cache_stats stats = cache.get_stats();
+
+    res.n_hits   = stats.n_hits;
+    res.n_states = stats.n_states;
+    res.n_nodes  = stats.n_nodes;
+    res.n_tokens = stats.n_tokens;
+
+    printf("has_mtmd = %d: restored", has_mtmd);
+    for (size_t n : res.restored) {
+        printf(" %zu", n);
+    }
+    printf(", hits %llu, states %llu, nodes %llu, tokens %llu\n",
+            (unsigned long long) res.n_hits, (unsigned long long) res.n_states,
+            (unsigned long long) res.n_nodes, (unsigned long long) res.n_tokens);
+
+    return 0;
+}
+
+static int run_disk(llama_context * ctx, bool has_mtmd, const std::vector<uint8_t> & state) {
+    const std::string dir = "test-prompt-cache.d";
+    std::filesystem::remove_all(dir);
+
+    const uint64_t model_id = 0x1234;
+
+    {
+        server_prompt_cache cache(64, 0);
+        cache.disk = std::make_unique<server_prompt_disk>(dir, 64, model_id);
+
+        save(cache, concat(range(1, 10), range(20, 10)), has_mtmd, state);
+        save(cache, concat(range(1, 10), range(50, 10)), has_mtmd, state);
+
+        // the destructor spills the states still in RAM
+    }
+
+    // (model id, lookup, expected restored length)
+    const struct {
+        uint64_t     model_id;
+        llama_tokens tokens;
+        size_t       n_restored;
+    } cases[] = {
+        { model_id,     concat(range(1, 10), range(20, 12)), 20 },
+        { model_id,     concat(range(1, 10), range(50, 12)), 20 },
+        { model_id + 1, concat(range(1, 10), range(20, 12)),  0 }, // written for another model
+    };
+
+    int ret = 0;
+
+    for (const auto & c : cases) {
+        server_prompt_cache cache(64, 0);
+        cache.disk = std::make_unique<server_prompt_disk>(dir, 64, c.model_id);
+
+        server_prompt prompt = { server_tokens(llama_tokens(), has_mtmd), {}, {} };
+        const server_tokens tokens_new(c.tokens, has_mtmd);
+
+        if (!cache.load(prompt, tokens_new, ctx, 0)) {
+            fprintf(stderr, "error: disk load failed (has_mtmd = %d)\n", has_mtmd);
+            ret = 1;
+            break;
+        }
+
+        const server_prompt_cache_stats stats = cache.get_stats();
+
+        printf("has_mtmd = %d, disk: restored %zu, disk hits %llu\n", has_mtmd, prompt.tokens.size(), (unsigned long long) stats.n_disk_hits);
+
+        if (prompt.tokens.size() != c.n_restored || stats.n_disk_hits != (c.n_restored > 0 ? 1u : 0u) ||
+            prompt.tokens.has_mtmd != has_mtmd) {
+            fprintf(stderr, "error: unexpected disk restore (has_mtmd = %d)\n", has_mtmd);
+            ret = 1;
+            break;
+        }
+
+        // put the state back, so that the next case finds it on disk again
+        if (!prompt.tokens.empty()) {
+            save(cache, prompt.tokens.get_tokens_raw(), has_mtmd, state);
+        }
+    }
+
+    std::filesystem::remove_all(dir);
+
+    return ret;
+}
+
+int main() {
+    const std::string path = "test-prompt-cache.gguf";
+    if (!write_model(path)) {
+        fprintf(stderr, "error: failed to write %s\n", path.c_str());
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    llama_model * model = llama_model_load_from_file(path.c_str(), mparams);
+    remove(path.c_str());
+    if (model == nullptr) {
+        fprintf(stderr, "error: failed to load the test model\n");
+        return 1;
+    }
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = 256;
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    std::vector<uint8_t> state(llama_state_seq_get_size_ext(ctx, 0, 0));
+    state.resize(llama_state_seq_get_data_ext(ctx, state.data(), state.size(), 0, 0));
+
+    test_result res_text;
+    test_result res_mtmd;
+
+    int ret = run(ctx, false, state, res_text) || run(ctx, true, state, res_mtmd);
+
+    if (ret == 0 && !(res_text == res_mtmd)) {
+        fprintf(stderr, "error: the results with and without mtmd differ\n");
+        ret = 1;
+    }
+
+    if (ret == 0 && res_text.restored != std::vector<size_t> { 20, 20, 0 }) {
+        fprintf(stderr, "error: unexpected hits\n");
+        ret = 1;
+    }
+
+    if (ret == 0) {
+        ret = run_disk(ctx, false, state) || run_disk(ctx, true, state);
+    }
+
+    llama_free(ctx);
+    llama_model_free(model);
+    llama_backend_free();
+
+    printf(ret == 0 ? "OK\n" : "FAIL\n");
+
+    return ret;
+}
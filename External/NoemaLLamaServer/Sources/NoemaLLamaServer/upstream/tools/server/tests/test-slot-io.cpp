@@ -0,0 +1,365 @@
+// test of the slot files written and read on the I/O thread (server_slot_state) and of their LZ4 block codec
+//
+// random and structured buffers must round-trip through server_lz4_compress/server_lz4_decompress, and slot states
+// through compressed and uncompressed slot files. malformed LZ4 data and malformed slot files (bad offsets, truncated
+// blocks, block headers that do not add up, an oversize uncompressed size) must be rejected with an error, without
+// reading out of bounds or allocating the claimed size
+//
+// usage: test-slot-io
+
+#include "server-slot-io.h"
+
+#include "llama.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+static int n_failed = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "error: %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            n_failed++; \
+        } \
+    } while (0)
+
+static std::mt19937 rng(42);
+
+static std::vector<uint8_t> random_bytes(size_t n) {
+    std::vector<uint8_t> res(n);
+    for (auto & b : res) {
+        b = (uint8_t) rng();
+    }
+    return res;
+}
+
+// data that compresses: runs, short repeats, a small alphabet and slowly varying f16-like words, as in a KV cache
+static std::vector<uint8_t> structured_bytes(size_t n) {
+    std::vector<uint8_t> res;
+    res.reserve(n);
+    while (res.size() < n) {
+        const size_t len = rng() % 500;
+        switch (rng() % 4) {
+            case 0: res.insert(res.end(), len, (uint8_t) rng()); break;
+            case 1: {
+                const size_t period = 1 + rng() % 16;
+                const size_t start  = res.size();
+                for (size_t i = 0; i < period; ++i) {
+                    res.push_back((uint8_t) rng());
+                }
+                for (size_t i = 0; i < len; ++i) {
+                    res.push_back(res[start + i % period]);
+                }
+            } break;
+            case 2: {
+                for (size_t i = 0; i < len; ++i) {
+                    res.push_back("abcd"[rng() % 4]);
+                }
+            } break;
+            case 3: {
+                uint16_t v = (uint16_t) rng();
+                for (size_t i = 0; i < len; ++i) {
+                    v += rng() % 3;
+                    res.push_back((uint8_t) (v & 0xff));
+                    res.push_back((uint8_t) (v >> 8));
+                }
+            } break;
+        }
+    }
+    res.resize(n);
+    return res;
+}
+
+static void check_round_trip(const std::vector<uint8_t> & src) {
+    std::vector<uint8_t> comp(server_lz4_compress_bound(src.size()));
+    const size_t n_comp = server_lz4_compress(src.data(), src.size(), comp.data());
+    CHECK(n_comp <= comp.size());
+
+    std::vector<uint8_t> dst(src.size());
+    CHECK(server_lz4_decompress(comp.data(), n_comp, dst.data(), dst.size()) == (int64_t) src.size());
+    CHECK(dst == src);
+
+    // the output does not fit
+    if (!src.empty()) {
+        std::vector<uint8_t> small(src.size() - 1);
+        CHECK(server_lz4_decompress(comp.data(), n_comp, small.data(), small.size()) == -1);
+    }
+}
+
+static void test_lz4() {
+    const size_t sizes[] = { 0, 1, 5, 12, 13, 16, 17, 100, 255, 256, 4096, 65535, 65536, 70000, 300000 };
+
+    for (size_t n : sizes) {
+        check_round_trip(random_bytes(n));
+        check_round_trip(structured_bytes(n));
+        check_round_trip(std::vector<uint8_t>(n, 0));
+    }
+
+    // matches at the max offset
+    {
+        auto src = random_bytes(65535 + 1000);
+        memcpy(src.data() + 65535, src.data(), 1000);
+        check_round_trip(src);
+    }
+
+    // structured data compresses, long runs close to the limit of the format
+    {
+        const auto src = structured_bytes(1 << 20);
+        std::vector<uint8_t> comp(server_lz4_compress_bound(src.size()));
+        CHECK(server_lz4_compress(src.data(), src.size(), comp.data()) < src.size());
+
+        const std::vector<uint8_t> zeros(1 << 20, 0);
+        CHECK(server_lz4_compress(zeros.data(), zeros.size(), comp.data()) < zeros.size()/200);
+    }
+
+    uint8_t dst[64];
+
+    // a match with offset 0
+    {
+        const uint8_t src[] = { 0x10, 'a', 0x00, 0x00, 0x00 };
+        CHECK(server_lz4_decompress(src, sizeof(src), dst, sizeof(dst)) == -1);
+    }
+
+    // a match before the start of the output
+    {
+        const uint8_t src[] = { 0x10, 'a', 0x02, 0x00, 0x00 };
+        CHECK(server_lz4_decompress(src, sizeof(src), dst, sizeof(dst)) == -1);
+    }
+
+    // an overlapping match that repeats the last byte
+    {
+        const uint8_t src[] = { 0x14, 'a', 0x01, 0x00, 0x50, 'b', 'c', 'd', 'e', 'f' };
+        CHECK(server_lz4_decompress(src, sizeof(src), dst, sizeof(dst)) == 1 + 8 + 5);
+        CHECK(memcmp(dst, "aaaaaaaaabcdef", 14) == 0);
+    }
+
+    // literals past the end of the input
+    {
+        const uint8_t src[] = { 0x50, 'a', 'b' };
+        CHECK(server_lz4_decompress(src, sizeof(src), dst, sizeof(dst)) == -1);
+    }
+
+    // a literal length that is cut off
+    {
+        const uint8_t src[] = { 0xf0, 0xff, 0xff };
+        CHECK(server_lz4_decompress(src, sizeof(src), dst, sizeof(dst)) == -1);
+    }
+
+    // an offset that is cut off
+    {
+        const uint8_t src[] = { 0x10, 'a', 0x01 };
+        CHECK(server_lz4_decompress(src, sizeof(src), dst, sizeof(dst)) == -1);
+    }
+
+    // a match length that is cut off
+    {
+        const uint8_t src[] = { 0x1f, 'a', 0x01, 0x00, 0xff };
+        CHECK(server_lz4_decompress(src, sizeof(src), dst, sizeof(dst)) == -1);
+    }
+
+    // a match longer than the output
+    {
+        const uint8_t src[] = { 0x1f, 'a', 0x01, 0x00, 0xff, 0x00 };
+        CHECK(server_lz4_decompress(src, sizeof(src), dst, sizeof(dst)) == -1);
+    }
+
+    // random garbage must not read or write out of bounds
+    for (int i = 0; i < 1000; ++i) {
+        const auto src = random_bytes(1 + rng() % 256);
+        std::vector<uint8_t> out(rng() % 1024);
+        const int64_t n = server_lz4_decompress(src.data(), src.size(), out.data(), out.size());
+        CHECK(n >= -1 && n <= (int64_t) out.size());
+    }
+}
+
+static std::vector<uint8_t> read_file(const std::string & path) {
+    std::vector<uint8_t> res(std::filesystem::file_size(path));
+    FILE * f = fopen(path.c_str(), "rb");
+    if (f != nullptr) {
+        res.resize(fread(res.data(), 1, res.size(), f));
+        fclose(f);
+    }
+    return res;
+}
+
+static void write_file(const std::string & path, const std::vector<uint8_t> & data) {
+    FILE * f = fopen(path.c_str(), "wb");
+    if (f != nullptr) {
+        if (!data.empty()) {
+            fwrite(data.data(), 1, data.size(), f);
+        }
+        fclose(f);
+    }
+}
+
+static bool read_fails(const std::string & path) {
+    server_slot_state state;
+    const bool ok = state.read(path);
+    return !ok && !state.error.empty() && state.data == nullptr;
+}
+
+static void test_slot_file(const std::string & dir) {
+    const std::string path = dir + "/slot.bin";
+
+    llama_tokens tokens(1000);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        tokens[i] = (llama_token) (rng() % 32000);
+    }
+
+    // more than one block, half of them do not compress
+    std::vector<uint8_t> data = structured_bytes(6u << 20);
+    {
+        const auto noise = random_bytes(3u << 20);
+        data.insert(data.end(), noise.begin(), noise.end());
+    }
+
+    for (bool compress : { false, true }) {
+        server_slot_state out;
+        out.tokens = tokens;
+        out.buf    = data;
+        CHECK(out.write(path, compress));
+        CHECK(out.error.empty());
+        CHECK(!std::filesystem::exists(path + ".tmp"));
+
+        server_slot_state in;
+        CHECK(in.read(path));
+        CHECK(in.error.empty());
+        CHECK(in.compressed == compress);
+        CHECK(in.tokens == tokens);
+        CHECK(in.size == data.size() && in.data != nullptr && memcmp(in.data, data.data(), data.size()) == 0);
+        CHECK(in.n_file_bytes == std::filesystem::file_size(path));
+
+        in.release();
+        CHECK(in.data == nullptr && in.size == 0 && in.tokens.empty());
+    }
+
+    // an empty state
+    {
+        server_slot_state out;
+        CHECK(out.write(path, true));
+
+        server_slot_state in;
+        CHECK(in.read(path));
+        CHECK(in.tokens.empty() && in.size == 0);
+    }
+
+    {
+        server_slot_state out;
+        out.tokens = tokens;
+        out.buf    = data;
+        CHECK(out.write(path, true));
+    }
+
+    const auto file = read_file(path);
+
+    // the file header: u32 magic, u32 version, u64 n_raw, then the first block header: u32 n_block, u32 n_comp
+    const size_t off_n_raw  = 8;
+    const size_t off_n_comp = 16 + 4;
+
+    const auto patch = [&](size_t off, const void * v, size_t n) {
+        auto res = file;
+        memcpy(res.data() + off, v, n);
+        return res;
+    };
+
+    // an oversize n_raw is rejected before anything is allocated
+    for (uint64_t n_raw : { (uint64_t) -1, (uint64_t) 1 << 40, (uint64_t) file.size()*255, (uint64_t) 0 }) {
+        write_file(path, patch(off_n_raw, &n_raw, sizeof(n_raw)));
+        CHECK(read_fails(path));
+    }
+
+    // an n_raw that is off by one from the sum of the blocks
+    {
+        uint64_t n_raw;
+        memcpy(&n_raw, file.data() + off_n_raw, sizeof(n_raw));
+        for (uint64_t v : { n_raw - 1, n_raw + 1 }) {
+            write_file(path, patch(off_n_raw, &v, sizeof(v)));
+            CHECK(read_fails(path));
+        }
+    }
+
+    // a block that claims more data than the file has
+    {
+        const uint32_t n_comp = (uint32_t) file.size();
+        write_file(path, patch(off_n_comp, &n_comp, sizeof(n_comp)));
+        CHECK(read_fails(path));
+    }
+
+    // a block larger than the block size of the format
+    {
+        const uint32_t n_block = 0xffffffffu;
+        write_file(path, patch(16, &n_block, sizeof(n_block)));
+        CHECK(read_fails(path));
+    }
+
+    // truncated files, including cuts inside the headers and inside the blocks
+    for (size_t n : { (size_t) 0, (size_t) 4, (size_t) 15, (size_t) 16, (size_t) 20, (size_t) 24, (size_t) 100, file.size()/2, file.size() - 1 }) {
+        write_file(path, std::vector<uint8_t>(file.begin(), file.begin() + n));
+        CHECK(read_fails(path));
+    }
+
+    // trailing garbage
+    {
+        auto res = file;
+        res.push_back(0);
+        write_file(path, res);
+        CHECK(read_fails(path));
+    }
+
+    // corrupt compressed data in the first block: bad offsets and lengths are rejected, corrupt literals are not
+    // detected by the format, so the read only has to stay in bounds
+    for (int i = 0; i < 200; ++i) {
+        auto res = file;
+        for (int k = 0; k < 8; ++k) {
+            res[24 + rng() % 4096] = (uint8_t) rng();
+        }
+        write_file(path, res);
+
+        server_slot_state in;
+        if (!in.read(path)) {
+            CHECK(!in.error.empty());
+        }
+    }
+
+    // unknown version
+    {
+        const uint32_t version = 99;
+        write_file(path, patch(4, &version, sizeof(version)));
+        CHECK(read_fails(path));
+    }
+
+    // an uncompressed file with more tokens than bytes, and one that is not a slot file
+    {
+        const uint32_t hdr[3] = { LLAMA_STATE_SEQ_MAGIC, LLAMA_STATE_SEQ_VERSION, 1000000 };
+        std::vector<uint8_t> res(sizeof(hdr) + 16);
+        memcpy(res.data(), hdr, sizeof(hdr));
+        write_file(path, res);
+        CHECK(read_fails(path));
+
+        write_file(path, random_bytes(100));
+        CHECK(read_fails(path));
+    }
+
+    // a missing file
+    std::filesystem::remove(path);
+    CHECK(read_fails(path));
+}
+
+int main() {
+    const std::string dir = (std::filesystem::temp_directory_path() / ("test-slot-io-" + std::to_string(rng()))).string();
+    std::filesystem::create_directories(dir);
+
+    test_lz4();
+    test_slot_file(dir);
+
+    std::filesystem::remove_all(dir);
+
+    printf(n_failed == 0 ? "OK\n" : "FAIL\n");
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,375 @@
+// test of speculative decoding with a draft context shared by several slots
+//
+// the server drafts for all of its slots through one draft context, evaluating the sequences of all slots in the same
+// batches (common_speculative_draft_batch). the same greedy generation is run for n_seq slots three times: without
+// speculation, with a draft context per slot, and with the shared draft context. the drafts of the two speculative runs
+// and the generated tokens of all three runs must be the same. the target and the draft model are tiny random models
+// written to temporary files, and the time spent drafting is reported for both speculative runs
+//
+// usage: test-speculative-shared [n_seq=8] [n_gen=64]
+
+#include "common.h"
+#include "sampling.h"
+#include "speculative.h"
+
+#include "ggml.h"
+#include "gguf.h"
+#include "llama.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static const int n_embd  = 128;
+static const int n_vocab = 512;
+
+// SPM vocab: <unk> <s> </s>, the byte tokens, then plain text tokens
+static void add_vocab(gguf_context * gctx) {
+    std::vector<std::string> texts;
+    std::vector<float>       scores;
+    std::vector<int32_t>     types;
+
+    const auto add = [&](const std::string & text, int32_t type) {
+        texts.push_back(text);
+        scores.push_back(-(float) texts.size());
+        types.push_back(type);
+    };
+
+    add("<unk>", LLAMA_TOKEN_TYPE_UNKNOWN);
+    add("<s>",   LLAMA_TOKEN_TYPE_CONTROL);
+    add("</s>",  LLAMA_TOKEN_TYPE_CONTROL);
+    for (int i = 0; i < 256; ++i) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "<0x%02X>", i);
+        add(buf, LLAMA_TOKEN_TYPE_BYTE);
+    }
+    while ((int) texts.size() < n_vocab) {
+        add("\xe2\x96\x81t" + std::to_string(texts.size()), LLAMA_TOKEN_TYPE_NORMAL);
+    }
+
+    std::vector<const char *> ptrs;
+    for (const auto & t : texts) {
+        ptrs.push_back(t.c_str());
+    }
+
+    gguf_set_val_str(gctx, "tokenizer.ggml.model", "llama");
+    gguf_set_arr_str(gctx, "tokenizer.ggml.tokens", ptrs.data(), ptrs.size());
+    gguf_set_arr_data(gctx, "tokenizer.ggml.scores", GGUF_TYPE_FLOAT32, scores.data(), scores.size());
+    gguf_set_arr_data(gctx, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, types.data(), types.size());
+}
+
+static bool write_model(const std::string & path, int n_layer, uint32_t seed) {
+    gguf_context * gctx = gguf_init_empty();
+    gguf_set_val_str(gctx, "general.architecture", "llama");
+    gguf_set_val_u32(gctx, "llama.block_count", n_layer);
+    gguf_set_val_u32(gctx, "llama.context_length", 1024);
+    gguf_set_val_u32(gctx, "llama.embedding_length", n_embd);
+    gguf_set_val_u32(gctx, "llama.feed_forward_length", 2*n_embd);
+    gguf_set_val_u32(gctx, "llama.attention.head_count", 4);
+    gguf_set_val_u32(gctx, "llama.attention.head_count_kv", 4);
+    gguf_set_val_f32(gctx, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+    gguf_set_val_u32(gctx, "llama.vocab_size", n_vocab);
+    add_vocab(gctx);
+
+    ggml_init_params params = { 64ull << 20, nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 0.5f);
+
+    const auto add = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = ne1 > 0 ? dist(rng)/std::sqrt((float) ne0) * 4.0f : 1.0f;
+        }
+        gguf_add_tensor(gctx, t);
+    };
+
+    add("token_embd.weight",  n_embd, n_vocab);
+    add("output_norm.weight", n_embd, 0);
+    add("output.weight",      n_embd, n_vocab);
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string p = "blk." + std::to_string(il) + ".";
+        add(p + "attn_norm.weight",   n_embd,   0);
+        add(p + "attn_q.weight",      n_embd,   n_embd);
+        add(p + "attn_k.weight",      n_embd,   n_embd);
+        add(p + "attn_v.weight",      n_embd,   n_embd);
+        add(p + "attn_output.weight", n_embd,   n_embd);
+        add(p + "ffn_norm.weight",    n_embd,   0);
+        add(p + "ffn_gate.weight",    n_embd,   2*n_embd);
+        add(p + "ffn_up.weight",      n_embd,   2*n_embd);
+        add(p + "ffn_down.weight",    2*n_embd, n_embd);
+    }
+
+    const bool ok = gguf_write_to_file(gctx, path.c_str(), false);
+
+    gguf_free(gctx);
+    ggml_free(ctx);
+
+    return ok;
+}
+
+enum test_mode {
+    TEST_MODE_NONE,     // no speculation
+    TEST_MODE_PER_SLOT, // a draft context per slot
+    TEST_MODE_SHARED,   // one draft context for all slots
+};
+
+struct test_slot {
+    common_sampler     * smpl = nullptr;
+    common_speculative * spec = nullptr;
+
+    llama_tokens prompt;  // tokens in the target KV cache
+    llama_token  id_last; // sampled, not yet in the KV cache
+
+    llama_tokens out;
+    llama_tokens draft;
+
+    int n_drafted  = 0;
+    int n_accepted = 0;
+};
+
+struct test_result {
+    std::vector<llama_tokens> out;
+    std::vector<llama_tokens> drafts; // every draft of every slot, in order
+
+    int     n_drafted  = 0;
+    int     n_accepted = 0;
+    int64_t t_draft_us = 0;
+};
+
+static bool run(llama_model * model_tgt, llama_model * model_dft, test_mode mode, int n_seq, int n_gen, test_result & res) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = n_seq*256;
+    cparams.n_batch         = 512;
+    cparams.n_seq_max       = n_seq;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+    cparams.kv_unified      = false;
+    llama_context * ctx = llama_init_from_model(model_tgt, cparams);
+    if (ctx == nullptr) {
+        return false;
+    }
+
+    common_params_speculative params_spec;
+    params_spec.n_max            = 8;
+    params_spec.n_min            = 0;
+    params_spec.p_min            = 0.0f; // always draft n_max tokens, the confidence is not under test
+    params_spec.mparams_dft.path = "draft";
+    params_spec.model_dft        = model_dft;
+    params_spec.cparams_dft      = cparams;
+    params_spec.cparams_dft.n_seq_max = mode == TEST_MODE_SHARED ? n_seq : 1;
+    params_spec.cparams_dft.n_ctx     = mode == TEST_MODE_SHARED ? n_seq*256 : 256;
+
+    common_speculative_shared * shared = nullptr;
+    if (mode == TEST_MODE_SHARED) {
+        shared = common_speculative_shared_init(params_spec, ctx, n_seq);
+        if (shared == nullptr) {
+            llama_free(ctx);
+            return false;
+        }
+    }
+
+    common_params_sampling params_smpl;
+    params_smpl.top_k    = 1;
+    params_smpl.samplers = { COMMON_SAMPLER_TYPE_TOP_K };
+
+    std::vector<test_slot> slots(n_seq);
+
+    llama_batch batch = llama_batch_init(512, 0, 1);
+
+    bool ok = true;
+
+    for (int s = 0; s < n_seq && ok; ++s) {
+        auto & slot = slots[s];
+
+        slot.smpl = common_sampler_init(model_tgt, params_smpl);
+        if (mode != TEST_MODE_NONE) {
+            // a draft context of its own only has sequence 0
+            slot.spec = common_speculative_init(params_spec, ctx, shared, shared ? s : 0);
+            ok = ok && slot.spec != nullptr;
+        }
+
+        // a different prompt per slot
+        for (int i = 0; i < 16; ++i) {
+            slot.prompt.push_back(3 + (s*37 + i*11) % (n_vocab - 3));
+        }
+
+        common_batch_clear(batch);
+        for (size_t i = 0; i < slot.prompt.size(); ++i) {
+            common_batch_add(batch, slot.prompt[i], i, { s }, i + 1 == slot.prompt.size());
+        }
+        ok = ok && llama_decode(ctx, batch) == 0;
+
+        if (ok) {
+            slot.id_last = common_sampler_sample(slot.smpl, ctx, -1);
+            common_sampler_accept(slot.smpl, slot.id_last, true);
+            slot.out.push_back(slot.id_last);
+        }
+    }
+
+    while (ok) {
+        std::vector<int> active;
+        for (int s = 0; s < n_seq; ++s) {
+            if ((int) slots[s].out.size() < n_gen) {
+                active.push_back(s);
+            }
+        }
+        if (active.empty()) {
+            break;
+        }
+
+        // draft for all active slots
+        const int64_t t_start_us = ggml_time_us();
+
+        if (mode == TEST_MODE_PER_SLOT) {
+            for (int s : active) {
+                slots[s].draft = common_speculative_draft(slots[s].spec, params_spec, slots[s].prompt, slots[s].id_last);
+            }
+        } else if (mode == TEST_MODE_SHARED) {
+            std::vector<common_speculative_request> reqs;
+            for (int s : active) {
+                reqs.push_back({ slots[s].spec, &params_spec, &slots[s].prompt, slots[s].id_last, {} });
+            }
+            common_speculative_draft_batch(reqs);
+            for (size_t k = 0; k < active.size(); ++k) {
+                slots[active[k]].draft = std::move(reqs[k].result);
+            }
+        }
+
+        res.t_draft_us += ggml_time_us() - t_start_us;
+
+        // verify each slot on its own, so that the target is evaluated the same way in every mode
+        for (int s : active) {
+            auto & slot = slots[s];
+
+            if (mode != TEST_MODE_NONE) {
+                res.drafts.push_back(slot.draft);
+            }
+
+            const llama_pos n_past = slot.prompt.size();
+
+            common_batch_clear(batch);
+            common_batch_add(batch, slot.id_last, n_past, { s }, true);
+            for (size_t i = 0; i < slot.draft.size(); ++i) {
+                common_batch_add(batch, slot.draft[i], n_past + 1 + i, { s }, true);
+            }
+            if (llama_decode(ctx, batch) != 0) {
+                ok = false;
+                break;
+            }
+
+            const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, slot.draft);
+
+            slot.n_drafted  += slot.draft.size();
+            slot.n_accepted += ids.size() - 1;
+
+            if (slot.spec) {
+                common_speculative_accept(slot.spec, ids.size() - 1);
+            }
+
+            slot.prompt.push_back(slot.id_last);
+            slot.prompt.insert(slot.prompt.end(), ids.begin(), ids.end() - 1);
+            slot.id_last = ids.back();
+
+            llama_memory_seq_rm(llama_get_memory(ctx), s, slot.prompt.size(), -1);
+
+            slot.out.insert(slot.out.end(), ids.begin(), ids.end());
+        }
+    }
+
+    for (auto & slot : slots) {
+        slot.out.resize(std::min<size_t>(slot.out.size(), n_gen));
+
+        res.out.push_back(slot.out);
+        res.n_drafted  += slot.n_drafted;
+        res.n_accepted += slot.n_accepted;
+
+        if (slot.spec) {
+            common_speculative_free(slot.spec);
+        }
+        if (slot.smpl) {
+            common_sampler_free(slot.smpl);
+        }
+    }
+
+    common_speculative_shared_free(shared);
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    const int n_seq = argc > 1 ? std::max(1, atoi(argv[1])) : 8;
+    const int n_gen = argc > 2 ? std::max(1, atoi(argv[2])) : 64;
+
+    const std::string path_tgt = "test-speculative-shared-tgt.gguf";
+    const std::string path_dft = "test-speculative-shared-dft.gguf";
+
+    // the draft model shares the first layers of the target and has fewer of them, so that only part of the drafts
+    // is accepted
+    if (!write_model(path_tgt, 4, 1) || !write_model(path_dft, 2, 1)) {
+        fprintf(stderr, "error: failed to write the test models\n");
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    llama_model * model_tgt = llama_model_load_from_file(path_tgt.c_str(), mparams);
+    llama_model * model_dft = llama_model_load_from_file(path_dft.c_str(), mparams);
+    remove(path_tgt.c_str());
+    remove(path_dft.c_str());
+    if (model_tgt == nullptr || model_dft == nullptr) {
+        fprintf(stderr, "error: failed to load the test models\n");
+        return 1;
+    }
+
+    test_result res_none;
+    test_result res_slot;
+    test_result res_shared;
+
+    int ret = 0;
+
+    if (!run(model_tgt, model_dft, TEST_MODE_NONE,     n_seq, n_gen, res_none) ||
+        !run(model_tgt, model_dft, TEST_MODE_PER_SLOT, n_seq, n_gen, res_slot) ||
+        !run(model_tgt, model_dft, TEST_MODE_SHARED,   n_seq, n_gen, res_shared)) {
+        fprintf(stderr, "error: generation failed\n");
+        ret = 1;
+    }
+
+    if (ret == 0) {
+        printf("n_seq = %d, n_gen = %d\n", n_seq, n_gen);
+        printf("per-slot draft contexts: %5d drafted, %5d accepted, drafting %8.2f ms (%7.1f drafted tokens/s)\n",
+                res_slot.n_drafted, res_slot.n_accepted, res_slot.t_draft_us/1e3, res_slot.n_drafted/(res_slot.t_draft_us/1e6));
+        printf("shared draft context:    %5d drafted, %5d accepted, drafting %8.2f ms (%7.1f drafted tokens/s)\n",
+                res_shared.n_drafted, res_shared.n_accepted, res_shared.t_draft_us/1e3, res_shared.n_drafted/(res_shared.t_draft_us/1e6));
+
+        if (res_slot.out != res_none.out || res_shared.out != res_none.out) {
+            fprintf(stderr, "error: the generated tokens differ from the generation without speculation\n");
+            ret = 1;
+        }
+        if (res_shared.drafts != res_slot.drafts) {
+            fprintf(stderr, "error: the drafts of the shared context differ from the per-slot drafts\n");
+            ret = 1;
+        }
+        if (res_shared.n_accepted == 0) {
+            fprintf(stderr, "error: no draft token was accepted\n");
+            ret = 1;
+        }
+    }
+
+    llama_model_free(model_dft);
+    llama_model_free(model_tgt);
+    llama_backend_free();
+
+    printf(ret == 0 ? "OK\n" : "FAIL\n");
+
+    return ret;
+}
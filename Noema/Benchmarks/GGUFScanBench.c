@@ -0,0 +1,183 @@
+// GGUFScanBench.c
+//
+// Library-scan benchmark for the GGUF header scanner over a synthetic model directory.
+// Not part of the app target. Build and run on the host:
+//
+//   cc -O2 -std=gnu11 -pthread -INoema Noema/GGUFHeaderScan.c
+//      Noema/Benchmarks/GGUFScanBench.c -o gguf-scan-bench -lm
+//   ./gguf-scan-bench [n_files=200] [vocab=128000] [dir=./gguf-scan-bench.d]
+//
+// Each file is a GGUF header only (KVs incl. a tokenizer of `vocab` strings, plus tensor infos
+// for a 32-block MoE model); tensor data is left out since no scanner reads it. Compared:
+// the previous fread/fseek-per-entry walk, the mmap scanner on one thread, the thread pool,
+// and a relaunch where every lookup is served from the persisted cache.
+#include "GGUFHeaderScan.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define N_BLOCKS 32
+#define N_EXPERTS 8
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void put_u32(FILE *f, uint32_t v) { fwrite(&v, 4, 1, f); }
+static void put_u64(FILE *f, uint64_t v) { fwrite(&v, 8, 1, f); }
+static void put_str(FILE *f, const char *s) { put_u64(f, strlen(s)); fwrite(s, 1, strlen(s), f); }
+static void put_key(FILE *f, const char *key, uint32_t type) { put_str(f, key); put_u32(f, type); }
+
+static void write_model(const char *path, int vocab) {
+    FILE *f = fopen(path, "wb");
+    if (!f) { perror(path); exit(1); }
+    const char *tensor_suffixes[] = {
+        "attn_q.weight", "attn_k.weight", "attn_v.weight", "attn_output.weight",
+        "ffn_gate_inp.weight", "ffn_gate_exps.weight", "ffn_up_exps.weight", "ffn_down_exps.weight",
+    };
+    const int per_block = (int)(sizeof(tensor_suffixes) / sizeof(tensor_suffixes[0]));
+    fwrite("GGUF", 1, 4, f);
+    put_u32(f, 3);
+    put_u64(f, (uint64_t)N_BLOCKS * per_block + 1);
+    put_u64(f, 8);
+    put_key(f, "general.architecture", 8); put_str(f, "llama");
+    put_key(f, "llama.block_count", 4); put_u32(f, N_BLOCKS);
+    put_key(f, "llama.embedding_length", 4); put_u32(f, 4096);
+    put_key(f, "llama.feed_forward_length", 4); put_u32(f, 14336);
+    put_key(f, "llama.expert_count", 4); put_u32(f, N_EXPERTS);
+    put_key(f, "llama.expert_used_count", 4); put_u32(f, 2);
+    put_key(f, "tokenizer.ggml.tokens", 9); put_u32(f, 8); put_u64(f, (uint64_t)vocab);
+    char tok[32];
+    for (int i = 0; i < vocab; ++i) {
+        snprintf(tok, sizeof(tok), "tok_%d", i);
+        put_str(f, tok);
+    }
+    put_key(f, "tokenizer.ggml.scores", 9); put_u32(f, 6); put_u64(f, (uint64_t)vocab);
+    for (int i = 0; i < vocab; ++i) { float s = -(float)i; fwrite(&s, 4, 1, f); }
+
+    char name[64];
+    uint64_t offset = 0;
+    put_str(f, "token_embd.weight"); put_u32(f, 2); put_u64(f, 4096); put_u64(f, (uint64_t)vocab);
+    put_u32(f, 0); put_u64(f, offset);
+    for (int b = 0; b < N_BLOCKS; ++b) {
+        for (int t = 0; t < per_block; ++t) {
+            snprintf(name, sizeof(name), "blk.%d.%s", b, tensor_suffixes[t]);
+            put_str(f, name); put_u32(f, 2); put_u64(f, 4096); put_u64(f, 4096);
+            put_u32(f, 0); put_u64(f, offset += 4096u * 4096u * 4u);
+        }
+    }
+    fclose(f);
+}
+
+// The walk gguf_layer_count used before: one stdio read or seek per KV and per token string.
+static int32_t legacy_layer_count(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    char magic[4];
+    uint32_t u32;
+    uint64_t n_kv, u64;
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "GGUF", 4) != 0) { fclose(f); return 0; }
+    if (fread(&u32, 4, 1, f) != 1 || fread(&u64, 8, 1, f) != 1 || fread(&n_kv, 8, 1, f) != 1) { fclose(f); return 0; }
+    int32_t result = 0;
+    for (uint64_t i = 0; i < n_kv; ++i) {
+        uint64_t key_len;
+        char key[1025];
+        uint32_t type;
+        if (fread(&key_len, 8, 1, f) != 1 || key_len > 1024 || fread(key, 1, key_len, f) != key_len) break;
+        key[key_len] = '\0';
+        if (fread(&type, 4, 1, f) != 1) break;
+        if (type == 8) {
+            if (fread(&u64, 8, 1, f) != 1 || fseek(f, (long)u64, SEEK_CUR) != 0) break;
+        } else if (type == 9) {
+            uint32_t et;
+            uint64_t n;
+            if (fread(&et, 4, 1, f) != 1 || fread(&n, 8, 1, f) != 1) break;
+            if (et == 8) {
+                for (uint64_t j = 0; j < n; ++j) {
+                    if (fread(&u64, 8, 1, f) != 1 || fseek(f, (long)u64, SEEK_CUR) != 0) break;
+                }
+            } else if (fseek(f, (long)(n * 4), SEEK_CUR) != 0) {
+                break;
+            }
+        } else {
+            if (fread(&u32, 4, 1, f) != 1) break;
+            if (strcmp(key, "llama.block_count") == 0) result = (int32_t)u32;
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+static int check(const struct gguf_header_info *info) {
+    return info->status == 0 && info->total_layer_count == N_BLOCKS && info->moe_layer_count == N_BLOCKS &&
+           info->expert_count == N_EXPERTS && info->expert_used_count == 2 && info->is_moe &&
+           info->hidden_size == 4096 && info->feed_forward_size == 14336;
+}
+
+int main(int argc, char **argv) {
+    const int n = argc > 1 ? atoi(argv[1]) : 200;
+    const int vocab = argc > 2 ? atoi(argv[2]) : 128000;
+    const char *dir = argc > 3 ? argv[3] : "gguf-scan-bench.d";
+    mkdir(dir, 0755);
+
+    char **paths = (char **)calloc((size_t)n, sizeof(char *));
+    for (int i = 0; i < n; ++i) {
+        paths[i] = (char *)malloc(strlen(dir) + 32);
+        sprintf(paths[i], "%s/model-%04d.gguf", dir, i);
+        write_model(paths[i], vocab);
+    }
+    struct stat st;
+    stat(paths[0], &st);
+    printf("library: %d files, vocab=%d, %.1f KiB header each\n", n, vocab, st.st_size / 1024.0);
+
+    struct gguf_header_info *out = (struct gguf_header_info *)calloc((size_t)n, sizeof(*out));
+    int bad = 0;
+
+    double t0 = now_ms();
+    for (int i = 0; i < n; ++i) bad += legacy_layer_count(paths[i]) != N_BLOCKS;
+    printf("%-30s %9.2f ms\n", "fread/fseek walk (1 thread)", now_ms() - t0);
+
+    t0 = now_ms();
+    for (int i = 0; i < n; ++i) {
+        gguf_header_scan(paths[i], &out[i]);
+        bad += !check(&out[i]);
+    }
+    printf("%-30s %9.2f ms\n", "mmap scan (1 thread)", now_ms() - t0);
+
+    char cache_path[512];
+    snprintf(cache_path, sizeof(cache_path), "%s/header-cache.bin", dir);
+    unlink(cache_path);
+    gguf_scan_cache_set_path(cache_path);
+    memset(out, 0, (size_t)n * sizeof(*out));
+    t0 = now_ms();
+    size_t ok = gguf_header_scan_many((const char *const *)paths, (size_t)n, out, 0);
+    printf("%-30s %9.2f ms  (%zu ok)\n", "mmap scan (thread pool, cold)", now_ms() - t0, ok);
+    for (int i = 0; i < n; ++i) bad += !check(&out[i]);
+
+    // Simulated relaunch: drop the in-memory table and reload it from disk
+    gguf_scan_cache_set_path(NULL);
+    t0 = now_ms();
+    gguf_scan_cache_set_path(cache_path);
+    memset(out, 0, (size_t)n * sizeof(*out));
+    ok = gguf_header_scan_many((const char *const *)paths, (size_t)n, out, 0);
+    printf("%-30s %9.2f ms  (%zu ok)\n", "persisted cache (relaunch)", now_ms() - t0, ok);
+    for (int i = 0; i < n; ++i) bad += !check(&out[i]);
+    uint64_t hits = 0, misses = 0;
+    gguf_scan_cache_stats(&hits, &misses);
+    printf("cache: hits=%llu misses=%llu\n", (unsigned long long)hits, (unsigned long long)misses);
+
+    for (int i = 0; i < n; ++i) { unlink(paths[i]); free(paths[i]); }
+    unlink(cache_path);
+    rmdir(dir);
+    free(paths);
+    free(out);
+    if (bad) { printf("MISMATCHES: %d\n", bad); return 1; }
+    return 0;
+}
@@ -0,0 +1,131 @@
+// VectorIndexBench.cpp
+//
+// Recall/latency benchmark for noema::VectorIndex on a synthetic clustered corpus.
+// Not part of the app target. Build and run on the host:
+//
+//   c++ -O3 -std=c++17 -march=native -pthread -INoema Noema/NoemaVectorIndex.cpp
+//       Noema/Benchmarks/VectorIndexBench.cpp -o vector-index-bench
+//   ./vector-index-bench [n_vectors=50000] [dim=768] [n_queries=200] [k=10]
+//
+// Ground truth is an exact f32 scan; every configuration reports recall@k against it.
+#include "NoemaVectorIndex.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace noema;
+
+namespace {
+
+struct Corpus {
+  int dim;
+  std::vector<float> vectors;
+  std::vector<float> queries;
+};
+
+// Gaussian blobs around random centers, roughly what chunk embeddings of a few documents look like
+Corpus make_corpus(size_t n, int dim, size_t n_queries, int n_centers) {
+  std::mt19937_64 rng(42);
+  std::normal_distribution<float> norm(0.0f, 1.0f);
+  std::uniform_int_distribution<int> pick(0, n_centers - 1);
+  std::vector<float> centers((size_t)n_centers * dim);
+  for (auto &c : centers) c = norm(rng);
+  auto sample = [&](std::vector<float> &out, size_t count) {
+    out.resize(count * dim);
+    for (size_t i = 0; i < count; ++i) {
+      const float *c = centers.data() + (size_t)pick(rng) * dim;
+      for (int j = 0; j < dim; ++j) out[i * dim + j] = c[j] + 0.35f * norm(rng);
+    }
+  };
+  Corpus corpus{dim, {}, {}};
+  sample(corpus.vectors, n);
+  sample(corpus.queries, n_queries);
+  return corpus;
+}
+
+struct Result {
+  double p50_us;
+  double p99_us;
+  double mean_us;
+  double recall;
+};
+
+Result run(const VectorIndex &idx, const Corpus &corpus, int k, const std::vector<std::vector<VectorHit>> &truth) {
+  const size_t nq = corpus.queries.size() / corpus.dim;
+  std::vector<double> lat(nq);
+  size_t found = 0;
+  for (size_t q = 0; q < nq; ++q) {
+    const auto t0 = std::chrono::steady_clock::now();
+    const auto hits = idx.search(corpus.queries.data() + q * corpus.dim, k);
+    lat[q] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+    std::set<int64_t> want;
+    for (const auto &h : truth[q]) want.insert(h.id);
+    for (const auto &h : hits) found += want.count(h.id);
+  }
+  std::vector<double> sorted = lat;
+  std::sort(sorted.begin(), sorted.end());
+  double sum = 0;
+  for (double v : lat) sum += v;
+  return {sorted[nq / 2], sorted[std::min(nq - 1, nq * 99 / 100)], sum / nq, (double)found / (double)(nq * k)};
+}
+
+void report(const char *name, const Result &r) {
+  printf("%-28s p50=%9.1fus  p99=%9.1fus  mean=%9.1fus  recall@k=%.4f\n", name, r.p50_us, r.p99_us, r.mean_us, r.recall);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 50000;
+  const int dim = argc > 2 ? atoi(argv[2]) : 768;
+  const size_t nq = argc > 3 ? (size_t)atoll(argv[3]) : 200;
+  const int k = argc > 4 ? atoi(argv[4]) : 10;
+  printf("corpus: n=%zu dim=%d queries=%zu k=%d\n", n, dim, nq, k);
+
+  const Corpus corpus = make_corpus(n, dim, nq, 256);
+
+  VectorIndex f32(dim, VectorMetric::Cosine, VectorStorage::F32);
+  VectorIndex i8(dim, VectorMetric::Cosine, VectorStorage::I8);
+  f32.reserve(n);
+  i8.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    f32.add((int64_t)i, corpus.vectors.data() + i * dim);
+    i8.add((int64_t)i, corpus.vectors.data() + i * dim);
+  }
+
+  std::vector<std::vector<VectorHit>> truth(nq);
+  for (size_t q = 0; q < nq; ++q) truth[q] = f32.search_exact(corpus.queries.data() + q * dim, k);
+
+  report("flat f32", run(f32, corpus, k, truth));
+  report("flat i8", run(i8, corpus, k, truth));
+
+  const int n_lists = std::max(1, (int)std::sqrt((double)n));
+  const auto t0 = std::chrono::steady_clock::now();
+  i8.train_ivf(n_lists);
+  const double train_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+  printf("ivf: %d lists trained in %.1f ms\n", n_lists, train_ms);
+  for (int probe : {1, 4, 8, 16, 32}) {
+    i8.set_nprobe(probe);
+    char name[64];
+    snprintf(name, sizeof(name), "ivf i8 nprobe=%d", probe);
+    report(name, run(i8, corpus, k, truth));
+  }
+
+  const std::string path = "vector-index-bench.nvidx";
+  if (i8.save(path)) {
+    auto mapped = VectorIndex::load(path);
+    if (mapped) {
+      mapped->set_nprobe(8);
+      report("ivf i8 nprobe=8 (mmap)", run(*mapped, corpus, k, truth));
+    }
+    remove(path.c_str());
+  }
+  return 0;
+}
@@ -24,15 +24,27 @@ actor DatasetRetriever {
     }
 
     private var cache: [String: [Chunk]] = [:]
+    /// SIMD top-k index over the cached chunk vectors, built on first query. Identifiers are chunk indices.
+    private var vectorStores: [String: LlamaVectorStore] = [:]
+    /// Vector hits handed to the ranker per requested chunk (at least 64 in total). Only the top hits are ranked:
+    /// the ranker prefers one chunk per source, and a source whose best chunk falls outside this pool can no longer
+    /// be picked. `nil` ranks every chunk, as the linear scan does.
+    private var vectorCandidatesPerChunk: Int? = 16
+
+    /// Sets how deep the vector search goes before ranking; `nil` ranks every chunk.
+    func setVectorCandidatesPerChunk(_ count: Int?) {
+        vectorCandidatesPerChunk = count.map { max(1, $0) }
+    }
 
     /// Drops any in-memory chunk cache. Safe to call on memory pressure; on-disk vectors remain.
     func clearCache() {
         cache.removeAll(keepingCapacity: false)
+        vectorStores.removeAll(keepingCapacity: false)
     }
 
     /// Purges any in-memory and on-disk embeddings for a dataset ID
     func purge(datasetID: String) {
-        cache[datasetID] = nil
+        setCachedChunks(nil, for: datasetID)
         var base = FileManager.default.urls(for: .documentDirectory, in: .userDomainMask)[0]
         base.appendPathComponent("LocalLLMDatasets", isDirectory: true)
         for comp in datasetID.split(separator: "/").map(String.init) {
@@ -41,6 +53,12 @@ actor DatasetRetriever {
         DatasetIndexIO.clearReadyIndex(at: base)
     }
 
+    /// Replaces the cached chunks for a dataset; its vector store is rebuilt on the next query.
+    private func setCachedChunks(_ chunks: [Chunk]?, for datasetID: String) {
+        cache[datasetID] = chunks
+        vectorStores[datasetID] = nil
+    }
+
     private func loadPersistedChunksIfValid(for dataset: LocalDataset) -> [Chunk]? {
         guard DatasetIndexIO.hasValidIndex(at: dataset.url) else { return nil }
         let file = DatasetIndexIO.vectorsURL(for: dataset.url)
@@ -65,7 +83,7 @@ actor DatasetRetriever {
     }
 
     private func recordFailure(for dataset: LocalDataset, reason: String) {
-        cache[dataset.datasetID] = nil
+        setCachedChunks(nil, for: dataset.datasetID)
         DatasetIndexIO.clearReadyIndex(at: dataset.url)
         var report = DatasetIndexIO.loadReport(from: dataset.url) ?? .empty
         report.failureReason = reason
@@ -121,7 +139,7 @@ actor DatasetRetriever {
             }
         }
         let validated = try validateChunks(result, for: dataset)
-        cache[dataset.datasetID] = validated
+        setCachedChunks(validated, for: dataset.datasetID)
         persist(validated, for: dataset)
         return validated
     }
@@ -137,7 +155,7 @@ actor DatasetRetriever {
         }
         if let cached = cache[dataset.datasetID] { return cached }
         if let decoded = loadPersistedChunksIfValid(for: dataset) {
-            cache[dataset.datasetID] = decoded
+            setCachedChunks(decoded, for: dataset.datasetID)
             return decoded
         }
 
@@ -158,7 +176,7 @@ actor DatasetRetriever {
         }
 
         if let decoded = loadPersistedChunksIfValid(for: dataset) {
-            cache[dataset.datasetID] = decoded
+            setCachedChunks(decoded, for: dataset.datasetID)
             return decoded
         }
 
@@ -219,7 +237,7 @@ actor DatasetRetriever {
 
         if DatasetIndexIO.hasIndexArtifacts(at: dir) {
             DatasetIndexIO.clearReadyIndex(at: dir)
-            cache[dataset.datasetID] = nil
+            setCachedChunks(nil, for: dataset.datasetID)
         }
 
         do {
@@ -428,7 +446,7 @@ actor DatasetRetriever {
         }
         if Task.isCancelled { throw CancellationError() }
         let validated = try validateChunks(finalChunks, for: dataset)
-        cache[dataset.datasetID] = validated
+        setCachedChunks(validated, for: dataset.datasetID)
         persist(validated, for: dataset)
         if Task.isCancelled { throw CancellationError() }
         Task { await logger.log("[RAG] embedPrepared.done - embeddings complete") }
@@ -938,8 +956,24 @@ actor DatasetRetriever {
         )
     }
 
+    /// Builds (once per cached chunk set) the vector store used for top-k search. Chunks whose
+    /// vectors are empty, non-finite or of another width are left out, as the linear scan skips them.
+    private func vectorStore(for datasetID: String, chunks: [Chunk]) -> LlamaVectorStore? {
+        if let store = vectorStores[datasetID] { return store }
+        guard let dim = chunks.first(where: { !$0.vector.isEmpty })?.vector.count else { return nil }
+        let store = LlamaVectorStore(dimension: Int32(dim), cosine: true, quantized: false)
+        store.reserve(chunks.count)
+        for (idx, chunk) in chunks.enumerated()
+        where chunk.vector.count == dim && chunk.vector.allSatisfy({ $0.isFinite }) {
+            store.addVector(chunk.vector, identifier: Int64(idx))
+        }
+        vectorStores[datasetID] = store
+        return store
+    }
+
     private func rankedChunks(
         for query: String,
+        datasetID: String,
         chunks: [Chunk],
         maxChunks: Int,
         minScore: Float
@@ -955,22 +989,38 @@ actor DatasetRetriever {
         if embedReady {
             let qVec = await EmbeddingModel.shared.embedQuery(trimmedQuery)
             if !qVec.isEmpty && qVec.allSatisfy({ $0.isFinite && !$0.isNaN }) {
-                candidates.reserveCapacity(chunks.count)
-                for chunk in chunks {
-                    guard !chunk.vector.isEmpty,
-                          chunk.vector.allSatisfy({ $0.isFinite && !$0.isNaN }) else {
-                        continue
-                    }
-                    let similarity = cosineSimilarity(chunk.vector, qVec)
-                    if similarity.isFinite && !similarity.isNaN {
+                if let store = vectorStore(for: datasetID, chunks: chunks), Int(store.dimension()) == qVec.count {
+                    // The ranker prefers one chunk per source, so keep a deeper pool than maxChunks
+                    let pool = vectorCandidatesPerChunk.map { max(maxChunks * $0, 64) }
+                    let k = min(chunks.count, pool ?? chunks.count)
+                    var ids = [Int64](repeating: 0, count: k)
+                    var scores = [Float](repeating: 0, count: k)
+                    let found = Int(store.searchVector(qVec, k: Int32(k), identifiers: &ids, scores: &scores))
+                    candidates.reserveCapacity(found)
+                    for i in 0..<found where scores[i].isFinite {
+                        let chunk = chunks[Int(ids[i])]
                         candidates.append(
-                            DatasetRetrievalCandidate(
-                                score: similarity,
-                                source: chunk.source,
-                                payload: chunk
-                            )
+                            DatasetRetrievalCandidate(score: scores[i], source: chunk.source, payload: chunk)
                         )
                     }
+                } else {
+                    candidates.reserveCapacity(chunks.count)
+                    for chunk in chunks {
+                        guard !chunk.vector.isEmpty,
+                              chunk.vector.allSatisfy({ $0.isFinite && !$0.isNaN }) else {
+                            continue
+                        }
+                        let similarity = cosineSimilarity(chunk.vector, qVec)
+                        if similarity.isFinite && !similarity.isNaN {
+                            candidates.append(
+                                DatasetRetrievalCandidate(
+                                    score: similarity,
+                                    source: chunk.source,
+                                    payload: chunk
+                                )
+                            )
+                        }
+                    }
                 }
             } else {
                 Task { await logger.log("[RAG] ❌ Invalid query embedding, using lexical fallback") }
@@ -1116,7 +1166,7 @@ actor DatasetRetriever {
             return ""
         }
 
-        let ranked = await rankedChunks(for: trimmedQuery, chunks: chunks, maxChunks: maxChunks, minScore: minScore)
+        let ranked = await rankedChunks(for: trimmedQuery, datasetID: dataset.datasetID, chunks: chunks, maxChunks: maxChunks, minScore: minScore)
         let selectedTexts = ranked.map(\.text)
         guard !selectedTexts.isEmpty else { Task { await logger.log("[RAG] retrieve.none") }; return "" }
         // Token-aware clamping for safety: cap total retrieved tokens; avoid per-chunk character truncation.
@@ -1152,7 +1202,7 @@ actor DatasetRetriever {
         let chunks = (try? await chunks(for: dataset, progress: progress)) ?? []
         if Task.isCancelled || chunks.isEmpty { return [] }
 
-        let ranked = await rankedChunks(for: trimmedQuery, chunks: chunks, maxChunks: maxChunks, minScore: minScore)
+        let ranked = await rankedChunks(for: trimmedQuery, datasetID: dataset.datasetID, chunks: chunks, maxChunks: maxChunks, minScore: minScore)
         // Do not character-trim individual chunks; keep full text and let token-aware injector handle final limits.
         var results: [(String, String?)] = []
         for chunk in ranked {
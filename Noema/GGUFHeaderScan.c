@@ -0,0 +1,766 @@
+// GGUFHeaderScan.c
+
+#include "GGUFHeaderScan.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// GGUF value types, as in gguf.h
+enum {
+    SCAN_TYPE_UINT8   = 0,
+    SCAN_TYPE_INT8    = 1,
+    SCAN_TYPE_UINT16  = 2,
+    SCAN_TYPE_INT16   = 3,
+    SCAN_TYPE_UINT32  = 4,
+    SCAN_TYPE_INT32   = 5,
+    SCAN_TYPE_FLOAT32 = 6,
+    SCAN_TYPE_BOOL    = 7,
+    SCAN_TYPE_STRING  = 8,
+    SCAN_TYPE_ARRAY   = 9,
+    SCAN_TYPE_UINT64  = 10,
+    SCAN_TYPE_INT64   = 11,
+    SCAN_TYPE_FLOAT64 = 12,
+};
+
+// Parse results besides success
+#define SCAN_INVALID   (-1)
+#define SCAN_NEED_MORE (-2)  // ran off the end of the mapped window, file continues
+
+// First mapping covers this much of the file; grown by doubling when the header is larger.
+// 4 MiB holds the KV section of every common tokenizer, so most files map exactly once.
+#define SCAN_INITIAL_WINDOW ((size_t)4 << 20)
+#define SCAN_MAX_KEY_LEN 1024
+
+// MARK: - Cursor
+
+struct scan_cursor {
+    const uint8_t *p;
+    const uint8_t *end;
+    int truncated;  // the window ended before the file did
+};
+
+static int cursor_take(struct scan_cursor *c, uint64_t n, const uint8_t **out) {
+    if (n > (uint64_t)(c->end - c->p)) {
+        return c->truncated ? SCAN_NEED_MORE : SCAN_INVALID;
+    }
+    if (out) { *out = c->p; }
+    c->p += n;
+    return 0;
+}
+
+static int cursor_u32(struct scan_cursor *c, uint32_t *v) {
+    const uint8_t *p;
+    int rc = cursor_take(c, sizeof(*v), &p);
+    if (rc == 0) { memcpy(v, p, sizeof(*v)); }
+    return rc;
+}
+
+static int cursor_u64(struct scan_cursor *c, uint64_t *v) {
+    const uint8_t *p;
+    int rc = cursor_take(c, sizeof(*v), &p);
+    if (rc == 0) { memcpy(v, p, sizeof(*v)); }
+    return rc;
+}
+
+static size_t scalar_size(uint32_t type) {
+    switch (type) {
+        case SCAN_TYPE_UINT8:
+        case SCAN_TYPE_INT8:
+        case SCAN_TYPE_BOOL: return 1;
+        case SCAN_TYPE_UINT16:
+        case SCAN_TYPE_INT16: return 2;
+        case SCAN_TYPE_UINT32:
+        case SCAN_TYPE_INT32:
+        case SCAN_TYPE_FLOAT32: return 4;
+        case SCAN_TYPE_UINT64:
+        case SCAN_TYPE_INT64:
+        case SCAN_TYPE_FLOAT64: return 8;
+        default: return 0;
+    }
+}
+
+// Integer view of one scalar, with the same conversions gguf_moe_scan always applied.
+static int scalar_as_i64(uint32_t type, const uint8_t *p, int64_t *out) {
+    switch (type) {
+        case SCAN_TYPE_UINT8:  { *out = *p; return 1; }
+        case SCAN_TYPE_INT8:   { *out = (int8_t)*p; return 1; }
+        case SCAN_TYPE_BOOL:   { *out = *p ? 1 : 0; return 1; }
+        case SCAN_TYPE_UINT16: { uint16_t v; memcpy(&v, p, 2); *out = v; return 1; }
+        case SCAN_TYPE_INT16:  { int16_t v;  memcpy(&v, p, 2); *out = v; return 1; }
+        case SCAN_TYPE_UINT32: { uint32_t v; memcpy(&v, p, 4); *out = v; return 1; }
+        case SCAN_TYPE_INT32:  { int32_t v;  memcpy(&v, p, 4); *out = v; return 1; }
+        case SCAN_TYPE_UINT64: { uint64_t v; memcpy(&v, p, 8); *out = (int64_t)v; return 1; }
+        case SCAN_TYPE_INT64:  { int64_t v;  memcpy(&v, p, 8); *out = v; return 1; }
+        case SCAN_TYPE_FLOAT32: {
+            float v; memcpy(&v, p, 4);
+            if (!isfinite(v)) { return 0; }
+            *out = (int64_t)llroundf(v);
+            return 1;
+        }
+        case SCAN_TYPE_FLOAT64: {
+            double v; memcpy(&v, p, 8);
+            if (!isfinite(v)) { return 0; }
+            *out = (int64_t)llround(v);
+            return 1;
+        }
+        default: return 0;
+    }
+}
+
+// Consume one value of `type`. When `out` is non-NULL the value is also converted to int32
+// (arrays yield their maximum element); otherwise arrays of scalars are skipped in O(1).
+static int cursor_value(struct scan_cursor *c, uint32_t type, int32_t *out) {
+    int rc;
+    if (out) { *out = 0; }
+    if (type == SCAN_TYPE_STRING) {
+        uint64_t len;
+        if ((rc = cursor_u64(c, &len)) != 0) { return rc; }
+        return cursor_take(c, len, NULL);
+    }
+    if (type == SCAN_TYPE_ARRAY) {
+        uint32_t et;
+        uint64_t n;
+        if ((rc = cursor_u32(c, &et)) != 0) { return rc; }
+        if ((rc = cursor_u64(c, &n)) != 0) { return rc; }
+        if (et == SCAN_TYPE_STRING) {
+            for (uint64_t j = 0; j < n; ++j) {
+                uint64_t len;
+                if ((rc = cursor_u64(c, &len)) != 0) { return rc; }
+                if ((rc = cursor_take(c, len, NULL)) != 0) { return rc; }
+            }
+            return 0;
+        }
+        const size_t sz = scalar_size(et);
+        if (sz == 0 || n > SIZE_MAX / sz) { return SCAN_INVALID; }
+        const uint8_t *data;
+        if ((rc = cursor_take(c, n * sz, &data)) != 0) { return rc; }
+        if (out) {
+            int64_t max_value = 0;
+            int found = 0;
+            for (uint64_t i = 0; i < n; ++i) {
+                int64_t v;
+                if (!scalar_as_i64(et, data + i * sz, &v)) { continue; }
+                if (!found || v > max_value) { max_value = v; found = 1; }
+            }
+            *out = found ? (int32_t)max_value : 0;
+        }
+        return 0;
+    }
+    const size_t sz = scalar_size(type);
+    if (sz == 0) { return SCAN_INVALID; }
+    const uint8_t *data;
+    if ((rc = cursor_take(c, sz, &data)) != 0) { return rc; }
+    if (out) {
+        int64_t v;
+        *out = scalar_as_i64(type, data, &v) ? (int32_t)v : 0;
+    }
+    return 0;
+}
+
+// MARK: - Name matching
+
+static int has_suffix(const char *value, size_t value_len, const char *suffix) {
+    const size_t suffix_len = strlen(suffix);
+    if (suffix_len == 0 || value_len < suffix_len) { return 0; }
+    return memcmp(value + (value_len - suffix_len), suffix, suffix_len) == 0;
+}
+
+static int parse_block_index(const char *name) {
+    const struct { const char *prefix; size_t len; } prefixes[] = {
+        { "blk.",    4 },
+        { "layers.", 7 },
+    };
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i) {
+        if (strncmp(name, prefixes[i].prefix, prefixes[i].len) != 0) { continue; }
+        const char *cursor = name + prefixes[i].len;
+        char *endptr = NULL;
+        long value = strtol(cursor, &endptr, 10);
+        if (endptr == cursor || value < 0) { continue; }
+        return (int)value;
+    }
+    return -1;
+}
+
+static int is_moe_tensor_name(const char *name, size_t len) {
+    // MoE-related tensor suffixes used across llama.cpp architectures.
+    static const char *suffixes[] = {
+        ".ffn_gate_inp.weight",
+        ".ffn_gate_inp_shexp.weight",
+        ".ffn_gate_exps.weight",
+        ".ffn_up_exps.weight",
+        ".ffn_down_exps.weight",
+        ".ffn_norm_exps.weight",
+        ".ffn_gate_chexps.weight",
+        ".ffn_up_chexps.weight",
+        ".ffn_down_chexps.weight",
+    };
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+        if (has_suffix(name, len, suffixes[i])) { return 1; }
+    }
+    return 0;
+}
+
+// MARK: - Parser
+
+// Everything collected while walking one file (and, for split models, its siblings).
+struct scan_state {
+    int32_t n_layer;
+    int32_t expert_count;       // "llama.expert_count"
+    int32_t expert_used_count;  // "llama.expert_used_count"
+    int32_t fallback_experts;   // first positive value among expert-count-like keys
+    int32_t fallback_used;      // first positive value among expert-used-like keys
+    int32_t layer_keys[3];      // llama.block_count, llama.n_layer, hparams.n_layer
+    int32_t hidden_size;
+    int32_t feed_forward_size;
+    int32_t vocab_size;
+    int32_t split_count;
+    int max_block_index;
+    uint8_t *moe_blocks;        // bitmap of blocks that carry expert tensors
+    size_t moe_blocks_cap;      // in bits
+};
+
+static int mark_moe_block(struct scan_state *s, int block) {
+    if ((size_t)block >= s->moe_blocks_cap) {
+        size_t cap = s->moe_blocks_cap ? s->moe_blocks_cap : 256;
+        while (cap <= (size_t)block) { cap *= 2; }
+        uint8_t *bits = (uint8_t *)realloc(s->moe_blocks, cap / 8);
+        if (bits == NULL) { return -1; }
+        memset(bits + s->moe_blocks_cap / 8, 0, (cap - s->moe_blocks_cap) / 8);
+        s->moe_blocks = bits;
+        s->moe_blocks_cap = cap;
+    }
+    s->moe_blocks[block / 8] |= (uint8_t)(1u << (block % 8));
+    return 0;
+}
+
+// Walk the KV section once, reading only the keys the library needs. With `tensors_only`
+// (sibling shards) the KVs are skipped and only tensor names are inspected.
+static int parse_header(const uint8_t *base, size_t bytes, int truncated,
+                        struct scan_state *s, int tensors_only) {
+    struct scan_cursor c = { base, base + bytes, truncated };
+    const uint8_t *magic;
+    uint32_t version;
+    uint64_t n_tensors, n_kv;
+    int rc;
+    if ((rc = cursor_take(&c, 4, &magic)) != 0) { return rc; }
+    if (memcmp(magic, "GGUF", 4) != 0) { return SCAN_INVALID; }
+    if ((rc = cursor_u32(&c, &version)) != 0) { return rc; }
+    if ((rc = cursor_u64(&c, &n_tensors)) != 0) { return rc; }
+    if ((rc = cursor_u64(&c, &n_kv)) != 0) { return rc; }
+
+    char key[SCAN_MAX_KEY_LEN + 1];
+    for (uint64_t i = 0; i < n_kv; ++i) {
+        uint64_t key_len;
+        const uint8_t *key_data;
+        uint32_t type;
+        if ((rc = cursor_u64(&c, &key_len)) != 0) { return rc; }
+        if (key_len > SCAN_MAX_KEY_LEN) { return SCAN_INVALID; }
+        if ((rc = cursor_take(&c, key_len, &key_data)) != 0) { return rc; }
+        if ((rc = cursor_u32(&c, &type)) != 0) { return rc; }
+        if (tensors_only) {
+            if ((rc = cursor_value(&c, type, NULL)) != 0) { return rc; }
+            continue;
+        }
+        memcpy(key, key_data, key_len);
+        key[key_len] = '\0';
+        const size_t len = (size_t)key_len;
+
+        int32_t *slot = NULL;
+        int expert_like = 0, used_like = 0;
+        if (strcmp(key, "llama.expert_count") == 0) { slot = &s->expert_count; }
+        else if (strcmp(key, "llama.expert_used_count") == 0) { slot = &s->expert_used_count; }
+        else if (strcmp(key, "llama.block_count") == 0) { slot = &s->layer_keys[0]; }
+        else if (strcmp(key, "llama.n_layer") == 0) { slot = &s->layer_keys[1]; }
+        else if (strcmp(key, "hparams.n_layer") == 0) { slot = &s->layer_keys[2]; }
+        else if (strcmp(key, "llama.embedding_length") == 0) { slot = &s->hidden_size; }
+        else if (strcmp(key, "llama.feed_forward_length") == 0) { slot = &s->feed_forward_size; }
+        else if (strcmp(key, "llama.vocab_size") == 0) { slot = &s->vocab_size; }
+        else if (strcmp(key, "split.count") == 0) { slot = &s->split_count; }
+        expert_like = has_suffix(key, len, "expert_count") || strstr(key, "num_experts") != NULL ||
+                      has_suffix(key, len, "n_expert") || has_suffix(key, len, "n_experts");
+        used_like = has_suffix(key, len, "expert_used_count") || strstr(key, "active_experts") != NULL ||
+                    strstr(key, "experts_per_token") != NULL || has_suffix(key, len, "n_expert_used");
+
+        if (slot == NULL && !expert_like && !used_like) {
+            if ((rc = cursor_value(&c, type, NULL)) != 0) { return rc; }
+            continue;
+        }
+        int32_t value = 0;
+        if ((rc = cursor_value(&c, type, &value)) != 0) { return rc; }
+        if (slot) { *slot = value; }
+        if (slot == &s->layer_keys[2] && (type == SCAN_TYPE_INT32 || type == SCAN_TYPE_UINT32) &&
+            s->n_layer == 0) {
+            s->n_layer = value;
+        }
+        if (expert_like && s->fallback_experts <= 0 && value > 0) { s->fallback_experts = value; }
+        if (used_like && s->fallback_used <= 0 && value > 0) { s->fallback_used = value; }
+    }
+
+    char name[SCAN_MAX_KEY_LEN + 1];
+    for (uint64_t i = 0; i < n_tensors; ++i) {
+        uint64_t name_len;
+        const uint8_t *name_data;
+        uint32_t n_dims, type;
+        uint64_t offset;
+        if ((rc = cursor_u64(&c, &name_len)) != 0) { return rc; }
+        if (name_len > SCAN_MAX_KEY_LEN) { return SCAN_INVALID; }
+        if ((rc = cursor_take(&c, name_len, &name_data)) != 0) { return rc; }
+        if ((rc = cursor_u32(&c, &n_dims)) != 0) { return rc; }
+        if (n_dims > 8) { return SCAN_INVALID; }
+        if ((rc = cursor_take(&c, (uint64_t)n_dims * sizeof(uint64_t), NULL)) != 0) { return rc; }
+        if ((rc = cursor_u32(&c, &type)) != 0) { return rc; }
+        if ((rc = cursor_u64(&c, &offset)) != 0) { return rc; }
+
+        memcpy(name, name_data, name_len);
+        name[name_len] = '\0';
+        const int block_index = parse_block_index(name);
+        if (block_index < 0) { continue; }
+        if (block_index > s->max_block_index) { s->max_block_index = block_index; }
+        if (is_moe_tensor_name(name, (size_t)name_len) && mark_moe_block(s, block_index) != 0) {
+            return SCAN_INVALID;
+        }
+    }
+    return 0;
+}
+
+// Map a growing prefix of the file until the header parses. Tensor data is never touched.
+static int scan_file(const char *path, struct scan_state *s, int tensors_only) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return SCAN_INVALID; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) { close(fd); return SCAN_INVALID; }
+    const size_t file_bytes = (size_t)st.st_size;
+
+    struct scan_state saved = *s;
+    size_t window = SCAN_INITIAL_WINDOW;
+    int rc;
+    for (;;) {
+        const size_t bytes = window < file_bytes ? window : file_bytes;
+        void *map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) { rc = SCAN_INVALID; break; }
+        madvise(map, bytes, MADV_SEQUENTIAL);
+        rc = parse_header((const uint8_t *)map, bytes, bytes < file_bytes, s, tensors_only);
+        munmap(map, bytes);
+        if (rc != SCAN_NEED_MORE) { break; }
+        // Restart on a larger window. Block bits are idempotent, so the bitmap is kept as is.
+        uint8_t *bits = s->moe_blocks;
+        size_t cap = s->moe_blocks_cap;
+        *s = saved;
+        s->moe_blocks = bits;
+        s->moe_blocks_cap = cap;
+        window *= 2;
+    }
+    close(fd);
+    return rc;
+}
+
+// "<prefix>-00001-of-00003.gguf" -> prefix length, or 0 if `path` is not a first shard.
+static size_t split_prefix_len(const char *path, int split_count) {
+    const size_t len = strlen(path);
+    const size_t tail = strlen("-00001-of-00000.gguf");
+    if (len <= tail) { return 0; }
+    char expected[32];
+    snprintf(expected, sizeof(expected), "-00001-of-%05d.gguf", split_count);
+    return strcmp(path + len - tail, expected) == 0 ? len - tail : 0;
+}
+
+int gguf_header_scan(const char *path, struct gguf_header_info *out) {
+    if (out == NULL) { return -1; }
+    memset(out, 0, sizeof(*out));
+    out->status = -1;
+    if (path == NULL) { return -1; }
+
+    struct scan_state s;
+    memset(&s, 0, sizeof(s));
+    s.max_block_index = -1;
+    if (scan_file(path, &s, 0) != 0) {
+        free(s.moe_blocks);
+        return -1;
+    }
+
+    // Split models keep their KVs in the first shard but spread tensors over all of them.
+    if (s.split_count > 1 && s.split_count < 100000) {
+        const size_t prefix = split_prefix_len(path, s.split_count);
+        if (prefix > 0) {
+            char *sibling = (char *)malloc(prefix + 32);
+            for (int i = 2; sibling != NULL && i <= s.split_count; ++i) {
+                memcpy(sibling, path, prefix);
+                snprintf(sibling + prefix, 32, "-%05d-of-%05d.gguf", i, s.split_count);
+                struct scan_state saved = s;
+                if (scan_file(sibling, &s, 1) != 0) {
+                    // A missing shard only costs the MoE layer count; keep what we have.
+                    // Bits marked before a shard turned out invalid still name real tensors.
+                    uint8_t *bits = s.moe_blocks;
+                    size_t cap = s.moe_blocks_cap;
+                    s = saved;
+                    s.moe_blocks = bits;
+                    s.moe_blocks_cap = cap;
+                }
+            }
+            free(sibling);
+        }
+    }
+
+    out->status = 0;
+    out->n_layer = s.n_layer;
+    out->split_count = s.split_count > 1 ? s.split_count : 1;
+    if (s.expert_count > 0) {
+        out->is_moe = 1;
+        out->expert_count = s.expert_count;
+    }
+    if (s.expert_used_count > 0) {
+        out->expert_used_count = s.expert_used_count;
+    }
+    if (out->expert_count <= 0 && s.fallback_experts > 0) {
+        out->expert_count = s.fallback_experts;
+        out->is_moe = 1;
+    }
+    if (out->expert_used_count <= 0 && s.fallback_used > 0) {
+        out->expert_used_count = s.fallback_used;
+        out->is_moe = 1;
+    }
+    for (size_t i = 0; i < sizeof(s.layer_keys) / sizeof(s.layer_keys[0]); ++i) {
+        if (s.layer_keys[i] > 0) { out->total_layer_count = s.layer_keys[i]; break; }
+    }
+    out->hidden_size = s.hidden_size;
+    out->feed_forward_size = s.feed_forward_size;
+    out->vocab_size = s.vocab_size;
+    if (out->total_layer_count <= 0 && s.max_block_index >= 0) {
+        out->total_layer_count = s.max_block_index + 1;
+    }
+    int moe_layers = 0;
+    for (size_t i = 0; i < s.moe_blocks_cap / 8; ++i) {
+        moe_layers += __builtin_popcount(s.moe_blocks[i]);
+    }
+    if (moe_layers > 0) {
+        out->moe_layer_count = moe_layers;
+        out->is_moe = 1;
+    }
+    free(s.moe_blocks);
+    return 0;
+}
+
+// MARK: - Cache
+
+// File layout: 32-byte header, then per entry
+//   [uint32 path_len][uint32 reserved][uint64 size][int64 mtime_ns][gguf_header_info][path bytes]
+// The whole file is rewritten (tmp + rename) on flush; it is small even for large libraries.
+static const char kCacheMagic[8] = { 'N', 'O', 'E', 'M', 'A', 'G', 'S', '1' };
+
+struct cache_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t info_bytes;  // sizeof(struct gguf_header_info) when written
+    uint64_t count;
+    uint64_t reserved;
+};
+
+struct cache_record {
+    uint32_t path_len;
+    uint32_t reserved;
+    uint64_t size;
+    int64_t mtime_ns;
+    struct gguf_header_info info;
+};
+
+struct cache_entry {
+    char *path;  // NULL marks an empty slot
+    uint64_t hash;
+    uint64_t size;
+    int64_t mtime_ns;
+    struct gguf_header_info info;
+};
+
+static pthread_mutex_t g_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *g_entries;
+static size_t g_capacity;  // power of two
+static size_t g_count;
+static char *g_cache_path;
+static int g_dirty;
+static int g_flush_pending;
+static uint64_t g_hits;
+static uint64_t g_misses;
+
+static uint64_t path_hash(const char *path) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (const unsigned char *p = (const unsigned char *)path; *p; ++p) {
+        h ^= *p;
+        h *= 0x100000001B3ull;
+    }
+    return h;
+}
+
+static struct cache_entry *cache_slot_locked(const char *path, uint64_t hash) {
+    if (g_capacity == 0) { return NULL; }
+    size_t i = (size_t)hash & (g_capacity - 1);
+    for (;;) {
+        struct cache_entry *e = &g_entries[i];
+        if (e->path == NULL || (e->hash == hash && strcmp(e->path, path) == 0)) { return e; }
+        i = (i + 1) & (g_capacity - 1);
+    }
+}
+
+static int cache_grow_locked(void) {
+    const size_t cap = g_capacity ? g_capacity * 2 : 256;
+    struct cache_entry *entries = (struct cache_entry *)calloc(cap, sizeof(*entries));
+    if (entries == NULL) { return -1; }
+    struct cache_entry *old = g_entries;
+    const size_t old_cap = g_capacity;
+    g_entries = entries;
+    g_capacity = cap;
+    for (size_t i = 0; i < old_cap; ++i) {
+        if (old[i].path == NULL) { continue; }
+        *cache_slot_locked(old[i].path, old[i].hash) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+static void cache_put_locked(const char *path, uint64_t size, int64_t mtime_ns,
+                             const struct gguf_header_info *info) {
+    if ((g_count + 1) * 4 > g_capacity * 3 && cache_grow_locked() != 0) { return; }
+    const uint64_t hash = path_hash(path);
+    struct cache_entry *e = cache_slot_locked(path, hash);
+    if (e->path == NULL) {
+        e->path = strdup(path);
+        if (e->path == NULL) { return; }
+        e->hash = hash;
+        g_count++;
+    }
+    e->size = size;
+    e->mtime_ns = mtime_ns;
+    e->info = *info;
+    g_dirty = 1;
+}
+
+static void cache_clear_locked(void) {
+    for (size_t i = 0; i < g_capacity; ++i) { free(g_entries[i].path); }
+    free(g_entries);
+    g_entries = NULL;
+    g_capacity = 0;
+    g_count = 0;
+    g_dirty = 0;
+}
+
+static void cache_load_locked(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) { return; }
+    struct cache_file_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+        h.version != 1 || h.info_bytes != sizeof(struct gguf_header_info)) {
+        // Unknown or older layout: rebuilt from scratch on the next scan
+        fclose(f);
+        return;
+    }
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    for (uint64_t i = 0; i < h.count; ++i) {
+        struct cache_record r;
+        if (fread(&r, sizeof(r), 1, f) != 1 || r.path_len == 0 || r.path_len > 4096) { break; }
+        if (r.path_len + 1 > buf_cap) {
+            char *grown = (char *)realloc(buf, r.path_len + 1);
+            if (grown == NULL) { break; }
+            buf = grown;
+            buf_cap = r.path_len + 1;
+        }
+        if (fread(buf, 1, r.path_len, f) != r.path_len) { break; }
+        buf[r.path_len] = '\0';
+        cache_put_locked(buf, r.size, r.mtime_ns, &r.info);
+    }
+    free(buf);
+    fclose(f);
+    g_dirty = 0;
+}
+
+static int cache_flush_locked(void) {
+    if (g_cache_path == NULL || !g_dirty) { return 0; }
+    const size_t tmp_len = strlen(g_cache_path) + 5;
+    char *tmp = (char *)malloc(tmp_len);
+    if (tmp == NULL) { return -1; }
+    snprintf(tmp, tmp_len, "%s.tmp", g_cache_path);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) { free(tmp); return -1; }
+    struct cache_file_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, kCacheMagic, sizeof(kCacheMagic));
+    h.version = 1;
+    h.info_bytes = sizeof(struct gguf_header_info);
+    h.count = g_count;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (size_t i = 0; ok && i < g_capacity; ++i) {
+        const struct cache_entry *e = &g_entries[i];
+        if (e->path == NULL) { continue; }
+        struct cache_record r;
+        memset(&r, 0, sizeof(r));
+        r.path_len = (uint32_t)strlen(e->path);
+        r.size = e->size;
+        r.mtime_ns = e->mtime_ns;
+        r.info = e->info;
+        ok = fwrite(&r, sizeof(r), 1, f) == 1 && fwrite(e->path, 1, r.path_len, f) == r.path_len;
+    }
+    ok = fflush(f) == 0 && ok;
+    fclose(f);
+    if (!ok || rename(tmp, g_cache_path) != 0) {
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    g_dirty = 0;
+    return 0;
+}
+
+static int64_t stat_mtime_ns(const struct stat *st) {
+#if defined(__APPLE__)
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+void gguf_scan_cache_set_path(const char *cache_path) {
+    pthread_mutex_lock(&g_cache_mutex);
+    cache_flush_locked();
+    cache_clear_locked();
+    free(g_cache_path);
+    g_cache_path = cache_path ? strdup(cache_path) : NULL;
+    if (g_cache_path) { cache_load_locked(g_cache_path); }
+    pthread_mutex_unlock(&g_cache_mutex);
+}
+
+// Single lookups (model list refreshes, per-model layer counts) arrive in bursts; their misses are
+// written out together this long after the first one instead of rewriting the file per miss.
+#define CACHE_FLUSH_DELAY_SEC 2
+
+static void *cache_deferred_flush(void *arg) {
+    (void)arg;
+    sleep(CACHE_FLUSH_DELAY_SEC);
+    pthread_mutex_lock(&g_cache_mutex);
+    g_flush_pending = 0;
+    cache_flush_locked();
+    pthread_mutex_unlock(&g_cache_mutex);
+    return NULL;
+}
+
+static void cache_schedule_flush_locked(void) {
+    if (g_flush_pending || g_cache_path == NULL || !g_dirty) { return; }
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr) != 0) { return; }
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, cache_deferred_flush, NULL) == 0) { g_flush_pending = 1; }
+    pthread_attr_destroy(&attr);
+}
+
+int gguf_scan_cache_flush(void) {
+    pthread_mutex_lock(&g_cache_mutex);
+    const int rc = cache_flush_locked();
+    pthread_mutex_unlock(&g_cache_mutex);
+    return rc;
+}
+
+void gguf_scan_cache_stats(uint64_t *hits, uint64_t *misses) {
+    pthread_mutex_lock(&g_cache_mutex);
+    if (hits) { *hits = g_hits; }
+    if (misses) { *misses = g_misses; }
+    pthread_mutex_unlock(&g_cache_mutex);
+}
+
+// Cache lookup and fill without flushing; returns 1 on a miss (the file was parsed).
+static int scan_cached(const char *path, struct gguf_header_info *out) {
+    struct stat st;
+    if (path == NULL || stat(path, &st) != 0) {
+        memset(out, 0, sizeof(*out));
+        out->status = -1;
+        return 0;
+    }
+    const uint64_t size = (uint64_t)st.st_size;
+    const int64_t mtime_ns = stat_mtime_ns(&st);
+
+    pthread_mutex_lock(&g_cache_mutex);
+    const struct cache_entry *e = cache_slot_locked(path, path_hash(path));
+    if (e && e->path && e->size == size && e->mtime_ns == mtime_ns) {
+        *out = e->info;
+        g_hits++;
+        pthread_mutex_unlock(&g_cache_mutex);
+        return 0;
+    }
+    g_misses++;
+    pthread_mutex_unlock(&g_cache_mutex);
+
+    // Parse outside the lock. Failures are cached too: a partial download changes size/mtime.
+    gguf_header_scan(path, out);
+    pthread_mutex_lock(&g_cache_mutex);
+    cache_put_locked(path, size, mtime_ns, out);
+    pthread_mutex_unlock(&g_cache_mutex);
+    return 1;
+}
+
+int gguf_header_scan_cached(const char *path, struct gguf_header_info *out) {
+    if (out == NULL) { return -1; }
+    if (scan_cached(path, out)) {
+        pthread_mutex_lock(&g_cache_mutex);
+        cache_schedule_flush_locked();
+        pthread_mutex_unlock(&g_cache_mutex);
+    }
+    return out->status == 0 ? 0 : -1;
+}
+
+// MARK: - Parallel scan
+
+struct scan_job {
+    const char *const *paths;
+    struct gguf_header_info *out;
+    size_t count;
+    atomic_size_t next;
+};
+
+static void *scan_worker(void *arg) {
+    struct scan_job *job = (struct scan_job *)arg;
+    for (;;) {
+        const size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->count) { break; }
+        scan_cached(job->paths[i], &job->out[i]);
+    }
+    return NULL;
+}
+
+size_t gguf_header_scan_many(const char *const *paths, size_t count,
+                             struct gguf_header_info *out, int n_threads) {
+    if (paths == NULL || out == NULL || count == 0) { return 0; }
+    if (n_threads <= 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if ((size_t)n_threads > count) { n_threads = (int)count; }
+
+    struct scan_job job;
+    job.paths = paths;
+    job.out = out;
+    job.count = count;
+    atomic_init(&job.next, 0);
+
+    // The calling thread is one of the workers
+    pthread_t *threads = n_threads > 1 ? (pthread_t *)calloc((size_t)n_threads - 1, sizeof(pthread_t)) : NULL;
+    int spawned = 0;
+    for (int t = 0; threads != NULL && t < n_threads - 1; ++t) {
+        if (pthread_create(&threads[t], NULL, scan_worker, &job) != 0) { break; }
+        spawned++;
+    }
+    scan_worker(&job);
+    for (int t = 0; t < spawned; ++t) { pthread_join(threads[t], NULL); }
+    free(threads);
+
+    gguf_scan_cache_flush();
+    size_t ok = 0;
+    for (size_t i = 0; i < count; ++i) { ok += out[i].status == 0; }
+    return ok;
+}
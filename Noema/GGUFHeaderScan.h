@@ -0,0 +1,50 @@
+// GGUFHeaderScan.h
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Everything the model library needs from a GGUF header, gathered in one pass.
+// Field meanings match struct gguf_moe_scan_result in GGUFScanner.c.
+struct gguf_header_info {
+    int32_t status;             // 0 on success, -1 if the file is missing or not a valid GGUF
+    int32_t n_layer;            // legacy "hparams.n_layer" key, 0 if absent
+    int32_t is_moe;
+    int32_t expert_count;
+    int32_t expert_used_count;
+    int32_t total_layer_count;
+    int32_t moe_layer_count;
+    int32_t hidden_size;
+    int32_t feed_forward_size;
+    int32_t vocab_size;
+    int32_t split_count;        // shards in a split model, 1 otherwise
+};
+
+// Parse one GGUF file. The file is memory-mapped and only the KV and tensor-info region is
+// touched; tensor data pages are never faulted in. For the first shard of a split model
+// ("name-00001-of-0000N.gguf") the sibling shards' tensor infos are folded in as well.
+int gguf_header_scan(const char *path, struct gguf_header_info *out);
+
+// Persisted cache of scan results keyed by (path, size, mtime). Set the backing file once at
+// startup; pass NULL to keep the cache in memory only. Safe to call from any thread.
+void gguf_scan_cache_set_path(const char *cache_path);
+// Cached variant of gguf_header_scan: unchanged files are never re-read. A miss is written to the
+// cache file by a deferred flush that batches the misses of the next few seconds.
+int gguf_header_scan_cached(const char *path, struct gguf_header_info *out);
+// Scan many files on a pool of `n_threads` workers (<= 0 picks the CPU count), consulting and
+// filling the cache. `out` must hold `count` entries. Returns the number of successful scans.
+size_t gguf_header_scan_many(const char *const *paths, size_t count,
+                             struct gguf_header_info *out, int n_threads);
+// Writes the in-memory cache to the path given to gguf_scan_cache_set_path now. Batch scans flush
+// on return; call this before exit if single lookups may still be pending.
+int gguf_scan_cache_flush(void);
+// Lookups answered from the cache vs. files parsed, since launch.
+void gguf_scan_cache_stats(uint64_t *hits, uint64_t *misses);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,5 +1,6 @@
 // LlamaEmbedder.h
 #import <Foundation/Foundation.h>
+#import "LlamaEmbeddingCache.h"
 
 NS_ASSUME_NONNULL_BEGIN
 
@@ -8,10 +9,23 @@ NS_ASSUME_NONNULL_BEGIN
                           threads:(int)threads
                        nGpuLayers:(int)nGpuLayers;
 
+// Optional persistent cache consulted before encoding. Its dimension must match the model.
+@property (nonatomic, strong, nullable) LlamaEmbeddingCache *cache;
+// Identity used to namespace cache keys: model file name and size plus pooling and
+// normalization settings, so switching models or pooling never returns stale vectors.
+@property (nonatomic, readonly, copy) NSString *cacheNamespace;
+
 - (BOOL)isReady;
 - (int)dimension;
 - (int)countTokens:(NSString *)text;
 - (BOOL)embedText:(NSString *)text intoBuffer:(float *)buffer length:(int)length; // returns YES on success
+// Embeds many texts with as few encoder calls as possible: inputs are sorted by token count and
+// packed into shared batches, one sequence id per text. Row i of `matrix` (row-major,
+// `dimension` floats per row, at least `rows` >= texts.count rows) receives text i. Rows for
+// texts that could not be embedded are left untouched. Returns the number of rows written.
+- (int)embedTexts:(NSArray<NSString *> *)texts intoMatrix:(float *)matrix rows:(int)rows;
+// Encoder throughput of the most recent embedTexts call, in tokens per second.
+- (double)lastBatchTokensPerSecond;
 - (void)unload;
 @end
 
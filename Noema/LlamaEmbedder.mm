@@ -7,6 +7,9 @@
 #include <cmath>
 #include <cstdlib>
 #include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <numeric>
 #include <dlfcn.h>
 
 // Backwards-compatible define for pooling types in case headers are older
@@ -51,12 +54,21 @@ static inline void noema_llama_kv_cache_clear(struct llama_context *ctx) {
 #endif
 }
 
+// Upper bound on sequences packed into one encode. Kept well below LLAMA_MAX_SEQ so the
+// per-sequence pooling bookkeeping stays small.
+static const int kNoemaEmbedMaxSeqs = 64;
+
 @implementation LlamaEmbedder {
   llama_model *_model;
   llama_context *_ctx;
   int _dim;
+  int _nSeqMax;
+  double _lastTokensPerSecond;
+  NSString *_cacheNamespace;
 }
 
+@synthesize cache = _cache;
+
 - (instancetype)initWithModelPath:(NSString *)modelPath
                           threads:(int)threads
                        nGpuLayers:(int)nGpuLayers {
@@ -85,11 +97,13 @@ static inline void noema_llama_kv_cache_clear(struct llama_context *ctx) {
     cp.n_threads_batch = cp.n_threads;
     // Use a larger context appropriate for nomic-embed-text-v1.5 (n_ctx_train = 2048)
     cp.n_ctx = 2048;
-    // Configure batching for single-sequence processing. We embed one text at a time
-    // but allow up to `n_ctx` tokens per batch.
+    // Allow up to `n_ctx` tokens per batch. Encoders cannot micro-batch, so n_ubatch must
+    // match. Several short texts can share one encode, each on its own sequence id; a
+    // unified layout keeps the full n_ctx available to a single long text.
     cp.n_batch = 2048;
     cp.n_ubatch = cp.n_batch;
-    cp.n_seq_max = 1;
+    cp.n_seq_max = kNoemaEmbedMaxSeqs;
+    cp.kv_unified = true;
     // Respect model's mean pooling requirement (nomic-bert.pooling_type = 1)
     cp.pooling_type = (enum llama_pooling_type)LLAMA_POOLING_MEAN;
     // Explicitly disable Flash Attention for non-causal BERT-style models.
@@ -100,9 +114,22 @@ static inline void noema_llama_kv_cache_clear(struct llama_context *ctx) {
   if (!_ctx) { llama_model_free(_model); _model = NULL; noema_llama_backend_release(); return self; }
   llama_set_n_threads(_ctx, cp.n_threads, cp.n_threads);
   _dim = _model ? llama_n_embd(_model) : 0;
+  _nSeqMax = (int)llama_n_seq_max(_ctx);
+  {
+    NSDictionary *attrs = [[NSFileManager defaultManager] attributesOfItemAtPath:modelPath error:nil];
+    // Vectors are stored raw (mean pooled, not normalized); callers normalize on read.
+    _cacheNamespace = [NSString stringWithFormat:@"%@|%llu|dim=%d|pool=mean|norm=0",
+                       modelPath.lastPathComponent, [attrs fileSize], _dim];
+  }
   return self;
 }
 
+- (NSString *)cacheNamespace { return _cacheNamespace ?: @""; }
+
+- (void)setCache:(LlamaEmbeddingCache *)cache {
+  _cache = (cache && cache.dimension == _dim) ? cache : nil;
+}
+
 - (BOOL)isReady { return _model && _ctx && _dim > 0; }
 - (int)dimension { return _dim; }
 
@@ -118,6 +145,8 @@ static inline void noema_llama_kv_cache_clear(struct llama_context *ctx) {
 
 - (BOOL)embedText:(NSString *)text intoBuffer:(float *)buffer length:(int)length {
   if (!_model || !_ctx || !buffer || length < _dim) return NO;
+  LlamaEmbeddingCache *cache = _cache;
+  if (cache && [cache lookupText:text namespace:_cacheNamespace intoBuffer:buffer]) return YES;
   
   // Clear the KV cache before processing a new sequence to ensure a clean state.
   noema_llama_kv_cache_clear(_ctx);
@@ -175,9 +204,103 @@ static inline void noema_llama_kv_cache_clear(struct llama_context *ctx) {
   }
   
   memcpy(buffer, emb, sizeof(float) * _dim);
+  [cache storeText:text namespace:_cacheNamespace vector:buffer];
   return YES;
 }
 
+- (int)embedTexts:(NSArray<NSString *> *)texts intoMatrix:(float *)matrix rows:(int)rows {
+  _lastTokensPerSecond = 0;
+  const int count = (int)texts.count;
+  if (!_model || !_ctx || !matrix || rows < count || _dim <= 0) return 0;
+  if (count == 0) return 0;
+
+  const auto t_start = std::chrono::steady_clock::now();
+  const struct llama_vocab *vocab = llama_model_get_vocab(_model);
+  const int n_batch = (int)llama_n_batch(_ctx);
+  const int limit = std::max(1, std::min((int)llama_n_ctx(_ctx), n_batch) - 8);
+
+  // Serve what we can from the cache; only misses are tokenized and encoded
+  LlamaEmbeddingCache *cache = _cache;
+  int written = 0;
+  std::vector<std::vector<llama_token>> toks(count);
+  for (int i = 0; i < count; ++i) {
+    if (cache && [cache lookupText:texts[i] namespace:_cacheNamespace intoBuffer:matrix + (size_t)i * _dim]) {
+      written++;
+      continue;
+    }
+    std::string s(texts[i].UTF8String ?: "");
+    std::vector<llama_token> &t = toks[i];
+    t.resize(s.size() + 8);
+    int n = llama_tokenize(vocab, s.c_str(), (int32_t)s.length(), t.data(), (int)t.size(), /*add_special*/ true, /*parse_special*/ false);
+    if (n < 0) n = 0;
+    t.resize(n);
+    // Same clamp as the single-text path: keep the tail
+    if (n > limit) t.erase(t.begin(), t.begin() + (n - limit));
+  }
+
+  // Sort by length so each encode holds texts of similar size and packs densely
+  std::vector<int> order(count);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return toks[a].size() < toks[b].size(); });
+
+  llama_batch batch = llama_batch_init(n_batch, 0, 1);
+  if (!batch.token) { llama_batch_free(batch); return 0; }
+  if (!batch.logits) {
+    batch.logits = (int8_t *)calloc(n_batch, sizeof(int8_t));
+    if (!batch.logits) { llama_batch_free(batch); return 0; }
+  }
+
+  long total_tokens = 0;
+  std::vector<int> group;
+  group.reserve(_nSeqMax);
+  size_t next = 0;
+  while (next < order.size()) {
+    // Pack as many texts as fit into one batch
+    group.clear();
+    batch.n_tokens = 0;
+    while (next < order.size() && (int)group.size() < _nSeqMax) {
+      const int idx = order[next];
+      const int n = (int)toks[idx].size();
+      if (n == 0) { next++; continue; }
+      if (batch.n_tokens + n > n_batch) break;
+      const llama_seq_id seq = (llama_seq_id)group.size();
+      for (int j = 0; j < n; ++j) {
+        const int k = batch.n_tokens++;
+        batch.token[k] = toks[idx][j];
+        batch.pos[k] = j;
+        batch.n_seq_id[k] = 1;
+        batch.seq_id[k][0] = seq;
+        batch.logits[k] = 1;
+      }
+      group.push_back(idx);
+      next++;
+    }
+    if (group.empty()) continue;
+
+    noema_llama_kv_cache_clear(_ctx);
+    if (llama_encode(_ctx, batch) != 0) break;
+    total_tokens += batch.n_tokens;
+
+    for (size_t g = 0; g < group.size(); ++g) {
+      const float *emb = llama_get_embeddings_seq(_ctx, (llama_seq_id)g);
+      if (!emb) continue;
+      bool finite = true;
+      for (int d = 0; d < _dim && finite; ++d) finite = std::isfinite(emb[d]);
+      if (!finite) continue;
+      memcpy(matrix + (size_t)group[g] * _dim, emb, sizeof(float) * _dim);
+      [cache storeText:texts[group[g]] namespace:_cacheNamespace vector:emb];
+      written++;
+    }
+  }
+  llama_batch_free(batch);
+
+  const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+  _lastTokensPerSecond = secs > 0 ? (double)total_tokens / secs : 0;
+  return written;
+}
+
+- (double)lastBatchTokensPerSecond { return _lastTokensPerSecond; }
+
 - (void)unload {
   if (_ctx) { llama_free(_ctx); _ctx = NULL; }
   if (_model) { llama_model_free(_model); _model = NULL; }
@@ -70,6 +70,7 @@ final class LlamaEmbeddingBackend: EmbeddingsBackend {
 
         embedder = resolvedEmbedder
         dimension = Int(resolvedEmbedder.dimension())
+        attachPersistentCache(to: resolvedEmbedder)
         let dim = dimension
         Task.detached(priority: .utility) {
             let backend = loadedWithGPU ? "GPU" : "CPU"
@@ -77,6 +78,25 @@ final class LlamaEmbeddingBackend: EmbeddingsBackend {
         }
     }
 
+    /// Opens the on-disk embedding cache for this model so unchanged chunks are not re-encoded.
+    private func attachPersistentCache(to embedder: LlamaEmbedder) {
+        let fm = FileManager.default
+        guard let caches = try? fm.url(for: .cachesDirectory, in: .userDomainMask, appropriateFor: nil, create: true) else { return }
+        let dir = caches.appendingPathComponent("EmbeddingCache", isDirectory: true)
+        try? fm.createDirectory(at: dir, withIntermediateDirectories: true)
+        let name = (modelPath as NSString).lastPathComponent
+        let url = dir.appendingPathComponent(name + ".embcache")
+        guard let cache = LlamaEmbeddingCache(path: url.path, dimension: embedder.dimension(), maxBytes: Self.cacheMaxBytes) else {
+            Task.detached(priority: .utility) { await logger.log("[Embed] ⚠️ Embedding cache unavailable at \(url.path)") }
+            return
+        }
+        embedder.cache = cache
+        let entries = cache.entryCount()
+        Task.detached(priority: .utility) { await logger.log("[Embed] Embedding cache attached (\(entries) entries)") }
+    }
+
+    private static let cacheMaxBytes: UInt64 = 256 * 1024 * 1024
+
     func warmUp() throws {
         guard let embedder else { throw EmbeddingError.notConfigured }
         let dim = Int(embedder.dimension())
@@ -113,49 +133,52 @@ final class LlamaEmbeddingBackend: EmbeddingsBackend {
         case .generic: Task.detached(priority: .utility) { await logger.log("[Embed] task=generic pooling=\(pooling) normalize=\(normalize)") }
         }
         
+        var inputs: [String] = []
+        inputs.reserveCapacity(texts.count)
+        for t in texts {
+            let s: String
+            if let prefix = task.prefix { s = prefix + " " + t } else { s = t }
+
+            // Validate input text
+            guard !s.isEmpty && s.count < 8192 else {
+                Task.detached(priority: .utility) { await logger.log("[Embed] ❌ Invalid text length: \(s.count)") }
+                throw EmbeddingError.embedFailed
+            }
+            inputs.append(s)
+        }
+        if Task.isCancelled { return [] }
+
+        // Embed all inputs with packed encoder batches; rows that fail stay NaN.
+        let rows = inputs.count
+        var matrix = Array(repeating: Float.nan, count: rows * dim)
+        _ = matrix.withUnsafeMutableBufferPointer { buf -> Int32 in
+            guard let base = buf.baseAddress else { return 0 }
+            return embedder.embedTexts(inputs, intoMatrix: base, rows: Int32(rows))
+        }
+        if rows > 1 {
+            let tps = embedder.lastBatchTokensPerSecond()
+            Task.detached(priority: .utility) { await logger.log(String(format: "[Embed] Batched %d text(s) at %.0f tok/s", rows, tps)) }
+        }
+
         var results: [[Float]] = []
-        results.reserveCapacity(texts.count)
-        
-        for (index, t) in texts.enumerated() {
-            if Task.isCancelled { break }
-            do {
-                let s: String
-                if let prefix = task.prefix { s = prefix + " " + t } else { s = t }
-                
-                // Validate input text
-                guard !s.isEmpty && s.count < 8192 else {
-                    Task.detached(priority: .utility) { await logger.log("[Embed] ❌ Invalid text length: \(s.count)") }
-                    throw EmbeddingError.embedFailed
-                }
-                
-                var vec = Array(repeating: Float(0), count: Int(dim))
-                let ok = vec.withUnsafeMutableBufferPointer { buf -> Bool in
-                    guard let base = buf.baseAddress else { return false }
-                    // Ensure the embedder returns mean-pooled sentence embeddings
-                    return embedder.embedText(s, intoBuffer: base, length: Int32(dim))
-                }
-                if !ok {
-                    Task.detached(priority: .utility) { await logger.log("[Embed] ❌ Embedding failed for text \(index)") }
-                    throw EmbeddingError.embedFailed
-                }
-                
-                if normalize {
-                    let n = sqrt(vec.reduce(0) { $0 + $1 * $1 })
-                    if n > 0 { for i in 0..<vec.count { vec[i] /= Float(n) } }
-                }
-                results.append(vec)
-                
-                // Log progress for longer sequences
-                if texts.count > 1 {
-                    Task.detached(priority: .utility) { await logger.log("[Embed] Progress: \(index + 1)/\(texts.count)") }
-                }
-                
-            } catch {
-                Task.detached(priority: .utility) { await logger.log("[Embed] ❌ Exception during embedding text \(index): \(error.localizedDescription)") }
-                throw error
+        results.reserveCapacity(rows)
+        for index in 0..<rows {
+            var vec = Array(matrix[(index * dim)..<((index + 1) * dim)])
+            if vec.first?.isNaN ?? true {
+                Task.detached(priority: .utility) { await logger.log("[Embed] ❌ Embedding failed for text \(index)") }
+                throw EmbeddingError.embedFailed
+            }
+            if normalize {
+                let n = sqrt(vec.reduce(0) { $0 + $1 * $1 })
+                if n > 0 { for i in 0..<vec.count { vec[i] /= Float(n) } }
             }
+            results.append(vec)
         }
         
+        if let cache = embedder.cache {
+            let hits = cache.hits(), misses = cache.misses()
+            Task.detached(priority: .utility) { await logger.log("[Embed] Cache hits=\(hits) misses=\(misses)") }
+        }
         Task.detached(priority: .utility) { await logger.log("[Embed] ✅ Successfully embedded \(results.count) text(s) [mean pooling]") }
         return results
     }
@@ -193,6 +216,7 @@ final class LlamaEmbeddingBackend: EmbeddingsBackend {
     }
 
     func unload() {
+        embedder?.cache?.flush()
         embedder?.unload()
         embedder = nil
         dimension = 0
@@ -0,0 +1,37 @@
+// LlamaEmbeddingCache.h
+#import <Foundation/Foundation.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+// Persistent, content-addressed store of embedding vectors.
+//
+// Entries are keyed by a 128-bit hash of (namespace, text), where the namespace captures the
+// model identity and pooling/normalization settings. Vectors live in a memory-mapped,
+// append-only file so a hit is a single memcpy out of the mapping. When the file grows past
+// `maxBytes`, it is compacted down to the most recently used entries.
+@interface LlamaEmbeddingCache : NSObject
+- (nullable instancetype)initWithPath:(NSString *)path
+                            dimension:(int)dimension
+                             maxBytes:(uint64_t)maxBytes;
+
+- (int)dimension;
+
+// Copies the cached vector for `text` into `buffer` (dimension floats). Returns NO on miss.
+- (BOOL)lookupText:(NSString *)text namespace:(NSString *)ns intoBuffer:(float *)buffer;
+// Appends a vector for `text`; a no-op if the key is already present.
+- (void)storeText:(NSString *)text namespace:(NSString *)ns vector:(const float *)vector;
+
+// Flushes the mapping to disk. Also called on dealloc.
+- (void)flush;
+// Drops every entry and truncates the file.
+- (void)removeAll;
+
+// Counters since the cache was opened.
+- (uint64_t)hits;
+- (uint64_t)misses;
+- (uint64_t)evictions;
+- (uint64_t)entryCount;
+- (uint64_t)fileBytes;
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,312 @@
+// LlamaEmbeddingCache.mm
+#import "LlamaEmbeddingCache.h"
+#include <vector>
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// File layout: a fixed 64-byte header followed by fixed-size records
+//   [uint64 key0][uint64 key1][uint64 checksum][float vector[dim]]
+// `count` in the header is bumped after a record is written, but the mapped pages may reach disk
+// in any order, so after a crash the header can count records whose bytes never landed. Loading
+// verifies each record's checksum and drops everything from the first mismatch on. Space past
+// the last committed record is preallocated capacity.
+namespace {
+
+constexpr char     kMagic[8] = {'N', 'O', 'E', 'M', 'A', 'E', 'C', '1'};
+constexpr uint32_t kVersion  = 2;
+
+struct CacheHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t dim;
+  uint64_t count;
+  uint64_t reserved[5];
+};
+static_assert(sizeof(CacheHeader) == 64, "cache header must stay 64 bytes");
+
+struct CacheKey {
+  uint64_t k0;
+  uint64_t k1;
+  bool operator==(const CacheKey &o) const { return k0 == o.k0 && k1 == o.k1; }
+};
+
+struct CacheKeyHash {
+  size_t operator()(const CacheKey &k) const { return (size_t)(k.k0 ^ (k.k1 * 0x9E3779B97F4A7C15ull)); }
+};
+
+inline uint64_t noema_fnv1a64(const uint8_t *data, size_t n, uint64_t h) {
+  for (size_t i = 0; i < n; ++i) {
+    h ^= data[i];
+    h *= 0x100000001B3ull;
+  }
+  return h;
+}
+
+inline uint64_t noema_mix64(uint64_t x) {
+  x ^= x >> 30; x *= 0xBF58476D1CE4E5B9ull;
+  x ^= x >> 27; x *= 0x94D049BB133111EBull;
+  x ^= x >> 31;
+  return x;
+}
+
+// Two independently seeded FNV-1a passes over "namespace\0text", finalized with splitmix64.
+inline CacheKey noema_cache_key(const std::string &ns, const std::string &text) {
+  const uint8_t zero = 0;
+  uint64_t a = 0xCBF29CE484222325ull;
+  uint64_t b = 0x84222325CBF29CE4ull;
+  a = noema_fnv1a64((const uint8_t *)ns.data(), ns.size(), a);
+  a = noema_fnv1a64(&zero, 1, a);
+  a = noema_fnv1a64((const uint8_t *)text.data(), text.size(), a);
+  b = noema_fnv1a64((const uint8_t *)text.data(), text.size(), b);
+  b = noema_fnv1a64(&zero, 1, b);
+  b = noema_fnv1a64((const uint8_t *)ns.data(), ns.size(), b);
+  return { noema_mix64(a), noema_mix64(b ^ (uint64_t)text.size()) };
+}
+
+// Checksum over the key and vector of a record; never 0, so a zero-filled record never verifies.
+inline uint64_t noema_record_checksum(const uint8_t *rec, size_t vectorBytes) {
+  uint64_t h = noema_fnv1a64(rec, 2 * sizeof(uint64_t), 0xCBF29CE484222325ull);
+  h = noema_fnv1a64(rec + 3 * sizeof(uint64_t), vectorBytes, h);
+  return noema_mix64(h) | 1;
+}
+
+}  // namespace
+
+@implementation LlamaEmbeddingCache {
+  std::mutex _mutex;
+  std::string _path;
+  int _fd;
+  uint8_t *_map;
+  size_t _mapBytes;
+  int _dim;
+  size_t _recordBytes;
+  uint64_t _maxBytes;
+  std::unordered_map<CacheKey, uint64_t, CacheKeyHash> _index;  // key -> record slot
+  std::vector<uint64_t> _lastUse;                                // per slot, for LRU compaction
+  uint64_t _tick;
+  uint64_t _hits;
+  uint64_t _misses;
+  uint64_t _evictions;
+}
+
+- (nullable instancetype)initWithPath:(NSString *)path
+                            dimension:(int)dimension
+                             maxBytes:(uint64_t)maxBytes {
+  self = [super init];
+  if (!self) return nil;
+  if (dimension <= 0 || path.length == 0) return nil;
+  _path = path.fileSystemRepresentation;
+  _dim = dimension;
+  _recordBytes = 3 * sizeof(uint64_t) + sizeof(float) * (size_t)dimension;
+  // Always room for at least a handful of records
+  _maxBytes = std::max<uint64_t>(maxBytes, sizeof(CacheHeader) + 16 * _recordBytes);
+  _fd = -1;
+  _map = nullptr;
+  if (![self openLocked]) return nil;
+  return self;
+}
+
+- (void)dealloc {
+  [self flush];
+  [self closeLocked];
+}
+
+- (int)dimension { return _dim; }
+
+#pragma mark - Mapping
+
+- (CacheHeader *)header { return (CacheHeader *)_map; }
+
+- (uint8_t *)recordAt:(uint64_t)slot {
+  return _map + sizeof(CacheHeader) + slot * _recordBytes;
+}
+
+- (BOOL)mapBytes:(size_t)bytes {
+  if (_map) { munmap(_map, _mapBytes); _map = nullptr; _mapBytes = 0; }
+  if (ftruncate(_fd, (off_t)bytes) != 0) return NO;
+  void *m = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (m == MAP_FAILED) return NO;
+  _map = (uint8_t *)m;
+  _mapBytes = bytes;
+  return YES;
+}
+
+- (void)closeLocked {
+  if (_map) { munmap(_map, _mapBytes); _map = nullptr; _mapBytes = 0; }
+  if (_fd >= 0) { close(_fd); _fd = -1; }
+  _index.clear();
+  _lastUse.clear();
+}
+
+- (BOOL)openLocked {
+  _fd = open(_path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (_fd < 0) return NO;
+  struct stat st;
+  if (fstat(_fd, &st) != 0) { [self closeLocked]; return NO; }
+  size_t size = (size_t)st.st_size;
+
+  bool valid = size >= sizeof(CacheHeader);
+  if (valid) {
+    CacheHeader h;
+    valid = pread(_fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+            memcmp(h.magic, kMagic, sizeof(kMagic)) == 0 &&
+            h.version == kVersion && h.dim == (uint32_t)_dim;
+  }
+  const size_t initial = sizeof(CacheHeader) + 64 * _recordBytes;
+  if (!valid) {
+    // Unknown, foreign, or different-dimension file: start over
+    if (![self mapBytes:initial]) { [self closeLocked]; return NO; }
+    memset(_map, 0, sizeof(CacheHeader));
+    CacheHeader *h = [self header];
+    memcpy(h->magic, kMagic, sizeof(kMagic));
+    h->version = kVersion;
+    h->dim = (uint32_t)_dim;
+    h->count = 0;
+  } else if (![self mapBytes:std::max(size, initial)]) {
+    [self closeLocked];
+    return NO;
+  }
+
+  CacheHeader *h = [self header];
+  const uint64_t fits = (uint64_t)((_mapBytes - sizeof(CacheHeader)) / _recordBytes);
+  if (h->count > fits) h->count = fits;
+  // Keep the records up to the first one torn by a crash.
+  const size_t vectorBytes = sizeof(float) * (size_t)_dim;
+  for (uint64_t i = 0; i < h->count; ++i) {
+    const uint8_t *rec = [self recordAt:i];
+    if (((const uint64_t *)rec)[2] != noema_record_checksum(rec, vectorBytes)) {
+      h->count = i;
+      break;
+    }
+  }
+  _index.reserve((size_t)h->count);
+  _lastUse.resize((size_t)h->count);
+  // File order approximates age across launches: older records get lower ticks.
+  for (uint64_t i = 0; i < h->count; ++i) {
+    const uint64_t *k = (const uint64_t *)[self recordAt:i];
+    _index[{k[0], k[1]}] = i;
+    _lastUse[i] = i + 1;
+  }
+  _tick = h->count + 1;
+  return YES;
+}
+
+- (uint64_t)usedBytesLocked {
+  return sizeof(CacheHeader) + [self header]->count * _recordBytes;
+}
+
+#pragma mark - Public API
+
+- (BOOL)lookupText:(NSString *)text namespace:(NSString *)ns intoBuffer:(float *)buffer {
+  if (!buffer) return NO;
+  const CacheKey key = noema_cache_key(ns.UTF8String ?: "", text.UTF8String ?: "");
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_map) return NO;
+  auto it = _index.find(key);
+  if (it == _index.end()) { _misses++; return NO; }
+  memcpy(buffer, [self recordAt:it->second] + 3 * sizeof(uint64_t), sizeof(float) * (size_t)_dim);
+  _lastUse[it->second] = ++_tick;
+  _hits++;
+  return YES;
+}
+
+- (void)storeText:(NSString *)text namespace:(NSString *)ns vector:(const float *)vector {
+  if (!vector) return;
+  const CacheKey key = noema_cache_key(ns.UTF8String ?: "", text.UTF8String ?: "");
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_map || _index.count(key)) return;
+
+  CacheHeader *h = [self header];
+  const uint64_t slot = h->count;
+  const size_t need = sizeof(CacheHeader) + (size_t)(slot + 1) * _recordBytes;
+  if (need > _mapBytes) {
+    if (![self mapBytes:std::max(need, _mapBytes * 2)]) { [self closeLocked]; return; }
+    h = [self header];
+  }
+  uint8_t *rec = [self recordAt:slot];
+  ((uint64_t *)rec)[0] = key.k0;
+  ((uint64_t *)rec)[1] = key.k1;
+  memcpy(rec + 3 * sizeof(uint64_t), vector, sizeof(float) * (size_t)_dim);
+  ((uint64_t *)rec)[2] = noema_record_checksum(rec, sizeof(float) * (size_t)_dim);
+  h->count = slot + 1;
+  _index[key] = slot;
+  _lastUse.push_back(++_tick);
+
+  if ([self usedBytesLocked] > _maxBytes) {
+    [self compactLocked];
+  }
+}
+
+// Rewrite the file keeping the most recently used entries (down to 3/4 of the budget), in
+// their original order, then swap it in atomically.
+- (void)compactLocked {
+  CacheHeader *h = [self header];
+  const uint64_t count = h->count;
+  const uint64_t target = (_maxBytes * 3 / 4 - sizeof(CacheHeader)) / _recordBytes;
+  if (count <= target) return;
+
+  std::vector<uint64_t> byRecency(count);
+  for (uint64_t i = 0; i < count; ++i) byRecency[i] = i;
+  std::nth_element(byRecency.begin(), byRecency.begin() + (ptrdiff_t)target, byRecency.end(),
+                   [&](uint64_t a, uint64_t b) { return _lastUse[a] > _lastUse[b]; });
+  std::vector<uint64_t> keep(byRecency.begin(), byRecency.begin() + (ptrdiff_t)target);
+  std::sort(keep.begin(), keep.end());
+
+  const std::string tmp = _path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) return;
+  CacheHeader nh = *h;
+  nh.count = keep.size();
+  bool ok = fwrite(&nh, sizeof(nh), 1, f) == 1;
+  for (size_t i = 0; ok && i < keep.size(); ++i) {
+    ok = fwrite([self recordAt:keep[i]], _recordBytes, 1, f) == 1;
+  }
+  ok = (fflush(f) == 0) && ok;
+  if (ok) fsync(fileno(f));
+  fclose(f);
+  if (!ok || rename(tmp.c_str(), _path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return;
+  }
+
+  std::vector<uint64_t> lastUse(keep.size());
+  for (size_t i = 0; i < keep.size(); ++i) lastUse[i] = _lastUse[keep[i]];
+  _evictions += count - keep.size();
+  [self closeLocked];
+  if ([self openLocked]) {
+    _lastUse.swap(lastUse);
+    _tick = std::max<uint64_t>(_tick, keep.size() + 1);
+    for (uint64_t t : _lastUse) _tick = std::max(_tick, t + 1);
+  }
+}
+
+- (void)flush {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_map) msync(_map, _mapBytes, MS_ASYNC);
+}
+
+- (void)removeAll {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_map) return;
+  [self header]->count = 0;
+  _index.clear();
+  _lastUse.clear();
+  [self mapBytes:sizeof(CacheHeader) + 64 * _recordBytes];
+}
+
+- (uint64_t)hits { std::lock_guard<std::mutex> lock(_mutex); return _hits; }
+- (uint64_t)misses { std::lock_guard<std::mutex> lock(_mutex); return _misses; }
+- (uint64_t)evictions { std::lock_guard<std::mutex> lock(_mutex); return _evictions; }
+- (uint64_t)entryCount { std::lock_guard<std::mutex> lock(_mutex); return _map ? [self header]->count : 0; }
+- (uint64_t)fileBytes { std::lock_guard<std::mutex> lock(_mutex); return _map ? [self usedBytesLocked] : 0; }
+
+@end
@@ -33,6 +33,49 @@ typedef struct {
 	NOEMAKVCacheType typeV;       // ignored if enabled == NO
 } NOEMAKVCacheConfig;
 
+// Per-call speculative decoding counters (all zero when no draft model is configured).
+// Acceptance rate = acceptedTokens / draftedTokens; tokens per target pass =
+// emittedTokens / targetPasses.
+typedef struct {
+	NSInteger draftedTokens;      // tokens proposed by the draft model
+	NSInteger acceptedTokens;     // proposals the target agreed with
+	NSInteger targetPasses;       // target llama_decode calls during generation
+	NSInteger emittedTokens;      // tokens delivered to onToken
+} NOEMASpeculativeStats;
+
+// Streaming output cadence. Text is always delivered as complete UTF-8 (a character split
+// across tokens waits for its remaining bytes). With both thresholds at zero (the default)
+// every token that completes text gets its own callback; otherwise the first text is delivered
+// at once and later tokens are coalesced until `flushBytes` bytes are pending or `flushMicros`
+// have passed since the previous callback.
+typedef struct {
+	NSUInteger flushBytes;
+	NSUInteger flushMicros;
+	BOOL deliverTokenIDs;         // onChunk variant only: pass token ids with byte offsets
+} NOEMAStreamConfig;
+
+typedef struct {
+	int32_t token;
+	uint64_t offset;              // UTF-8 byte offset in the streamed text of the character holding the token's first byte
+} NOEMAStreamToken;
+
+// `tokens` lists the tokens that started since the previous chunk (NULL/0 unless enabled).
+// `text` may be empty when only token ids are pending.
+typedef void (^LlamaChunkHandler)(NSString *text, const NOEMAStreamToken * _Nullable tokens, NSInteger count);
+
+// Sampler chain configuration. The runner keeps its samplers across calls and rebuilds them
+// only when these values change.
+typedef struct {
+	float temperature;            // <= 0 is treated as 0.1
+	int topK;
+	float topP;                   // 1 disables
+	float minP;                   // 0 disables
+	float repeatPenalty;
+	float frequencyPenalty;
+	float presencePenalty;
+	int repeatLastN;
+} NOEMASamplingParams;
+
 @interface LlamaRunner : NSObject
 // Returns YES if the current process exports known vision symbols discovered via dlsym,
 // regardless of whether headers were available at compile time.
@@ -70,6 +113,13 @@ typedef struct {
                       onDone:(LlamaDoneHandler)onDone
                      onError:(LlamaErrorHandler)onError;
 
+// Same as above with chunked delivery per the stream config, optionally with token ids.
+- (void)generateWithPrompt:(NSString *)prompt
+                  maxTokens:(int)maxTokens
+                     onChunk:(LlamaChunkHandler)onChunk
+                      onDone:(LlamaDoneHandler)onDone
+                     onError:(LlamaErrorHandler)onError;
+
 // New API: optional image paths for multimodal prompts. In this configuration we do not
 // process images in-process; callers should pass nil here and prefer routing vision
 // requests through a server using the OpenAI-compatible chat API with base64 image URLs.
@@ -80,6 +130,25 @@ typedef struct {
                     onDone:(LlamaDoneHandler)onDone
                    onError:(LlamaErrorHandler)onError;
 
+// Batched generation: decode N independent prompts together, one token per active sequence
+// per llama_decode, using sequence ids 0..N-1. N must not exceed the nSeqMax the runner was
+// created with. Each sequence has its own sampler; onTokens[i] receives the pieces of
+// prompt i. onDone fires once after every sequence has finished.
+- (void)generateWithPrompts:(NSArray<NSString *> *)prompts
+                  maxTokens:(int)maxTokens
+                   onTokens:(NSArray<LlamaTokenHandler> *)onTokens
+                     onDone:(LlamaDoneHandler)onDone
+                    onError:(LlamaErrorHandler)onError;
+
+// Same as above, but `prefix` is decoded once into sequence 0 and shared with the other
+// sequences via llama_memory_seq_cp; each continuation is appended after it.
+- (void)generateWithSharedPrefix:(nullable NSString *)prefix
+                   continuations:(NSArray<NSString *> *)continuations
+                       maxTokens:(int)maxTokens
+                        onTokens:(NSArray<LlamaTokenHandler> *)onTokens
+                          onDone:(LlamaDoneHandler)onDone
+                         onError:(LlamaErrorHandler)onError;
+
 // Whether vision ops appear to be present in the linked binary (runtime symbol probe).
 - (BOOL)hasVisionOps;
 
@@ -90,10 +159,43 @@ typedef struct {
 // Request cancellation of any in-flight generation. Safe to call from any thread.
 - (void)cancelCurrent;
 
+// Prompt prefix reuse: tokens resident in the KV cache from the previous call are kept up to
+// the longest common prefix with the new prompt, so only the divergent suffix is prefilled.
+// Disable with NOEMA_PROMPT_CACHE=0. Counters describe the most recent generate call.
+- (NSInteger)lastPromptTokensReused;
+- (NSInteger)lastPromptTokensRecomputed;
+// Drop the cached prefix so the next call prefills from scratch.
+- (void)resetPromptCache;
+
+// Session persistence: the KV state of seq 0 plus its token list, written as one memory-mapped
+// file per session name under `directory`. After each save the least recently used sessions
+// (saves and successful restores count as use) are evicted until the directory fits `maxBytes`
+// (0 = no cap). Pass nil to disable.
+- (void)setSessionDirectory:(nullable NSString *)directory maxBytes:(uint64_t)maxBytes;
+- (BOOL)saveSessionNamed:(NSString *)name;
+// Restores the session if its tokens share a longer prefix with `prompt` than the tokens
+// already resident, so the following generate only prefills the remainder. Returns the number
+// of matching prefix tokens, or 0 if nothing was restored (missing file, other model, no gain).
+- (NSInteger)restoreSessionNamed:(NSString *)name forPrompt:(NSString *)prompt;
+- (void)removeSessionNamed:(NSString *)name;
+
+// Speculative decoding counters for the most recent generate call.
+- (NOEMASpeculativeStats)lastSpeculativeStats;
+
 // KV-cache config (thread-safe enough for “configure before load” usage)
 - (void)setKVCacheConfig:(NOEMAKVCacheConfig)config;
 - (NOEMAKVCacheConfig)kvCacheConfig;
 
+// Sampling parameters for subsequent generate calls. A new runner starts from the NOEMA_*
+// sampling environment variables, falling back to +defaultSamplingParams.
++ (NOEMASamplingParams)defaultSamplingParams;
+- (void)setSamplingParams:(NOEMASamplingParams)params;
+- (NOEMASamplingParams)samplingParams;
+
+// Streaming cadence for all generate calls; applies from the next call.
+- (void)setStreamConfig:(NOEMAStreamConfig)config;
+- (NOEMAStreamConfig)streamConfig;
+
 - (void)unload;
 @end
 
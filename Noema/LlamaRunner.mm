@@ -5,14 +5,22 @@
 #include <string>
 #include <algorithm>
 #include <atomic>
+#include <mutex>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstdio>
 #include <type_traits>
+#include "NoemaTokenStream.hpp"
 // Build-time configuration for llama.cpp capabilities
 #import "NoemaLlamaConfig.h"
 #import "LlamaBackendManager.h"
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #if __has_include(<llama/llama.h>)
 #import <llama/llama.h>
 #elif __has_include(<LlamaFramework/llama.h>)
@@ -41,12 +49,16 @@ extern "C" {
 __attribute__((weak_import)) LLAMA_API llama_memory_t llama_get_memory(const struct llama_context * ctx);
 __attribute__((weak_import)) LLAMA_API void llama_memory_clear(llama_memory_t mem, bool data);
 __attribute__((weak_import)) LLAMA_API bool llama_memory_seq_rm(llama_memory_t mem, llama_seq_id seq_id, llama_pos p0, llama_pos p1);
+__attribute__((weak_import)) LLAMA_API void llama_memory_seq_cp(llama_memory_t mem, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1);
+__attribute__((weak_import)) LLAMA_API llama_pos llama_memory_seq_pos_min(llama_memory_t mem, llama_seq_id seq_id);
 }
 #else
 extern "C" {
 LLAMA_API llama_memory_t llama_get_memory(const struct llama_context * ctx);
 LLAMA_API void llama_memory_clear(llama_memory_t mem, bool data);
 LLAMA_API bool llama_memory_seq_rm(llama_memory_t mem, llama_seq_id seq_id, llama_pos p0, llama_pos p1);
+LLAMA_API void llama_memory_seq_cp(llama_memory_t mem, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1);
+LLAMA_API llama_pos llama_memory_seq_pos_min(llama_memory_t mem, llama_seq_id seq_id);
 }
 #endif
 
@@ -74,6 +86,247 @@ static inline void noema_llama_kv_cache_clear(struct llama_context * ctx, bool c
 #endif
 }
 
+// Remove positions [p0, end) of a sequence. Returns false when the runtime lacks the
+// memory API or the backend cannot trim partially (e.g. recurrent state), in which case
+// callers must fall back to a full clear.
+static inline bool noema_llama_seq_rm_tail(struct llama_context * ctx, llama_seq_id seq, llama_pos p0) {
+#if defined(__APPLE__)
+  using llama_get_memory_fn = llama_memory_t (*)(const struct llama_context *);
+  using llama_memory_seq_rm_fn = bool (*)(llama_memory_t, llama_seq_id, llama_pos, llama_pos);
+  llama_get_memory_fn p_get_memory = (llama_get_memory_fn)llama_get_memory;
+  llama_memory_seq_rm_fn p_memory_seq_rm = (llama_memory_seq_rm_fn)llama_memory_seq_rm;
+  if (!p_get_memory || !p_memory_seq_rm) return false;
+  return p_memory_seq_rm(p_get_memory(ctx), seq, p0, -1);
+#else
+  return llama_memory_seq_rm(llama_get_memory(ctx), seq, p0, -1);
+#endif
+}
+
+// Smallest position still resident for a sequence, -1 when it is empty. Returns -2 when the
+// runtime lacks llama_memory_seq_pos_min, which callers treat as "prefix not verifiable".
+static inline llama_pos noema_llama_seq_pos_min(struct llama_context * ctx, llama_seq_id seq) {
+#if defined(__APPLE__)
+  using llama_get_memory_fn = llama_memory_t (*)(const struct llama_context *);
+  using llama_memory_seq_pos_min_fn = llama_pos (*)(llama_memory_t, llama_seq_id);
+  llama_get_memory_fn p_get_memory = (llama_get_memory_fn)llama_get_memory;
+  llama_memory_seq_pos_min_fn p_memory_seq_pos_min = (llama_memory_seq_pos_min_fn)llama_memory_seq_pos_min;
+  if (!p_get_memory || !p_memory_seq_pos_min) return -2;
+  return p_memory_seq_pos_min(p_get_memory(ctx), seq);
+#else
+  return llama_memory_seq_pos_min(llama_get_memory(ctx), seq);
+#endif
+}
+
+// Share all cells of `src` with `dst` (the caller clears `dst` first). Returns false when the
+// runtime lacks llama_memory_seq_cp.
+static inline bool noema_llama_seq_cp(struct llama_context * ctx, llama_seq_id src, llama_seq_id dst) {
+#if defined(__APPLE__)
+  using llama_get_memory_fn = llama_memory_t (*)(const struct llama_context *);
+  using llama_memory_seq_cp_fn = void (*)(llama_memory_t, llama_seq_id, llama_seq_id, llama_pos, llama_pos);
+  llama_get_memory_fn p_get_memory = (llama_get_memory_fn)llama_get_memory;
+  llama_memory_seq_cp_fn p_memory_seq_cp = (llama_memory_seq_cp_fn)llama_memory_seq_cp;
+  if (!p_get_memory || !p_memory_seq_cp) return false;
+  p_memory_seq_cp(p_get_memory(ctx), src, dst, -1, -1);
+#else
+  llama_memory_seq_cp(llama_get_memory(ctx), src, dst, -1, -1);
+#endif
+  return true;
+}
+
+// Align the KV contents of seq 0 with `toks` by keeping the longest common prefix with
+// `cached` (the tokens currently resident) and dropping the divergent tail. At least one
+// token is always left to decode so the caller gets fresh logits. Returns the number of
+// reused positions and truncates `cached` to match. Sliding-window (SWA) and other partial
+// memories may have evicted the start of the prefix; then the sequence is prefilled from scratch.
+static int noema_reuse_prompt_prefix(struct llama_context * ctx,
+                                     std::vector<llama_token> &cached,
+                                     const std::vector<llama_token> &toks,
+                                     bool enabled) {
+  size_t lcp = 0;
+  if (enabled) {
+    const size_t lim = std::min(cached.size(), toks.size());
+    while (lcp < lim && cached[lcp] == toks[lcp]) ++lcp;
+    if (lcp == toks.size() && lcp > 0) --lcp;
+  }
+  if (lcp > 0 && noema_llama_seq_rm_tail(ctx, 0, (llama_pos)lcp) && noema_llama_seq_pos_min(ctx, 0) == 0) {
+    cached.resize(lcp);
+    return (int)lcp;
+  }
+  noema_llama_kv_cache_clear(ctx, /*clearData=*/true);
+  cached.clear();
+  return 0;
+}
+
+// Tokenize a templated prompt, parsing special tokens (e.g., <|im_start|>, <|eot_id|>) so chat
+// templates survive. A leading segment gets BOS auto-inserted unless it already starts with a
+// control-token prefix ('<' as in <bos>/<|...|>, '[' as in [INST]); continuation segments never do.
+static std::vector<llama_token> noema_tokenize_prompt(const struct llama_vocab *vocab, const std::string &p, bool leading) {
+  bool addSpecial = leading;
+  if (addSpecial && !p.empty()) {
+    const char c0 = p[0];
+    if (c0 == '<' || c0 == '[') {
+      addSpecial = false;
+    }
+  }
+  std::vector<llama_token> toks(p.size() * 4 + 16);
+  int n = llama_tokenize(vocab, p.c_str(), (int32_t)p.length(), toks.data(), (int)toks.size(), /*add_special*/ addSpecial, /*parse_special*/ true);
+  toks.resize(std::max(0, n));
+  return toks;
+}
+
+// Render one token's bytes for the piece cache, growing `out` when the piece is long.
+static void noema_render_piece(const struct llama_vocab *vocab, llama_token tok, std::string &out) {
+  out.resize(32);
+  int nout = llama_token_to_piece(vocab, tok, out.data(), (int32_t)out.size(), 0, false);
+  if (nout < 0) {
+    out.resize((size_t)-nout);
+    nout = llama_token_to_piece(vocab, tok, out.data(), (int32_t)out.size(), 0, false);
+  }
+  out.resize((size_t)std::max(0, nout));
+}
+
+static_assert(sizeof(NOEMAStreamToken) == sizeof(noema::StreamToken) &&
+              offsetof(NOEMAStreamToken, offset) == offsetof(noema::StreamToken, offset),
+              "NOEMAStreamToken must mirror noema::StreamToken");
+
+static inline noema::StreamCadence noema_stream_cadence(NOEMAStreamConfig cfg, bool tokenIDs) {
+  noema::StreamCadence cadence;
+  cadence.flush_bytes = cfg.flushBytes;
+  cadence.flush_micros = (int64_t)cfg.flushMicros;
+  cadence.token_ids = tokenIDs;
+  return cadence;
+}
+
+static inline void noema_batch_add(llama_batch &batch, llama_token tok, llama_pos pos, llama_seq_id seq, bool logits) {
+  const int i = batch.n_tokens;
+  batch.token[i]     = tok;
+  batch.pos[i]       = pos;
+  batch.n_seq_id[i]  = 1;
+  batch.seq_id[i][0] = seq;
+  batch.logits[i]    = logits;
+  batch.n_tokens++;
+}
+
+// Decode toks[start, end) into seq 0 in chunks of at most `n_batch`, requesting logits
+// only for the final token. Every decoded token is appended to `cached` so the resident
+// prefix stays accurate even if a later chunk fails or the caller cancels.
+// Returns 0 on success, 1 if cancelled, -1 on decode failure.
+static int noema_decode_prompt_range(struct llama_context * ctx,
+                                     llama_batch &batch,
+                                     int n_batch,
+                                     const std::vector<llama_token> &toks,
+                                     int start,
+                                     int end,
+                                     std::vector<llama_token> &cached,
+                                     const std::atomic<bool> *cancel) {
+  int n_cur = start;
+  while (n_cur < end) {
+    if (cancel && cancel->load()) return 1;
+    const int n_chunk = std::min(end - n_cur, n_batch);
+    batch.n_tokens = 0;
+    for (int i = 0; i < n_chunk; ++i) {
+      const int pos = n_cur + i;
+      batch.token[batch.n_tokens]     = toks[pos];
+      batch.pos[batch.n_tokens]       = pos;
+      batch.n_seq_id[batch.n_tokens]  = 1;
+      batch.seq_id[batch.n_tokens][0] = 0;
+      batch.logits[batch.n_tokens]    = (pos == end - 1);
+      batch.n_tokens++;
+    }
+    if (llama_decode(ctx, batch) != 0) return -1;
+    cached.insert(cached.end(), toks.begin() + n_cur, toks.begin() + n_cur + n_chunk);
+    n_cur += n_chunk;
+  }
+  return 0;
+}
+
+// --- Session files ---
+// Layout: a 64-byte header, the token list, then the llama_state_seq blob starting on a page
+// boundary. The blob is written straight into a shared mapping and restored from a read-only
+// mapping, so neither direction stages the (often hundreds of MB) state in heap memory.
+namespace {
+
+constexpr char kNoemaSessionMagic[8] = {'N', 'O', 'E', 'M', 'A', 'S', 'S', '1'};
+
+struct NoemaSessionHeader {
+  char     magic[8];
+  uint64_t model_fingerprint;
+  uint64_t n_tokens;
+  uint64_t state_offset;
+  uint64_t state_bytes;
+  uint64_t reserved[3];
+};
+static_assert(sizeof(NoemaSessionHeader) == 64, "session header must stay 64 bytes");
+
+}  // namespace
+
+// Identifies the weights a session was produced with; state from another model is rejected.
+static uint64_t noema_model_fingerprint(const llama_model *model) {
+  uint64_t h = 0xCBF29CE484222325ull;
+  auto mix = [&h](uint64_t v) { h ^= v; h *= 0x100000001B3ull; h ^= h >> 29; };
+  mix(llama_model_size(model));
+  mix(llama_model_n_params(model));
+  mix((uint64_t)llama_model_n_embd(model));
+  mix((uint64_t)llama_model_n_layer(model));
+  mix((uint64_t)llama_vocab_n_tokens(llama_model_get_vocab(model)));
+  return h;
+}
+
+static std::string noema_session_file(const std::string &dir, NSString *name) {
+  uint64_t h = 0xCBF29CE484222325ull;
+  for (const char *p = name.UTF8String ?: ""; *p; ++p) { h ^= (uint8_t)*p; h *= 0x100000001B3ull; }
+  char file[40];
+  snprintf(file, sizeof(file), "/%016llx.noemasess", (unsigned long long)h);
+  return dir + file;
+}
+
+// Flush a file's data to stable storage. On Apple platforms fsync only reaches the drive's
+// cache; F_FULLFSYNC also flushes that, and fsync is the fallback where it is not supported.
+static bool noema_full_sync(int fd) {
+#if defined(__APPLE__)
+  if (fcntl(fd, F_FULLFSYNC) == 0) return true;
+#endif
+  return fsync(fd) == 0;
+}
+
+// Make a rename inside `dir` durable.
+static void noema_sync_dir(const std::string &dir) {
+  const int fd = open(dir.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  noema_full_sync(fd);
+  close(fd);
+}
+
+// Drop least recently used sessions (by mtime; restores touch the file) until the directory
+// fits `max_bytes`. `keep` is never evicted.
+static void noema_evict_sessions(const std::string &dir, uint64_t max_bytes, const std::string &keep) {
+  NSFileManager *fm = [NSFileManager defaultManager];
+  NSArray<NSString *> *names = [fm contentsOfDirectoryAtPath:[NSString stringWithUTF8String:dir.c_str()] error:nil];
+  struct Entry { std::string path; uint64_t bytes; struct timespec mtime; };
+  std::vector<Entry> entries;
+  uint64_t total = 0;
+  for (NSString *n in names) {
+    if (![n hasSuffix:@".noemasess"]) continue;
+    std::string path = dir + "/" + n.UTF8String;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) continue;
+#if defined(__APPLE__)
+    entries.push_back({path, (uint64_t)st.st_size, st.st_mtimespec});
+#else
+    entries.push_back({path, (uint64_t)st.st_size, st.st_mtim});
+#endif
+    total += (uint64_t)st.st_size;
+  }
+  std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+    return a.mtime.tv_sec != b.mtime.tv_sec ? a.mtime.tv_sec < b.mtime.tv_sec : a.mtime.tv_nsec < b.mtime.tv_nsec;
+  });
+  for (const auto &e : entries) {
+    if (total <= max_bytes) break;
+    if (e.path == keep) continue;
+    if (unlink(e.path.c_str()) == 0) total -= e.bytes;
+  }
+}
+
 // (Removed) Legacy helper functions for batch operations; using direct batch API instead
 
 // --- KV cache type mappers ---
@@ -226,58 +479,58 @@ static int noema_llava_prime_with_images(
     return -1;
 }
 
-// Construct a robust default sampler chain.
-// Uses temperature + top-k to avoid empty candidate sets.
-// Optional top-p/typical lines are left commented with min_keep = 1 for safe experimentation.
-static llama_sampler * noema_make_default_sampler() {
-  auto *chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
-
+// Sampling parameters the host has left in the environment (ChatVM mirrors ModelSettings
+// there). Read once when a runner is created; later changes go through setSamplingParams.
+static NOEMASamplingParams noema_sampling_params_from_env() {
+  NOEMASamplingParams p = [LlamaRunner defaultSamplingParams];
   const char *envTemp = getenv("NOEMA_TEMPERATURE");
-  float temp = 0.7f;
-  if (envTemp && envTemp[0] != '\0') {
-    temp = strtof(envTemp, nullptr);
-    if (temp <= 0.0f) temp = 0.1f;
-  }
-  llama_sampler_chain_add(chain, llama_sampler_init_temp(temp));
-
+  if (envTemp && envTemp[0] != '\0') p.temperature = strtof(envTemp, nullptr);
   const char *envTopK = getenv("NOEMA_TOP_K");
-  int top_k = 40;
-  if (envTopK && envTopK[0] != '\0') {
-    top_k = std::max(1, atoi(envTopK));
-  }
-  llama_sampler_chain_add(chain, llama_sampler_init_top_k(top_k));
-
+  if (envTopK && envTopK[0] != '\0') p.topK = atoi(envTopK);
   const char *envTopP = getenv("NOEMA_TOP_P");
-  if (envTopP && envTopP[0] != '\0') {
-    float top_p = strtof(envTopP, nullptr);
-    if (top_p > 0.0f && top_p <= 1.0f) {
-      llama_sampler_chain_add(chain, llama_sampler_init_top_p(top_p, 1));
-    }
-  }
-
+  if (envTopP && envTopP[0] != '\0') p.topP = strtof(envTopP, nullptr);
   const char *envMinP = getenv("NOEMA_MIN_P");
-  if (envMinP && envMinP[0] != '\0') {
-    float min_p = strtof(envMinP, nullptr);
-    if (min_p > 0.0f && min_p <= 1.0f) {
-      llama_sampler_chain_add(chain, llama_sampler_init_min_p(min_p, 1));
-    }
-  }
-
+  if (envMinP && envMinP[0] != '\0') p.minP = strtof(envMinP, nullptr);
   const char *envRepeatPenalty = getenv("NOEMA_REPEAT_PENALTY");
+  if (envRepeatPenalty) p.repeatPenalty = strtof(envRepeatPenalty, nullptr);
   const char *envFrequencyPenalty = getenv("NOEMA_FREQUENCY_PENALTY");
+  if (envFrequencyPenalty) p.frequencyPenalty = strtof(envFrequencyPenalty, nullptr);
   const char *envPresencePenalty = getenv("NOEMA_PRESENCE_PENALTY");
+  if (envPresencePenalty) p.presencePenalty = strtof(envPresencePenalty, nullptr);
   const char *envRepeatLastN = getenv("NOEMA_REPEAT_LAST_N");
-  float repeat_penalty = envRepeatPenalty ? strtof(envRepeatPenalty, nullptr) : 1.1f;
-  float frequency_penalty = envFrequencyPenalty ? strtof(envFrequencyPenalty, nullptr) : 0.0f;
-  float presence_penalty = envPresencePenalty ? strtof(envPresencePenalty, nullptr) : 0.0f;
-  int repeat_last_n = envRepeatLastN ? std::max(0, atoi(envRepeatLastN)) : 64;
+  if (envRepeatLastN) p.repeatLastN = atoi(envRepeatLastN);
+  return p;
+}
+
+static inline bool noema_sampling_params_equal(const NOEMASamplingParams &a, const NOEMASamplingParams &b) {
+  return a.temperature == b.temperature && a.topK == b.topK && a.topP == b.topP && a.minP == b.minP &&
+         a.repeatPenalty == b.repeatPenalty && a.frequencyPenalty == b.frequencyPenalty &&
+         a.presencePenalty == b.presencePenalty && a.repeatLastN == b.repeatLastN;
+}
+
+// Construct a robust sampler chain: temperature + top-k, optional top-p/min-p (min_keep = 1),
+// penalties, then greedy selection.
+static llama_sampler * noema_make_sampler(const NOEMASamplingParams &p) {
+  auto *chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+
+  const float temp = p.temperature > 0.0f ? p.temperature : 0.1f;
+  llama_sampler_chain_add(chain, llama_sampler_init_temp(temp));
+  llama_sampler_chain_add(chain, llama_sampler_init_top_k(std::max(1, p.topK)));
+
+  if (p.topP > 0.0f && p.topP < 1.0f) {
+    llama_sampler_chain_add(chain, llama_sampler_init_top_p(p.topP, 1));
+  }
+  if (p.minP > 0.0f && p.minP <= 1.0f) {
+    llama_sampler_chain_add(chain, llama_sampler_init_min_p(p.minP, 1));
+  }
+
   // Recent llama.cpp releases changed the penalty sampler signature to take penalty_last_n first
   // and removed the explicit newline toggle, so we just forward the configured values.
   llama_sampler_chain_add(chain, llama_sampler_init_penalties(
-      repeat_last_n,
-      repeat_penalty,
-      frequency_penalty,
-      presence_penalty));
+      std::max(0, p.repeatLastN),
+      p.repeatPenalty,
+      p.frequencyPenalty,
+      p.presencePenalty));
 
   llama_sampler_chain_add(chain, llama_sampler_init_greedy());
   return chain;
@@ -330,6 +583,30 @@ static void noema_prepare_moe_overrides(std::vector<llama_model_kv_override> &ou
   bool _specEnabled;
   int _specValue;
   bool _specModeMax;
+  llama_batch _draftBatch;          // persistent draft batch, sized for a full prompt chunk
+  NOEMASpeculativeStats _lastSpecStats;
+  // Tokens currently resident in seq 0 of each context, in position order. Used to
+  // reuse the longest common prefix across turns instead of re-prefilling the history.
+  bool _promptCacheEnabled;
+  std::vector<llama_token> _seqTokens;
+  std::vector<llama_token> _draftSeqTokens;
+  std::atomic<NSInteger> _lastReusedTokens;
+  std::atomic<NSInteger> _lastRecomputedTokens;
+  // Detokenized bytes per token id for the loaded model, filled lazily while streaming
+  noema::PieceCache _pieceCache;
+  NOEMAStreamConfig _streamConfig;
+  // Long-lived per-request objects. Samplers are rebuilt only when the parameters change
+  // (generation bumps `_samplingVersion`); otherwise they are reset between calls.
+  std::mutex _samplingMutex;
+  NOEMASamplingParams _samplingParams;
+  uint64_t _samplingVersion;
+  uint64_t _builtSamplingVersion;
+  std::vector<llama_sampler *> _samplers;  // one per sequence, grown on demand
+  llama_sampler *_draftGreedy;
+  llama_batch _batch;
+  // Session persistence (disabled until a directory is set)
+  std::string _sessionDir;
+  uint64_t _sessionMaxBytes;
 }
 
 - (instancetype)init {
@@ -352,6 +629,60 @@ static void noema_prepare_moe_overrides(std::vector<llama_model_kv_override> &ou
 - (void)setKVCacheConfig:(NOEMAKVCacheConfig)config { _kvConfig = config; }
 - (NOEMAKVCacheConfig)kvCacheConfig { return _kvConfig; }
 
+- (void)setStreamConfig:(NOEMAStreamConfig)config { _streamConfig = config; }
+- (NOEMAStreamConfig)streamConfig { return _streamConfig; }
+
++ (NOEMASamplingParams)defaultSamplingParams {
+  NOEMASamplingParams p;
+  p.temperature = 0.7f;
+  p.topK = 40;
+  p.topP = 1.0f;
+  p.minP = 0.0f;
+  p.repeatPenalty = 1.1f;
+  p.frequencyPenalty = 0.0f;
+  p.presencePenalty = 0.0f;
+  p.repeatLastN = 64;
+  return p;
+}
+
+- (void)setSamplingParams:(NOEMASamplingParams)params {
+  std::lock_guard<std::mutex> lock(_samplingMutex);
+  if (noema_sampling_params_equal(params, _samplingParams)) return;
+  _samplingParams = params;
+  _samplingVersion++;
+}
+
+- (NOEMASamplingParams)samplingParams {
+  std::lock_guard<std::mutex> lock(_samplingMutex);
+  return _samplingParams;
+}
+
+// Samplers for sequences [0, count), rebuilt if the parameters changed since they were made
+// and reset so penalties start from a clean history.
+- (void)prepareSamplers:(int)count {
+  NOEMASamplingParams params;
+  uint64_t version;
+  {
+    std::lock_guard<std::mutex> lock(_samplingMutex);
+    params = _samplingParams;
+    version = _samplingVersion;
+  }
+  if (version != _builtSamplingVersion) {
+    for (auto *smpl : _samplers) llama_sampler_free(smpl);
+    _samplers.clear();
+    _builtSamplingVersion = version;
+  }
+  while ((int)_samplers.size() < count) _samplers.push_back(noema_make_sampler(params));
+  for (int i = 0; i < count; ++i) llama_sampler_reset(_samplers[i]);
+}
+
+- (void)freeRequestObjects {
+  for (auto *smpl : _samplers) llama_sampler_free(smpl);
+  _samplers.clear();
+  if (_draftGreedy) { llama_sampler_free(_draftGreedy); _draftGreedy = nullptr; }
+  if (_batch.token) { llama_batch_free(_batch); _batch = {}; }
+}
+
 - (nullable instancetype)initWithModelPath:(NSString *)modelPath
                        nCtxTokens:(int)nCtx
                        nGpuLayers:(int)nGpu
@@ -371,6 +702,139 @@ static void noema_prepare_moe_overrides(std::vector<llama_model_kv_override> &ou
   _cancelRequested.store(true);
 }
 
+- (NSInteger)lastPromptTokensReused { return _lastReusedTokens.load(); }
+- (NSInteger)lastPromptTokensRecomputed { return _lastRecomputedTokens.load(); }
+- (NOEMASpeculativeStats)lastSpeculativeStats { return _lastSpecStats; }
+
+- (void)resetPromptCache {
+  // Only the bookkeeping is dropped; the next generate sees an empty prefix and clears KV itself.
+  _seqTokens.clear();
+  _draftSeqTokens.clear();
+}
+
+- (void)setSessionDirectory:(NSString * _Nullable)directory maxBytes:(uint64_t)maxBytes {
+  if (directory.length == 0) { _sessionDir.clear(); return; }
+  [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:nil];
+  _sessionDir = directory.fileSystemRepresentation;
+  _sessionMaxBytes = maxBytes;
+}
+
+- (BOOL)saveSessionNamed:(NSString *)name {
+  if (!_loaded || _sessionDir.empty() || _seqTokens.empty()) return NO;
+  const CFAbsoluteTime t0 = CFAbsoluteTimeGetCurrent();
+  const size_t state_bytes = llama_state_seq_get_size(_ctx, 0);
+  if (state_bytes == 0) return NO;
+
+  const size_t page = (size_t)getpagesize();
+  NoemaSessionHeader h = {};
+  memcpy(h.magic, kNoemaSessionMagic, sizeof(kNoemaSessionMagic));
+  h.model_fingerprint = noema_model_fingerprint(_model);
+  h.n_tokens = _seqTokens.size();
+  h.state_offset = (sizeof(h) + h.n_tokens * sizeof(llama_token) + page - 1) / page * page;
+  h.state_bytes = state_bytes;
+  const size_t file_bytes = (size_t)h.state_offset + state_bytes;
+
+  const std::string path = noema_session_file(_sessionDir, name);
+  const std::string tmp = path + ".tmp";
+  const int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return NO;
+  bool ok = ftruncate(fd, (off_t)file_bytes) == 0;
+  void *map = ok ? mmap(nullptr, file_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  ok = map != MAP_FAILED;
+  if (ok) {
+    uint8_t *base = (uint8_t *)map;
+    memcpy(base + sizeof(h), _seqTokens.data(), h.n_tokens * sizeof(llama_token));
+    ok = llama_state_seq_get_data(_ctx, base + h.state_offset, state_bytes, 0) == state_bytes;
+    // Body on disk before the header, so a torn write never looks like a valid session
+    ok = ok && msync(map, file_bytes, MS_SYNC) == 0 && noema_full_sync(fd);
+    if (ok) {
+      memcpy(base, &h, sizeof(h));
+      ok = msync(map, page, MS_SYNC) == 0;
+    }
+    munmap(map, file_bytes);
+  }
+  // The temp file must be durable before the rename publishes it
+  ok = ok && noema_full_sync(fd);
+  close(fd);
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return NO;
+  }
+  noema_sync_dir(_sessionDir);
+  if (_sessionMaxBytes > 0) noema_evict_sessions(_sessionDir, _sessionMaxBytes, path);
+  if (_verbose) {
+    NSLog(@"[LlamaRunner] Saved session %@: %llu tokens, %.1f MB in %.1f ms", name, (unsigned long long)h.n_tokens,
+          file_bytes / 1048576.0, (CFAbsoluteTimeGetCurrent() - t0) * 1000.0);
+  }
+  return YES;
+}
+
+- (NSInteger)restoreSessionNamed:(NSString *)name forPrompt:(NSString *)prompt {
+  if (!_loaded || _sessionDir.empty()) return 0;
+  const CFAbsoluteTime t0 = CFAbsoluteTimeGetCurrent();
+  const std::string path = noema_session_file(_sessionDir, name);
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat st;
+  NoemaSessionHeader h = {};
+  if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+      memcmp(h.magic, kNoemaSessionMagic, sizeof(kNoemaSessionMagic)) != 0 ||
+      h.model_fingerprint != noema_model_fingerprint(_model) || h.n_tokens == 0 ||
+      h.state_offset + h.state_bytes != (uint64_t)st.st_size ||
+      sizeof(h) + h.n_tokens * sizeof(llama_token) > h.state_offset) {
+    close(fd);
+    return 0;
+  }
+  void *map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+  const uint8_t *base = (const uint8_t *)map;
+  const llama_token *saved = (const llama_token *)(base + sizeof(h));
+
+  // Only worth it if the session covers more of the prompt than what is already resident
+  const struct llama_vocab *vocab = llama_model_get_vocab(_model);
+  const std::vector<llama_token> toks = noema_tokenize_prompt(vocab, prompt.UTF8String ?: "", /*leading*/ true);
+  auto common = [&toks](const llama_token *a, size_t n) {
+    size_t i = 0;
+    const size_t lim = std::min(n, toks.size());
+    while (i < lim && a[i] == toks[i]) ++i;
+    return i;
+  };
+  const size_t session_lcp = common(saved, (size_t)h.n_tokens);
+  const size_t resident_lcp = common(_seqTokens.data(), _seqTokens.size());
+  if (session_lcp == 0 || session_lcp <= resident_lcp) {
+    munmap(map, (size_t)st.st_size);
+    return 0;
+  }
+
+  madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+  noema_llama_kv_cache_clear(_ctx, /*clearData=*/true);
+  const bool ok = llama_state_seq_set_data(_ctx, base + h.state_offset, (size_t)h.state_bytes, 0) > 0;
+  if (ok) {
+    // The next generate keeps the common prefix and trims the rest via the prompt cache
+    _seqTokens.assign(saved, saved + h.n_tokens);
+  } else {
+    noema_llama_kv_cache_clear(_ctx, /*clearData=*/true);
+    _seqTokens.clear();
+  }
+  _draftSeqTokens.clear();
+  if (_draftCtx) noema_llama_kv_cache_clear(_draftCtx, /*clearData=*/true);
+  munmap(map, (size_t)st.st_size);
+  if (ok) {
+    utimes(path.c_str(), nullptr);  // mark as recently used for eviction
+  }
+  if (_verbose) {
+    NSLog(@"[LlamaRunner] Restore session %@: %@ (%zu/%llu tokens match) in %.1f ms", name, ok ? @"ok" : @"failed",
+          session_lcp, (unsigned long long)h.n_tokens, (CFAbsoluteTimeGetCurrent() - t0) * 1000.0);
+  }
+  return ok ? (NSInteger)session_lcp : 0;
+}
+
+- (void)removeSessionNamed:(NSString *)name {
+  if (_sessionDir.empty()) return;
+  unlink(noema_session_file(_sessionDir, name).c_str());
+}
+
 // --- Speculative decoding support (lazy) ---
 static inline int noema_env_int(const char *key, int defv) {
   const char *v = getenv(key);
@@ -410,6 +874,9 @@ static inline bool noema_env_bool(const char *key, bool defv) {
   noema_apply_flash_and_kv_params(cparams, self.kvConfig, &k, &v, &dummy, &merged);
   _draftCtx = llama_init_from_model(_draftModel, cparams);
   if (_draftCtx == nullptr) { llama_model_free(_draftModel); _draftModel = nullptr; _specEnabled = false; return; }
+  _draftBatch = llama_batch_init(/*n_tokens_alloc*/ (int)cparams.n_batch, /*embd*/ 0, /*n_seq_max*/ 1);
+  _draftGreedy = llama_sampler_init_greedy();
+  _draftSeqTokens.clear();
   if (_verbose) NSLog(@"[LlamaRunner] Speculative decoding enabled (value=%d, mode=%@)", _specValue, _specModeMax ? @"max" : @"tokens");
   _specEnabled = true;
 }
@@ -425,6 +892,7 @@ static inline bool noema_env_bool(const char *key, bool defv) {
 
   const char *v = getenv("NOEMA_LLAMA_VERBOSE");
   _verbose = (v && atoi(v) != 0);
+  _promptCacheEnabled = noema_env_bool("NOEMA_PROMPT_CACHE", true);
 
 #if TARGET_OS_IPHONE
   const char *metalSafeMode = getenv("NOEMA_LLAMA_METAL_SAFE_MODE");
@@ -553,6 +1021,11 @@ static inline bool noema_env_bool(const char *key, bool defv) {
   llama_set_n_threads(_ctx, nThreads, nThreads);
   _loaded = true;
   _nThreads = nThreads;
+  _pieceCache.reset((size_t)llama_vocab_n_tokens(llama_model_get_vocab(_model)));
+  _samplingParams = noema_sampling_params_from_env();
+  _samplingVersion = 1;
+  _builtSamplingVersion = 0;
+  _batch = llama_batch_init(/*n_tokens_alloc*/ (int)cparams.n_batch, /*embd*/ 0, /*n_seq_max*/ 1);
 
   if (_verbose) {
     NSLog(@"[LlamaRunner] Context ready. n_ctx=%d, n_seq_max=%d, n_gpu_layers=%d, threads=%d, threads_batch=%d",
@@ -573,6 +1046,7 @@ static inline bool noema_env_bool(const char *key, bool defv) {
 
   const char *v = getenv("NOEMA_LLAMA_VERBOSE");
   _verbose = (v && atoi(v) != 0);
+  _promptCacheEnabled = noema_env_bool("NOEMA_PROMPT_CACHE", true);
 #if TARGET_OS_IPHONE
   const char *metalSafeMode = getenv("NOEMA_LLAMA_METAL_SAFE_MODE");
   if (metalSafeMode && atoi(metalSafeMode) != 0) {
@@ -727,6 +1201,11 @@ static inline bool noema_env_bool(const char *key, bool defv) {
   llama_set_n_threads(_ctx, nThreads, nThreads);
   _loaded = true;
   _nThreads = nThreads;
+  _pieceCache.reset((size_t)llama_vocab_n_tokens(llama_model_get_vocab(_model)));
+  _samplingParams = noema_sampling_params_from_env();
+  _samplingVersion = 1;
+  _builtSamplingVersion = 0;
+  _batch = llama_batch_init(/*n_tokens_alloc*/ (int)cparams.n_batch, /*embd*/ 0, /*n_seq_max*/ 1);
 
   if (_verbose) {
     NSLog(@"[LlamaRunner] Context ready. n_ctx=%d, n_seq_max=%d, n_gpu_layers=%d, threads=%d, threads_batch=%d",
@@ -765,6 +1244,27 @@ static inline bool noema_env_bool(const char *key, bool defv) {
                      onToken:(LlamaTokenHandler)onToken
                       onDone:(LlamaDoneHandler)onDone
                      onError:(LlamaErrorHandler)onError {
+  LlamaChunkHandler onChunk = onToken ? ^(NSString *text, const NOEMAStreamToken *tokens, NSInteger count) {
+    (void)tokens; (void)count;
+    if (text.length > 0) onToken(text);
+  } : nil;
+  [self generateWithPrompt:prompt maxTokens:maxTokens deliverTokenIDs:NO onChunk:onChunk onDone:onDone onError:onError];
+}
+
+- (void)generateWithPrompt:(NSString *)prompt
+                  maxTokens:(int)maxTokens
+                     onChunk:(LlamaChunkHandler)onChunk
+                      onDone:(LlamaDoneHandler)onDone
+                     onError:(LlamaErrorHandler)onError {
+  [self generateWithPrompt:prompt maxTokens:maxTokens deliverTokenIDs:_streamConfig.deliverTokenIDs onChunk:onChunk onDone:onDone onError:onError];
+}
+
+- (void)generateWithPrompt:(NSString *)prompt
+                  maxTokens:(int)maxTokens
+            deliverTokenIDs:(BOOL)deliverTokenIDs
+                     onChunk:(LlamaChunkHandler)onChunk
+                      onDone:(LlamaDoneHandler)onDone
+                     onError:(LlamaErrorHandler)onError {
   if (!_loaded) {
     if (onError) {
       NSError *err = [NSError errorWithDomain:@"Llama" code:1 userInfo:@{NSLocalizedDescriptionKey:@"Model not loaded"}];
@@ -776,31 +1276,15 @@ static inline bool noema_env_bool(const char *key, bool defv) {
   // Reset cancellation flag at the start of each generation
   _cancelRequested.store(false);
 
-    // Clear memory/KV using new memory API
-    noema_llama_kv_cache_clear(_ctx, /*clearData=*/true);
-    // Ensure we are producing logits (not embeddings) for subsequent decodes/sampling
-    llama_set_embeddings(_ctx, false);
-
+  // Ensure we are producing logits (not embeddings) for subsequent decodes/sampling
+  llama_set_embeddings(_ctx, false);
 
   // Build an initial prompt (avoid duplicate BOS by disabling auto-add when control tokens are present)
   const int n_batch_alloc = 512;
-  llama_batch batch = llama_batch_init(/*n_tokens_alloc*/ n_batch_alloc, /*embd*/ 0, /*n_seq_max*/ 1);
-  std::string p = [prompt UTF8String];
-  std::vector<llama_token> toks;
-  toks.resize(p.size() * 4 + 16);
+  llama_batch &batch = _batch;
   const struct llama_vocab *vocab = llama_model_get_vocab(_model);
-  // Decide whether to auto-insert BOS depending on whether the prompt already starts with control tokens
-  bool addSpecial = true;
-  if (!p.empty()) {
-    const char c0 = p[0];
-    // Common control-token prefixes in chat templates: '<' (e.g. <bos>, <|...|>) or '[' (e.g. [INST])
-    if (c0 == '<' || c0 == '[') {
-      addSpecial = false;
-    }
-  }
-  // Parse special tokens (e.g., <|im_start|>, <|eot_id|>) to preserve chat templates; avoid double BOS
-  int n = llama_tokenize(vocab, p.c_str(), (int32_t)p.length(), toks.data(), (int)toks.size(), /*add_special*/ addSpecial, /*parse_special*/ true);
-  toks.resize(n);
+  std::vector<llama_token> toks = noema_tokenize_prompt(vocab, [prompt UTF8String], /*leading*/ true);
+  int n = (int)toks.size();
 
   // Clamp prompt to fit into context window with headroom
   const int ctx_max = llama_n_ctx(_ctx);
@@ -810,166 +1294,182 @@ static inline bool noema_env_bool(const char *key, bool defv) {
     const int start = n - prompt_limit;
     std::vector<llama_token> tail(toks.begin() + start, toks.end());
     toks.swap(tail);
-    n = (int)toks.size();
   }
 
-  // If the prompt is empty, inject a BOS and run a single decode to produce logits
-  if (n == 0) {
-    batch.n_tokens = 0;
-    batch.token[0]     = llama_vocab_bos(vocab);
-    batch.pos[0]       = 0;
-    batch.n_seq_id[0]  = 1;
-    batch.seq_id[0][0] = 0;
-    batch.logits[0]    = true;
-    batch.n_tokens     = 1;
-
-    if (llama_decode(_ctx, batch) != 0) {
-      if (onError) {
-        NSError *err = [NSError errorWithDomain:@"Llama" code:2 userInfo:@{NSLocalizedDescriptionKey:@"decode failed (BOS)"}];
-        onError(err);
-      }
-      llama_batch_free(batch);
-      return;
-    }
-    // Keep n at 0; we already produced logits at pos 0. We'll start generation at pos 1.
+  // If the prompt is empty, decode a lone BOS so there are logits to sample from
+  if (toks.empty()) {
+    toks.push_back(llama_vocab_bos(vocab));
   }
+  n = (int)toks.size();
 
-  // Evaluate the entire prompt in chunks so KV positions remain consecutive
-  int n_cur = 0;
-  while (n_cur < n) {
-    if (_cancelRequested.load()) {
-      llama_batch_free(batch);
-      if (onDone) onDone();
-      return;
-    }
-    batch.n_tokens = 0;
-    const int n_chunk = std::min(n - n_cur, n_batch_alloc);
-    // Clear logits flags for the slice we will use, then mark the last token to return logits
-    for (int j = 0; j < n_chunk; ++j) batch.logits[j] = 0;
-    for (int i = 0; i < n_chunk; ++i) {
-      const int pos = n_cur + i;
-      batch.token[batch.n_tokens]     = toks[pos];
-      batch.pos[batch.n_tokens]       = pos;
-      batch.n_seq_id[batch.n_tokens]  = 1;
-      batch.seq_id[batch.n_tokens][0] = 0;
-      batch.logits[batch.n_tokens]    = (i == n_chunk - 1);
-      batch.n_tokens++;
-    }
-    if (_cancelRequested.load()) {
-      llama_batch_free(batch);
+  // Keep whatever prefix of the previous turn is still valid and only prefill the rest
+  const int reused = noema_reuse_prompt_prefix(_ctx, _seqTokens, toks, _promptCacheEnabled);
+  _lastReusedTokens.store(reused);
+  _lastRecomputedTokens.store(n - reused);
+  if (_verbose) {
+    NSLog(@"[LlamaRunner] Prompt cache: reused=%d recomputed=%d (prompt=%d)", reused, n - reused, n);
+  }
+
+  const int prefill_rc = noema_decode_prompt_range(_ctx, batch, n_batch_alloc, toks, reused, n, _seqTokens, &_cancelRequested);
+  if (prefill_rc != 0) {
+    if (prefill_rc > 0) {
       if (onDone) onDone();
-      return;
-    }
-    if (llama_decode(_ctx, batch) != 0) {
+    } else {
+      // KV contents are uncertain after a failed decode; force a full prefill next time
+      noema_llama_kv_cache_clear(_ctx, /*clearData=*/true);
+      _seqTokens.clear();
       if (onError) {
         NSError *err = [NSError errorWithDomain:@"Llama" code:2 userInfo:@{NSLocalizedDescriptionKey:@"decode failed"}];
         onError(err);
       }
-      llama_batch_free(batch);
-      return;
     }
-    n_cur += n_chunk;
+    return;
   }
 
   // Default sampler: temperature + top-k
-  auto *smpl = noema_make_default_sampler();
-  llama_sampler_reset(smpl);
+  [self prepareSamplers:1];
+  llama_sampler *smpl = _samplers[0];
   // Lazy initialize speculative decoder if configured
   [self setupSpeculativeIfConfigured];
-  llama_sampler *greedy_main = llama_sampler_init_greedy();
-  llama_sampler *greedy_draft = _specEnabled ? llama_sampler_init_greedy() : nullptr;
+  llama_sampler *greedy_draft = _specEnabled ? _draftGreedy : nullptr;
   if (greedy_draft) llama_sampler_reset(greedy_draft);
-  llama_sampler_reset(greedy_main);
   // If speculation is enabled, feed the prompt into the draft context to align states
   if (_specEnabled) {
-    llama_batch db = llama_batch_init(/*n_tokens_alloc*/ n_batch_alloc, /*embd*/ 0, /*n_seq_max*/ 1);
-    int cur = 0;
-    while (cur < n) {
-      db.n_tokens = 0;
-      const int n_chunk = std::min(n - cur, n_batch_alloc);
-      for (int i = 0; i < n_chunk; ++i) {
-        const int pos = cur + i;
-        db.token[db.n_tokens]     = toks[pos];
-        db.pos[db.n_tokens]       = pos;
-        db.n_seq_id[db.n_tokens]  = 1;
-        db.seq_id[db.n_tokens][0] = 0;
-        db.logits[db.n_tokens]    = (i == n_chunk - 1);
-        db.n_tokens++;
-      }
-      (void)llama_decode(_draftCtx, db);
-      cur += n_chunk;
+    const int draft_reused = noema_reuse_prompt_prefix(_draftCtx, _draftSeqTokens, toks, _promptCacheEnabled);
+    if (noema_decode_prompt_range(_draftCtx, _draftBatch, n_batch_alloc, toks, draft_reused, n, _draftSeqTokens, nullptr) != 0) {
+      _draftSeqTokens.clear();
     }
-    llama_batch_free(db);
   }
-  
-  const int base_pos = (n > 0 ? n : 1);
+
+  // Pieces come from the per-model cache and are assembled into valid UTF-8 chunks; the
+  // configured cadence decides how many tokens share one NSString and one callback.
+  noema::TokenStream stream(noema_stream_cadence(_streamConfig, deliverTokenIDs),
+      [&](std::string_view text, const noema::StreamToken *tokens, size_t count) {
+        if (!onChunk) return;
+        NSString *chunk = [[NSString alloc] initWithBytes:text.data() length:text.size() encoding:NSUTF8StringEncoding];
+        onChunk(chunk ?: @"", reinterpret_cast<const NOEMAStreamToken *>(tokens), (NSInteger)count);
+      });
+  auto render = [vocab](int32_t t, std::string &out) { noema_render_piece(vocab, t, out); };
+  auto emit = [&](llama_token t) {
+    stream.push(t, _pieceCache.piece(t, render));
+  };
+
   int generated = 0;
+  // Cleared if a decode fails mid-generation, since the KV tail is then unknown
+  bool main_synced = true;
   const bool unlimited = maxTokens <= 0;
-  int pos_main = base_pos;
-  int pos_draft = base_pos;
-  while (unlimited || generated < maxTokens) {
-    if (_cancelRequested.load()) { break; }
-    if (_specEnabled) {
-      // Draft proposal
-      std::vector<llama_token> proposal; proposal.reserve(_specValue);
-      llama_batch db = llama_batch_init(32, 0, 1);
-      for (int i = 0; i < _specValue; ++i) {
-        const llama_token dtok = llama_sampler_sample(greedy_draft, _draftCtx, -1);
-        if (dtok < 0 || dtok == llama_vocab_eos(vocab)) break;
-        proposal.push_back(dtok);
-        db.n_tokens = 0;
-        if (pos_draft >= ctx_max - 1) break;
-        db.token[0] = dtok; db.pos[0] = pos_draft; db.n_seq_id[0] = 1; db.seq_id[0][0] = 0; db.logits[0] = 1; db.n_tokens = 1;
-        (void)llama_decode(_draftCtx, db);
-        pos_draft++;
+  int pos_main = n;
+  NOEMASpeculativeStats spec = {0, 0, 0, 0};
+  if (_specEnabled) {
+    // Speculative loop. `id_last` is sampled from the target but not yet in either KV cache.
+    // Each round the draft catches up to [history, id_last] and greedily proposes up to
+    // `_specValue` tokens, then the target scores [id_last, proposal...] in a single decode
+    // with logits at every position. The target sampler walks those logits and keeps the
+    // longest prefix it agrees with; its first disagreement becomes the next `id_last`, and
+    // rejected positions are trimmed from both contexts.
+    std::vector<llama_token> proposal;
+    proposal.reserve(std::min(_specValue, n_batch_alloc));
+    llama_token id_last = llama_sampler_sample(smpl, _ctx, -1);
+    while (!_cancelRequested.load()) {
+      if (id_last < 0 || id_last == llama_vocab_eos(vocab)) break;
+      emit(id_last);
+      generated++;
+      if (!unlimited && generated >= maxTokens) break;
+      if (pos_main >= ctx_max - 1) break;
+
+      int n_draft_max = std::min(_specValue, std::min(n_batch_alloc - 1, ctx_max - 2 - pos_main));
+      if (!unlimited) n_draft_max = std::min(n_draft_max, maxTokens - generated);
+
+      // Draft: catch up on accepted tokens, then propose greedily
+      _seqTokens.push_back(id_last);
+      proposal.clear();
+      if (noema_decode_prompt_range(_draftCtx, _draftBatch, n_batch_alloc, _seqTokens,
+                                    (int)_draftSeqTokens.size(), (int)_seqTokens.size(),
+                                    _draftSeqTokens, nullptr) == 0) {
+        for (int i = 0; i < n_draft_max; ++i) {
+          const llama_token dtok = llama_sampler_sample(greedy_draft, _draftCtx, -1);
+          if (dtok < 0 || dtok == llama_vocab_eos(vocab)) break;
+          proposal.push_back(dtok);
+          // The last proposal's successor is never needed
+          if (i == n_draft_max - 1) break;
+          _draftBatch.n_tokens = 0;
+          noema_batch_add(_draftBatch, dtok, pos_main + 1 + i, 0, true);
+          if (llama_decode(_draftCtx, _draftBatch) != 0) break;
+          _draftSeqTokens.push_back(dtok);
+        }
       }
-      llama_batch_free(db);
-      bool diverged = false;
+
+      // Target: verify the whole proposal in one forward pass
+      batch.n_tokens = 0;
+      noema_batch_add(batch, id_last, pos_main, 0, true);
       for (size_t i = 0; i < proposal.size(); ++i) {
-        const llama_token top_main = llama_sampler_sample(greedy_main, _ctx, -1);
-        if (top_main == proposal[i]) {
-          llama_sampler_accept(smpl, top_main);
-          char buf[512]; int nout = llama_token_to_piece(vocab, top_main, buf, sizeof(buf), 0, false);
-          if (nout > 0 && onToken) { NSString *piece = [[NSString alloc] initWithBytes:buf length:nout encoding:NSUTF8StringEncoding]; onToken(piece ?: @""); }
-          batch.n_tokens = 0; if (pos_main >= ctx_max - 1) { diverged = true; break; }
-          batch.token[0] = top_main; batch.pos[0] = pos_main; batch.n_seq_id[0] = 1; batch.seq_id[0][0] = 0; batch.logits[0] = 1; batch.n_tokens = 1;
-          if (llama_decode(_ctx, batch) != 0) { diverged = true; break; }
-          pos_main++; generated++; if (!unlimited && generated >= maxTokens) { diverged = true; break; }
+        noema_batch_add(batch, proposal[i], pos_main + 1 + (int)i, 0, true);
+      }
+      if (llama_decode(_ctx, batch) != 0) { main_synced = false; break; }
+      spec.targetPasses++;
+      spec.draftedTokens += (NSInteger)proposal.size();
+
+      size_t n_accept = 0;
+      llama_token next = LLAMA_TOKEN_NULL;
+      for (size_t i = 0; i <= proposal.size(); ++i) {
+        const llama_token tok = llama_sampler_sample(smpl, _ctx, (int32_t)i);
+        if (i < proposal.size() && tok == proposal[i]) { n_accept++; continue; }
+        next = tok;
+        break;
+      }
+      _seqTokens.insert(_seqTokens.end(), proposal.begin(), proposal.begin() + n_accept);
+      pos_main += 1 + (int)n_accept;
+      spec.acceptedTokens += (NSInteger)n_accept;
+
+      // Roll back rejected positions in both contexts
+      if (n_accept < proposal.size() && !noema_llama_seq_rm_tail(_ctx, 0, pos_main)) {
+        NSLog(@"[LlamaRunner] Speculative rollback unsupported by this memory type; stopping");
+        main_synced = false;
+        break;
+      }
+      if ((int)_draftSeqTokens.size() > pos_main) {
+        if (noema_llama_seq_rm_tail(_draftCtx, 0, pos_main)) {
+          _draftSeqTokens.resize(pos_main);
         } else {
-          const llama_token tok = llama_sampler_sample(smpl, _ctx, -1);
-          if (tok < 0 || tok == llama_vocab_eos(vocab)) { diverged = true; break; }
-          llama_sampler_accept(smpl, tok);
-          char buf[512]; int nout = llama_token_to_piece(vocab, tok, buf, sizeof(buf), 0, false);
-          if (nout > 0 && onToken) { NSString *piece = [[NSString alloc] initWithBytes:buf length:nout encoding:NSUTF8StringEncoding]; onToken(piece ?: @""); }
-          batch.n_tokens = 0; if (pos_main >= ctx_max - 1) { diverged = true; break; }
-          batch.token[0] = tok; batch.pos[0] = pos_main; batch.n_seq_id[0] = 1; batch.seq_id[0][0] = 0; batch.logits[0] = 1; batch.n_tokens = 1;
-          if (llama_decode(_ctx, batch) != 0) { diverged = true; break; }
-          pos_main++; generated++;
-          // sync draft with chosen token
-          llama_batch sdb = llama_batch_init(1, 0, 1); sdb.n_tokens=1; sdb.token[0]=tok; sdb.pos[0]=pos_draft++; sdb.n_seq_id[0]=1; sdb.seq_id[0][0]=0; sdb.logits[0]=1; (void)llama_decode(_draftCtx, sdb); llama_batch_free(sdb);
-          diverged = true; break;
+          noema_llama_kv_cache_clear(_draftCtx, /*clearData=*/true);
+          _draftSeqTokens.clear();
         }
       }
-      if (diverged) { if (!unlimited && generated >= maxTokens) break; continue; }
+
+      for (size_t i = 0; i < n_accept; ++i) {
+        emit(proposal[i]);
+      }
+      generated += (int)n_accept;
       if (!unlimited && generated >= maxTokens) break;
-      continue;
-    } else {
+      id_last = next;
+    }
+    spec.emittedTokens = generated;
+  } else {
+    while (unlimited || generated < maxTokens) {
+      if (_cancelRequested.load()) { break; }
       const llama_token tok = llama_sampler_sample(smpl, _ctx, -1);
       if (tok < 0 || tok == llama_vocab_eos(vocab)) break;
       llama_sampler_accept(smpl, tok);
-      char buf[512]; int nout = llama_token_to_piece(vocab, tok, buf, sizeof(buf), 0, false);
-      if (nout > 0 && onToken) { NSString *piece = [[NSString alloc] initWithBytes:buf length:nout encoding:NSUTF8StringEncoding]; onToken(piece ?: @""); }
+      emit(tok);
       batch.n_tokens = 0; if (pos_main >= ctx_max - 1) break;
       batch.token[0]=tok; batch.pos[0]=pos_main; batch.n_seq_id[0]=1; batch.seq_id[0][0]=0; batch.logits[0]=1; batch.n_tokens=1;
-      if (_cancelRequested.load()) break; if (llama_decode(_ctx, batch) != 0) break;
+      if (_cancelRequested.load()) break; if (llama_decode(_ctx, batch) != 0) { main_synced = false; break; }
+      _seqTokens.push_back(tok);
       pos_main++; generated++;
     }
   }
 
-  llama_sampler_free(smpl);
-  llama_sampler_free(greedy_main);
-  if (greedy_draft) llama_sampler_free(greedy_draft);
-  llama_batch_free(batch);
+  if (_specEnabled) {
+    _lastSpecStats = spec;
+    if (_verbose && spec.targetPasses > 0) {
+      NSLog(@"[LlamaRunner] Speculative: drafted=%ld accepted=%ld (%.1f%%) target_passes=%ld tokens/pass=%.2f",
+            (long)spec.draftedTokens, (long)spec.acceptedTokens,
+            spec.draftedTokens > 0 ? 100.0 * spec.acceptedTokens / spec.draftedTokens : 0.0,
+            (long)spec.targetPasses, (double)spec.emittedTokens / spec.targetPasses);
+    }
+  }
+  stream.finish();
+  if (!main_synced) _seqTokens.clear();
   if (onDone) onDone();
 }
 
@@ -1002,6 +1502,193 @@ static inline bool noema_env_bool(const char *key, bool defv) {
     }
 }
 
+- (void)generateWithPrompts:(NSArray<NSString *> *)prompts
+                  maxTokens:(int)maxTokens
+                   onTokens:(NSArray<LlamaTokenHandler> *)onTokens
+                     onDone:(LlamaDoneHandler)onDone
+                    onError:(LlamaErrorHandler)onError {
+  [self generateWithSharedPrefix:nil continuations:prompts maxTokens:maxTokens onTokens:onTokens onDone:onDone onError:onError];
+}
+
+- (void)generateWithSharedPrefix:(NSString * _Nullable)prefix
+                   continuations:(NSArray<NSString *> *)continuations
+                       maxTokens:(int)maxTokens
+                        onTokens:(NSArray<LlamaTokenHandler> *)onTokens
+                          onDone:(LlamaDoneHandler)onDone
+                         onError:(LlamaErrorHandler)onError {
+  if (!_loaded) {
+    if (onError) {
+      NSError *err = [NSError errorWithDomain:@"Llama" code:1 userInfo:@{NSLocalizedDescriptionKey:@"Model not loaded"}];
+      onError(err);
+    }
+    return;
+  }
+  const int n_seq = (int)continuations.count;
+  const int n_seq_max = (int)llama_n_seq_max(_ctx);
+  if (n_seq == 0 || n_seq > n_seq_max || (int)onTokens.count != n_seq) {
+    if (onError) {
+      NSString *msg = [NSString stringWithFormat:@"Batched generation needs 1...%d sequences with one token handler each (got %d prompts, %d handlers)",
+                       n_seq_max, n_seq, (int)onTokens.count];
+      NSError *err = [NSError errorWithDomain:@"Llama" code:3 userInfo:@{NSLocalizedDescriptionKey:msg}];
+      onError(err);
+    }
+    return;
+  }
+
+  _cancelRequested.store(false);
+  llama_set_embeddings(_ctx, false);
+
+  const struct llama_vocab *vocab = llama_model_get_vocab(_model);
+  const int seq_ctx = (int)llama_n_ctx(_ctx) / n_seq_max;
+  std::vector<llama_token> shared;
+  if (prefix.length > 0) {
+    shared = noema_tokenize_prompt(vocab, prefix.UTF8String, /*leading*/ true);
+  }
+  std::vector<std::vector<llama_token>> conts(n_seq);
+  for (int s = 0; s < n_seq; ++s) {
+    conts[s] = noema_tokenize_prompt(vocab, continuations[s].UTF8String, /*leading*/ shared.empty());
+  }
+  // Every sequence must decode at least one token of its own to get logits, so the last
+  // shared token moves into each continuation.
+  if (!shared.empty()) {
+    const llama_token last = shared.back();
+    shared.pop_back();
+    for (auto &c : conts) c.insert(c.begin(), last);
+  }
+  for (int s = 0; s < n_seq; ++s) {
+    if (conts[s].empty()) conts[s].push_back(llama_vocab_bos(vocab));
+    if ((int)(shared.size() + conts[s].size()) > std::max(1, seq_ctx - 64)) {
+      if (onError) {
+        NSString *msg = [NSString stringWithFormat:@"Prompt %d does not fit the per-sequence context (%d tokens)", s, seq_ctx];
+        NSError *err = [NSError errorWithDomain:@"Llama" code:4 userInfo:@{NSLocalizedDescriptionKey:msg}];
+        onError(err);
+      }
+      return;
+    }
+  }
+
+  const int n_batch_alloc = 512;
+  llama_batch &batch = _batch;
+  bool ok = true;
+
+  // Drop whatever the other sequences held from an earlier call
+  for (int s = 1; s < n_seq_max; ++s) {
+    (void)noema_llama_seq_rm_tail(_ctx, s, 0);
+  }
+
+  // Shared prefix: decode once into seq 0 (reusing the resident prefix), then share its cells
+  const int n_shared = (int)shared.size();
+  int reused = 0;
+  if (n_shared > 0) {
+    reused = noema_reuse_prompt_prefix(_ctx, _seqTokens, shared, _promptCacheEnabled);
+    ok = noema_decode_prompt_range(_ctx, batch, n_batch_alloc, shared, reused, n_shared, _seqTokens, &_cancelRequested) == 0;
+    for (int s = 1; ok && s < n_seq; ++s) {
+      ok = noema_llama_seq_cp(_ctx, 0, s);
+    }
+  } else {
+    noema_llama_kv_cache_clear(_ctx, /*clearData=*/true);
+    _seqTokens.clear();
+  }
+
+  int n_recomputed = n_shared - reused;
+  for (const auto &c : conts) n_recomputed += (int)c.size();
+  _lastReusedTokens.store(reused);
+  _lastRecomputedTokens.store(n_recomputed);
+  if (_verbose) {
+    NSLog(@"[LlamaRunner] Batched generation: sequences=%d shared=%d reused=%d recomputed=%d", n_seq, n_shared, reused, n_recomputed);
+  }
+
+  [self prepareSamplers:n_seq];
+  llama_sampler **samplers = _samplers.data();
+  std::vector<noema::TokenStream> streams;
+  streams.reserve(n_seq);
+  for (int s = 0; s < n_seq; ++s) {
+    LlamaTokenHandler handler = onTokens[s];
+    streams.emplace_back(noema_stream_cadence(_streamConfig, false),
+        [handler](std::string_view text, const noema::StreamToken *, size_t) {
+          if (!handler || text.empty()) return;
+          NSString *chunk = [[NSString alloc] initWithBytes:text.data() length:text.size() encoding:NSUTF8StringEncoding];
+          if (chunk) handler(chunk);
+        });
+  }
+  auto render = [vocab](int32_t t, std::string &out) { noema_render_piece(vocab, t, out); };
+  std::vector<int> pos(n_seq, n_shared);
+  std::vector<int> out_idx(n_seq, -1);
+  std::vector<llama_token> cur(n_seq, LLAMA_TOKEN_NULL);
+
+  // Decode the pending batch and sample for every sequence that requested logits in it
+  auto flush = [&]() -> bool {
+    if (batch.n_tokens == 0) return true;
+    if (llama_decode(_ctx, batch) != 0) return false;
+    for (int s = 0; s < n_seq; ++s) {
+      if (out_idx[s] < 0) continue;
+      cur[s] = llama_sampler_sample(samplers[s], _ctx, out_idx[s]);
+      out_idx[s] = -1;
+    }
+    batch.n_tokens = 0;
+    return true;
+  };
+
+  // Continuations: packed across sequences, chunked by the batch size
+  batch.n_tokens = 0;
+  for (int s = 0; ok && s < n_seq; ++s) {
+    for (size_t j = 0; ok && j < conts[s].size(); ++j) {
+      if (batch.n_tokens == n_batch_alloc) {
+        ok = !_cancelRequested.load() && flush();
+      }
+      const bool last = (j + 1 == conts[s].size());
+      if (last) out_idx[s] = batch.n_tokens;
+      noema_batch_add(batch, conts[s][j], pos[s]++, s, last);
+    }
+  }
+  ok = ok && flush();
+  if (ok) {
+    _seqTokens.insert(_seqTokens.end(), conts[0].begin(), conts[0].end());
+  }
+
+  // Generation: one token per active sequence per step
+  const bool unlimited = maxTokens <= 0;
+  std::vector<int> produced(n_seq, 0);
+  std::vector<bool> active(n_seq, ok);
+  while (ok && !_cancelRequested.load()) {
+    batch.n_tokens = 0;
+    for (int s = 0; s < n_seq; ++s) {
+      if (!active[s]) continue;
+      const llama_token tok = cur[s];
+      if (tok < 0 || tok == llama_vocab_eos(vocab)) { active[s] = false; continue; }
+      streams[s].push(tok, _pieceCache.piece(tok, render));
+      produced[s]++;
+      if ((!unlimited && produced[s] >= maxTokens) || pos[s] >= seq_ctx - 1) { active[s] = false; continue; }
+      out_idx[s] = batch.n_tokens;
+      noema_batch_add(batch, tok, pos[s], s, true);
+    }
+    if (batch.n_tokens == 0) break;
+    if (out_idx[0] >= 0) _seqTokens.push_back(cur[0]);
+    for (int s = 0; s < n_seq; ++s) {
+      if (out_idx[s] >= 0) pos[s]++;
+    }
+    ok = flush();
+  }
+
+  for (auto &stream : streams) stream.finish();
+  // Release the cells of the extra sequences; seq 0 stays resident for prefix reuse
+  for (int s = 1; s < n_seq; ++s) {
+    (void)noema_llama_seq_rm_tail(_ctx, s, 0);
+  }
+  if (!ok) {
+    noema_llama_kv_cache_clear(_ctx, /*clearData=*/true);
+    _seqTokens.clear();
+    if (!_cancelRequested.load()) {
+      if (onError) {
+        NSError *err = [NSError errorWithDomain:@"Llama" code:2 userInfo:@{NSLocalizedDescriptionKey:@"decode failed"}];
+        onError(err);
+      }
+      return;
+    }
+  }
+  if (onDone) onDone();
+}
+
 - (void)unload {
   if (_ctx || _model || _draftCtx || _draftModel) {
     fputs("[LlamaRunner] Unload begin\n", stderr);
@@ -1010,6 +1697,11 @@ static inline bool noema_env_bool(const char *key, bool defv) {
   if (_model) { llama_model_free(_model); _model = nullptr; }
   if (_draftCtx) { llama_free(_draftCtx); _draftCtx = nullptr; }
   if (_draftModel) { llama_model_free(_draftModel); _draftModel = nullptr; }
+  if (_draftBatch.token) { llama_batch_free(_draftBatch); _draftBatch = {}; }
+  [self freeRequestObjects];
+  _seqTokens.clear();
+  _draftSeqTokens.clear();
+  _pieceCache.reset(0);
   _loaded = false;
   noema_llama_backend_release();
   fputs("[LlamaRunner] Unload complete\n", stderr);
@@ -0,0 +1,36 @@
+// LlamaVectorStore.h
+#import <Foundation/Foundation.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+// Objective-C face of noema::VectorIndex (NoemaVectorIndex.hpp) for retrieval over embedded
+// chunks: a flat aligned store (f32 or int8), SIMD top-k search across worker threads, an
+// optional IVF index for large corpora, and a memory-mappable on-disk format.
+@interface LlamaVectorStore : NSObject
+- (instancetype)initWithDimension:(int)dimension
+                           cosine:(BOOL)cosine
+                        quantized:(BOOL)quantized;
+// Memory-maps an index written by -saveToPath:. Returns nil if the file is missing or invalid.
+- (nullable instancetype)initWithContentsOfPath:(NSString *)path;
+
+- (int)dimension;
+- (NSInteger)count;
+
+- (void)reserve:(NSInteger)capacity;
+- (void)addVector:(const float *)vector identifier:(int64_t)identifier;
+
+// Writes up to k results, best first. Returns the number written.
+- (int)searchVector:(const float *)query
+                  k:(int)k
+        identifiers:(int64_t *)outIdentifiers
+             scores:(float *)outScores;
+
+// Builds `lists` coarse clusters; subsequent searches scan only the `nprobe` closest ones.
+// Worth it from roughly 100k vectors. Returns NO if there are fewer vectors than lists.
+- (BOOL)trainIVFWithLists:(int)lists;
+@property (nonatomic) int nprobe;
+
+- (BOOL)saveToPath:(NSString *)path;
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,87 @@
+// LlamaVectorStore.mm
+#import "LlamaVectorStore.h"
+#include "NoemaVectorIndex.hpp"
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+@implementation LlamaVectorStore {
+  std::unique_ptr<noema::VectorIndex> _index;
+  // Searches and saves share the index; adds and training are exclusive.
+  std::shared_mutex _lock;
+  // Saves write through one temp file per path, so they run one at a time.
+  std::mutex _saveLock;
+}
+
+- (instancetype)initWithDimension:(int)dimension
+                           cosine:(BOOL)cosine
+                        quantized:(BOOL)quantized {
+  self = [super init];
+  if (!self) return nil;
+  _index = std::make_unique<noema::VectorIndex>(dimension,
+                                                cosine ? noema::VectorMetric::Cosine : noema::VectorMetric::Dot,
+                                                quantized ? noema::VectorStorage::I8 : noema::VectorStorage::F32);
+  return self;
+}
+
+- (nullable instancetype)initWithContentsOfPath:(NSString *)path {
+  self = [super init];
+  if (!self) return nil;
+  _index = noema::VectorIndex::load(path.fileSystemRepresentation);
+  if (!_index) return nil;
+  return self;
+}
+
+- (int)dimension { return _index->dim(); }
+
+- (NSInteger)count {
+  std::shared_lock<std::shared_mutex> lock(_lock);
+  return (NSInteger)_index->size();
+}
+
+- (void)reserve:(NSInteger)capacity {
+  std::unique_lock<std::shared_mutex> lock(_lock);
+  if (capacity > 0) _index->reserve((size_t)capacity);
+}
+
+- (void)addVector:(const float *)vector identifier:(int64_t)identifier {
+  std::unique_lock<std::shared_mutex> lock(_lock);
+  _index->add(identifier, vector);
+}
+
+- (int)searchVector:(const float *)query
+                  k:(int)k
+        identifiers:(int64_t *)outIdentifiers
+             scores:(float *)outScores {
+  if (!query || k <= 0) return 0;
+  std::shared_lock<std::shared_mutex> lock(_lock);
+  const auto hits = _index->search(query, k);
+  for (size_t i = 0; i < hits.size(); ++i) {
+    if (outIdentifiers) outIdentifiers[i] = hits[i].id;
+    if (outScores) outScores[i] = hits[i].score;
+  }
+  return (int)hits.size();
+}
+
+- (BOOL)trainIVFWithLists:(int)lists {
+  std::unique_lock<std::shared_mutex> lock(_lock);
+  return _index->train_ivf(lists) ? YES : NO;
+}
+
+- (int)nprobe {
+  std::shared_lock<std::shared_mutex> lock(_lock);
+  return _index->nprobe();
+}
+
+- (void)setNprobe:(int)nprobe {
+  std::unique_lock<std::shared_mutex> lock(_lock);
+  _index->set_nprobe(nprobe);
+}
+
+- (BOOL)saveToPath:(NSString *)path {
+  std::lock_guard<std::mutex> saveLock(_saveLock);
+  std::shared_lock<std::shared_mutex> lock(_lock);
+  return _index->save(path.fileSystemRepresentation) ? YES : NO;
+}
+
+@end
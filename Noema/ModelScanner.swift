@@ -2,10 +2,50 @@
 import Foundation
 
 enum ModelScanner {
+    /// Points the C header scanner at its on-disk cache once per launch.
+    private static let headerCacheConfigured: Void = {
+        let fm = FileManager.default
+        guard let caches = try? fm.url(for: .cachesDirectory, in: .userDomainMask, appropriateFor: nil, create: true) else { return }
+        let file = caches.appendingPathComponent("gguf-header-cache.bin")
+        file.path.withCString { gguf_scan_cache_set_path($0) }
+    }()
+
+    /// Parses every GGUF header in `urls` on a thread pool and fills the metadata cache, so the
+    /// per-model `layerCount`/`moeInfo` calls that follow are answered without touching the files.
+    static func prewarmHeaders(for urls: [URL]) {
+        _ = headerCacheConfigured
+        let paths = urls.compactMap { ggufFile(for: $0)?.path }
+        guard !paths.isEmpty else { return }
+        var cStrings = paths.map { strdup($0) }
+        defer { cStrings.forEach { free($0) } }
+        var results = [gguf_header_info](repeating: gguf_header_info(), count: paths.count)
+        let ok = cStrings.withUnsafeMutableBufferPointer { buffer -> Int in
+            buffer.baseAddress!.withMemoryRebound(to: UnsafePointer<CChar>?.self, capacity: buffer.count) { ptr in
+                Int(gguf_header_scan_many(ptr, buffer.count, &results, 0))
+            }
+        }
+        var hits: UInt64 = 0
+        var misses: UInt64 = 0
+        gguf_scan_cache_stats(&hits, &misses)
+        print("[ModelScanner] scanned \(ok)/\(paths.count) GGUF headers (cache hits=\(hits) misses=\(misses))")
+    }
+
+    /// The file to read for a GGUF model: the URL itself, or the first `.gguf` in a model directory.
+    private static func ggufFile(for url: URL) -> URL? {
+        var isDir: ObjCBool = false
+        guard FileManager.default.fileExists(atPath: url.path, isDirectory: &isDir) else { return nil }
+        guard isDir.boolValue else { return url }
+        return try? FileManager.default
+            .contentsOfDirectory(at: url, includingPropertiesForKeys: nil)
+            .first(where: { $0.pathExtension.lowercased() == "gguf" })
+    }
+
     static func layerCount(for url: URL, format: ModelFormat) -> Int {
         switch format {
         case .gguf:
-            let cCount = Int(gguf_layer_count(url.path))
+            _ = headerCacheConfigured
+            // Same key as prewarmHeaders: the .gguf inside a model directory
+            let cCount = Int(gguf_layer_count((ggufFile(for: url) ?? url).path))
             if cCount > 0 { return cCount }
             return GGUFMetadata.layerCount(at: url) ?? 0
         case .mlx, .et:
@@ -20,16 +60,8 @@ enum ModelScanner {
     static func moeInfo(for url: URL, format: ModelFormat) -> MoEInfo? {
         switch format {
         case .gguf:
-            var target = url
-            var isDir: ObjCBool = false
-            if FileManager.default.fileExists(atPath: target.path, isDirectory: &isDir), isDir.boolValue {
-                if let gguf = try? FileManager.default
-                    .contentsOfDirectory(at: target, includingPropertiesForKeys: nil)
-                    .first(where: { $0.pathExtension.lowercased() == "gguf" }) {
-                    target = gguf
-                }
-            }
-            return GGUFMetadata.moeInfo(at: target)
+            _ = headerCacheConfigured
+            return GGUFMetadata.moeInfo(at: ggufFile(for: url) ?? url)
         case .mlx:
             return MLXMetadata.moeInfo(at: url)
         case .et, .ane, .afm:
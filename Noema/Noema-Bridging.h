@@ -31,10 +31,19 @@ int gguf_moe_scan(const char *path, struct gguf_moe_scan_result *out_result);
 }
 #endif
 
+// Header scanner behind the two functions above; batch scans and the metadata cache
+#import "GGUFHeaderScan.h"
+
 // Expose minimal Objective-C++ bridges to Swift
 #if __has_include("LlamaEmbedder.h")
 #import "LlamaEmbedder.h"
 #endif
+#if __has_include("LlamaEmbeddingCache.h")
+#import "LlamaEmbeddingCache.h"
+#endif
+#if __has_include("LlamaVectorStore.h")
+#import "LlamaVectorStore.h"
+#endif
 #if __has_include("LlamaBackendManager.h")
 #import "LlamaBackendManager.h"
 #endif
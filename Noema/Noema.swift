@@ -2044,6 +2044,7 @@ private func fetchTokenizer(into dir: URL, repoID: String) async {
         guard !pending.isEmpty else { return }
         let models = pending
         Task.detached(priority: .utility) { [weak self] in
+            ModelScanner.prewarmHeaders(for: models.filter { $0.format == .gguf }.map(\.url))
             for model in models {
                 let count = ModelScanner.layerCount(for: model.url, format: model.format)
                 await self?.applyLayerCount(count, to: model)
@@ -2079,6 +2080,7 @@ private func fetchTokenizer(into dir: URL, repoID: String) async {
         let models = pending
         Task.detached(priority: .utility) { [weak self] in
             print("[MoEDetect] queued \(models.count) models for metadata scan")
+            ModelScanner.prewarmHeaders(for: models.filter { $0.format == .gguf }.map(\.url))
             for model in models {
                 let descriptor = "\(model.name) (\(model.quant)) [\(model.format.displayName)]"
                 print("[MoEDetect] ▶︎ scanning \(descriptor)")
@@ -0,0 +1,146 @@
+// NoemaTokenStream.cpp
+#include "NoemaTokenStream.hpp"
+
+#include <cstdint>
+#include <utility>
+
+namespace noema {
+
+namespace {
+
+constexpr char kReplacement[] = "\xEF\xBF\xBD";  // U+FFFD
+
+// Length of the sequence introduced by `lead` and the valid range of its second byte
+// (RFC 3629: no overlongs, no surrogates, nothing above U+10FFFF). 0 for an invalid lead.
+inline int utf8_sequence(unsigned char lead, unsigned char &lo, unsigned char &hi) {
+  lo = 0x80;
+  hi = 0xBF;
+  if (lead >= 0xC2 && lead <= 0xDF) return 2;
+  if (lead == 0xE0) { lo = 0xA0; return 3; }
+  if (lead == 0xED) { hi = 0x9F; return 3; }
+  if (lead >= 0xE1 && lead <= 0xEF) return 3;
+  if (lead == 0xF0) { lo = 0x90; return 4; }
+  if (lead == 0xF4) { hi = 0x8F; return 4; }
+  if (lead >= 0xF1 && lead <= 0xF3) return 4;
+  return 0;
+}
+
+}  // namespace
+
+void PieceCache::reset(size_t n_vocab) {
+  start_.assign(n_vocab, kUnset);
+  len_.assign(n_vocab, 0);
+  arena_.clear();
+  // Most pieces are a few bytes; avoid regrowing the arena during the first responses
+  arena_.reserve(n_vocab * 4);
+}
+
+TokenStream::TokenStream(StreamCadence cadence, Sink sink)
+    : cadence_(cadence), sink_(std::move(sink)) {
+  pending_.reserve(cadence_.flush_bytes > 0 ? cadence_.flush_bytes * 2 : 64);
+}
+
+void TokenStream::push(int32_t token, std::string_view piece) {
+  tokens_++;
+  Clock::time_point now;
+  if (cadence_.flush_micros > 0) {
+    now = Clock::now();
+    if (tokens_ > 1) {
+      const int64_t dt = std::chrono::duration_cast<std::chrono::microseconds>(now - last_push_).count();
+      push_interval_us_ = push_interval_us_ > 0 ? (3 * push_interval_us_ + dt) / 4 : dt;
+    }
+    last_push_ = now;
+  }
+  const size_t at = assemble(piece);
+  if (cadence_.token_ids) {
+    token_buf_.push_back({token, delivered_ + at});
+  }
+  if (due(now)) deliver(now);
+}
+
+void TokenStream::finish() {
+  if (!tail_.empty()) {
+    pending_.append(kReplacement);
+    tail_.clear();
+  }
+  deliver(Clock::time_point());
+}
+
+// Appends `bytes` after any held-back tail and returns the offset in pending_ of the character
+// holding the first of `bytes` (where that character will land, if it is still incomplete).
+size_t TokenStream::assemble(std::string_view bytes) {
+  const size_t mark = tail_.size();
+  std::string joined;
+  if (!tail_.empty()) {
+    joined.swap(tail_);
+    joined.append(bytes.data(), bytes.size());
+    bytes = joined;
+  }
+  const auto *s = reinterpret_cast<const unsigned char *>(bytes.data());
+  const size_t n = bytes.size();
+  size_t i = 0;
+  size_t run = 0;  // start of the current run of bytes that can be copied verbatim
+  size_t at = SIZE_MAX;
+  while (i < n) {
+    if (s[i] < 0x80) {
+      if (i == mark) at = pending_.size() + (i - run);
+      ++i;
+      continue;
+    }
+    unsigned char lo, hi;
+    const int len = utf8_sequence(s[i], lo, hi);
+    int k = 1;
+    bool incomplete = false;
+    for (; len > 0 && k < len; ++k) {
+      if (i + k >= n) { incomplete = true; break; }
+      const unsigned char c = s[i + k];
+      if (k == 1 ? (c < lo || c > hi) : (c < 0x80 || c > 0xBF)) break;
+    }
+    if (incomplete) {
+      pending_.append(bytes.data() + run, i - run);
+      if (at == SIZE_MAX) at = pending_.size();
+      tail_.assign(bytes.data() + i, n - i);
+      return at;
+    }
+    if (len > 0 && k == len) {
+      if (at == SIZE_MAX && mark < i + len && mark >= i) at = pending_.size() + (i - run);
+      i += len;
+      continue;
+    }
+    // Invalid lead, or a sequence cut short: replace its maximal valid prefix
+    pending_.append(bytes.data() + run, i - run);
+    if (at == SIZE_MAX && mark < i + k && mark >= i) at = pending_.size();
+    pending_.append(kReplacement);
+    i += (size_t)k;
+    run = i;
+  }
+  pending_.append(bytes.data() + run, n - run);
+  return at == SIZE_MAX ? pending_.size() : at;
+}
+
+bool TokenStream::due(Clock::time_point now) const {
+  if (pending_.empty()) return false;
+  // Nothing to batch against yet: the first text goes out as soon as it is complete
+  if (chunks_ == 0) return true;
+  if (cadence_.flush_bytes == 0 && cadence_.flush_micros == 0) return true;
+  if (cadence_.flush_bytes > 0 && pending_.size() >= cadence_.flush_bytes) return true;
+  if (cadence_.flush_micros > 0) {
+    // Pending text is only looked at again on the next push, so flush now if that push is
+    // expected after the deadline rather than holding the text past it
+    const auto since = std::chrono::duration_cast<std::chrono::microseconds>(now - last_delivery_);
+    if (since.count() + push_interval_us_ >= cadence_.flush_micros) return true;
+  }
+  return false;
+}
+
+void TokenStream::deliver(Clock::time_point now) {
+  if (pending_.empty() && token_buf_.empty()) return;
+  if (sink_) sink_(pending_, token_buf_.data(), token_buf_.size());
+  delivered_ += pending_.size();
+  chunks_++;
+  last_delivery_ = now;
+  pending_.clear();
+  token_buf_.clear();
+}
+
+}  // namespace noema
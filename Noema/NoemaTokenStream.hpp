@@ -0,0 +1,108 @@
+// NoemaTokenStream.hpp
+//
+// Output stage between the decode loop and the streaming callbacks.
+//
+// PieceCache memoizes the detokenized bytes of every token id in one arena, so each vocab
+// entry is rendered once per model instead of once per emitted token. TokenStream assembles
+// those bytes incrementally: a multi-byte UTF-8 character split across tokens is held back
+// until it completes (invalid bytes become U+FFFD), so every chunk handed to the sink is valid
+// UTF-8. Chunks are batched by a byte and/or time cadence; with both at zero every token that
+// completes text is delivered on its own, as before. The first text of a stream is never held,
+// and the time cadence is measured from the previous delivery.
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace noema {
+
+class PieceCache {
+ public:
+  explicit PieceCache(size_t n_vocab = 0) { reset(n_vocab); }
+
+  void reset(size_t n_vocab);
+  size_t vocab_size() const { return start_.size(); }
+
+  // `render(token, std::string &out)` produces the bytes on a miss. The view stays valid until
+  // the next call that misses.
+  template <typename Render>
+  std::string_view piece(int32_t token, Render &&render) {
+    if (token < 0 || (size_t)token >= start_.size()) {
+      scratch_.clear();
+      render(token, scratch_);
+      return scratch_;
+    }
+    if (start_[token] == kUnset) {
+      scratch_.clear();
+      render(token, scratch_);
+      start_[token] = (uint32_t)arena_.size();
+      len_[token] = (uint32_t)scratch_.size();
+      arena_.append(scratch_);
+    }
+    return std::string_view(arena_.data() + start_[token], len_[token]);
+  }
+
+ private:
+  static constexpr uint32_t kUnset = UINT32_MAX;
+  std::vector<uint32_t> start_;
+  std::vector<uint32_t> len_;
+  std::string arena_;
+  std::string scratch_;
+};
+
+struct StreamCadence {
+  size_t flush_bytes = 0;    // deliver once this many bytes are pending (0 = no byte threshold)
+  int64_t flush_micros = 0;  // or once this long has passed since the last delivery (0 = no time threshold)
+  bool token_ids = false;    // also collect token ids with their byte offsets
+};
+
+struct StreamToken {
+  int32_t token;
+  // Byte offset, in the whole delivered text, of the character holding the token's first byte.
+  // A token that continues a split character points at that character's start; bytes that were
+  // replaced by U+FFFD point at the replacement.
+  uint64_t offset;
+};
+
+class TokenStream {
+ public:
+  // Receives a valid UTF-8 chunk and, when token ids are enabled, the tokens whose bytes
+  // started since the previous chunk.
+  using Sink = std::function<void(std::string_view text, const StreamToken *tokens, size_t n_tokens)>;
+
+  TokenStream(StreamCadence cadence, Sink sink);
+
+  void push(int32_t token, std::string_view piece);
+  // Deliver everything pending. An unfinished UTF-8 sequence at the end is replaced by U+FFFD.
+  void finish();
+
+  uint64_t bytes_delivered() const { return delivered_; }
+  uint64_t chunks_delivered() const { return chunks_; }
+  uint64_t tokens_pushed() const { return tokens_; }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  size_t assemble(std::string_view bytes);
+  bool due(Clock::time_point now) const;
+  void deliver(Clock::time_point now);
+
+  StreamCadence cadence_;
+  Sink sink_;
+  std::string pending_;   // complete, valid UTF-8 waiting for the next delivery
+  std::string tail_;      // bytes of a character that has not completed yet
+  std::vector<StreamToken> token_buf_;
+  Clock::time_point last_delivery_;
+  Clock::time_point last_push_;
+  int64_t push_interval_us_ = 0;  // smoothed time between tokens, to flush before the next one would be late
+  uint64_t delivered_ = 0;
+  uint64_t chunks_ = 0;
+  uint64_t tokens_ = 0;
+};
+
+}  // namespace noema
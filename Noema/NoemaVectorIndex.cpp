@@ -0,0 +1,628 @@
+// NoemaVectorIndex.cpp
+#include "NoemaVectorIndex.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define NOEMA_VEC_AVX2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define NOEMA_VEC_NEON 1
+#endif
+
+namespace noema {
+
+namespace {
+
+constexpr size_t kAlign = 64;
+constexpr char kMagic[8] = {'N', 'V', 'I', 'D', 'X', '0', '0', '1'};
+constexpr uint32_t kVersion = 1;
+// Rows per worker below which another thread costs more than it saves
+constexpr size_t kRowsPerThread = 16384;
+
+inline size_t align_up(size_t v, size_t a) { return (v + a - 1) / a * a; }
+
+// Process-wide workers shared by every index, so a query costs a queue push per worker
+// instead of a thread spawn. Threads start on the first parallel call.
+class WorkerPool {
+ public:
+  static WorkerPool &shared() {
+    static WorkerPool pool;
+    return pool;
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : threads_) t.join();
+  }
+
+  // Runs fn(0) .. fn(n - 1) and returns once all have finished. fn(0) runs on the caller,
+  // which then helps drain the queue so concurrent queries never wait on a busy pool.
+  void run(int n, const std::function<void(int)> &fn) {
+    if (n <= 1) {
+      fn(0);
+      return;
+    }
+    struct Batch {
+      std::mutex mutex;
+      std::condition_variable done;
+      int pending;
+    } batch;
+    batch.pending = n - 1;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      start_locked();
+      for (int t = 1; t < n; ++t) {
+        queue_.emplace_back([&batch, &fn, t] {
+          fn(t);
+          std::lock_guard<std::mutex> lock(batch.mutex);
+          if (--batch.pending == 0) batch.done.notify_one();
+        });
+      }
+    }
+    cv_.notify_all();
+    fn(0);
+    std::function<void()> task;
+    while (pop(task)) task();
+    std::unique_lock<std::mutex> lock(batch.mutex);
+    batch.done.wait(lock, [&batch] { return batch.pending == 0; });
+  }
+
+ private:
+  WorkerPool() = default;
+
+  void start_locked() {
+    if (!threads_.empty()) return;
+    const unsigned hw = std::max(2u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i + 1 < hw; ++i) {
+      threads_.emplace_back([this] {
+        std::function<void()> task;
+        for (;;) {
+          {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) return;
+            task = std::move(queue_.front());
+            queue_.pop_front();
+          }
+          task();
+        }
+      });
+    }
+  }
+
+  bool pop(std::function<void()> &task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queue_.empty()) return false;
+    task = std::move(queue_.front());
+    queue_.pop_front();
+    return true;
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> queue_;
+  std::vector<std::thread> threads_;
+  bool stop_ = false;
+};
+
+// ---- kernels ----
+
+inline float dot_f32(const float *a, const float *b, int n) {
+  int i = 0;
+  float sum = 0.0f;
+#if defined(NOEMA_VEC_AVX2)
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  for (; i + 16 <= n; i += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+  }
+  for (; i + 8 <= n; i += 8) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+  }
+  acc0 = _mm256_add_ps(acc0, acc1);
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+  s = _mm_hadd_ps(s, s);
+  s = _mm_hadd_ps(s, s);
+  sum = _mm_cvtss_f32(s);
+#elif defined(NOEMA_VEC_NEON)
+  float32x4_t acc0 = vdupq_n_f32(0.0f);
+  float32x4_t acc1 = vdupq_n_f32(0.0f);
+  for (; i + 8 <= n; i += 8) {
+    acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+  }
+  sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+#endif
+  for (; i < n; ++i) sum += a[i] * b[i];
+  return sum;
+}
+
+inline float dot_f32_i8(const float *a, const int8_t *b, int n) {
+  int i = 0;
+  float sum = 0.0f;
+#if defined(NOEMA_VEC_AVX2)
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  for (; i + 16 <= n; i += 16) {
+    const __m128i q = _mm_loadu_si128((const __m128i *)(b + i));
+    const __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q));
+    const __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(q, 8)));
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), lo, acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), hi, acc1);
+  }
+  acc0 = _mm256_add_ps(acc0, acc1);
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+  s = _mm_hadd_ps(s, s);
+  s = _mm_hadd_ps(s, s);
+  sum = _mm_cvtss_f32(s);
+#elif defined(NOEMA_VEC_NEON)
+  float32x4_t acc0 = vdupq_n_f32(0.0f);
+  float32x4_t acc1 = vdupq_n_f32(0.0f);
+  for (; i + 8 <= n; i += 8) {
+    const int16x8_t w = vmovl_s8(vld1_s8(b + i));
+    acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vcvtq_f32_s32(vmovl_s16(vget_low_s16(w))));
+    acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vcvtq_f32_s32(vmovl_s16(vget_high_s16(w))));
+  }
+  sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+#endif
+  for (; i < n; ++i) sum += a[i] * (float)b[i];
+  return sum;
+}
+
+inline void normalize(float *v, int n) {
+  const float norm = std::sqrt(dot_f32(v, v, n));
+  if (norm > 0.0f) {
+    const float inv = 1.0f / norm;
+    for (int i = 0; i < n; ++i) v[i] *= inv;
+  }
+}
+
+// Bounded min-heap on score; the root is the weakest of the current top-k.
+inline bool hit_greater(const VectorHit &a, const VectorHit &b) { return a.score > b.score; }
+
+inline void heap_offer(std::vector<VectorHit> &heap, int k, int64_t id, float score) {
+  if ((int)heap.size() < k) {
+    heap.push_back({id, score});
+    std::push_heap(heap.begin(), heap.end(), hit_greater);
+  } else if (score > heap.front().score) {
+    std::pop_heap(heap.begin(), heap.end(), hit_greater);
+    heap.back() = {id, score};
+    std::push_heap(heap.begin(), heap.end(), hit_greater);
+  }
+}
+
+std::vector<VectorHit> merge_heaps(std::vector<std::vector<VectorHit>> &parts, int k) {
+  std::vector<VectorHit> out;
+  for (auto &p : parts) out.insert(out.end(), p.begin(), p.end());
+  std::sort(out.begin(), out.end(), hit_greater);
+  if ((int)out.size() > k) out.resize(k);
+  return out;
+}
+
+void *aligned_alloc_bytes(size_t bytes) {
+  void *p = nullptr;
+  if (posix_memalign(&p, kAlign, std::max<size_t>(bytes, kAlign)) != 0) return nullptr;
+  return p;
+}
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dim;
+  uint32_t metric;
+  uint32_t storage;
+  uint64_t count;
+  uint64_t stride;
+  uint32_t n_lists;
+  uint32_t nprobe;
+  uint64_t off_rows;
+  uint64_t off_ids;
+  uint64_t off_scales;
+  uint64_t off_centroids;
+  uint64_t off_list_offsets;  // (n_lists + 1) x uint64
+  uint64_t off_list_rows;     // count x uint32, grouped by list
+  uint64_t file_size;
+};
+
+}  // namespace
+
+VectorIndex::VectorIndex(int dim, VectorMetric metric, VectorStorage storage)
+    : dim_(std::max(1, dim)), metric_(metric), storage_(storage) {
+  const size_t elem = storage_ == VectorStorage::I8 ? sizeof(int8_t) : sizeof(float);
+  stride_ = align_up((size_t)dim_ * elem, kAlign);
+}
+
+VectorIndex::~VectorIndex() {
+  if (map_base_) {
+    munmap(map_base_, map_bytes_);
+  } else {
+    free(rows_);
+    free(ids_);
+    free(scales_);
+  }
+}
+
+// ---- storage ----
+
+void VectorIndex::materialize() {
+  if (!map_base_) return;
+  const size_t cap = std::max<size_t>(count_, 16);
+  uint8_t *rows = (uint8_t *)aligned_alloc_bytes(cap * stride_);
+  int64_t *ids = (int64_t *)aligned_alloc_bytes(cap * sizeof(int64_t));
+  float *scales = storage_ == VectorStorage::I8 ? (float *)aligned_alloc_bytes(cap * sizeof(float)) : nullptr;
+  memcpy(rows, rows_, count_ * stride_);
+  memcpy(ids, ids_, count_ * sizeof(int64_t));
+  if (scales) memcpy(scales, scales_, count_ * sizeof(float));
+  munmap(map_base_, map_bytes_);
+  map_base_ = nullptr;
+  map_bytes_ = 0;
+  rows_ = rows;
+  ids_ = ids;
+  scales_ = scales;
+  capacity_ = cap;
+}
+
+void VectorIndex::grow(size_t min_capacity) {
+  materialize();
+  if (min_capacity <= capacity_) return;
+  const size_t cap = std::max(min_capacity, capacity_ * 2);
+  uint8_t *rows = (uint8_t *)aligned_alloc_bytes(cap * stride_);
+  int64_t *ids = (int64_t *)aligned_alloc_bytes(cap * sizeof(int64_t));
+  if (count_) {
+    memcpy(rows, rows_, count_ * stride_);
+    memcpy(ids, ids_, count_ * sizeof(int64_t));
+  }
+  free(rows_);
+  free(ids_);
+  rows_ = rows;
+  ids_ = ids;
+  if (storage_ == VectorStorage::I8) {
+    float *scales = (float *)aligned_alloc_bytes(cap * sizeof(float));
+    if (count_) memcpy(scales, scales_, count_ * sizeof(float));
+    free(scales_);
+    scales_ = scales;
+  }
+  capacity_ = cap;
+}
+
+void VectorIndex::reserve(size_t n) { grow(n); }
+
+void VectorIndex::add(int64_t id, const float *vec) {
+  if (!vec) return;
+  if (count_ == capacity_ || map_base_) grow(count_ + 1);
+
+  std::vector<float> tmp(vec, vec + dim_);
+  if (metric_ == VectorMetric::Cosine) normalize(tmp.data(), dim_);
+
+  uint8_t *row = rows_ + count_ * stride_;
+  memset(row, 0, stride_);
+  if (storage_ == VectorStorage::I8) {
+    float amax = 0.0f;
+    for (float v : tmp) amax = std::max(amax, std::fabs(v));
+    const float scale = amax > 0.0f ? amax / 127.0f : 1.0f;
+    const float inv = 1.0f / scale;
+    int8_t *q = (int8_t *)row;
+    for (int i = 0; i < dim_; ++i) q[i] = (int8_t)std::lrintf(std::max(-127.0f, std::min(127.0f, tmp[i] * inv)));
+    scales_[count_] = scale;
+  } else {
+    memcpy(row, tmp.data(), sizeof(float) * dim_);
+  }
+  ids_[count_] = id;
+
+  if (n_lists_ > 0) {
+    lists_[nearest_list(tmp.data())].push_back((uint32_t)count_);
+  }
+  count_++;
+}
+
+void VectorIndex::decode_row(size_t row, float *out) const {
+  const uint8_t *r = rows_ + row * stride_;
+  if (storage_ == VectorStorage::I8) {
+    const int8_t *q = (const int8_t *)r;
+    const float s = scales_[row];
+    for (int i = 0; i < dim_; ++i) out[i] = q[i] * s;
+  } else {
+    memcpy(out, r, sizeof(float) * dim_);
+  }
+}
+
+// ---- search ----
+
+inline float VectorIndex::score_row(const float *q, size_t row) const {
+  const uint8_t *r = rows_ + row * stride_;
+  if (storage_ == VectorStorage::I8) {
+    return dot_f32_i8(q, (const int8_t *)r, dim_) * scales_[row];
+  }
+  return dot_f32(q, (const float *)r, dim_);
+}
+
+void VectorIndex::scan_rows(const float *q, const uint32_t *rows, size_t begin, size_t end, int k,
+                            std::vector<VectorHit> &heap) const {
+  for (size_t i = begin; i < end; ++i) {
+    const size_t row = rows ? rows[i] : i;
+    heap_offer(heap, k, ids_[row], score_row(q, row));
+  }
+}
+
+int VectorIndex::pick_threads(size_t work, int requested) const {
+  if (requested > 0) return requested;
+  const int hw = (int)std::max(1u, std::thread::hardware_concurrency());
+  return (int)std::max<size_t>(1, std::min<size_t>((size_t)hw, work / kRowsPerThread));
+}
+
+std::vector<VectorHit> VectorIndex::search_exact(const float *query, int k, int n_threads) const {
+  if (!query || k <= 0 || count_ == 0) return {};
+  std::vector<float> q(query, query + dim_);
+  if (metric_ == VectorMetric::Cosine) normalize(q.data(), dim_);
+
+  const int nt = std::min<int>(pick_threads(count_, n_threads), (int)count_);
+  std::vector<std::vector<VectorHit>> parts(nt);
+  for (auto &p : parts) p.reserve(k);
+  const size_t chunk = (count_ + nt - 1) / nt;
+  WorkerPool::shared().run(nt, [&](int t) {
+    scan_rows(q.data(), nullptr, t * chunk, std::min(count_, (t + 1) * chunk), k, parts[t]);
+  });
+  return merge_heaps(parts, k);
+}
+
+std::vector<VectorHit> VectorIndex::search(const float *query, int k, int n_threads) const {
+  if (n_lists_ == 0) return search_exact(query, k, n_threads);
+  if (!query || k <= 0 || count_ == 0) return {};
+  std::vector<float> q(query, query + dim_);
+  if (metric_ == VectorMetric::Cosine) normalize(q.data(), dim_);
+
+  // Rank lists by centroid similarity and keep the nprobe best
+  std::vector<std::pair<float, int>> ranked(n_lists_);
+  for (int l = 0; l < n_lists_; ++l) {
+    ranked[l] = {dot_f32(q.data(), centroids_.data() + (size_t)l * dim_, dim_), l};
+  }
+  const int probe = std::min(nprobe_, n_lists_);
+  std::partial_sort(ranked.begin(), ranked.begin() + probe, ranked.end(),
+                    [](const std::pair<float, int> &a, const std::pair<float, int> &b) { return a.first > b.first; });
+
+  size_t work = 0;
+  for (int p = 0; p < probe; ++p) work += lists_[ranked[p].second].size();
+  const int nt = std::min(pick_threads(work, n_threads), probe);
+
+  // Lists are dealt round-robin so each worker sees a mix of large and small lists
+  std::vector<std::vector<VectorHit>> parts(nt);
+  auto run = [&](int t) {
+    parts[t].reserve(k);
+    for (int p = t; p < probe; p += nt) {
+      const auto &list = lists_[ranked[p].second];
+      scan_rows(q.data(), list.data(), 0, list.size(), k, parts[t]);
+    }
+  };
+  WorkerPool::shared().run(nt, run);
+  return merge_heaps(parts, k);
+}
+
+// ---- IVF ----
+
+int VectorIndex::nearest_list(const float *v) const {
+  int best = 0;
+  float best_score = -INFINITY;
+  for (int l = 0; l < n_lists_; ++l) {
+    const float s = dot_f32(v, centroids_.data() + (size_t)l * dim_, dim_);
+    if (s > best_score) { best_score = s; best = l; }
+  }
+  return best;
+}
+
+bool VectorIndex::train_ivf(int n_lists, int iterations, uint64_t seed) {
+  if (n_lists <= 0 || (size_t)n_lists > count_) return false;
+  const size_t d = (size_t)dim_;
+
+  // Train on a bounded sample; 64 points per list is plenty for a coarse quantizer
+  uint64_t rng = seed ? seed : 1;
+  auto next_rand = [&rng]() { rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17; return rng; };
+  const size_t n_sample = std::min(count_, (size_t)n_lists * 64);
+  std::vector<size_t> sample(count_);
+  for (size_t i = 0; i < count_; ++i) sample[i] = i;
+  for (size_t i = 0; i < n_sample; ++i) std::swap(sample[i], sample[i + next_rand() % (count_ - i)]);
+  sample.resize(n_sample);
+
+  std::vector<float> data(n_sample * d);
+  for (size_t i = 0; i < n_sample; ++i) {
+    decode_row(sample[i], data.data() + i * d);
+    normalize(data.data() + i * d, dim_);
+  }
+
+  n_lists_ = n_lists;
+  centroids_.assign((size_t)n_lists * d, 0.0f);
+  for (int l = 0; l < n_lists; ++l) {
+    memcpy(centroids_.data() + l * d, data.data() + (size_t)l * d, sizeof(float) * d);
+  }
+
+  // Spherical k-means: assign by max cosine, recompute means, renormalize
+  std::vector<int> assign(n_sample, 0);
+  std::vector<size_t> counts(n_lists);
+  for (int it = 0; it < std::max(1, iterations); ++it) {
+    for (size_t i = 0; i < n_sample; ++i) assign[i] = nearest_list(data.data() + i * d);
+    std::fill(centroids_.begin(), centroids_.end(), 0.0f);
+    std::fill(counts.begin(), counts.end(), 0);
+    for (size_t i = 0; i < n_sample; ++i) {
+      float *c = centroids_.data() + (size_t)assign[i] * d;
+      const float *v = data.data() + i * d;
+      for (size_t j = 0; j < d; ++j) c[j] += v[j];
+      counts[assign[i]]++;
+    }
+    for (int l = 0; l < n_lists; ++l) {
+      float *c = centroids_.data() + (size_t)l * d;
+      if (counts[l] == 0) {
+        // Re-seed empty lists from a random sample point
+        memcpy(c, data.data() + (next_rand() % n_sample) * d, sizeof(float) * d);
+      }
+      normalize(c, dim_);
+    }
+  }
+
+  // Assign every row, in parallel
+  std::vector<int> row_list(count_);
+  const int nt = pick_threads(count_ * (size_t)n_lists / 64, 0);
+  const size_t chunk = (count_ + nt - 1) / nt;
+  auto run = [&](int t) {
+    std::vector<float> tmp(d);
+    for (size_t r = t * chunk; r < std::min(count_, (t + 1) * chunk); ++r) {
+      decode_row(r, tmp.data());
+      row_list[r] = nearest_list(tmp.data());
+    }
+  };
+  WorkerPool::shared().run(nt, run);
+
+  lists_.assign(n_lists, {});
+  for (size_t r = 0; r < count_; ++r) lists_[row_list[r]].push_back((uint32_t)r);
+  nprobe_ = std::min(std::max(nprobe_, 1), n_lists);
+  return true;
+}
+
+// ---- persistence ----
+
+bool VectorIndex::save(const std::string &path) const {
+  FileHeader h = {};
+  memcpy(h.magic, kMagic, sizeof(kMagic));
+  h.version = kVersion;
+  h.dim = (uint32_t)dim_;
+  h.metric = (uint32_t)metric_;
+  h.storage = (uint32_t)storage_;
+  h.count = count_;
+  h.stride = stride_;
+  h.n_lists = (uint32_t)n_lists_;
+  h.nprobe = (uint32_t)nprobe_;
+
+  size_t off = align_up(sizeof(FileHeader), kAlign);
+  h.off_rows = off;          off = align_up(off + count_ * stride_, kAlign);
+  h.off_ids = off;           off = align_up(off + count_ * sizeof(int64_t), kAlign);
+  h.off_scales = off;        off = align_up(off + (storage_ == VectorStorage::I8 ? count_ * sizeof(float) : 0), kAlign);
+  h.off_centroids = off;     off = align_up(off + centroids_.size() * sizeof(float), kAlign);
+  h.off_list_offsets = off;  off = align_up(off + (n_lists_ ? (size_t)(n_lists_ + 1) * sizeof(uint64_t) : 0), kAlign);
+  h.off_list_rows = off;     off = off + (n_lists_ ? count_ * sizeof(uint32_t) : 0);
+  h.file_size = off;
+
+  const std::string tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) return false;
+  bool ok = true;
+  auto put = [&](uint64_t at, const void *p, size_t n) {
+    if (!ok || n == 0) return;
+    ok = fseeko(f, (off_t)at, SEEK_SET) == 0 && fwrite(p, 1, n, f) == n;
+  };
+  put(0, &h, sizeof(h));
+  put(h.off_rows, rows_, count_ * stride_);
+  put(h.off_ids, ids_, count_ * sizeof(int64_t));
+  if (storage_ == VectorStorage::I8) put(h.off_scales, scales_, count_ * sizeof(float));
+  put(h.off_centroids, centroids_.data(), centroids_.size() * sizeof(float));
+  if (n_lists_) {
+    std::vector<uint64_t> offsets(n_lists_ + 1, 0);
+    std::vector<uint32_t> flat;
+    flat.reserve(count_);
+    for (int l = 0; l < n_lists_; ++l) {
+      offsets[l] = flat.size();
+      flat.insert(flat.end(), lists_[l].begin(), lists_[l].end());
+    }
+    offsets[n_lists_] = flat.size();
+    put(h.off_list_offsets, offsets.data(), offsets.size() * sizeof(uint64_t));
+    put(h.off_list_rows, flat.data(), flat.size() * sizeof(uint32_t));
+  }
+  // Pad to the declared size so the mapping covers every section
+  if (ok && h.file_size > 0) ok = ftruncate(fileno(f), (off_t)h.file_size) == 0;
+  ok = (fflush(f) == 0) && ok;
+  fclose(f);
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<VectorIndex> VectorIndex::load(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FileHeader)) { close(fd); return nullptr; }
+  const size_t bytes = (size_t)st.st_size;
+  void *base = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return nullptr;
+
+  const FileHeader &h = *(const FileHeader *)base;
+  // Every section must lie inside the file; save() aligns each one to kAlign
+  auto fits = [&h](uint64_t off, uint64_t n, uint64_t elem) {
+    return off % kAlign == 0 && off <= h.file_size && (elem == 0 || n <= (h.file_size - off) / elem);
+  };
+  const bool i8 = h.storage == (uint32_t)VectorStorage::I8;
+  bool valid = memcmp(h.magic, kMagic, sizeof(kMagic)) == 0 && h.version == kVersion &&
+               h.dim > 0 && h.dim <= (uint32_t)INT32_MAX && h.count <= UINT32_MAX &&
+               h.metric <= (uint32_t)VectorMetric::Cosine && h.storage <= (uint32_t)VectorStorage::I8 &&
+               h.file_size <= bytes && h.stride > 0 &&
+               fits(h.off_rows, h.count, h.stride) &&
+               fits(h.off_ids, h.count, sizeof(int64_t)) &&
+               (!i8 || fits(h.off_scales, h.count, sizeof(float)));
+  if (valid && h.n_lists > 0) {
+    valid = h.n_lists <= h.count &&
+            fits(h.off_centroids, h.n_lists, (uint64_t)h.dim * sizeof(float)) &&
+            fits(h.off_list_offsets, (uint64_t)h.n_lists + 1, sizeof(uint64_t)) &&
+            fits(h.off_list_rows, h.count, sizeof(uint32_t));
+  }
+  if (valid && h.n_lists > 0) {
+    // List bounds must be ascending within the flat row array, and rows must exist
+    const uint8_t *b = (const uint8_t *)base;
+    const uint64_t *offsets = (const uint64_t *)(b + h.off_list_offsets);
+    const uint32_t *flat = (const uint32_t *)(b + h.off_list_rows);
+    valid = offsets[0] == 0 && offsets[h.n_lists] <= h.count;
+    for (uint32_t l = 0; valid && l < h.n_lists; ++l) valid = offsets[l] <= offsets[l + 1];
+    for (uint64_t i = 0; valid && i < offsets[h.n_lists]; ++i) valid = flat[i] < h.count;
+  }
+  if (!valid) { munmap(base, bytes); return nullptr; }
+
+  auto idx = std::make_unique<VectorIndex>((int)h.dim, (VectorMetric)h.metric, (VectorStorage)h.storage);
+  if (idx->stride_ != h.stride) { munmap(base, bytes); return nullptr; }
+  uint8_t *b = (uint8_t *)base;
+  idx->map_base_ = base;
+  idx->map_bytes_ = bytes;
+  idx->count_ = h.count;
+  idx->capacity_ = h.count;
+  // The mapping is read-only; these pointers are only written after materialize()
+  idx->rows_ = b + h.off_rows;
+  idx->ids_ = (int64_t *)(b + h.off_ids);
+  idx->scales_ = idx->storage_ == VectorStorage::I8 ? (float *)(b + h.off_scales) : nullptr;
+#if defined(POSIX_MADV_WILLNEED)
+  posix_madvise(idx->rows_, h.count * h.stride, POSIX_MADV_WILLNEED);
+#endif
+
+  if (h.n_lists > 0) {
+    idx->n_lists_ = (int)h.n_lists;
+    idx->nprobe_ = (int)std::max<uint32_t>(1, h.nprobe);
+    const float *c = (const float *)(b + h.off_centroids);
+    idx->centroids_.assign(c, c + (size_t)h.n_lists * h.dim);
+    const uint64_t *offsets = (const uint64_t *)(b + h.off_list_offsets);
+    const uint32_t *flat = (const uint32_t *)(b + h.off_list_rows);
+    idx->lists_.resize(h.n_lists);
+    for (uint32_t l = 0; l < h.n_lists; ++l) {
+      idx->lists_[l].assign(flat + offsets[l], flat + offsets[l + 1]);
+    }
+  }
+  return idx;
+}
+
+}  // namespace noema
@@ -0,0 +1,97 @@
+// NoemaVectorIndex.hpp
+//
+// In-process vector store for retrieval over embedded chunks.
+//
+// Rows are kept in one contiguous, 64-byte aligned, row-major buffer, either as f32 or as
+// int8 with a per-row scale. Top-k search scans rows with AVX2/NEON kernels (scalar fallback)
+// split across worker threads. For large corpora an IVF coarse quantizer (spherical k-means)
+// restricts each query to the `nprobe` closest lists. Indexes persist to a single file that
+// `load` memory-maps read-only, so reopening a corpus costs page faults, not parsing.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace noema {
+
+enum class VectorMetric : uint32_t {
+  Dot    = 0,
+  Cosine = 1,  // vectors and queries are L2-normalized, then scored by dot product
+};
+
+enum class VectorStorage : uint32_t {
+  F32 = 0,
+  I8  = 1,  // symmetric per-row quantization: value ~= int8 * scale
+};
+
+struct VectorHit {
+  int64_t id;
+  float score;
+};
+
+class VectorIndex {
+ public:
+  VectorIndex(int dim, VectorMetric metric, VectorStorage storage);
+  ~VectorIndex();
+  VectorIndex(const VectorIndex &) = delete;
+  VectorIndex &operator=(const VectorIndex &) = delete;
+
+  int dim() const { return dim_; }
+  size_t size() const { return count_; }
+  VectorMetric metric() const { return metric_; }
+  VectorStorage storage() const { return storage_; }
+  bool is_mapped() const { return map_base_ != nullptr; }
+
+  void reserve(size_t n);
+  void add(int64_t id, const float *vec);
+
+  // Uses the IVF lists when trained, otherwise scans every row. Results are sorted by
+  // descending score. `n_threads` <= 0 picks a count from the corpus size.
+  std::vector<VectorHit> search(const float *query, int k, int n_threads = 0) const;
+  std::vector<VectorHit> search_exact(const float *query, int k, int n_threads = 0) const;
+
+  // Build `n_lists` coarse lists over the current rows. Rows added later are assigned to
+  // their nearest list. Returns false if there are fewer rows than lists.
+  bool train_ivf(int n_lists, int iterations = 8, uint64_t seed = 0x5EEDu);
+  bool has_ivf() const { return n_lists_ > 0; }
+  void set_nprobe(int nprobe) { nprobe_ = nprobe > 0 ? nprobe : 1; }
+  int nprobe() const { return nprobe_; }
+
+  bool save(const std::string &path) const;
+  static std::unique_ptr<VectorIndex> load(const std::string &path);
+
+ private:
+  float score_row(const float *q, size_t row) const;
+  void decode_row(size_t row, float *out) const;
+  void scan_rows(const float *q, const uint32_t *rows, size_t begin, size_t end, int k,
+                 std::vector<VectorHit> &heap) const;
+  int nearest_list(const float *v) const;
+  void materialize();
+  void grow(size_t min_capacity);
+  int pick_threads(size_t work, int requested) const;
+
+  int dim_;
+  VectorMetric metric_;
+  VectorStorage storage_;
+  size_t stride_;  // bytes per row, multiple of 64
+
+  size_t count_ = 0;
+  size_t capacity_ = 0;
+  uint8_t *rows_ = nullptr;   // owned (aligned) or points into the mapping
+  int64_t *ids_ = nullptr;
+  float *scales_ = nullptr;   // I8 only
+
+  // Memory-mapped backing when created by load(); first mutation copies out of it.
+  void *map_base_ = nullptr;
+  size_t map_bytes_ = 0;
+
+  int n_lists_ = 0;
+  int nprobe_ = 8;
+  std::vector<float> centroids_;               // n_lists x dim, L2-normalized
+  std::vector<std::vector<uint32_t>> lists_;   // row indices per list
+};
+
+}  // namespace noema